@@ -1,11 +1,43 @@
 #include <GL/glut.h>
+#include <GL/freeglut_ext.h>
+#include <GL/glext.h>
+#ifdef _WIN32
 #include <windows.h>
+#include <conio.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <strings.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#if defined(__has_include)
+#if __has_include(<EGL/egl.h>)
+#define HAVE_EGL 1
+#include <dlfcn.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#endif
+#endif
+#include <sys/stat.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include <stdbool.h>
-#include <conio.h>
 #include <math.h>
 #include <malloc.h>
 #include <dirent.h>
@@ -14,6 +46,15 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSE42_CRC
+#include <nmmintrin.h>
+#endif
 
 
 typedef struct {
@@ -22,10 +63,11 @@ typedef struct {
     int directory_pos;
 } PWADHeader;
 
+// Same layout as wad_directory_t: position, size, then the name
 typedef struct {
-    char name[8];
     int lump_pos;
     int lump_size;
+    char name[8];
 } LumpEntry;
 
 // DOOM WAD file structures
@@ -41,23 +83,548 @@ typedef struct {
     char name[8];
 } wad_directory_t;
 
+// Text rendering: glyph atlas layout
+#define FONT_FIRST_CHAR 32
+#define FONT_NUM_GLYPHS 95
+#define FONT_CELL_W 8
+#define FONT_CELL_H 14
+#define FONT_DESCENT 3        // Rows below the baseline
+#define FONT_ATLAS_COLS 16
+#define FONT_ATLAS_SIZE 128   // 16x6 cells of 8x14 fit in 128x128
+
+typedef struct {
+    float x, y;                // Position (relative to the baseline origin in layouts)
+    float u, v;                // Atlas coordinates
+    unsigned char rgba[4];     // Filled in when queued into the frame batch
+} text_vertex_t;
+
+// Prebuilt glyph quads for a string that does not change between frames
+typedef struct {
+    text_vertex_t *vertices;
+    int num_vertices;
+} text_layout_t;
+
+// Cached render layers, each an FBO-backed texture covering part of the window
+#define LAYER_SIGNATURE_SIZE 4096
+
+enum {
+    LAYER_GRID,        // Thumbnail grid
+    LAYER_HEADER,      // Title bar
+    LAYER_STATUS,      // Status bar
+    LAYER_OVERLAY,     // Help screen and selectors
+    NUM_LAYERS
+};
+
+typedef struct {
+    GLuint fbo;
+    GLuint texture;
+    int x, y, width, height;   // Window area covered by the layer
+    int tex_width, tex_height; // Power-of-two backing texture size
+    char signature[LAYER_SIGNATURE_SIZE]; // State the current contents were drawn from
+} render_layer_t;
+
+// How detect_image_dimensions() decided to interpret a lump
+enum {
+    IMAGE_FORMAT_RAW,      // Guessed raw 8-bit pixels
+    IMAGE_FORMAT_PATCH,    // Column-based DOOM patch
+    IMAGE_FORMAT_FLAT,     // 64x64 flat or another known fixed-size lump
+    IMAGE_FORMAT_MAP,      // Line-art preview rendered from a map's linedefs
+    IMAGE_FORMAT_PNG       // PNG lump, matched to the palette when decoded
+};
+
+// Pixel-art upscalers for images shown larger than their size. Both only
+// copy neighbouring pixels, so scaled graphics keep the palette's colours.
+enum {
+    SCALER_NONE,
+    SCALER_SCALE2X,    // Scale2x (EPX) at 2x, and applied twice at 4x
+    SCALER_SCALE3X,    // Scale3x at 3x
+    NUM_SCALERS
+};
+
+// Grid search: the query typed into the search box, split into terms
+#define MAX_QUERY_PATTERNS 8
+
+enum {
+    PATTERN_PREFIX,
+    PATTERN_GLOB,
+    PATTERN_REGEX
+};
+
+typedef struct {
+    int kind;
+    char text[64];
+    uint64_t prefix, mask;    // Packed name bits for PATTERN_PREFIX
+} lump_pattern_t;
+
+typedef struct {
+    lump_pattern_t patterns[MAX_QUERY_PATTERNS];
+    int num_patterns;
+    int min_width, max_width;
+    int min_height, max_height;
+    int format;               // IMAGE_FORMAT_* or -1 for any
+} lump_query_t;
+
+// A read-only memory mapping of a whole file
+typedef struct {
+    unsigned char *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} mapped_file_t;
+
+typedef struct wad_file_s wad_file_t;
+
+// Threading primitives used by the worker pool
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#define THREAD_PROC(name) DWORD WINAPI name(LPVOID arg)
+typedef LPTHREAD_START_ROUTINE thread_fn;
+#else
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#define THREAD_PROC(name) void *name(void *arg)
+typedef void *(*thread_fn)(void *arg);
+#endif
+
+#define MAX_WORKER_THREADS 64
+
+typedef void (*parallel_fn)(void *context, int index);
+
+// One parallel_for() call. Items are handed out through an atomic counter.
+typedef struct parallel_job_s {
+    parallel_fn fn;
+    void *context;
+    int count;
+    atomic_int next;                 // Next item to hand out
+    atomic_int remaining;            // Items not finished yet
+    int workers;                     // Pool threads inside the job (guarded by pool_mutex)
+    struct parallel_job_s *next_job;
+} parallel_job_t;
+
+// WAD discovery: what the selector knows about each file without loading it
+#define MAX_SCAN_DEPTH 32
+#define WAD_INDEX_FILENAME "eyeglass.idx"
+#define WAD_INDEX_HEADER "# eyeglass wad index v1"
+
+enum {
+    WAD_TYPE_UNKNOWN,   // Not probed yet
+    WAD_TYPE_INVALID,   // Not a readable WAD
+    WAD_TYPE_IWAD,
+    WAD_TYPE_PWAD,
+    WAD_TYPE_PK3        // ZIP container with the lumps as files
+};
+
+typedef struct {
+    char *path;
+    long long size;
+    long long mtime;
+    int type;
+    int num_lumps;
+    int num_maps;
+    bool has_palette;
+} wad_info_t;
+
+// Catalog: lump names and stats of a whole WAD library in one file that is
+// mapped and queried in place. After the header come the WAD records
+// (sorted by path), the distinct lump names (sorted by packed value), the
+// posting lists of WAD indexes per name, and the path strings.
+#define CATALOG_FILENAME "eyeglass.cat"
+#define CATALOG_MAGIC "EGC1"
+#define CATALOG_HAS_PALETTE 1
+
+typedef struct {
+    char magic[4];
+    uint32_t num_wads;
+    uint32_t num_names;
+    uint32_t num_postings;
+    uint32_t strings_size;
+    uint32_t reserved;
+    uint64_t wads_offset;
+    uint64_t names_offset;
+    uint64_t postings_offset;
+    uint64_t strings_offset;
+} catalog_header_t;
+
+typedef struct {
+    uint32_t path;                // Offset in the string table
+    uint32_t type;                // WAD_TYPE_*
+    int64_t size;
+    int64_t mtime;
+    uint32_t num_lumps;
+    uint32_t num_maps;
+    uint32_t num_sprites;
+    uint32_t num_flats;
+    uint32_t flags;               // CATALOG_HAS_PALETTE
+    uint32_t reserved;
+} catalog_wad_t;
+
+typedef struct {
+    uint64_t name;                // pack_lump_name()
+    uint32_t first_posting;       // WADs with this lump are postings[first .. first + count)
+    uint32_t num_postings;
+} catalog_name_t;
+
+typedef struct {
+    mapped_file_t map;
+    const catalog_header_t *header;
+    const catalog_wad_t *wads;
+    const catalog_name_t *names;
+    const uint32_t *postings;
+    const char *strings;
+} catalog_t;
+
+// Bump arena: allocations are never freed one by one, only all together
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct arena_block_s {
+    struct arena_block_s *next;
+    size_t used;
+    size_t size;
+    unsigned char data[];
+} arena_block_t;
+
+typedef struct {
+    arena_block_t *head;
+    size_t used;           // Bytes handed out
+    size_t reserved;       // Bytes held in blocks
+} arena_t;
+
+// Decoded image: one palette index per pixel plus, per column, the runs of
+// opaque pixels (from the patch posts, or the raw transparency rules)
+typedef struct {
+    unsigned short top;
+    unsigned short length;
+} pixel_span_t;
+
+typedef struct {
+    int width, height;
+    unsigned char *pixels;         // width * height indexes, row-major
+    unsigned int *column_first;    // Spans of column x are spans[column_first[x] .. column_first[x + 1])
+    pixel_span_t *spans;
+    unsigned int num_spans;
+} indexed_image_t;
+
+// A source image ready for the patch encoder: column-major palette
+// indexes plus a visibility byte per pixel
+typedef struct {
+    int width, height;
+    int left_offset, top_offset;
+    unsigned char *indexes;
+    unsigned char *visible;
+    bool indexed;                  // Came from palette indexes, no colour matching
+} import_image_t;
+
 // Image data structure
 typedef struct {
     char name[9];          // 8 chars + null terminator
-    unsigned char *data;   // Raw pixel data
+    char ns[9];            // Override namespace: "" global, "S" sprites, "F" flats, or the map marker
+    wad_file_t *wad;       // WAD in the load stack this lump comes from
+    bool overridden;       // A later lump with the same name and namespace replaces this one
+    int format;            // IMAGE_FORMAT_* picked by detect_image_dimensions()
+    unsigned char *data;   // Raw pixel data (points into the WAD mapping)
     int width;             // Image width
     int height;            // Image height
+    int left_offset;       // Patch anchor, from bytes 4-7 of the patch header
+    int top_offset;
+    const char *offset_problem;   // Set by validate_sprite_offsets() for outliers
     int size;              // Data size
     GLuint texture_id;     // OpenGL texture ID
+    GLuint scaled_textures[3];  // Upscaled at 2x, 3x and 4x, made when first shown
+    indexed_image_t *indexed;   // Cached decode in the WAD's arena, or NULL
     bool is_valid;         // Flag to indicate if image is valid
+    int lump;              // Directory index of the lump
+    bool pending;          // PK3 member not read yet; see load_pending_images()
+    uint64_t phash;        // Perceptual hash once phash_ready, 0 if too plain to compare
+    bool phash_ready;
+    text_layout_t label;   // Cached "NAME (WxH)" caption for the grid
 } wad_image_t;
 
+// Parsed map geometry, one array per field
+#define MAP_GRID_CELL 128.0f   // Spatial index cell size in map units, like BLOCKMAP
+#define MAP_PREVIEW_SIZE 128   // Grid thumbnail of a map, in pixels
+
+enum {
+    MAP_LUMP_THINGS,
+    MAP_LUMP_LINEDEFS,
+    MAP_LUMP_SIDEDEFS,
+    MAP_LUMP_VERTEXES,
+    MAP_LUMP_SECTORS,
+    NUM_MAP_LUMPS
+};
+
+// Uniform grid over the map bounds; the lines of cell c are
+// cell_lines[cell_start[c] .. cell_start[c + 1])
+typedef struct {
+    float origin_x, origin_y;
+    float cell_size;
+    int cols, rows;
+    int *cell_start;
+    int *cell_lines;
+    int *cell_fill;        // Scratch while building
+} map_grid_t;
+
+// Interleaved automap vertex: position plus color
+typedef struct {
+    float x, y;
+    unsigned char rgba[4];
+} map_vertex_t;
+
+typedef struct {
+    char name[9];
+    wad_file_t *wad;
+    bool overridden;           // A later WAD has a map with the same name
+    bool hexen_format;
+    
+    int num_vertices;
+    float *vertex_x, *vertex_y;
+    
+    int num_linedefs;
+    int *line_v1, *line_v2;
+    unsigned short *line_flags;
+    unsigned short *line_special;
+    int *line_front_sector;    // -1 if there is no sidedef on that side
+    int *line_back_sector;
+    
+    int num_sectors;
+    short *sector_floor, *sector_ceiling;
+    
+    int num_things;
+    float *thing_x, *thing_y;
+    unsigned short *thing_type;
+    unsigned short *thing_angle;
+    
+    float min_x, min_y, max_x, max_y;
+    map_grid_t grid;
+    unsigned int *line_stamp;  // Dedup marks for grid queries
+    unsigned int stamp;
+    
+    map_vertex_t *buffer;      // Linedef vertex pairs followed by thing points
+    bool buffer_ready;
+    GLuint vbo;
+    
+    unsigned char *preview;    // MAP_PREVIEW_SIZE^2 line coverage, shown in the grid
+} map_data_t;
+
+// grid_flags bits
+#define GRID_VALID 1
+#define GRID_OVERRIDDEN 2
+
+// Sprites grouped by their 4-letter prefix for animation
+#define MAX_SPRITE_FRAMES 29       // Frame letters A through ']'
+#define SPRITE_ATLAS_WIDTH 2048    // Shelf width for a group's frame atlas
+#define TICRATE 35                 // Engine tics per second
+#define OFFSET_VIEW_UNITS 160      // Map units shown across a grid cell in offset view
+#define OFFSET_TOLERANCE 16        // Allowed anchor drift between frames of one sprite
+#define OFFSET_REPORT_FILENAME "eyeglass_offsets.txt"
+#define TRANSPOSE_TILE 32          // Square tile edge for the import row-to-column transpose
+#define IMPORT_MAX_DIMENSION 32767 // Largest edge a patch header's signed 16-bit fields hold
+#define DECODE_MAX_DIMENSION 4096  // Largest image edge the PNG/TGA/BMP decoders accept
+#define INFLATE_FAST_BITS 10       // Huffman codes up to this length decode with one lookup
+#define BUILD_MANIFEST_SUFFIX ".manifest"
+#define BUILD_MANIFEST_HEADER "# eyeglass build manifest v1"
+#define RELOAD_POLL_MS 100         // How often loaded files are checked for rebuilds
+#define RELOAD_SETTLE_SECONDS 0.15 // Quiet time after the last write before reloading
+#define SERVE_DEFAULT_PORT 8040
+#define SERVE_THUMB_SIZE 64        // Edge of a served thumbnail and of an atlas cell
+#define SERVE_ATLAS_COLUMNS 16     // Atlas pages are 16x16 thumbnails
+#define SERVE_CACHE_MB 64          // Encoded responses kept for reuse
+#define SERVE_REQUEST_MAX 8192     // Longest request head accepted
+#define SERVE_MAX_EVENTS 64
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_MAX_CHAIN 32       // Match candidates tried per position
+#define UPSCALE_TILE_ROWS 32       // Source rows per upscaler work item
+#define TEXTURE_BATCH 512          // Images expanded at once for compressed uploads
+
+typedef struct {
+    wad_image_t *image;            // Lump drawn for this frame and rotation, or NULL
+    bool flipped;                  // Second half of a mirrored pair like TROOA2A8
+    float u0, v0, u1, v1;          // Rectangle in the group's atlas
+} sprite_view_t;
+
+typedef struct {
+    sprite_view_t rotations[9];    // 0 = all angles, 1-8 = the eight rotations
+} sprite_frame_t;
+
+typedef struct {
+    char prefix[5];
+    sprite_frame_t frames[MAX_SPRITE_FRAMES];
+    int frame_order[MAX_SPRITE_FRAMES];   // Frame letters present, in order
+    int num_frames;
+    GLuint atlas;                  // Every lump of the group in one texture
+    int atlas_width, atlas_height;
+    bool atlas_ready;              // Atlas was attempted (atlas is 0 if it failed)
+} sprite_group_t;
+
+// One WAD in the load stack (IWAD first, then PWADs in load order)
+#define MAX_WAD_STACK 64
+
+// Perceptual hashes within this many bits of each other look alike
+#define PHASH_DISTANCE 6
+
+// BK-tree over perceptual hashes. The children of a node each sit at a
+// different Hamming distance from it, so a radius query skips every
+// subtree whose distance is out of reach.
+typedef struct {
+    uint64_t hash;
+    int item;                     // Caller's index for this hash
+    int first_child;              // Node indexes, -1 for none
+    int next_sibling;
+    int next_same;                // Further items with exactly this hash
+    int distance;                 // From the parent
+} phash_node_t;
+
+typedef struct {
+    phash_node_t *nodes;
+    int count;
+    int capacity;
+} phash_tree_t;
+
+// One member of a PK3/ZIP container, from the central directory
+typedef struct {
+    long long local_offset;       // Local file header in the mapping
+    long long compressed_size;
+    int method;                   // 0 stored, 8 deflated
+    char ns[9];                   // Namespace from the member's folder
+    uint32_t crc32;               // From the central directory
+    unsigned char *data;          // Uncompressed bytes once read, or NULL
+    bool failed;                  // Damaged or could not be inflated
+} zip_entry_t;
+
+struct wad_file_s {
+    char filename[256];
+    mapped_file_t map;            // The whole file, mapped for as long as it is loaded
+    wad_header_t header;
+    wad_directory_t *directory;   // Aligned copy of the lump directory
+    zip_entry_t *zip_entries;     // PK3 members, parallel to directory; NULL for a WAD
+    uint64_t *lump_hashes;        // Content hash per directory entry, to spot changes on reload
+    char (*lump_ns)[9];           // Override namespace per directory entry, once images are indexed
+    long long mtime;              // Modification time when opened
+    int watch;                    // inotify watch on the file's folder, or -1
+    double reload_at;             // When a reload is due after a change on disk, or 0
+    bool is_iwad;
+    wad_image_t *images;          // Image lumps found in this file
+    int num_images;
+    map_data_t **maps;            // Maps found in this file
+    int num_maps;
+    arena_t arena;                // Everything this file allocates, freed in one call
+    int image_capacity;           // Image records allocated (lumps plus map previews)
+};
+
+// One lump of the merged stack directory
+typedef struct {
+    wad_file_t *wad;
+    int lump;
+    bool overridden;              // A later lump with the same name and namespace replaces it
+} stack_lump_t;
+
+// How a lump differs between two WADs
+enum {
+    DIFF_SAME,
+    DIFF_ADDED,        // Only in the second WAD
+    DIFF_REMOVED,      // Only in the first WAD
+    DIFF_CHANGED,      // Same name and namespace, different bytes
+    DIFF_MOVED,        // Same bytes, out of order in the directory
+    DIFF_RENAMED,      // Same bytes under another name or namespace
+    NUM_DIFF_KINDS
+};
+
+// One lump that differs; the pixel fields are filled by wad_diff_pixels()
+typedef struct {
+    int kind;                     // DIFF_*
+    int lump_a, lump_b;           // Directory indexes, -1 on the side without the lump
+    bool moved;                   // A changed lump that is also out of order
+    int width_a, height_a, width_b, height_b;
+    int left_a, top_a, left_b, top_b;
+    int pixels_changed;           // Over both images laid on one canvas, -1 if not compared
+    int box_x0, box_y0, box_x1, box_y1;   // Bounds of the changed pixels
+} lump_diff_t;
+
+typedef struct {
+    wad_file_t *a, *b;
+    lump_diff_t *entries;         // Removed lumps in A's order, then the rest in B's
+    int num_entries;
+    int counts[NUM_DIFF_KINDS];
+    unsigned char *kind_a;        // DIFF_* per directory entry of A
+    unsigned char *kind_b;        // and of B
+    char (*ns_a)[9];              // Namespace per directory entry, as in wad_image_t
+    char (*ns_b)[9];
+    double seconds;
+} wad_diff_t;
+
 // DOOM palette (RGB triplets)
 unsigned char doom_palette[256][3];
 
 // Global variables
-wad_image_t *images = NULL;
+wad_file_t *wad_stack[MAX_WAD_STACK];   // Loaded WADs, bottom (IWAD) to top
+int num_wads = 0;
+arena_t view_arena = {0};              // Merged view arrays, rebuilt on every stack change
+wad_image_t **grid_images = NULL;      // Merged view over the whole stack
+// Hot fields of grid_images, one array each, so the filter and grid
+// passes stream through memory instead of chasing image records
+uint64_t *grid_names = NULL;           // Packed names, for searching
+int *grid_width = NULL;
+int *grid_height = NULL;
+unsigned char *grid_format = NULL;     // IMAGE_FORMAT_*
+unsigned char *grid_flags = NULL;      // GRID_VALID, GRID_OVERRIDDEN
+GLuint *grid_textures = NULL;
+unsigned char *grid_keep = NULL;       // Filter scratch, one byte per image
+unsigned char *grid_diff = NULL;       // DIFF_* per image while diff_mode is on
+unsigned char *grid_similar = NULL;    // Distance to similar_image plus one, 0 if unlike it
 int total_images = 0;
+int *shown_images = NULL;              // Indexes of grid_images matching the search query
+int num_shown_images = 0;
+char search_query[256] = "";
+bool search_active = false;            // Search box is open and taking keystrokes
+double search_time_ms = 0;
+int overridden_count = 0;              // Lumps of the stack replaced by a later one
+stack_lump_t *stack_lumps = NULL;      // Every lump in the stack, bottom WAD first, in view_arena
+int num_stack_lumps = 0;
+int *stack_lump_slots = NULL;          // Open-addressed (namespace, name) -> winning stack_lumps index
+int stack_lump_slot_mask = 0;
+wad_image_t *selected_image = NULL;    // Last image clicked in the grid
+bool image_cache_enabled = true;       // Keep decoded images as palette indexes
+bool compressed_textures = false;      // Upload images as BC1 (S3TC) blocks instead of RGBA
+bool live_reload = true;               // Reload WADs that are rebuilt on disk
+int reload_watch_fd = -1;              // inotify descriptor watching the loaded WADs' folders
+arena_t scratch_arena = {0};           // Decodes when the image cache is off
+unsigned char *upload_buffer = NULL;   // RGBA staging for texture uploads
+size_t upload_capacity = 0;
+sprite_group_t *sprite_groups = NULL;
+int num_sprite_groups = 0;
+bool show_animation = false;
+bool animation_timer_running = false;
+sprite_group_t *animation_group = NULL;
+int animation_frame = 0;               // Position in the group's frame_order
+int animation_rotation = 1;
+int animation_tic = 0;
+int animation_tics_per_frame = 8;
+bool animation_paused = false;
+bool offset_view = false;              // Draw patches anchored at their offsets
+int pixel_scaler = SCALER_NONE;        // Upscaler for images drawn enlarged
+const char *scaler_names[NUM_SCALERS] = { "off", "scale2x", "scale3x" };
+const char *scaler_descriptions[NUM_SCALERS] = {
+    "off", "Scale2x (EPX) at 2x and 4x", "Scale3x at 3x"
+};
+bool diff_mode = false;                // Show only what the top WAD changes against the one below
+wad_diff_t stack_diff = {0};           // Top two WADs of the stack, in view_arena
+wad_image_t *similar_image = NULL;     // Grid shows only images that look like this one
+map_data_t **all_maps = NULL;          // Maps over the whole stack, in load order
+int num_all_maps = 0;
+bool automap_mode = false;
+int automap_index = 0;
+float automap_center_x = 0;
+float automap_center_y = 0;
+float automap_zoom = 1.0f;            // Window pixels per map unit
+bool automap_show_things = true;
+int automap_picked_line = -1;
+bool automap_dragging = false;
+int drag_x = 0, drag_y = 0;
 int scroll_position = 0;
 int window_width = 800;
 int window_height = 600;
@@ -69,46 +636,213 @@ char status_message[256] = "";
 char wad_filename[256] = "";
 int current_page = 0;
 int images_per_page = 0;
+int total_pages = 1;
 bool show_help = false;
 bool show_file_selector = false;
 bool show_folder_selector = false;
-char available_wads[10][256]; // Store up to 10 WAD filenames
+wad_info_t *available_wads = NULL;    // Every WAD found below wad_search_root
 int num_available_wads = 0;
-int selected_wad_index = 0;
+int *filtered_wads = NULL;            // Indexes into available_wads matching wad_filter
+int num_filtered_wads = 0;
+int selected_wad_index = 0;           // Position in filtered_wads
+int wad_list_scroll = 0;              // First visible row of the selector
+char wad_filter[256] = "";
+char wad_search_root[1024] = ".";
 // DOOM palette (RGB triplets)
 unsigned char doom_palette[256][3];
 bool palette_loaded = false;
+bool external_palette = false;     // playpal.lmp was found and takes precedence over the WADs
 // Global variables to support folder selection
 char input_png_folder[1024] = {0};
 char wad_output_name[256] = "output";
 char output_wad_folder[1024] = {0};
 int selected_input_field = 0;
+// Cached layer rendering
+render_layer_t layers[NUM_LAYERS];
+bool layers_supported = false;
+int layer_generation = 0;
+PFNGLGENFRAMEBUFFERSEXTPROC gl_gen_framebuffers = NULL;
+PFNGLDELETEFRAMEBUFFERSEXTPROC gl_delete_framebuffers = NULL;
+PFNGLBINDFRAMEBUFFEREXTPROC gl_bind_framebuffer = NULL;
+PFNGLFRAMEBUFFERTEXTURE2DEXTPROC gl_framebuffer_texture_2d = NULL;
+PFNGLCHECKFRAMEBUFFERSTATUSEXTPROC gl_check_framebuffer_status = NULL;
+PFNGLBLENDFUNCSEPARATEPROC gl_blend_func_separate = NULL;
+bool vbo_supported = false;
+PFNGLGENBUFFERSPROC gl_gen_buffers = NULL;
+PFNGLDELETEBUFFERSPROC gl_delete_buffers = NULL;
+PFNGLBINDBUFFERPROC gl_bind_buffer = NULL;
+PFNGLBUFFERDATAPROC gl_buffer_data = NULL;
+bool texture_compression_supported = false;
+PFNGLCOMPRESSEDTEXIMAGE2DPROC gl_compressed_tex_image_2d = NULL;
+// Image textures made so far, for comparing compressed and RGBA uploads
+struct {
+    int textures;
+    double rgba_bytes;             // What RGBA uploads of the same images take
+    double stored_bytes;           // What was uploaded
+    double encode_seconds, upload_seconds;
+    double squared_error, samples; // BC1 error over opaque pixels, per channel
+} texture_stats;
+// Offscreen rendering (eyeglass render) draws into a framebuffer instead of a window
+typedef void (*gl_proc_t)(void);
+bool offscreen = false;
+GLuint window_framebuffer = 0;        // Where frames end up: 0 is the window
+gl_proc_t (*offscreen_proc_address)(const char *name) = NULL;
 
 // Function prototypes
 
 void load_wad_file(const char *filename);
 void unload_current_wad();
+bool map_file(const char *filename, mapped_file_t *map);
+void unmap_file(mapped_file_t *map);
+wad_file_t *wad_open_directory(const char *filename);
+wad_file_t *wad_open(const char *filename);
+bool zip_read_directory(wad_file_t *wad);
+void wad_close(wad_file_t *wad);
+const unsigned char *wad_find_lump(wad_file_t *wad, const char *name, int *size);
+bool wad_stack_push(const char *filename);
+void wad_stack_remove(int index);
+int wad_stack_find(const char *filename);
+bool wad_reload(int index);
+void reload_watch_refresh();
+void reload_tick(int value);
+bool wad_diff(wad_file_t *a, wad_file_t *b, wad_diff_t *diff, arena_t *arena);
+void wad_diff_pixels(wad_diff_t *diff, const char *image_folder);
+void update_stack_diff();
+uint64_t image_phash(const indexed_image_t *indexed);
+void hash_images(wad_image_t **images, int count);
+bool phash_tree_init(phash_tree_t *tree, int capacity, arena_t *arena);
+void phash_tree_insert(phash_tree_t *tree, uint64_t hash, int item);
+int phash_tree_query(const phash_tree_t *tree, uint64_t hash, int radius, int *items, int max_items);
+void find_similar_images();
+bool catalog_open(const char *path, catalog_t *catalog);
+void catalog_close(catalog_t *catalog);
+const catalog_name_t *catalog_find(const catalog_t *catalog, const char *name);
+int catalog_query(const catalog_t *catalog, const char *query, unsigned char *matches);
+bool is_map_marker(const char *clean_name);
+bool is_map_data_lump(const char *clean_name);
+const unsigned char *wad_lump_data(wad_file_t *wad, int index, int *size);
+int load_pending_images(wad_image_t **images, int count);
+void load_page_images();
+float grid_magnification(int k);
+map_data_t *parse_map(wad_file_t *wad, int marker_index);
+void wad_index_maps(wad_file_t *wad);
+void rebuild_map_view();
+void draw_line_aa(unsigned char *buffer, int size, float x0, float y0, float x1, float y1, float intensity);
+void wad_build_map_previews(wad_file_t *wad);
+void draw_automap();
+void automap_fit();
+int automap_pick_line(int x, int y);
+uint64_t pack_lump_name(const char *name);
+bool glob_match(const char *pattern, const char *text);
+bool regex_match(const char *re, const char *text);
+void parse_lump_query(const char *text, lump_query_t *query);
+void apply_lump_filter();
+void rebuild_sprite_groups();
+sprite_group_t *find_sprite_group(const char *name);
+sprite_view_t *sprite_frame_view(sprite_group_t *group, int frame, int rotation);
+bool build_sprite_atlas(sprite_group_t *group);
+void start_animation(const wad_image_t *image);
+void animation_tick(int value);
+void draw_animation();
+void validate_sprite_offsets();
 void load_doom_palette();
 bool extract_palette_from_wad(const char *filename);
 bool is_image_lump(char *name);
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_calloc(arena_t *arena, size_t size);
+void arena_free(arena_t *arena);
+void arena_reset(arena_t *arena);
+indexed_image_t *decode_image_indexed(wad_image_t *image, arena_t *arena);
+indexed_image_t *indexed_from_columns(const import_image_t *source, arena_t *arena);
+indexed_image_t *image_indexes(wad_image_t *image);
+void expand_image_rgba(const wad_image_t *image, const indexed_image_t *indexed, unsigned char *out, int stride);
+unsigned char *upload_buffer_reserve(size_t size);
 void create_texture_from_image(wad_image_t *image);
+void create_textures(wad_image_t **images, int count);
 void detect_image_dimensions(wad_image_t *image);
 void display();
+void update_page_layout();
+void draw_grid();
+void draw_status_bar();
+void draw_header();
+void draw_overlays();
+void load_gl_extensions();
+void invalidate_layers();
 void reshape(int w, int h);
 void keyboard(unsigned char key, int x, int y);
 void special_keys(int key, int x, int y);
 void mouse(int button, int state, int x, int y);
+void motion(int x, int y);
 void draw_string(float x, float y, const char *text);
+void text_init();
+void text_layout_build(text_layout_t *layout, const char *text);
+void text_layout_build_in(text_layout_t *layout, const char *text, arena_t *arena);
+void text_layout_free(text_layout_t *layout);
+void draw_text_layout(float x, float y, const text_layout_t *layout);
+void text_begin_frame();
+void text_flush();
 void find_available_wads();
+void apply_wad_filter();
+bool is_directory(const char *path);
+int cpu_count();
+double now_seconds();
+void mutex_init(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+void cond_init(cond_t *cond);
+void cond_wait(cond_t *cond, mutex_t *mutex);
+void cond_broadcast(cond_t *cond);
+bool thread_start(thread_t *thread, thread_fn fn, void *arg);
+void parallel_for(int count, parallel_fn fn, void *context);
 void file_selector_menu();
 int pngtopwad(const char* input_folder, const char* wad_name, const char* output_folder);
+int build_command(int argc, char **argv);
+int diff_command(int argc, char **argv);
+int dupes_command(int argc, char **argv);
+int catalog_command(int argc, char **argv);
+int serve_command(int argc, char **argv);
+int loadtest_command(int argc, char **argv);
+int render_command(int argc, char **argv);
+int verify_command(int argc, char **argv);
 int read_png_dimensions(const char* filename, int* width, int* height);
+void prepare_color_lookup();
+long inflate_raw(const unsigned char *src, size_t src_size, unsigned char *dst, size_t dst_size);
+size_t deflate_fixed(const unsigned char *src, size_t size, unsigned char *out);
+size_t png_encode(unsigned char *out, const unsigned char *scanlines, int width, int height,
+                  int color_type, int transparent_index);
+bool decode_png(const unsigned char *data, size_t size, const char *path, import_image_t *image);
+void import_image_free(import_image_t *image);
 void folder_selector_menu();
-int bmp32_to_pwad(const char* input_folder, const char* wad_name, const char* output_folder);
 
 int main(int argc, char** argv) {
     char wadPath[256] = "doom2.wad";  // Default WAD path
     
+    // Subcommands run headless, without a window
+    if (argc >= 2 && strcmp(argv[1], "build") == 0) {
+        return build_command(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "diff") == 0) {
+        return diff_command(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "dupes") == 0) {
+        return dupes_command(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "catalog") == 0) {
+        return catalog_command(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "serve") == 0) {
+        return serve_command(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "loadtest") == 0) {
+        return loadtest_command(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "render") == 0) {
+        return render_command(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "verify") == 0) {
+        return verify_command(argc - 2, argv + 2);
+    }
+    
     // Initialize GLUT
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB);
@@ -121,134 +855,708 @@ int main(int argc, char** argv) {
     glutKeyboardFunc(keyboard);
     glutSpecialFunc(special_keys);
     glutMouseFunc(mouse);
+    glutMotionFunc(motion);
     
     // Initialize OpenGL
     glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
     glEnable(GL_TEXTURE_2D);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    text_init();
+    load_gl_extensions();
     
     // Load palette
     load_doom_palette();
     
+    // A directory argument selects where the WAD selector looks
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-image-cache") == 0) {
+            image_cache_enabled = false;
+        } else if (strcmp(argv[i], "--no-live-reload") == 0) {
+            live_reload = false;
+        } else if (strcmp(argv[i], "--compress-textures") == 0) {
+            compressed_textures = true;
+        } else if (is_directory(argv[i])) {
+            snprintf(wad_search_root, sizeof(wad_search_root), "%s", argv[i]);
+        }
+    }
+    
     // Find available WAD files
     find_available_wads();
     
-    // If WADs were found, load the first one
-    if (num_available_wads > 0) {
-        strcpy(wadPath, available_wads[0]);
+    // WADs named on the command line form the load stack, IWAD first
+    int stacked = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' && !is_directory(argv[i]) && wad_stack_push(argv[i])) {
+            stacked++;
+        }
+    }
+    
+    if (stacked > 0) {
+        // Already loaded from the command line
+    } else if (num_available_wads > 0) {
+        // If WADs were found, load the first one
+        snprintf(wadPath, sizeof(wadPath), "%s", available_wads[0].path);
         load_wad_file(wadPath);
     } else {
         // Try to load the default WAD
         load_wad_file(wadPath);
     }
     
+    // Pick up rebuilt WADs while the viewer is open
+    if (live_reload) {
+        glutTimerFunc(RELOAD_POLL_MS, reload_tick, 0);
+    }
+    
     // Start the main loop
     glutMainLoop();
     return 0;
 }
 
-// Find all .WAD files in the current directory
-void find_available_wads() {
-    WIN32_FIND_DATA findData;
-    HANDLE hFind;
+// Number of hardware threads available to the worker pool
+int cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Monotonic time in seconds, for throughput and timing reports
+double now_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+void mutex_init(mutex_t *mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutex_lock(mutex_t *mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutex_unlock(mutex_t *mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void cond_init(cond_t *cond) {
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_wait(cond_t *cond, mutex_t *mutex) {
+#ifdef _WIN32
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void cond_broadcast(cond_t *cond) {
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+bool thread_start(thread_t *thread, thread_fn fn, void *arg) {
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)fn, arg, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, (void *(*)(void *))fn, arg) == 0;
+#endif
+}
+
+// Worker pool. Threads are started on first use and then sleep until a
+// parallel_for() hands them work. The calling thread always helps, so on a
+// single-core machine everything simply runs inline.
+mutex_t pool_mutex;
+cond_t pool_work_cond;
+cond_t pool_done_cond;
+parallel_job_t *pool_jobs = NULL;   // Jobs with items still to hand out
+int pool_size = 0;                  // Worker threads, not counting callers
+int worker_limit = 0;               // Threads in total including the caller, 0 for one per CPU
+bool pool_started = false;
+
+// Claim and run items until the job has none left
+static void run_job_items(parallel_job_t *job) {
+    int index;
+    while ((index = atomic_fetch_add(&job->next, 1)) < job->count) {
+        job->fn(job->context, index);
+        if (atomic_fetch_sub(&job->remaining, 1) == 1) {
+            mutex_lock(&pool_mutex);
+            cond_broadcast(&pool_done_cond);
+            mutex_unlock(&pool_mutex);
+        }
+    }
+}
+
+static void pool_remove_job(parallel_job_t *job) {
+    for (parallel_job_t **link = &pool_jobs; *link; link = &(*link)->next_job) {
+        if (*link == job) {
+            *link = job->next_job;
+            return;
+        }
+    }
+}
+
+static THREAD_PROC(pool_worker) {
+    mutex_lock(&pool_mutex);
+    for (;;) {
+        while (!pool_jobs) {
+            cond_wait(&pool_work_cond, &pool_mutex);
+        }
+        
+        parallel_job_t *job = pool_jobs;
+        if (atomic_load(&job->next) >= job->count) {
+            // Everything handed out; the owner is waiting for the stragglers
+            pool_remove_job(job);
+            continue;
+        }
+        
+        job->workers++;
+        mutex_unlock(&pool_mutex);
+        run_job_items(job);
+        mutex_lock(&pool_mutex);
+        job->workers--;
+        cond_broadcast(&pool_done_cond);
+    }
+    return 0;
+}
+
+void pool_init() {
+    if (pool_started) return;
+    pool_started = true;
     
-    num_available_wads = 0;
+    mutex_init(&pool_mutex);
+    cond_init(&pool_work_cond);
+    cond_init(&pool_done_cond);
     
-    hFind = FindFirstFile("*.wad", &findData);
-    if (hFind != INVALID_HANDLE_VALUE) {
-        do {
-            // Skip directories
-            if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                strcpy(available_wads[num_available_wads], findData.cFileName);
-                num_available_wads++;
-                
-                // Limit to 10 WADs
-                if (num_available_wads >= 10) {
-                    break;
-                }
-            }
-        } while (FindNextFile(hFind, &findData) != 0);
-        
-        FindClose(hFind);
+    int wanted = (worker_limit > 0 ? worker_limit : cpu_count()) - 1;
+    if (wanted > MAX_WORKER_THREADS) wanted = MAX_WORKER_THREADS;
+    for (int i = 0; i < wanted; i++) {
+        thread_t thread;
+        if (thread_start(&thread, pool_worker, NULL)) {
+            pool_size++;
+        }
     }
+}
+
+// Run fn(context, i) for every i in [0, count) across the worker pool and
+// wait for all of them. Items must be independent of each other.
+void parallel_for(int count, parallel_fn fn, void *context) {
+    if (count <= 0) return;
+    pool_init();
     
-    // If no WADs found, set a default message
-    if (num_available_wads == 0) {
-        strcpy(status_message, "No WAD files found in the current directory");
+    if (pool_size == 0 || count == 1) {
+        for (int i = 0; i < count; i++) fn(context, i);
+        return;
+    }
+    
+    parallel_job_t job;
+    job.fn = fn;
+    job.context = context;
+    job.count = count;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.remaining, count);
+    job.workers = 0;
+    job.next_job = NULL;
+    
+    mutex_lock(&pool_mutex);
+    parallel_job_t **tail = &pool_jobs;
+    while (*tail) tail = &(*tail)->next_job;
+    *tail = &job;
+    cond_broadcast(&pool_work_cond);
+    mutex_unlock(&pool_mutex);
+    
+    run_job_items(&job);
+    
+    mutex_lock(&pool_mutex);
+    while (atomic_load(&job.remaining) > 0 || job.workers > 0) {
+        cond_wait(&pool_done_cond, &pool_mutex);
+    }
+    pool_remove_job(&job);
+    mutex_unlock(&pool_mutex);
+}
+
+bool is_directory(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool has_wad_extension(const char *name) {
+    const char *ext = strrchr(name, '.');
+    return ext && (strcasecmp(ext, ".wad") == 0 || strcasecmp(ext, ".pk3") == 0);
+}
+
+static void add_wad_candidate(wad_info_t **list, int *count, int *capacity,
+                              const char *path, long long size, long long mtime) {
+    if (*count == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 256;
+        wad_info_t *grown = (wad_info_t *)realloc(*list, new_capacity * sizeof(wad_info_t));
+        if (!grown) return;
+        *list = grown;
+        *capacity = new_capacity;
+    }
+    
+    wad_info_t *info = &(*list)[*count];
+    memset(info, 0, sizeof(*info));
+    info->path = strdup(path);
+    info->size = size;
+    info->mtime = mtime;
+    info->type = WAD_TYPE_UNKNOWN;
+    if (info->path) (*count)++;
+}
+
+// False when the joined path does not fit; the caller skips the entry
+static bool join_path(char *out, size_t out_size, const char *dir, const char *name) {
+    int length;
+    if (strcmp(dir, ".") == 0) {
+        length = snprintf(out, out_size, "%s", name);
     } else {
-        sprintf(status_message, "Found %d WAD files. Press L to select a WAD.", num_available_wads);
+        length = snprintf(out, out_size, "%s/%s", dir, name);
     }
+    return length >= 0 && (size_t)length < out_size;
 }
 
-// Clean up the currently loaded WAD resources
-void unload_current_wad() {
-    if (images) {
-        for (int i = 0; i < total_images; i++) {
-            if (images[i].data) {
-                free(images[i].data);
-            }
-            if (images[i].texture_id > 0) {
-                glDeleteTextures(1, &images[i].texture_id);
+// One folder of a scan: the WADs found in it and the folders below it
+typedef struct {
+    char *path;
+    wad_info_t *files;
+    int num_files;
+    int files_capacity;
+    char **subdirs;
+    int num_subdirs;
+    int subdirs_capacity;
+} scan_folder_t;
+
+static void add_scan_subdir(scan_folder_t *folder, const char *path) {
+    if (folder->num_subdirs == folder->subdirs_capacity) {
+        int new_capacity = folder->subdirs_capacity ? folder->subdirs_capacity * 2 : 16;
+        char **grown = (char **)realloc(folder->subdirs, new_capacity * sizeof(char *));
+        if (!grown) return;
+        folder->subdirs = grown;
+        folder->subdirs_capacity = new_capacity;
+    }
+    char *copy = strdup(path);
+    if (copy) folder->subdirs[folder->num_subdirs++] = copy;
+}
+
+// Read one folder's entries. Runs on the worker pool; each folder has its
+// own lists, so nothing is shared.
+static void scan_folder(void *context, int index) {
+    scan_folder_t *folder = &((scan_folder_t *)context)[index];
+    char path[1024];
+    
+#ifdef _WIN32
+    WIN32_FIND_DATA findData;
+    char pattern[1024];
+    if (!join_path(pattern, sizeof(pattern), folder->path, "*")) return;
+    
+    HANDLE hFind = FindFirstFile(pattern, &findData);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    
+    do {
+        if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0) continue;
+        if (!join_path(path, sizeof(path), folder->path, findData.cFileName)) continue;
+        
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            // Don't follow junctions; they can loop
+            if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+                add_scan_subdir(folder, path);
             }
+        } else if (has_wad_extension(findData.cFileName)) {
+            long long size = ((long long)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+            long long mtime = ((long long)findData.ftLastWriteTime.dwHighDateTime << 32) |
+                              findData.ftLastWriteTime.dwLowDateTime;
+            add_wad_candidate(&folder->files, &folder->num_files, &folder->files_capacity, path, size, mtime);
         }
-        free(images);
-        images = NULL;
-    }
+    } while (FindNextFile(hFind, &findData) != 0);
     
-    total_images = 0;
-    current_page = 0;
+    FindClose(hFind);
+#else
+    DIR *dir = opendir(folder->path);
+    if (!dir) return;
+    
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        
+        // Most file systems report the type, so directories cost no stat()
+        if (entry->d_type == DT_LNK) continue;   // Don't follow symlinks; they can loop
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN && !has_wad_extension(entry->d_name)) continue;
+        
+        if (!join_path(path, sizeof(path), folder->path, entry->d_name)) continue;
+        
+        struct stat st;
+        if (lstat(path, &st) != 0) continue;
+        
+        if (S_ISDIR(st.st_mode)) {
+            add_scan_subdir(folder, path);
+        } else if (S_ISREG(st.st_mode) && has_wad_extension(entry->d_name)) {
+            add_wad_candidate(&folder->files, &folder->num_files, &folder->files_capacity,
+                              path, st.st_size, (long long)st.st_mtime);
+        }
+    }
+    closedir(dir);
+#endif
 }
 
-void load_doom_palette() {
-    FILE *palette_file = fopen("playpal.lmp", "rb");
+// Recursively list *.wad and *.pk3 files with their size and modification time.
+// Only directory entries are read here; the files themselves are not opened.
+// The tree is walked one level at a time, with the folders of a level read
+// on the worker pool, so slow or network file systems overlap their
+// lookups. Entries whose path would not fit are skipped.
+static void collect_wad_files(const char *dir_path, wad_info_t **list, int *count, int *capacity) {
+    char **level = (char **)malloc(sizeof(char *));
+    if (!level) return;
+    level[0] = strdup(dir_path);
+    int level_size = level[0] ? 1 : 0;
     
-    if (palette_file) {
-        // Read the palette from file
-        fread(doom_palette, 3, 256, palette_file);
-        fclose(palette_file);
-        palette_loaded = true;
-        sprintf(status_message, "Loaded palette from playpal.lmp");
-    } else {
-        // If external palette not found, try to extract from WAD
-        if (strlen(wad_filename) > 0) {
-            if (extract_palette_from_wad(wad_filename)) {
-                palette_loaded = true;
-                sprintf(status_message, "Extracted palette from %s", wad_filename);
-            } else {
-                // If all else fails, use a grayscale palette
-                for (int i = 0; i < 256; i++) {
-                    doom_palette[i][0] = i;
-                    doom_palette[i][1] = i;
-                    doom_palette[i][2] = i;
-                }
-                palette_loaded = false;
-                sprintf(status_message, "Using grayscale palette (no palette found)");
+    for (int depth = 0; level_size > 0; depth++) {
+        scan_folder_t *folders = (scan_folder_t *)calloc(level_size, sizeof(scan_folder_t));
+        if (!folders) break;
+        for (int i = 0; i < level_size; i++) folders[i].path = level[i];
+        parallel_for(level_size, scan_folder, folders);
+        
+        // Merge in folder order; the records move over with their paths
+        int found = 0, next_size = 0;
+        for (int i = 0; i < level_size; i++) {
+            found += folders[i].num_files;
+            next_size += folders[i].num_subdirs;
+        }
+        if (*count + found > *capacity) {
+            int new_capacity = *capacity ? *capacity : 256;
+            while (new_capacity < *count + found) new_capacity *= 2;
+            wad_info_t *grown = (wad_info_t *)realloc(*list, new_capacity * sizeof(wad_info_t));
+            if (grown) {
+                *list = grown;
+                *capacity = new_capacity;
+            }
+        }
+        for (int i = 0; i < level_size; i++) {
+            for (int f = 0; f < folders[i].num_files; f++) {
+                if (*count < *capacity) (*list)[(*count)++] = folders[i].files[f];
+                else free(folders[i].files[f].path);
+            }
+            free(folders[i].files);
+        }
+        
+        char **next = depth < MAX_SCAN_DEPTH && next_size > 0 ? (char **)malloc(next_size * sizeof(char *)) : NULL;
+        int next_count = 0;
+        for (int i = 0; i < level_size; i++) {
+            for (int d = 0; d < folders[i].num_subdirs; d++) {
+                if (next) next[next_count++] = folders[i].subdirs[d];
+                else free(folders[i].subdirs[d]);
             }
+            free(folders[i].subdirs);
+            free(folders[i].path);
         }
+        free(folders);
+        free(level);
+        level = next;
+        level_size = next_count;
     }
+    for (int i = 0; i < level_size; i++) free(level[i]);
+    free(level);
 }
 
-// Extract palette from WAD file
-bool extract_palette_from_wad(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) return false;
+// Read just the header and directory of a WAD and summarize it.
+// Runs on the worker pool; entries already filled from the index are skipped.
+static void probe_wad(void *context, int index) {
+    wad_info_t *info = &((wad_info_t *)context)[index];
+    if (info->type != WAD_TYPE_UNKNOWN) return;
+    
+    info->type = WAD_TYPE_INVALID;
+    
+    FILE *file = fopen(info->path, "rb");
+    if (!file) return;
     
-    // Read WAD header
     wad_header_t header;
-    fread(&header, sizeof(wad_header_t), 1, file);
+    bool have_header = fread(&header, sizeof(wad_header_t), 1, file) == 1;
+    if (have_header && memcmp(header.identifier, "PK\3\4", 4) == 0) {
+        // A PK3 is summarized from its central directory, at the end of the file
+        fclose(file);
+        wad_file_t pk3 = {0};
+        if (map_file(info->path, &pk3.map) && zip_read_directory(&pk3)) {
+            info->type = WAD_TYPE_PK3;
+            info->num_lumps = pk3.header.num_lumps;
+            for (int i = 0; i < pk3.header.num_lumps; i++) {
+                if (strncmp(pk3.directory[i].name, "PLAYPAL", 8) == 0) info->has_palette = true;
+            }
+        }
+        arena_free(&pk3.arena);
+        unmap_file(&pk3.map);
+        return;
+    }
+    if (!have_header ||
+        (strncmp(header.identifier, "IWAD", 4) != 0 && strncmp(header.identifier, "PWAD", 4) != 0) ||
+        header.num_lumps < 0 || header.directory_offset < 0 ||
+        (long long)header.directory_offset + (long long)header.num_lumps * sizeof(wad_directory_t) > info->size) {
+        fclose(file);
+        return;
+    }
     
-    // Check WAD signature
-    if (strncmp(header.identifier, "IWAD", 4) != 0 && strncmp(header.identifier, "PWAD", 4) != 0) {
+    wad_directory_t *directory = (wad_directory_t *)malloc(header.num_lumps * sizeof(wad_directory_t) + 1);
+    if (!directory) {
         fclose(file);
-        return false;
+        return;
     }
     
-    // Read directory
-    wad_directory_t *directory = (wad_directory_t *)malloc(header.num_lumps * sizeof(wad_directory_t));
     fseek(file, header.directory_offset, SEEK_SET);
-    fread(directory, sizeof(wad_directory_t), header.num_lumps, file);
-    
+    if (fread(directory, sizeof(wad_directory_t), header.num_lumps, file) == (size_t)header.num_lumps) {
+        info->type = strncmp(header.identifier, "IWAD", 4) == 0 ? WAD_TYPE_IWAD : WAD_TYPE_PWAD;
+        info->num_lumps = header.num_lumps;
+        
+        for (int i = 0; i < header.num_lumps; i++) {
+            char name[9] = {0};
+            strncpy(name, directory[i].name, 8);
+            
+            if (is_map_marker(name)) {
+                info->num_maps++;
+            } else if (strcmp(name, "PLAYPAL") == 0) {
+                info->has_palette = true;
+            }
+        }
+    }
+    
+    free(directory);
+    fclose(file);
+}
+
+static int compare_wad_info_path(const void *a, const void *b) {
+    return strcmp(((const wad_info_t *)a)->path, ((const wad_info_t *)b)->path);
+}
+
+// Fill entries from the index file where path, size and mtime still match.
+// Returns the number of entries that were found there.
+static int load_wad_index(const char *index_path, wad_info_t *list, int count) {
+    FILE *file = fopen(index_path, "r");
+    if (!file) return 0;
+    
+    char line[1200];
+    if (!fgets(line, sizeof(line), file) || strncmp(line, WAD_INDEX_HEADER, strlen(WAD_INDEX_HEADER)) != 0) {
+        fclose(file);
+        return 0;
+    }
+    
+    int hits = 0;
+    while (fgets(line, sizeof(line), file)) {
+        // path \t size \t mtime \t type \t lumps \t maps \t has_palette
+        char *tab = strchr(line, '\t');
+        if (!tab) continue;
+        *tab = '\0';
+        
+        wad_info_t key;
+        key.path = line;
+        wad_info_t *info = (wad_info_t *)bsearch(&key, list, count, sizeof(wad_info_t), compare_wad_info_path);
+        if (!info) continue;
+        
+        long long size, mtime;
+        int type, num_lumps, num_maps, has_palette;
+        if (sscanf(tab + 1, "%lld\t%lld\t%d\t%d\t%d\t%d",
+                   &size, &mtime, &type, &num_lumps, &num_maps, &has_palette) != 6) continue;
+        if (size != info->size || mtime != info->mtime) continue;   // Changed since it was indexed
+        
+        info->type = type;
+        info->num_lumps = num_lumps;
+        info->num_maps = num_maps;
+        info->has_palette = has_palette != 0;
+        hits++;
+    }
+    
+    fclose(file);
+    return hits;
+}
+
+static void save_wad_index(const char *index_path, const wad_info_t *list, int count) {
+    FILE *file = fopen(index_path, "w");
+    if (!file) return;
+    
+    fprintf(file, "%s\n", WAD_INDEX_HEADER);
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%s\t%lld\t%lld\t%d\t%d\t%d\t%d\n", list[i].path, list[i].size, list[i].mtime,
+                list[i].type, list[i].num_lumps, list[i].num_maps, list[i].has_palette ? 1 : 0);
+    }
+    fclose(file);
+}
+
+static bool contains_nocase(const char *haystack, const char *needle) {
+    if (!*needle) return true;
+    for (; *haystack; haystack++) {
+        const char *h = haystack, *n = needle;
+        while (*h && *n && tolower((unsigned char)*h) == tolower((unsigned char)*n)) {
+            h++;
+            n++;
+        }
+        if (!*n) return true;
+    }
+    return false;
+}
+
+// Rebuild the list of WADs shown in the selector from the current filter
+void apply_wad_filter() {
+    free(filtered_wads);
+    filtered_wads = (int *)malloc((num_available_wads > 0 ? num_available_wads : 1) * sizeof(int));
+    num_filtered_wads = 0;
+    if (!filtered_wads) return;
+    
+    for (int i = 0; i < num_available_wads; i++) {
+        if (contains_nocase(available_wads[i].path, wad_filter)) {
+            filtered_wads[num_filtered_wads++] = i;
+        }
+    }
+    
+    selected_wad_index = 0;
+    wad_list_scroll = 0;
+}
+
+// Find all .WAD files below the search directory. The directory tree is
+// walked once, files whose size and mtime match the index file are taken
+// from it, and only new or changed WADs are opened (header and directory
+// only) on the worker pool.
+void find_available_wads() {
+    double start_time = now_seconds();
+    
+    for (int i = 0; i < num_available_wads; i++) {
+        free(available_wads[i].path);
+    }
+    free(available_wads);
+    available_wads = NULL;
+    num_available_wads = 0;
+    
+    wad_info_t *list = NULL;
+    int count = 0, capacity = 0;
+    collect_wad_files(wad_search_root, &list, &count, &capacity);
+    if (count > 0) {
+        qsort(list, count, sizeof(wad_info_t), compare_wad_info_path);
+    }
+    
+    // A root too long for the index path just goes without one
+    char index_path[1024];
+    bool have_index = join_path(index_path, sizeof(index_path), wad_search_root, WAD_INDEX_FILENAME);
+    int cached = have_index ? load_wad_index(index_path, list, count) : 0;
+    
+    parallel_for(count, probe_wad, list);
+    
+    // Keep only real WADs; the index remembers the rest so they aren't reopened
+    if (have_index && (cached != count || count == 0)) {
+        save_wad_index(index_path, list, count);
+    }
+    for (int i = 0; i < count; i++) {
+        if (list[i].type == WAD_TYPE_INVALID) {
+            free(list[i].path);
+        } else {
+            list[num_available_wads++] = list[i];
+        }
+    }
+    available_wads = list;
+    
+    wad_filter[0] = '\0';
+    apply_wad_filter();
+    invalidate_layers();
+    
+    // If no WADs found, set a default message
+    if (num_available_wads == 0) {
+        strcpy(status_message, "No WAD files found in the current directory");
+    } else {
+        sprintf(status_message, "Found %d WAD files (%d probed, %d from index) in %.0f ms. Press L to select a WAD.",
+                num_available_wads, count - cached, cached, (now_seconds() - start_time) * 1000.0);
+    }
+}
+
+void load_doom_palette() {
+    FILE *palette_file = fopen("playpal.lmp", "rb");
+    
+    if (palette_file) {
+        // Read the palette from file
+        fread(doom_palette, 3, 256, palette_file);
+        fclose(palette_file);
+        palette_loaded = true;
+        external_palette = true;
+        sprintf(status_message, "Loaded palette from playpal.lmp");
+    } else {
+        // If external palette not found, try to extract from WAD
+        if (strlen(wad_filename) > 0) {
+            if (extract_palette_from_wad(wad_filename)) {
+                palette_loaded = true;
+                sprintf(status_message, "Extracted palette from %s", wad_filename);
+            } else {
+                // If all else fails, use a grayscale palette
+                for (int i = 0; i < 256; i++) {
+                    doom_palette[i][0] = i;
+                    doom_palette[i][1] = i;
+                    doom_palette[i][2] = i;
+                }
+                palette_loaded = false;
+                sprintf(status_message, "Using grayscale palette (no palette found)");
+            }
+        }
+    }
+}
+
+// Extract palette from WAD file
+bool extract_palette_from_wad(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) return false;
+    
+    // Read WAD header
+    wad_header_t header;
+    fread(&header, sizeof(wad_header_t), 1, file);
+    
+    // PK3s need the zip index to find the lump
+    if (memcmp(header.identifier, "PK\3\4", 4) == 0) {
+        fclose(file);
+        wad_file_t *pk3 = wad_open(filename);
+        if (!pk3) return false;
+        int size = 0;
+        const unsigned char *playpal = wad_find_lump(pk3, "PLAYPAL", &size);
+        if (playpal && size >= (int)sizeof(doom_palette)) memcpy(doom_palette, playpal, sizeof(doom_palette));
+        bool found_palette = playpal && size >= (int)sizeof(doom_palette);
+        wad_close(pk3);
+        return found_palette;
+    }
+    
+    // Check WAD signature
+    if (strncmp(header.identifier, "IWAD", 4) != 0 && strncmp(header.identifier, "PWAD", 4) != 0) {
+        fclose(file);
+        return false;
+    }
+    
+    // Read directory
+    wad_directory_t *directory = (wad_directory_t *)malloc(header.num_lumps * sizeof(wad_directory_t));
+    fseek(file, header.directory_offset, SEEK_SET);
+    fread(directory, sizeof(wad_directory_t), header.num_lumps, file);
+    
     bool found_palette = false;
     
     // Look for PLAYPAL lump
@@ -272,23 +1580,83 @@ bool extract_palette_from_wad(const char *filename) {
     return found_palette;
 }
 
+static int read_le16(const unsigned char *p) {
+    return (short)(p[0] | (p[1] << 8));
+}
+
+static unsigned int read_le16u(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const unsigned char *p) {
+    return read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+static uint32_t read_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// 64-bit hash of a lump payload, eight bytes per step
+uint64_t hash_lump64(const unsigned char *data, size_t size) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+        hash ^= hash >> 31;
+    }
+    for (; i < size; i++) hash = (hash ^ data[i]) * 0x100000001B3ull;
+    hash ^= hash >> 29;
+    hash *= 0x94D049BB133111EBull;
+    return hash ^ (hash >> 32);
+}
+
 void detect_image_dimensions(wad_image_t *image) {
+    image->format = IMAGE_FORMAT_RAW;
+    
+    // PNG lumps (common in PK3s) describe themselves; offsets come from grAb
+    if (image->size >= 33 && memcmp(image->data, "\x89PNG\r\n\x1a\n", 8) == 0 &&
+        memcmp(image->data + 12, "IHDR", 4) == 0) {
+        const unsigned char *p = image->data;
+        int width = (int)read_be32(p + 16);
+        int height = (int)read_be32(p + 20);
+        image->format = IMAGE_FORMAT_PNG;
+        image->is_valid = width > 0 && height > 0 && width <= DECODE_MAX_DIMENSION && height <= DECODE_MAX_DIMENSION;
+        image->width = width;
+        image->height = height;
+        
+        for (int pos = 8; pos + 12 <= image->size; ) {
+            int length = (int)read_be32(p + pos);
+            if (length < 0 || length > image->size - pos - 12 || memcmp(p + pos + 4, "IDAT", 4) == 0) break;
+            if (memcmp(p + pos + 4, "grAb", 4) == 0 && length >= 8) {
+                image->left_offset = (int)read_be32(p + pos + 8);
+                image->top_offset = (int)read_be32(p + pos + 12);
+            }
+            pos += length + 12;
+        }
+        return;
+    }
+    
     // First, check for patch format (standard DOOM sprite format)
     if (image->size >= 8) {
         // First 4 bytes in patch format are header: width (2 bytes) and height (2 bytes)
         int width = (unsigned char)image->data[0] | ((unsigned char)image->data[1] << 8);
         int height = (unsigned char)image->data[2] | ((unsigned char)image->data[3] << 8);
         
-        // Sanity check the dimensions
-        if (width > 0 && width < 1024 && height > 0 && height < 1024) {
+        // Sanity check the dimensions; the column offsets must fit in the lump
+        if (width > 0 && width < 1024 && height > 0 && height < 1024 && 8 + 4 * width <= image->size) {
             // Verify column offsets are within bounds
             bool valid_patch = true;
-            int *column_offsets = (int*)(image->data + 8);
             
             // Check a few column offsets to see if they make sense
             for (int i = 0; i < width && i < 16; i++) {
-                int offset = column_offsets[i];
-                if (offset < 0 || offset >= image->size) {
+                uint32_t offset = read_le32(image->data + 8 + i * 4);
+                if (offset < 8 + 4 * (uint32_t)width || offset >= (uint32_t)image->size) {
                     valid_patch = false;
                     break;
                 }
@@ -297,6 +1665,9 @@ void detect_image_dimensions(wad_image_t *image) {
             if (valid_patch) {
                 image->width = width;
                 image->height = height;
+                image->left_offset = (short)(image->data[4] | (image->data[5] << 8));
+                image->top_offset = (short)(image->data[6] | (image->data[7] << 8));
+                image->format = IMAGE_FORMAT_PATCH;
                 image->is_valid = true;
                 return;
             }
@@ -323,6 +1694,7 @@ void detect_image_dimensions(wad_image_t *image) {
         if (image->size == known_sizes[i].size) {
             image->width = known_sizes[i].width;
             image->height = known_sizes[i].height;
+            image->format = IMAGE_FORMAT_FLAT;
             image->is_valid = true;
             return;
         }
@@ -335,6 +1707,7 @@ void detect_image_dimensions(wad_image_t *image) {
         if (image->size % 4096 == 0) {  // Could be multiple flats
             image->width = 64;
             image->height = 64 * (image->size / 4096);
+            image->format = IMAGE_FORMAT_FLAT;
             image->is_valid = true;
             return;
         }
@@ -427,16 +1800,162 @@ void detect_image_dimensions(wad_image_t *image) {
     }
 }
 
-void create_texture_from_image(wad_image_t *image) {
-    if (!image->is_valid || image->size <= 0) return;
+// Bump allocator: memory comes from large blocks and is only given back
+// all at once
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    arena_block_t *block = arena->head;
     
-    // Create RGBA data for texture
-    int tex_size = image->width * image->height * 4;
-    unsigned char *tex_data = (unsigned char *)malloc(tex_size);
-    if (!tex_data) return;
+    if (!block || block->used + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (arena_block_t *)malloc(sizeof(arena_block_t) + block_size);
+        if (!block) return NULL;
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
+        arena->reserved += block_size;
+    }
     
-    // Clear texture data (transparent black)
-    memset(tex_data, 0, tex_size);
+    void *result = block->data + block->used;
+    block->used += size;
+    arena->used += size;
+    return result;
+}
+
+void *arena_calloc(arena_t *arena, size_t size) {
+    void *result = arena_alloc(arena, size);
+    if (result) memset(result, 0, size);
+    return result;
+}
+
+void arena_free(arena_t *arena) {
+    arena_block_t *block = arena->head;
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->used = 0;
+    arena->reserved = 0;
+}
+
+// Empty an arena but keep its newest block for reuse
+void arena_reset(arena_t *arena) {
+    if (!arena->head) return;
+    arena_block_t *keep = arena->head;
+    arena->head = keep->next;
+    arena_free(arena);
+    keep->next = NULL;
+    keep->used = 0;
+    arena->head = keep;
+    arena->reserved = keep->size;
+}
+
+// Record one opaque run of a column, splitting it around index 255, which
+// is drawn transparent like the original RGBA decoder did
+static void add_column_spans(indexed_image_t *indexed, int x, int top, int length, int height) {
+    if (top + length > height) length = height - top;
+    int run_start = -1;
+    for (int y = top; y <= top + length; y++) {
+        bool opaque = y < top + length && indexed->pixels[y * indexed->width + x] != 255;
+        if (opaque && run_start < 0) {
+            run_start = y;
+        } else if (!opaque && run_start >= 0) {
+            indexed->spans[indexed->num_spans].top = run_start;
+            indexed->spans[indexed->num_spans].length = y - run_start;
+            indexed->num_spans++;
+            run_start = -1;
+        }
+    }
+}
+
+// Indexes and opaque runs from a decoded source image (column-major, with
+// a visibility byte per pixel), allocated from the given arena
+indexed_image_t *indexed_from_columns(const import_image_t *source, arena_t *arena) {
+    int width = source->width, height = source->height;
+    size_t pixel_count = (size_t)width * height;
+    
+    // Count the runs first so the span array is allocated once, exactly
+    unsigned int num_spans = 0;
+    for (size_t i = 0; i < pixel_count; i++) {
+        if (source->visible[i] && (i % height == 0 || !source->visible[i - 1])) num_spans++;
+    }
+    
+    indexed_image_t *indexed = (indexed_image_t *)arena_alloc(arena, sizeof(indexed_image_t));
+    unsigned char *pixels = (unsigned char *)arena_calloc(arena, pixel_count);
+    unsigned int *column_first = (unsigned int *)arena_alloc(arena, (width + 1) * sizeof(unsigned int));
+    pixel_span_t *spans = (pixel_span_t *)arena_alloc(arena, (num_spans + 1) * sizeof(pixel_span_t));
+    if (!indexed || !pixels || !column_first || !spans) return NULL;
+    
+    indexed->width = width;
+    indexed->height = height;
+    indexed->pixels = pixels;
+    indexed->column_first = column_first;
+    indexed->spans = spans;
+    indexed->num_spans = 0;
+    
+    for (int x = 0; x < width; x++) {
+        const unsigned char *column = source->indexes + (size_t)x * height;
+        const unsigned char *visible = source->visible + (size_t)x * height;
+        column_first[x] = indexed->num_spans;
+        int run_start = -1;
+        for (int y = 0; y <= height; y++) {
+            bool opaque = y < height && visible[y];
+            if (opaque) pixels[y * width + x] = column[y];
+            if (opaque && run_start < 0) {
+                run_start = y;
+            } else if (!opaque && run_start >= 0) {
+                spans[indexed->num_spans].top = run_start;
+                spans[indexed->num_spans].length = y - run_start;
+                indexed->num_spans++;
+                run_start = -1;
+            }
+        }
+    }
+    column_first[width] = indexed->num_spans;
+    return indexed;
+}
+
+// Decode an image lump into palette indexes and per-column opaque runs.
+// Patch posts give the runs directly; raw lumps get them from the same
+// transparency rules the RGBA decoder used. Everything is allocated from
+// the given arena. Returns NULL if the image can't be decoded.
+indexed_image_t *decode_image_indexed(wad_image_t *image, arena_t *arena) {
+    if (!image->is_valid || image->size <= 0 || image->format == IMAGE_FORMAT_MAP) return NULL;
+    
+    // PNGs are matched to the palette like a folder import
+    if (image->format == IMAGE_FORMAT_PNG) {
+        import_image_t source = {0};
+        indexed_image_t *indexed = NULL;
+        prepare_color_lookup();
+        if (decode_png(image->data, image->size, image->name, &source) &&
+            source.width == image->width && source.height == image->height) {
+            indexed = indexed_from_columns(&source, arena);
+        }
+        import_image_free(&source);
+        return indexed;
+    }
+    
+    int width = image->width, height = image->height;
+    indexed_image_t *indexed = (indexed_image_t *)arena_alloc(arena, sizeof(indexed_image_t));
+    unsigned char *pixels = (unsigned char *)arena_alloc(arena, (size_t)width * height);
+    unsigned int *column_first = (unsigned int *)arena_alloc(arena, (width + 1) * sizeof(unsigned int));
+    if (!indexed || !pixels || !column_first) return NULL;
+    
+    indexed->width = width;
+    indexed->height = height;
+    indexed->pixels = pixels;
+    indexed->column_first = column_first;
+    indexed->num_spans = 0;
+    memset(pixels, 0, (size_t)width * height);
+    
+    // Collect runs in a worst-case sized temporary (a column splits into at
+    // most height/2 + 1 runs), then keep only what was used in the arena
+    size_t max_spans = (size_t)width * (height / 2 + 1);
+    indexed->spans = (pixel_span_t *)malloc(max_spans * sizeof(pixel_span_t));
+    if (!indexed->spans) return NULL;
     
     // First, check if this is a patch format by examining the header
     bool is_patch = false;
@@ -445,157 +1964,176 @@ void create_texture_from_image(wad_image_t *image) {
         int height_header = (unsigned char)image->data[2] | ((unsigned char)image->data[3] << 8);
         
         // If the header width/height match our detected dimensions, it's likely a patch
-        if (width_header == image->width && height_header == image->height) {
+        if (width_header == width && height_header == height && image->size >= 8 + width * 4) {
             is_patch = true;
         }
     }
     
     if (is_patch) {
-        // Process DOOM patch format
-        int header_size = 8;
-        int *column_offsets = (int*)(image->data + header_size);
-        
-        // Process each column
-        for (int x = 0; x < image->width; x++) {
-            // Get and validate column offset
-            if (x >= image->width) continue; // Bounds check
-            
-            int offset = column_offsets[x];
-            if (offset < 0 || offset >= image->size) continue;
+        const unsigned char *end = image->data + image->size;
+        
+        for (int x = 0; x < width; x++) {
+            column_first[x] = indexed->num_spans;
             
-            unsigned char *column_ptr = image->data + offset;
+            uint32_t offset = read_le32(image->data + 8 + x * 4);
+            if (offset >= (uint32_t)image->size) continue;
             
-            // Continue until we hit the 0xFF terminator or exceed image bounds
-            while (column_ptr < image->data + image->size) {
-                // Get row start position
-                int row_start = *column_ptr++;
-                if (row_start == 0xFF || column_ptr >= image->data + image->size) break;
-                
-                // Bounds check
-                if (row_start >= image->height) {
-                    // Skip invalid span
-                    if (column_ptr + 2 >= image->data + image->size) break;
-                    int pixel_count = *column_ptr;
-                    if (pixel_count < 0 || pixel_count > 255) break; // Sanity check
-                    column_ptr += pixel_count + 2; // Skip pixel count + 2 dummy bytes
-                    continue;
-                }
-                
-                // Get pixel count
-                if (column_ptr >= image->data + image->size) break;
-                int pixel_count = *column_ptr++;
-                if (pixel_count < 0 || pixel_count > 255 || column_ptr >= image->data + image->size) break;
-                
-                // Bounds check for pixel count
-                if (row_start + pixel_count > image->height) {
-                    pixel_count = image->height - row_start;
-                    if (pixel_count <= 0) continue;
-                }
+            // Posts: top row, pixel count, a dummy byte, the pixels, a dummy byte.
+            // A top no larger than the previous one is relative (tall patches).
+            const unsigned char *post = image->data + offset;
+            int last_top = -1;
+            while (post + 2 < end && *post != 0xFF) {
+                int row_start = post[0];
+                if (row_start <= last_top) row_start += last_top;
+                last_top = row_start;
+                int pixel_count = post[1];
+                const unsigned char *source = post + 3;
+                if (source + pixel_count > end) pixel_count = (int)(end - source);
                 
-                // Skip dummy byte
-                column_ptr++;
-                if (column_ptr >= image->data + image->size) break;
-                
-                // Process pixel data
-                for (int y = 0; y < pixel_count; y++) {
-                    if (column_ptr >= image->data + image->size) break;
-                    
-                    unsigned char pixel_index = *column_ptr++;
-                    
-                    // Check if index is valid for the palette
-                    if (pixel_index < 256) {
-                        // Get palette color
-                        unsigned char r = doom_palette[pixel_index][0];
-                        unsigned char g = doom_palette[pixel_index][1];
-                        unsigned char b = doom_palette[pixel_index][2];
-                        
-                        // DOOM uses index 255 for transparent in some cases
-                        unsigned char a = (pixel_index == 255) ? 0 : 255;
-                        
-                        // Set RGBA in destination
-                        int dest_idx = ((row_start + y) * image->width + x) * 4;
-                        if (dest_idx + 3 < tex_size) {
-                            tex_data[dest_idx + 0] = r;
-                            tex_data[dest_idx + 1] = g;
-                            tex_data[dest_idx + 2] = b;
-                            tex_data[dest_idx + 3] = a;
-                        }
+                if (row_start < height) {
+                    int visible = row_start + pixel_count > height ? height - row_start : pixel_count;
+                    for (int y = 0; y < visible; y++) {
+                        pixels[(row_start + y) * width + x] = source[y];
                     }
+                    add_column_spans(indexed, x, row_start, visible, height);
                 }
-                
-                // Skip dummy byte at end of column
-                if (column_ptr >= image->data + image->size) break;
-                column_ptr++;
+                post = source + pixel_count + 1;
             }
         }
     } else {
+        // Raw pixels, row-major; anything past the end of the lump stays empty
+        size_t available = (size_t)width * height;
+        if ((size_t)image->size < available) available = image->size;
+        memcpy(pixels, image->data, available);
+        
         // Determine if this is likely a flat based on name prefix or size
-        bool is_flat = ((image->size == 4096 && image->width == 64 && image->height == 64) ||
+        bool is_flat = ((image->size == 4096 && width == 64 && height == 64) ||
                         strncmp(image->name, "F_", 2) == 0 ||
                         strncmp(image->name, "FLAT", 4) == 0 ||
                         strncmp(image->name, "FLOOR", 5) == 0 ||
                         strncmp(image->name, "CEIL", 4) == 0);
         
-        // Handle as raw pixel data (common for flats, colormaps, etc.)
-        for (int y = 0; y < image->height; y++) {
-            for (int x = 0; x < image->width; x++) {
-                // Calculate source index
-                int src_idx = y * image->width + x;
-                
-                // Skip if out of bounds
-                if (src_idx >= image->size) continue;
-                
-                // Get palette index
-                unsigned char pixel_index = image->data[src_idx];
-                
-                // Get palette color
-                unsigned char r = doom_palette[pixel_index][0];
-                unsigned char g = doom_palette[pixel_index][1];
-                unsigned char b = doom_palette[pixel_index][2];
-                
-                // Special handling for transparency:
-                // - For flats, everything is opaque
-                // - For most other textures, index 0 is often transparent
-                // - Some textures use 255 as transparent instead
-                unsigned char a = 255;
-                if (!is_flat) {
-                    if (pixel_index == 0 || pixel_index == 255) {
-                        // Detect if this might be a solid texture vs a sprite
-                        // In a sprite, there are typically many transparent pixels
-                        // We'll need to load the entire texture first to determine this
-                        a = 0;
-                    }
-                }
-                
-                // Set RGBA in destination
-                int dest_idx = (y * image->width + x) * 4;
-                if (dest_idx + 3 < tex_size) {
-                    tex_data[dest_idx + 0] = r;
-                    tex_data[dest_idx + 1] = g;
-                    tex_data[dest_idx + 2] = b;
-                    tex_data[dest_idx + 3] = a;
-                }
+        // Indexes 0 and 255 are transparent in non-flats, unless nearly
+        // everything would be, which means the guess was wrong
+        bool keyed = false;
+        if (!is_flat) {
+            size_t transparent_count = (size_t)width * height - available;
+            for (size_t i = 0; i < available; i++) {
+                if (pixels[i] == 0 || pixels[i] == 255) transparent_count++;
             }
+            keyed = transparent_count <= (size_t)width * height * 0.9;
         }
         
-        // Post-process for raw pixels: if most pixels are transparent, this is likely
-        // not a correct interpretation. Make everything opaque in that case.
-        if (!is_flat) {
-            int transparent_count = 0;
-            for (int i = 0; i < image->width * image->height; i++) {
-                if (tex_data[i * 4 + 3] == 0) {
-                    transparent_count++;
+        for (int x = 0; x < width; x++) {
+            column_first[x] = indexed->num_spans;
+            int run_start = -1;
+            for (int y = 0; y <= height; y++) {
+                bool opaque = false;
+                if (y < height && (size_t)y * width + x < available) {
+                    unsigned char index = pixels[y * width + x];
+                    opaque = !keyed || (index != 0 && index != 255);
+                } else if (y < height) {
+                    opaque = !keyed;
                 }
+                if (opaque && run_start < 0) {
+                    run_start = y;
+                } else if (!opaque && run_start >= 0) {
+                    indexed->spans[indexed->num_spans].top = run_start;
+                    indexed->spans[indexed->num_spans].length = y - run_start;
+                    indexed->num_spans++;
+                    run_start = -1;
+                }
+            }
+        }
+    }
+    column_first[width] = indexed->num_spans;
+    
+    pixel_span_t *spans = (pixel_span_t *)arena_alloc(arena, (indexed->num_spans + 1) * sizeof(pixel_span_t));
+    if (spans) memcpy(spans, indexed->spans, indexed->num_spans * sizeof(pixel_span_t));
+    free(indexed->spans);
+    indexed->spans = spans;
+    return spans ? indexed : NULL;
+}
+
+// Write an image as RGBA straight into an upload buffer (or a region of a
+// larger one, stride in pixels) through the current palette. Only the
+// opaque runs are touched; the caller clears the rest.
+void expand_image_rgba(const wad_image_t *image, const indexed_image_t *indexed, unsigned char *out, int stride) {
+    if (image->format == IMAGE_FORMAT_MAP) {
+        // Map previews are line coverage, not palette indexes: amber lines on black
+        for (int y = 0; y < image->height; y++) {
+            for (int x = 0; x < image->width; x++) {
+                unsigned char coverage = image->data[y * image->width + x];
+                unsigned char *pixel = out + ((size_t)y * stride + x) * 4;
+                pixel[0] = 16 + coverage * 239 / 255;
+                pixel[1] = 16 + coverage * 175 / 255;
+                pixel[2] = 16 + coverage * 48 / 255;
+                pixel[3] = 255;
             }
+        }
+        return;
+    }
+    
+    for (int x = 0; x < indexed->width; x++) {
+        for (unsigned int s = indexed->column_first[x]; s < indexed->column_first[x + 1]; s++) {
+            const pixel_span_t *span = &indexed->spans[s];
+            const unsigned char *source = indexed->pixels + span->top * indexed->width + x;
+            unsigned char *pixel = out + ((size_t)span->top * stride + x) * 4;
             
-            // If more than 90% transparent, make everything opaque
-            if (transparent_count > image->width * image->height * 0.9) {
-                for (int i = 0; i < image->width * image->height; i++) {
-                    tex_data[i * 4 + 3] = 255; // Make opaque
-                }
+            for (int y = 0; y < span->length; y++) {
+                pixel[0] = doom_palette[*source][0];
+                pixel[1] = doom_palette[*source][1];
+                pixel[2] = doom_palette[*source][2];
+                pixel[3] = 255;
+                source += indexed->width;
+                pixel += (size_t)stride * 4;
             }
         }
     }
+}
+
+// The decoded form of an image: from the CPU image cache if enabled
+// (decoding into the WAD's store on first use), otherwise decoded into
+// scratch memory that the next call may reuse
+indexed_image_t *image_indexes(wad_image_t *image) {
+    if (image->pending) load_pending_images(&image, 1);
+    if (image->indexed) return image->indexed;
+    if (image_cache_enabled && image->wad) {
+        image->indexed = decode_image_indexed(image, &image->wad->arena);
+        return image->indexed;
+    }
+    arena_reset(&scratch_arena);
+    return decode_image_indexed(image, &scratch_arena);
+}
+
+// Shared RGBA staging buffer for texture uploads, grown as needed
+unsigned char *upload_buffer_reserve(size_t size) {
+    if (size > upload_capacity) {
+        unsigned char *buffer = (unsigned char *)realloc(upload_buffer, size);
+        if (!buffer) return NULL;
+        upload_buffer = buffer;
+        upload_capacity = size;
+    }
+    return upload_buffer;
+}
+
+void create_texture_from_image(wad_image_t *image) {
+    if (!image->is_valid || image->size <= 0) return;
+    if (compressed_textures && texture_compression_supported) {
+        create_textures(&image, 1);
+        return;
+    }
+    
+    indexed_image_t *indexed = image_indexes(image);
+    if (!indexed && image->format != IMAGE_FORMAT_MAP) return;
+    
+    size_t tex_size = (size_t)image->width * image->height * 4;
+    unsigned char *tex_data = upload_buffer_reserve(tex_size);
+    if (!tex_data) return;
+    
+    // Clear texture data (transparent black), then fill the opaque runs
+    memset(tex_data, 0, tex_size);
+    expand_image_rgba(image, indexed, tex_data, image->width);
     
     // Generate OpenGL texture
     glGenTextures(1, &image->texture_id);
@@ -606,35 +2144,589 @@ void create_texture_from_image(wad_image_t *image) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     
     // Create the texture
+    double start = now_seconds();
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image->width, image->height, 
                  0, GL_RGBA, GL_UNSIGNED_BYTE, tex_data);
-    
-    free(tex_data);
+    texture_stats.upload_seconds += now_seconds() - start;
+    texture_stats.textures++;
+    texture_stats.rgba_bytes += tex_size;
+    texture_stats.stored_bytes += tex_size;
 }
 
-bool is_image_lump(char *name) {
-    // Remove trailing spaces from name
-    char clean_name[9] = {0};
-    strncpy(clean_name, name, 8);
-    int len = strlen(clean_name);
-    while (len > 0 && clean_name[len-1] == ' ') {
-        clean_name[len-1] = '\0';
-        len--;
+// RGB565 endpoint from 8-bit channels, and back the way decoders expand it
+static uint16_t rgb565_pack(const int *rgb) {
+    return (uint16_t)((((rgb[0] * 31 + 127) / 255) << 11) | (((rgb[1] * 63 + 127) / 255) << 5) |
+                      ((rgb[2] * 31 + 127) / 255));
+}
+
+static void rgb565_expand(uint16_t color, int *rgb) {
+    int r = color >> 11, g = (color >> 5) & 63, b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// Encode a 4x4 block of RGBA pixels, row by row, as 8 bytes of BC1.
+// Alpha is taken as on or off, which is all palette graphics have;
+// blocks with holes use BC1's three-colour mode and its transparent
+// index. Only pixels in the real mask (bit i for pixel i) count towards
+// the returned squared RGB error; the rest are edge padding.
+static uint64_t bc1_encode_block(const unsigned char block[16][4], unsigned int real,
+                                 unsigned char *out, int *opaque_pixels) {
+    int opaque = 0, first = -1;
+    for (int i = 0; i < 16; i++) {
+        if (block[i][3] >= 128) {
+            opaque++;
+            if (first < 0) first = i;
+        }
+    }
+    if (opaque == 0) {
+        memset(out, 0, 4);
+        memset(out + 4, 0xFF, 4);
+        return 0;
     }
     
-    // Known NON-image lumps to skip
+    // Holes take an opaque pixel's colour so they do not stretch the box
+    unsigned char colors[16][4];
+    for (int i = 0; i < 16; i++) {
+        memcpy(colors[i], block[i][3] >= 128 ? block[i] : block[first], 4);
+    }
     
-    const char *skip_lumps[] = {
-    /*  "PLAYPAL", "COLORMAP", "ENDOOM", "DEMO", "DS", "PC", "D_",
-        "THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS",
-        "SSECTORS", "NODES", "SECTORS", "REJECT", "BLOCKMAP",
-        "BEHAVIOR", "SCRIPTS", "GENMIDI", "DMXGUS", 
-        "DEHACKED", "MAPINFO", "SNDINFO", "SNDSEQ", "CONVERSATION",
-        "ANIMDEFS", "LANGUAGE", "KEYCONF", "FONTDEFS",
-        "TERRAIN", "SBARINFO", "LOCKDEFS",
-        "TITLEMAP", "TEXTMAP", "DIALOGUE", "ZNODES", "EXTENDED",
-        "LOADACS",  "ANIMATED", "README", "INFO", "LOG" */
-    };
+    // Bounding box of the block's colours
+    unsigned char low[4], high[4];
+#ifdef __SSE2__
+    __m128i v0 = _mm_loadu_si128((const __m128i *)colors[0]);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)colors[4]);
+    __m128i v2 = _mm_loadu_si128((const __m128i *)colors[8]);
+    __m128i v3 = _mm_loadu_si128((const __m128i *)colors[12]);
+    __m128i minimum = _mm_min_epu8(_mm_min_epu8(v0, v1), _mm_min_epu8(v2, v3));
+    __m128i maximum = _mm_max_epu8(_mm_max_epu8(v0, v1), _mm_max_epu8(v2, v3));
+    minimum = _mm_min_epu8(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(1, 0, 3, 2)));
+    minimum = _mm_min_epu8(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(2, 3, 0, 1)));
+    maximum = _mm_max_epu8(maximum, _mm_shuffle_epi32(maximum, _MM_SHUFFLE(1, 0, 3, 2)));
+    maximum = _mm_max_epu8(maximum, _mm_shuffle_epi32(maximum, _MM_SHUFFLE(2, 3, 0, 1)));
+    int packed = _mm_cvtsi128_si32(minimum);
+    memcpy(low, &packed, 4);
+    packed = _mm_cvtsi128_si32(maximum);
+    memcpy(high, &packed, 4);
+#else
+    memcpy(low, colors[0], 4);
+    memcpy(high, colors[0], 4);
+    for (int i = 1; i < 16; i++) {
+        for (int c = 0; c < 3; c++) {
+            if (colors[i][c] < low[c]) low[c] = colors[i][c];
+            if (colors[i][c] > high[c]) high[c] = colors[i][c];
+        }
+    }
+#endif
+    
+    // The box diagonal runs the wrong way for channels that fall while
+    // the widest channel rises, e.g. red to green; flip those
+    int widest = 0;
+    for (int c = 1; c < 3; c++) {
+        if (high[c] - low[c] > high[widest] - low[widest]) widest = c;
+    }
+    int end0[3], end1[3];
+    for (int c = 0; c < 3; c++) {
+        int covariance = 0;
+        for (int i = 0; i < 16 && c != widest; i++) {
+            covariance += (colors[i][widest] * 2 - low[widest] - high[widest]) * (colors[i][c] * 2 - low[c] - high[c]);
+        }
+        end0[c] = covariance < 0 ? low[c] : high[c];
+        end1[c] = covariance < 0 ? high[c] : low[c];
+        
+        // Pull the ends in by 1/16 of the range; the extremes are rarely worth matching exactly
+        int inset = (end0[c] - end1[c]) / 16;
+        end0[c] -= inset;
+        end1[c] += inset;
+    }
+    
+    uint16_t color0 = rgb565_pack(end0), color1 = rgb565_pack(end1);
+    bool holes = opaque < 16;
+    if (holes ? color0 > color1 : color0 < color1) {
+        uint16_t swap = color0;
+        color0 = color1;
+        color1 = swap;
+    }
+    
+    // color0 > color1 selects four colours, otherwise three and transparent
+    int palette[4][3];
+    rgb565_expand(color0, palette[0]);
+    rgb565_expand(color1, palette[1]);
+    int num_colors = color0 > color1 ? 4 : 3;
+    for (int c = 0; c < 3; c++) {
+        if (num_colors == 4) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        } else {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+        }
+    }
+    
+    // Project each pixel onto the line between the endpoints and round to
+    // the nearest of the evenly spaced colours on it
+    static const int order4[4] = { 1, 3, 2, 0 }, order3[3] = { 1, 2, 0 };
+    const int *order = num_colors == 4 ? order4 : order3;
+    int steps = num_colors - 1;
+    int axis[3], length = 0;
+    for (int c = 0; c < 3; c++) {
+        axis[c] = palette[0][c] - palette[1][c];
+        length += axis[c] * axis[c];
+    }
+    float scale = length > 0 ? (float)steps / length : 0.0f;
+    int step[16];
+#ifdef __SSE2__
+    // Four dot products per step: madd pairs r*dr + g*dg and b*db, then
+    // the two halves of each pixel are added
+    __m128i zero = _mm_setzero_si128();
+    __m128i base = _mm_set_epi16(0, palette[1][2], palette[1][1], palette[1][0], 0, palette[1][2], palette[1][1], palette[1][0]);
+    __m128i direction = _mm_set_epi16(0, axis[2], axis[1], axis[0], 0, axis[2], axis[1], axis[0]);
+    __m128 scale4 = _mm_set1_ps(scale), half = _mm_set1_ps(0.5f);
+    for (int i = 0; i < 16; i += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)block[i]);
+        __m128i low = _mm_madd_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(pixels, zero), base), direction);
+        __m128i high = _mm_madd_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(pixels, zero), base), direction);
+        __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 dot = _mm_cvtepi32_ps(_mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd)));
+        _mm_storeu_si128((__m128i *)(step + i), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(dot, scale4), half)));
+    }
+#else
+    for (int i = 0; i < 16; i++) {
+        int dot = (block[i][0] - palette[1][0]) * axis[0] + (block[i][1] - palette[1][1]) * axis[1] +
+                  (block[i][2] - palette[1][2]) * axis[2];
+        step[i] = (int)(dot * scale + 0.5f);
+    }
+#endif
+    
+    uint32_t indices = 0;
+    uint64_t error = 0;
+    for (int i = 0; i < 16; i++) {
+        if (block[i][3] < 128) {
+            indices |= 3u << (2 * i);
+            continue;
+        }
+        int index = length > 0 ? order[step[i] < 0 ? 0 : step[i] > steps ? steps : step[i]] : 0;
+        indices |= (uint32_t)index << (2 * i);
+        if (real & (1u << i)) {
+            int dr = block[i][0] - palette[index][0], dg = block[i][1] - palette[index][1];
+            int db = block[i][2] - palette[index][2];
+            error += dr * dr + dg * dg + db * db;
+            (*opaque_pixels)++;
+        }
+    }
+    
+    out[0] = color0 & 0xFF;
+    out[1] = color0 >> 8;
+    out[2] = color1 & 0xFF;
+    out[3] = color1 >> 8;
+    for (int b = 0; b < 4; b++) out[4 + b] = (indices >> (8 * b)) & 0xFF;
+    return error;
+}
+
+// BC1 of a whole image, one 8-byte block per 4x4 tile in row order. Edge
+// tiles repeat the last row and column.
+static uint64_t bc1_encode_image(const unsigned char *rgba, int width, int height,
+                                 unsigned char *out, int *opaque_pixels) {
+    uint64_t error = 0;
+    for (int by = 0; by < height; by += 4) {
+        for (int bx = 0; bx < width; bx += 4) {
+            unsigned char block[16][4];
+            unsigned int real = 0xFFFF;
+            if (bx + 4 <= width && by + 4 <= height) {
+                for (int row = 0; row < 4; row++) {
+                    memcpy(block[row * 4], rgba + ((size_t)(by + row) * width + bx) * 4, 16);
+                }
+            } else {
+                real = 0;
+                for (int i = 0; i < 16; i++) {
+                    int x = bx + (i & 3), y = by + (i >> 2);
+                    if (x < width && y < height) real |= 1u << i;
+                    if (x >= width) x = width - 1;
+                    if (y >= height) y = height - 1;
+                    memcpy(block[i], rgba + ((size_t)y * width + x) * 4, 4);
+                }
+            }
+            error += bc1_encode_block((const unsigned char (*)[4])block, real, out, opaque_pixels);
+            out += 8;
+        }
+    }
+    return error;
+}
+
+// One image of a create_textures() batch
+typedef struct {
+    wad_image_t *image;
+    unsigned char *rgba;          // Expanded on the calling thread
+    unsigned char *blocks;
+    size_t block_bytes;
+    uint64_t squared_error;
+    int opaque_pixels;
+} texture_job_t;
+
+static void encode_texture_job(void *context, int index) {
+    texture_job_t *job = (texture_job_t *)context + index;
+    job->squared_error = bc1_encode_image(job->rgba, job->image->width, job->image->height,
+                                          job->blocks, &job->opaque_pixels);
+}
+
+// Make the textures for a set of images. Uncompressed, that is
+// create_texture_from_image() on each. With compressed textures the
+// images are expanded here (decoding may use the shared scratch arena),
+// BC1-encoded on the worker pool and uploaded here, TEXTURE_BATCH at a
+// time to bound the staging memory.
+void create_textures(wad_image_t **images, int count) {
+    if (!compressed_textures || !texture_compression_supported) {
+        for (int i = 0; i < count; i++) create_texture_from_image(images[i]);
+        return;
+    }
+    
+    texture_job_t *jobs = (texture_job_t *)calloc(TEXTURE_BATCH, sizeof(texture_job_t));
+    if (!jobs) return;
+    for (int done = 0; done < count; done += TEXTURE_BATCH) {
+        int num_jobs = 0;
+        for (int i = done; i < count && i < done + TEXTURE_BATCH; i++) {
+            wad_image_t *image = images[i];
+            if (!image->is_valid || image->size <= 0) continue;
+            indexed_image_t *indexed = image_indexes(image);
+            if (!indexed && image->format != IMAGE_FORMAT_MAP) continue;
+            
+            texture_job_t *job = &jobs[num_jobs];
+            size_t pixels = (size_t)image->width * image->height;
+            job->block_bytes = (size_t)((image->width + 3) / 4) * ((image->height + 3) / 4) * 8;
+            job->rgba = (unsigned char *)calloc(pixels * 4 + job->block_bytes, 1);
+            if (!job->rgba) continue;
+            job->blocks = job->rgba + pixels * 4;
+            job->image = image;
+            job->squared_error = 0;
+            job->opaque_pixels = 0;
+            expand_image_rgba(image, indexed, job->rgba, image->width);
+            num_jobs++;
+        }
+        
+        double start = now_seconds();
+        parallel_for(num_jobs, encode_texture_job, jobs);
+        double encoded = now_seconds();
+        texture_stats.encode_seconds += encoded - start;
+        
+        for (int j = 0; j < num_jobs; j++) {
+            texture_job_t *job = &jobs[j];
+            wad_image_t *image = job->image;
+            glGenTextures(1, &image->texture_id);
+            glBindTexture(GL_TEXTURE_2D, image->texture_id);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            gl_compressed_tex_image_2d(GL_TEXTURE_2D, 0, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, image->width, image->height,
+                                       0, (GLsizei)job->block_bytes, job->blocks);
+            
+            texture_stats.textures++;
+            texture_stats.rgba_bytes += (double)image->width * image->height * 4;
+            texture_stats.stored_bytes += job->block_bytes;
+            texture_stats.squared_error += job->squared_error;
+            texture_stats.samples += job->opaque_pixels * 3.0;
+            free(job->rgba);
+        }
+        texture_stats.upload_seconds += now_seconds() - encoded;
+    }
+    free(jobs);
+}
+
+// Scale2x (EPX) of source pixels [x, end) of one row into two output rows.
+// This is the reference; scale2x_row() vectorises the middle of the row.
+static void scale2x_span(const uint32_t *up, const uint32_t *row, const uint32_t *down,
+                         int width, int x, int end, uint32_t *out0, uint32_t *out1) {
+    for (; x < end; x++) {
+        uint32_t b = up[x], h = down[x], e = row[x];
+        uint32_t d = row[x > 0 ? x - 1 : x], f = row[x + 1 < width ? x + 1 : x];
+        bool edge = b != h && d != f;
+        out0[2 * x] = edge && d == b ? d : e;
+        out0[2 * x + 1] = edge && b == f ? f : e;
+        out1[2 * x] = edge && d == h ? d : e;
+        out1[2 * x + 1] = edge && h == f ? f : e;
+    }
+}
+
+// Scale3x of source pixels [x, end) of one row into three output rows
+static void scale3x_span(const uint32_t *up, const uint32_t *row, const uint32_t *down,
+                         int width, int x, int end, uint32_t *out0, uint32_t *out1, uint32_t *out2) {
+    for (; x < end; x++) {
+        int left = x > 0 ? x - 1 : x, right = x + 1 < width ? x + 1 : x;
+        uint32_t a = up[left], b = up[x], c = up[right];
+        uint32_t d = row[left], e = row[x], f = row[right];
+        uint32_t g = down[left], h = down[x], i = down[right];
+        uint32_t *o0 = out0 + 3 * x, *o1 = out1 + 3 * x, *o2 = out2 + 3 * x;
+        if (b != h && d != f) {
+            o0[0] = d == b ? d : e;
+            o0[1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+            o0[2] = b == f ? f : e;
+            o1[0] = (d == b && e != g) || (d == h && e != a) ? d : e;
+            o1[1] = e;
+            o1[2] = (b == f && e != i) || (h == f && e != c) ? f : e;
+            o2[0] = d == h ? d : e;
+            o2[1] = (d == h && e != i) || (h == f && e != g) ? h : e;
+            o2[2] = h == f ? f : e;
+        } else {
+            o0[0] = o0[1] = o0[2] = e;
+            o1[0] = o1[1] = o1[2] = e;
+            o2[0] = o2[1] = o2[2] = e;
+        }
+    }
+}
+
+#ifdef __SSE2__
+static inline __m128i select_si128(__m128i mask, __m128i yes, __m128i no) {
+    return _mm_or_si128(_mm_and_si128(mask, yes), _mm_andnot_si128(mask, no));
+}
+
+// Store a0 b0 c0 a1 b1 c1 ... a3 b3 c3
+static inline void store3_interleaved(uint32_t *out, __m128i a, __m128i b, __m128i c) {
+    __m128i a_next = _mm_srli_si128(a, 4), b_next = _mm_srli_si128(b, 4);
+    __m128 first = _mm_shuffle_ps(_mm_castsi128_ps(_mm_unpacklo_epi32(a, b)),
+                                  _mm_castsi128_ps(_mm_unpacklo_epi32(c, a_next)), _MM_SHUFFLE(1, 0, 1, 0));
+    __m128 second = _mm_shuffle_ps(_mm_castsi128_ps(_mm_unpacklo_epi32(b_next, _mm_srli_si128(c, 4))),
+                                   _mm_castsi128_ps(_mm_unpackhi_epi32(a, b)), _MM_SHUFFLE(1, 0, 1, 0));
+    __m128 third = _mm_shuffle_ps(_mm_castsi128_ps(_mm_unpackhi_epi32(c, a_next)),
+                                  _mm_castsi128_ps(_mm_unpackhi_epi32(b, c)), _MM_SHUFFLE(3, 2, 1, 0));
+    _mm_storeu_ps((float *)out, first);
+    _mm_storeu_ps((float *)(out + 4), second);
+    _mm_storeu_ps((float *)(out + 8), third);
+}
+#endif
+
+// Four source pixels per SSE2 step; the clamped first and last pixels
+// go through the scalar span
+static void scale2x_row(const uint32_t *up, const uint32_t *row, const uint32_t *down,
+                        int width, uint32_t *out0, uint32_t *out1) {
+    int x = 0;
+#ifdef __SSE2__
+    scale2x_span(up, row, down, width, 0, width < 1 ? width : 1, out0, out1);
+    for (x = 1; x + 5 <= width; x += 4) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(up + x));
+        __m128i h = _mm_loadu_si128((const __m128i *)(down + x));
+        __m128i e = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i d = _mm_loadu_si128((const __m128i *)(row + x - 1));
+        __m128i f = _mm_loadu_si128((const __m128i *)(row + x + 1));
+        __m128i same = _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+        __m128i e0 = select_si128(_mm_andnot_si128(same, _mm_cmpeq_epi32(d, b)), d, e);
+        __m128i e1 = select_si128(_mm_andnot_si128(same, _mm_cmpeq_epi32(b, f)), f, e);
+        __m128i e2 = select_si128(_mm_andnot_si128(same, _mm_cmpeq_epi32(d, h)), d, e);
+        __m128i e3 = select_si128(_mm_andnot_si128(same, _mm_cmpeq_epi32(h, f)), f, e);
+        _mm_storeu_si128((__m128i *)(out0 + 2 * x), _mm_unpacklo_epi32(e0, e1));
+        _mm_storeu_si128((__m128i *)(out0 + 2 * x + 4), _mm_unpackhi_epi32(e0, e1));
+        _mm_storeu_si128((__m128i *)(out1 + 2 * x), _mm_unpacklo_epi32(e2, e3));
+        _mm_storeu_si128((__m128i *)(out1 + 2 * x + 4), _mm_unpackhi_epi32(e2, e3));
+    }
+#endif
+    scale2x_span(up, row, down, width, x, width, out0, out1);
+}
+
+static void scale3x_row(const uint32_t *up, const uint32_t *row, const uint32_t *down,
+                        int width, uint32_t *out0, uint32_t *out1, uint32_t *out2) {
+    int x = 0;
+#ifdef __SSE2__
+    scale3x_span(up, row, down, width, 0, width < 1 ? width : 1, out0, out1, out2);
+    for (x = 1; x + 5 <= width; x += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(up + x - 1));
+        __m128i b = _mm_loadu_si128((const __m128i *)(up + x));
+        __m128i c = _mm_loadu_si128((const __m128i *)(up + x + 1));
+        __m128i d = _mm_loadu_si128((const __m128i *)(row + x - 1));
+        __m128i e = _mm_loadu_si128((const __m128i *)(row + x));
+        __m128i f = _mm_loadu_si128((const __m128i *)(row + x + 1));
+        __m128i g = _mm_loadu_si128((const __m128i *)(down + x - 1));
+        __m128i h = _mm_loadu_si128((const __m128i *)(down + x));
+        __m128i i = _mm_loadu_si128((const __m128i *)(down + x + 1));
+        
+        __m128i edge = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)),
+                                        _mm_set1_epi32(-1));
+        __m128i db = _mm_and_si128(edge, _mm_cmpeq_epi32(d, b));
+        __m128i bf = _mm_and_si128(edge, _mm_cmpeq_epi32(b, f));
+        __m128i dh = _mm_and_si128(edge, _mm_cmpeq_epi32(d, h));
+        __m128i hf = _mm_and_si128(edge, _mm_cmpeq_epi32(h, f));
+        __m128i ea = _mm_cmpeq_epi32(e, a), ec = _mm_cmpeq_epi32(e, c);
+        __m128i eg = _mm_cmpeq_epi32(e, g), ei = _mm_cmpeq_epi32(e, i);
+        
+        store3_interleaved(out0 + 3 * x, select_si128(db, d, e),
+                           select_si128(_mm_or_si128(_mm_andnot_si128(ec, db), _mm_andnot_si128(ea, bf)), b, e),
+                           select_si128(bf, f, e));
+        store3_interleaved(out1 + 3 * x,
+                           select_si128(_mm_or_si128(_mm_andnot_si128(eg, db), _mm_andnot_si128(ea, dh)), d, e),
+                           e,
+                           select_si128(_mm_or_si128(_mm_andnot_si128(ei, bf), _mm_andnot_si128(ec, hf)), f, e));
+        store3_interleaved(out2 + 3 * x, select_si128(dh, d, e),
+                           select_si128(_mm_or_si128(_mm_andnot_si128(ei, dh), _mm_andnot_si128(eg, hf)), h, e),
+                           select_si128(hf, f, e));
+    }
+#endif
+    scale3x_span(up, row, down, width, x, width, out0, out1, out2);
+}
+
+// Scale source rows [y0, y1) of a width x height image by 2 or 3
+static void upscale_rows(const uint32_t *source, int width, int height, int y0, int y1,
+                         int factor, uint32_t *out) {
+    size_t out_stride = (size_t)width * factor;
+    for (int y = y0; y < y1; y++) {
+        const uint32_t *row = source + (size_t)y * width;
+        const uint32_t *up = y > 0 ? row - width : row;
+        const uint32_t *down = y + 1 < height ? row + width : row;
+        uint32_t *line = out + (size_t)y * factor * out_stride;
+        if (factor == 3) {
+            scale3x_row(up, row, down, width, line, line + out_stride, line + 2 * out_stride);
+        } else {
+            scale2x_row(up, row, down, width, line, line + out_stride);
+        }
+    }
+}
+
+// Which upscale a cell shown magnification times larger gets: 0 for none,
+// else 2, 3 or 4. Never more than the cell shows, so nothing is shrunk back.
+int scaler_factor(float magnification) {
+    if (pixel_scaler == SCALER_SCALE2X) {
+        return magnification >= 4.0f ? 4 : magnification >= 2.0f ? 2 : 0;
+    }
+    if (pixel_scaler == SCALER_SCALE3X) {
+        return magnification >= 3.0f ? 3 : 0;
+    }
+    return 0;
+}
+
+// One image being upscaled for the grid
+typedef struct {
+    wad_image_t *image;
+    int factor;
+    int width, height;
+    uint32_t *source;          // The image as RGBA
+    uint32_t *middle;          // The 2x pass that 4x scales again
+    uint32_t *scaled;
+} upscale_job_t;
+
+typedef struct {
+    int job;
+    int row;                   // First row of the tile in the pass's input
+} upscale_tile_t;
+
+typedef struct {
+    upscale_job_t *jobs;
+    upscale_tile_t *tiles;
+    int pass;                  // 0 scales the source, 1 scales middle again for 4x
+} upscale_batch_t;
+
+static void upscale_tile(void *context, int index) {
+    upscale_batch_t *batch = (upscale_batch_t *)context;
+    const upscale_tile_t *tile = &batch->tiles[index];
+    const upscale_job_t *job = &batch->jobs[tile->job];
+    
+    if (batch->pass == 0) {
+        int end = tile->row + UPSCALE_TILE_ROWS < job->height ? tile->row + UPSCALE_TILE_ROWS : job->height;
+        upscale_rows(job->source, job->width, job->height, tile->row, end,
+                     job->factor == 3 ? 3 : 2, job->factor == 4 ? job->middle : job->scaled);
+    } else {
+        int end = tile->row + UPSCALE_TILE_ROWS < job->height * 2 ? tile->row + UPSCALE_TILE_ROWS : job->height * 2;
+        upscale_rows(job->middle, job->width * 2, job->height * 2, tile->row, end, 2, job->scaled);
+    }
+}
+
+// Make the missing upscaled textures for a set of images. The images are
+// expanded serially (decoding may use the shared scratch arena), then cut
+// into row tiles that the worker pool scales, and uploaded on this thread.
+// Returns true if any texture was made.
+bool upscale_images(wad_image_t **images, const int *factors, int count) {
+    upscale_job_t *jobs = (upscale_job_t *)calloc(count + 1, sizeof(upscale_job_t));
+    if (!jobs) return false;
+    
+    int num_jobs = 0, num_tiles = 0;
+    for (int n = 0; n < count; n++) {
+        wad_image_t *image = images[n];
+        indexed_image_t *indexed = image_indexes(image);
+        if (!indexed) continue;
+        
+        int factor = factors[n];
+        size_t pixels = (size_t)image->width * image->height;
+        upscale_job_t *job = &jobs[num_jobs];
+        job->source = (uint32_t *)calloc(pixels * (1 + factor * factor + (factor == 4 ? 4 : 0)), sizeof(uint32_t));
+        if (!job->source) continue;
+        job->scaled = job->source + pixels;
+        job->middle = factor == 4 ? job->scaled + pixels * 16 : NULL;
+        job->image = image;
+        job->factor = factor;
+        job->width = image->width;
+        job->height = image->height;
+        expand_image_rgba(image, indexed, (unsigned char *)job->source, image->width);
+        num_tiles += (job->height + UPSCALE_TILE_ROWS - 1) / UPSCALE_TILE_ROWS;
+        if (factor == 4) num_tiles += (job->height * 2 + UPSCALE_TILE_ROWS - 1) / UPSCALE_TILE_ROWS;
+        num_jobs++;
+    }
+    
+    upscale_batch_t batch = { jobs, (upscale_tile_t *)malloc((num_tiles + 1) * sizeof(upscale_tile_t)), 0 };
+    if (batch.tiles) {
+        // 4x needs all of its 2x pass before the second pass reads the rows around a tile
+        for (batch.pass = 0; batch.pass < 2; batch.pass++) {
+            int tiles = 0;
+            for (int j = 0; j < num_jobs; j++) {
+                if (batch.pass == 1 && jobs[j].factor != 4) continue;
+                int rows = batch.pass == 0 ? jobs[j].height : jobs[j].height * 2;
+                for (int row = 0; row < rows; row += UPSCALE_TILE_ROWS) {
+                    batch.tiles[tiles].job = j;
+                    batch.tiles[tiles].row = row;
+                    tiles++;
+                }
+            }
+            if (tiles > 0) parallel_for(tiles, upscale_tile, &batch);
+        }
+    }
+    
+    int made = 0;
+    for (int j = 0; j < num_jobs; j++) {
+        upscale_job_t *job = &jobs[j];
+        if (batch.tiles) {
+            GLuint *texture = &job->image->scaled_textures[job->factor - 2];
+            glGenTextures(1, texture);
+            glBindTexture(GL_TEXTURE_2D, *texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, job->width * job->factor, job->height * job->factor,
+                         0, GL_RGBA, GL_UNSIGNED_BYTE, job->scaled);
+            made++;
+        }
+        free(job->source);
+    }
+    free(batch.tiles);
+    free(jobs);
+    return made > 0;
+}
+
+// Drop an image's upscaled textures, e.g. when its pixels or palette change
+void free_scaled_textures(wad_image_t *image) {
+    for (int f = 0; f < 3; f++) {
+        if (image->scaled_textures[f] > 0) {
+            glDeleteTextures(1, &image->scaled_textures[f]);
+            image->scaled_textures[f] = 0;
+        }
+    }
+}
+
+bool is_image_lump(char *name) {
+    // Remove trailing spaces from name
+    char clean_name[9] = {0};
+    strncpy(clean_name, name, 8);
+    int len = strlen(clean_name);
+    while (len > 0 && clean_name[len-1] == ' ') {
+        clean_name[len-1] = '\0';
+        len--;
+    }
+    
+    // Known NON-image lumps to skip
+    
+    const char *skip_lumps[] = {
+    /*  "PLAYPAL", "COLORMAP", "ENDOOM", "DEMO", "DS", "PC", "D_",
+        "THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS",
+        "SSECTORS", "NODES", "SECTORS", "REJECT", "BLOCKMAP",
+        "BEHAVIOR", "SCRIPTS", "GENMIDI", "DMXGUS", 
+        "DEHACKED", "MAPINFO", "SNDINFO", "SNDSEQ", "CONVERSATION",
+        "ANIMDEFS", "LANGUAGE", "KEYCONF", "FONTDEFS",
+        "TERRAIN", "SBARINFO", "LOCKDEFS",
+        "TITLEMAP", "TEXTMAP", "DIALOGUE", "ZNODES", "EXTENDED",
+        "LOADACS",  "ANIMATED", "README", "INFO", "LOG" */
+    };
     
     // Check if lump is in skip list
     for (int i = 0; i < sizeof(skip_lumps)/sizeof(char*); i++) {
@@ -644,10 +2736,7 @@ bool is_image_lump(char *name) {
     }
     
     // Skip MAP markers (MAPxx, ExMy)
-    if ((len == 5 && strncmp(clean_name, "MAP", 3) == 0 && 
-         isdigit(clean_name[3]) && isdigit(clean_name[4])) ||
-        (len == 4 && clean_name[0] == 'E' && isdigit(clean_name[1]) && 
-         clean_name[2] == 'M' && isdigit(clean_name[3]))) {
+    if (is_map_marker(clean_name)) {
         return false;
     }
     
@@ -740,912 +2829,9825 @@ bool is_image_lump(char *name) {
     return false;
 }
 
-void load_wad_file(const char *filename) {
-    // First unload any currently loaded WAD
-    unload_current_wad();
+// Map a whole file read-only into memory
+bool map_file(const char *filename, mapped_file_t *map) {
+    memset(map, 0, sizeof(*map));
+#ifdef _WIN32
+    map->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) return false;
     
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        sprintf(status_message, "Error: Cannot open file %s", filename);
-        return;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(map->file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(map->file);
+        return false;
     }
+    map->size = (size_t)file_size.QuadPart;
     
-    // Store the filename
-    strcpy(wad_filename, filename);
-    
-    // Read WAD header
-    wad_header_t header;
-    fread(&header, sizeof(wad_header_t), 1, file);
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!map->mapping) {
+        CloseHandle(map->file);
+        return false;
+    }
+    map->data = (unsigned char *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!map->data) {
+        CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        return false;
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
     
-    // Check WAD signature
-    if (strncmp(header.identifier, "IWAD", 4) != 0 && strncmp(header.identifier, "PWAD", 4) != 0) {
-        sprintf(status_message, "Error: %s is not a valid WAD file", filename);
-        fclose(file);
-        return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
     }
+    map->size = (size_t)st.st_size;
     
-    // Update window title with WAD info
-    sprintf(window_title, "DOOM WAD Image Viewer - %s (%s, %d lumps)", 
-            filename, header.identifier, header.num_lumps);
-    glutSetWindowTitle(window_title);
+    void *data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping keeps the file referenced
+    if (data == MAP_FAILED) return false;
+    map->data = (unsigned char *)data;
+#endif
+    return true;
+}
 
-    // Load palette first - try to extract from this WAD
-    if (!palette_loaded || (palette_loaded && !strcmp(status_message, "Using grayscale palette (no palette found)"))) {
-        if (extract_palette_from_wad(filename)) {
-            palette_loaded = true;
-            strcpy(status_message, "Extracted palette from WAD file");
-        } else {
-            load_doom_palette();  // Try to load from external file
+void unmap_file(mapped_file_t *map) {
+    if (!map->data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    munmap(map->data, map->size);
+#endif
+    memset(map, 0, sizeof(*map));
+}
+
+// Lump name and namespace of a PK3 member, from its file name and top
+// folder as the engine sees them. Returns false for folders that hold no
+// graphics (maps, sounds, music, scripts, ...) and for directories.
+static bool zip_member_lump(const char *path, int length, char *name, char *ns) {
+    const char *slash = memchr(path, '/', length);
+    const char *base = path;
+    for (int i = 0; i < length; i++) {
+        if (path[i] == '/') base = path + i + 1;
+    }
+    
+    ns[0] = '\0';
+    if (slash) {
+        int folder_length = (int)(slash - path);
+        static const struct {
+            const char *folder;
+            const char *ns;
+        } namespaces[] = {
+            {"sprites", "S"}, {"flats", "F"}, {"textures", "TX"}, {"hires", "HI"},
+            {"patches", ""}, {"graphics", ""}
+        };
+        int found = -1;
+        for (int i = 0; i < (int)(sizeof(namespaces) / sizeof(namespaces[0])); i++) {
+            if ((int)strlen(namespaces[i].folder) == folder_length &&
+                strncasecmp(path, namespaces[i].folder, folder_length) == 0) {
+                found = i;
+            }
         }
+        if (found < 0) return false;
+        strcpy(ns, namespaces[found].ns);
     }
     
-    // Read directory
-    wad_directory_t *directory = (wad_directory_t *)malloc(header.num_lumps * sizeof(wad_directory_t));
-    fseek(file, header.directory_offset, SEEK_SET);
-    fread(directory, sizeof(wad_directory_t), header.num_lumps, file);
+    // Up to the first dot, uppercased and cut to 8 characters
+    int name_length = 0;
+    while (name_length < 8 && base + name_length < path + length && base[name_length] != '.') {
+        name[name_length] = toupper((unsigned char)base[name_length]);
+        name_length++;
+    }
+    name[name_length] = '\0';
+    return name_length > 0;
+}
+
+// Index a PK3/ZIP from its central directory: every member becomes a
+// directory entry (file_pos unused, size uncompressed) with a zip_entry_t
+// beside it. Nothing is read or inflated here.
+bool zip_read_directory(wad_file_t *wad) {
+    const unsigned char *data = wad->map.data;
+    size_t size = wad->map.size;
+    if (size < 22) return false;
     
-    // First pass: count images
-    total_images = 0;
-    for (int i = 0; i < header.num_lumps; i++) {
-        // Make sure name is null-terminated
-        char name[9] = {0};
-        strncpy(name, directory[i].name, 8);
-        
-        if (is_image_lump(name) && directory[i].size > 0) {
-            total_images++;
-        }
+    // End of central directory record, searched backwards past any comment
+    size_t scan_end = size > 22 + 65535 ? size - 22 - 65535 : 0;
+    size_t eocd = size - 22;
+    while (read_le32(data + eocd) != 0x06054b50) {
+        if (eocd == scan_end) return false;
+        eocd--;
     }
+    uint64_t count = read_le16u(data + eocd + 10);
+    uint64_t directory_size = read_le32(data + eocd + 12);
+    uint64_t directory_offset = read_le32(data + eocd + 16);
     
-    // Allocate image array
-    images = (wad_image_t *)malloc(total_images * sizeof(wad_image_t));
-    if (!images) {
-        sprintf(status_message, "Error: Memory allocation failed");
-        free(directory);
-        fclose(file);
-        return;
+    // ZIP64 keeps the real values in its own record, found through a locator
+    if (eocd >= 20 && read_le32(data + eocd - 20) == 0x07064b50) {
+        uint64_t record = read_le64(data + eocd - 20 + 8);
+        if (record < size && size - record >= 56 && read_le32(data + record) == 0x06064b50) {
+            count = read_le64(data + record + 32);
+            directory_size = read_le64(data + record + 40);
+            directory_offset = read_le64(data + record + 48);
+        }
+    }
+    if (directory_offset > size || directory_size > size - directory_offset || count > directory_size / 46) {
+        return false;
     }
     
-    // Second pass: load images
-    int image_index = 0;
-    for (int i = 0; i < header.num_lumps; i++) {
-        char name[9] = {0};
-        strncpy(name, directory[i].name, 8);
+    wad->directory = (wad_directory_t *)arena_alloc(&wad->arena, (count + 1) * sizeof(wad_directory_t));
+    wad->zip_entries = (zip_entry_t *)arena_calloc(&wad->arena, (count + 1) * sizeof(zip_entry_t));
+    if (!wad->directory || !wad->zip_entries) return false;
+    
+    const unsigned char *entry = data + directory_offset;
+    const unsigned char *end = entry + directory_size;
+    int lumps = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (entry + 46 > end || read_le32(entry) != 0x02014b50) return false;
+        int method = read_le16u(entry + 10);
+        uint32_t crc = read_le32(entry + 16);
+        uint64_t compressed_size = read_le32(entry + 20);
+        uint64_t uncompressed_size = read_le32(entry + 24);
+        int name_length = read_le16u(entry + 28);
+        int extra_length = read_le16u(entry + 30);
+        int comment_length = read_le16u(entry + 32);
+        uint64_t local_offset = read_le32(entry + 42);
+        const char *path = (const char *)entry + 46;
+        const unsigned char *extra = entry + 46 + name_length;
+        const unsigned char *next = extra + extra_length + comment_length;
+        if (next > end) return false;
         
-        if (is_image_lump(name) && directory[i].size > 0) {
-            // Copy lump name
-            strcpy(images[image_index].name, name);
-            
-            // Allocate memory for image data
-            images[image_index].data = (unsigned char *)malloc(directory[i].size);
-            if (!images[image_index].data) continue;
-            
-            // Read image data
-            fseek(file, directory[i].file_pos, SEEK_SET);
-            fread(images[image_index].data, directory[i].size, 1, file);
-            
-            // Set image properties
-            images[image_index].size = directory[i].size;
-            
-            // Try to determine image dimensions
-            detect_image_dimensions(&images[image_index]);
-            
-            // Create OpenGL texture for this image
-            if (images[image_index].is_valid) {
-                create_texture_from_image(&images[image_index]);
+        // ZIP64 extra field: only the values saturated above are present, in order
+        const unsigned char *field = extra;
+        while (field + 4 <= extra + extra_length) {
+            int id = read_le16u(field), field_size = read_le16u(field + 2);
+            const unsigned char *value = field + 4;
+            const unsigned char *field_end = value + field_size;
+            if (field_end > extra + extra_length) break;
+            if (id == 0x0001) {
+                if (uncompressed_size == 0xFFFFFFFF && value + 8 <= field_end) {
+                    uncompressed_size = read_le64(value);
+                    value += 8;
+                }
+                if (compressed_size == 0xFFFFFFFF && value + 8 <= field_end) {
+                    compressed_size = read_le64(value);
+                    value += 8;
+                }
+                if (local_offset == 0xFFFFFFFF && value + 8 <= field_end) {
+                    local_offset = read_le64(value);
+                }
             }
-            
-            image_index++;
+            field = field_end;
+        }
+        entry = next;
+        
+        char name[9], ns[9];
+        if ((method != 0 && method != 8) || uncompressed_size > INT_MAX ||
+            local_offset >= size || compressed_size > size ||
+            !zip_member_lump(path, name_length, name, ns)) {
+            continue;
         }
+        
+        wad_directory_t *lump = &wad->directory[lumps];
+        lump->file_pos = 0;
+        lump->size = (int)uncompressed_size;
+        memset(lump->name, 0, sizeof(lump->name));
+        memcpy(lump->name, name, strlen(name));
+        
+        zip_entry_t *member = &wad->zip_entries[lumps];
+        member->local_offset = (long long)local_offset;
+        member->compressed_size = (long long)compressed_size;
+        member->method = method;
+        member->crc32 = crc;
+        strcpy(member->ns, ns);
+        lumps++;
     }
     
-    // Update status message
-    if (!palette_loaded) {
-        sprintf(status_message, "Loaded %d images from %s (using grayscale - no palette found)", 
-                total_images, filename);
+    wad->header.num_lumps = lumps;
+    return true;
+}
+
+// Where a member's stored bytes start in the mapping, or NULL if its local
+// header is damaged
+static const unsigned char *zip_member_start(const wad_file_t *wad, const zip_entry_t *member) {
+    const unsigned char *data = wad->map.data;
+    size_t size = wad->map.size;
+    size_t header = (size_t)member->local_offset;
+    if (header + 30 > size || read_le32(data + header) != 0x04034b50) return NULL;
+    
+    size_t start = header + 30 + read_le16u(data + header + 26) + read_le16u(data + header + 28);
+    if (start > size || (size_t)member->compressed_size > size - start) return NULL;
+    return data + start;
+}
+
+// Inflate one deflated member into dest, which holds its whole
+// uncompressed size. Safe to run on the worker pool.
+static bool zip_member_inflate(const wad_file_t *wad, int index, unsigned char *dest) {
+    const zip_entry_t *member = &wad->zip_entries[index];
+    const unsigned char *start = zip_member_start(wad, member);
+    int size = wad->directory[index].size;
+    return start && inflate_raw(start, member->compressed_size, dest, size) == size;
+}
+
+// Give a member a place for its bytes: stored members are used straight
+// from the mapping, deflated ones get a buffer in the arena to inflate
+// into. Returns false if there is nothing to inflate.
+static bool zip_member_reserve(wad_file_t *wad, int index) {
+    zip_entry_t *member = &wad->zip_entries[index];
+    if (member->data || member->failed) return false;
+    
+    if (member->method == 0) {
+        member->data = (unsigned char *)zip_member_start(wad, member);
+        if (member->data && member->compressed_size != wad->directory[index].size) member->data = NULL;
+        member->failed = !member->data;
+        return false;
+    }
+    member->data = (unsigned char *)arena_alloc(&wad->arena, wad->directory[index].size + 1);
+    member->failed = !member->data;
+    return member->data != NULL;
+}
+
+// Uncompressed bytes of a PK3 member, read on first use
+static const unsigned char *zip_member_data(wad_file_t *wad, int index) {
+    zip_entry_t *member = &wad->zip_entries[index];
+    if (zip_member_reserve(wad, index) && !zip_member_inflate(wad, index, member->data)) {
+        member->failed = true;
+    }
+    return member->failed ? NULL : member->data;
+}
+
+static void hash_wad_lump(void *context, int index) {
+    wad_file_t *wad = (wad_file_t *)context;
+    const wad_directory_t *entry = &wad->directory[index];
+    if (entry->file_pos < 0 || entry->size < 0 || (size_t)entry->file_pos + entry->size > wad->map.size) {
+        wad->lump_hashes[index] = 0;
     } else {
-        sprintf(status_message, "Loaded %d images from %s with color palette", 
-                total_images, filename);
+        wad->lump_hashes[index] = hash_lump64(wad->map.data + entry->file_pos, entry->size);
     }
-    
-    // Cleanup
-    free(directory);
-    fclose(file);
 }
 
-void draw_string(float x, float y, const char *text) {
-    glRasterPos2f(x, y);
-    for (const char *c = text; *c; c++) {
-        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *c);
+// Content hash of every lump, so a reload can tell which ones changed.
+// WAD lumps are hashed in parallel; PK3 members already carry a CRC.
+static void wad_hash_lumps(wad_file_t *wad) {
+    wad->lump_hashes = (uint64_t *)arena_alloc(&wad->arena, (wad->header.num_lumps + 1) * sizeof(uint64_t));
+    if (!wad->lump_hashes) return;
+    if (wad->zip_entries) {
+        for (int i = 0; i < wad->header.num_lumps; i++) {
+            wad->lump_hashes[i] = wad->zip_entries[i].crc32 | ((uint64_t)wad->directory[i].size << 32);
+        }
+    } else {
+        parallel_for(wad->header.num_lumps, hash_wad_lump, wad);
     }
 }
 
-// The file selector menu
-void file_selector_menu() {
-    // Semi-transparent background
-    glColor4f(0.0, 0.0, 0.5, 0.8);
-    glEnable(GL_BLEND);
-    glBegin(GL_QUADS);
-        glVertex2f(window_width/4, window_height/4);
-        glVertex2f(window_width*3/4, window_height/4);
-        glVertex2f(window_width*3/4, window_height*3/4);
-        glVertex2f(window_width/4, window_height*3/4);
-    glEnd();
-    glDisable(GL_BLEND);
+// Map a WAD or PK3 and validate its header and directory, without
+// hashing the lumps. Returns NULL on error (with status_message set).
+wad_file_t *wad_open_directory(const char *filename) {
+    wad_file_t *wad = (wad_file_t *)calloc(1, sizeof(wad_file_t));
+    if (!wad) {
+        sprintf(status_message, "Error: Memory allocation failed");
+        return NULL;
+    }
     
-    // Title
-    glColor3f(1.0, 1.0, 0.0);
-    draw_string(window_width/4 + 20, window_height/4 + 20, "Select a WAD file to load:");
+    if (!map_file(filename, &wad->map)) {
+        sprintf(status_message, "Error: Cannot open file %s", filename);
+        free(wad);
+        return NULL;
+    }
     
-    // List of WAD files
-    for (int i = 0; i < num_available_wads; i++) {
-        if (i == selected_wad_index) {
-            // Highlight selected item
-            glColor3f(1.0, 1.0, 0.0);
-            glBegin(GL_QUADS);
-                glVertex2f(window_width/4 + 10, window_height/4 + 40 + i*20 - 3);
-                glVertex2f(window_width*3/4 - 10, window_height/4 + 40 + i*20 - 3);
-                glVertex2f(window_width*3/4 - 10, window_height/4 + 40 + i*20 + 15);
-                glVertex2f(window_width/4 + 10, window_height/4 + 40 + i*20 + 15);
-            glEnd();
-            glColor3f(0.0, 0.0, 0.0);
-        } else {
-            glColor3f(1.0, 1.0, 1.0);
+    strncpy(wad->filename, filename, sizeof(wad->filename) - 1);
+    wad->watch = -1;
+    struct stat st;
+    if (stat(filename, &st) == 0) wad->mtime = (long long)st.st_mtime;
+    
+    // PK3s are zips (an empty one starts with its end record)
+    if (wad->map.size >= 4 && (memcmp(wad->map.data, "PK\3\4", 4) == 0 || memcmp(wad->map.data, "PK\5\6", 4) == 0)) {
+        if (!zip_read_directory(wad)) {
+            sprintf(status_message, "Error: %s has a damaged zip directory", filename);
+            wad_close(wad);
+            return NULL;
         }
-        
-        draw_string(window_width/4 + 20, window_height/4 + 40 + i*20, available_wads[i]);
+        memcpy(wad->header.identifier, "PK3", 4);
+        return wad;
     }
     
-    // Instructions
-    glColor3f(0.7, 0.7, 1.0);
-    draw_string(window_width/4 + 20, window_height*3/4 - 40, "Use Up/Down to select, Enter to load, Esc to cancel");
-}
-
-void display() {
-    glClear(GL_COLOR_BUFFER_BIT);
+    // Read WAD header
+    if (wad->map.size >= sizeof(wad_header_t)) {
+        memcpy(&wad->header, wad->map.data, sizeof(wad_header_t));
+    }
     
-    // Set up 2D projection
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluOrtho2D(0, window_width, window_height, 0);
+    // Check WAD signature
+    if (wad->map.size < sizeof(wad_header_t) ||
+        (strncmp(wad->header.identifier, "IWAD", 4) != 0 && strncmp(wad->header.identifier, "PWAD", 4) != 0)) {
+        sprintf(status_message, "Error: %s is not a valid WAD file", filename);
+        wad_close(wad);
+        return NULL;
+    }
+    wad->is_iwad = strncmp(wad->header.identifier, "IWAD", 4) == 0;
     
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    // The directory must lie inside the file
+    size_t directory_bytes = (size_t)wad->header.num_lumps * sizeof(wad_directory_t);
+    if (wad->header.num_lumps < 0 || wad->header.directory_offset < 0 ||
+        (size_t)wad->header.directory_offset + directory_bytes > wad->map.size) {
+        sprintf(status_message, "Error: %s has a truncated directory", filename);
+        wad_close(wad);
+        return NULL;
+    }
     
-    // Calculate how many images we can display per page
-    images_per_page = images_per_row * ((window_height - 50) / (image_size + image_padding));
-    if (images_per_page <= 0) images_per_page = 1;
+    // Copy the directory out of the mapping so entries are aligned
+    wad->directory = (wad_directory_t *)arena_alloc(&wad->arena, directory_bytes + 1);
+    if (!wad->directory) {
+        sprintf(status_message, "Error: Memory allocation failed");
+        wad_close(wad);
+        return NULL;
+    }
+    memcpy(wad->directory, wad->map.data + wad->header.directory_offset, directory_bytes);
+    return wad;
+}
+
+// wad_open_directory() plus the content hashes reloads compare
+wad_file_t *wad_open(const char *filename) {
+    wad_file_t *wad = wad_open_directory(filename);
+    if (wad) wad_hash_lumps(wad);
+    return wad;
+}
+
+// Release everything owned by one WAD in the stack
+void wad_close(wad_file_t *wad) {
+    if (!wad) return;
     
-    // Calculate total pages
-    int total_pages = 1;
-    if (total_images > 0) {
-        total_pages = (total_images + images_per_page - 1) / images_per_page;
+    // GL objects are the only things outside the arena; hand them back in
+    // one call per kind
+    GLuint *names = (GLuint *)arena_alloc(&wad->arena, (wad->num_images * 4 + wad->num_maps + 1) * sizeof(GLuint));
+    if (names) {
+        int count = 0;
+        for (int i = 0; i < wad->num_images; i++) {
+            if (wad->images[i].texture_id > 0) names[count++] = wad->images[i].texture_id;
+            for (int f = 0; f < 3; f++) {
+                if (wad->images[i].scaled_textures[f] > 0) names[count++] = wad->images[i].scaled_textures[f];
+            }
+        }
+        if (count > 0) glDeleteTextures(count, names);
+        
+        count = 0;
+        for (int m = 0; m < wad->num_maps; m++) {
+            if (wad->maps[m]->vbo) names[count++] = wad->maps[m]->vbo;
+        }
+        if (count > 0 && gl_delete_buffers) gl_delete_buffers(count, names);
     }
     
-    // Make sure current page is valid
-    if (current_page >= total_pages) current_page = total_pages - 1;
-    if (current_page < 0) current_page = 0;
+    arena_free(&wad->arena);
+    unmap_file(&wad->map);
+    free(wad);
+}
+
+// Find the last lump with this name in one WAD (the engine searches backwards)
+const unsigned char *wad_find_lump(wad_file_t *wad, const char *name, int *size) {
+    for (int i = wad->header.num_lumps - 1; i >= 0; i--) {
+        if (strncmp(wad->directory[i].name, name, 8) == 0) {
+            return wad_lump_data(wad, i, size);
+        }
+    }
+    return NULL;
+}
+
+bool is_map_marker(const char *clean_name) {
+    int len = strlen(clean_name);
+    return (len == 5 && strncmp(clean_name, "MAP", 3) == 0 &&
+            isdigit(clean_name[3]) && isdigit(clean_name[4])) ||
+           (len == 4 && clean_name[0] == 'E' && isdigit(clean_name[1]) &&
+            clean_name[2] == 'M' && isdigit(clean_name[3]));
+}
+
+// Lumps that belong to the map marker before them
+bool is_map_data_lump(const char *clean_name) {
+    const char *map_lumps[] = {
+        "THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS", "SSECTORS",
+        "NODES", "SECTORS", "REJECT", "BLOCKMAP", "BEHAVIOR", "SCRIPTS",
+        "TEXTMAP", "ZNODES", "DIALOGUE", "ENDMAP"
+    };
     
-    // Calculate starting image index
-    int start_idx = current_page * images_per_page;
+    for (int i = 0; i < sizeof(map_lumps)/sizeof(char*); i++) {
+        if (strcmp(clean_name, map_lumps[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Override namespace of every lump: S and F between sprite and flat
+// markers, the map's name for the lumps after a map marker, and a PK3
+// member's folder. The viewer, diff, dupes, serve and verify all use this.
+static void wad_lump_namespaces(const wad_file_t *wad, char (*ns)[9]) {
+    char map_name[9] = "";
+    bool in_sprites = false;
+    bool in_flats = false;
     
-    // Draw images for current page
-    for (int i = 0; i < images_per_page && start_idx + i < total_images; i++) {
-        int row = i / images_per_row;
-        int col = i % images_per_row;
+    for (int i = 0; i < wad->header.num_lumps; i++) {
+        ns[i][0] = '\0';
+        if (wad->zip_entries) {
+            strcpy(ns[i], wad->zip_entries[i].ns);
+            continue;
+        }
         
-        // Calculate position but ensure integer coordinates
-        int x = col * (image_size + image_padding) + image_padding;
-        int y = row * (image_size + image_padding) + image_padding + 30; // 30px for header
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        if (strcmp(name, "S_START") == 0 || strcmp(name, "SS_START") == 0) in_sprites = true;
+        else if (strcmp(name, "S_END") == 0 || strcmp(name, "SS_END") == 0) in_sprites = false;
+        else if (strcmp(name, "F_START") == 0 || strcmp(name, "FF_START") == 0) in_flats = true;
+        else if (strcmp(name, "F_END") == 0 || strcmp(name, "FF_END") == 0) in_flats = false;
         
-        wad_image_t *img = &images[start_idx + i];
+        if (is_map_marker(name)) {
+            strcpy(map_name, name);
+            continue;
+        } else if (!is_map_data_lump(name)) {
+            map_name[0] = '\0';
+        }
         
-        if (img->is_valid && img->texture_id > 0) {
-            // Calculate aspect ratio
-            float aspect_ratio = (float)img->width / (float)img->height;
-            
-            // Calculate display dimensions while preserving aspect ratio
-            int display_width, display_height;
-            
-            if (aspect_ratio >= 1.0) {
-                // Wider than tall
-                display_width = image_size;
-                display_height = (int)(image_size / aspect_ratio);
-            } else {
-                // Taller than wide
-                display_height = image_size;
-                display_width = (int)(image_size * aspect_ratio);
-            }
-            
-            // Center the image in its allocated space - ensure integer coordinates
-            int x_offset = (image_size - display_width) / 2;
-            int y_offset = (image_size - display_height) / 2;
-            
-            // Draw image - use integer coordinates to ensure pixel-perfect alignment
-            glEnable(GL_TEXTURE_2D);
-            glBindTexture(GL_TEXTURE_2D, img->texture_id);
-            
-            // Force glTexParameteri to enforce nearest-neighbor interpolation
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-            
-            glColor3f(1.0, 1.0, 1.0);
-            glBegin(GL_QUADS);
-                glTexCoord2f(0.0, 0.0); glVertex2i(x + x_offset, y + y_offset);
-                glTexCoord2f(1.0, 0.0); glVertex2i(x + x_offset + display_width, y + y_offset);
-                glTexCoord2f(1.0, 1.0); glVertex2i(x + x_offset + display_width, y + y_offset + display_height);
-                glTexCoord2f(0.0, 1.0); glVertex2i(x + x_offset, y + y_offset + display_height);
-            glEnd();
-            
-            glDisable(GL_TEXTURE_2D);
-            
-            // Draw image name
-            char label[64];
-            sprintf(label, "%s (%dx%d)", img->name, img->width, img->height);
-            
-            glColor3f(1.0, 1.0, 0.0);
-            draw_string(x, y + image_size + 12, label);
-        } else {
-            // Draw placeholder for invalid image
-            glColor3f(0.5, 0.5, 0.5);
-            glBegin(GL_QUADS);
-                glVertex2i(x, y);
-                glVertex2i(x + image_size, y);
-                glVertex2i(x + image_size, y + image_size);
-                glVertex2i(x, y + image_size);
-            glEnd();
-            
-            glColor3f(1.0, 0.0, 0.0);
-            draw_string(x, y + image_size / 2, "Invalid Image");
-            draw_string(x, y + image_size / 2 + 15, img->name);
+        if (map_name[0]) strcpy(ns[i], map_name);
+        else if (in_sprites) strcpy(ns[i], "S");
+        else if (in_flats) strcpy(ns[i], "F");
+    }
+}
+
+// Decode every image lump of one WAD and create its textures. Lump data
+// stays in the mapping; nothing else in the stack is touched. PK3 members
+// only get a pending record here and are read when first shown. When a
+// reload passes the previous copy of the file, lumps whose content hash is
+// unchanged take over its textures instead of being decoded again.
+// Returns how many images were carried over that way.
+int wad_index_images(wad_file_t *wad, wad_file_t *previous) {
+    // First pass: count images
+    int count = 0;
+    for (int i = 0; i < wad->header.num_lumps; i++) {
+        // Make sure name is null-terminated
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        
+        if ((is_image_lump(name) && wad->directory[i].size > 0) || is_map_marker(name)) {
+            count++;
         }
     }
     
-    // Draw status bar
-    glColor3f(0.0, 0.0, 0.0);
-    glBegin(GL_QUADS);
-        glVertex2i(0, window_height - 20);
-        glVertex2i(window_width, window_height - 20);
-        glVertex2i(window_width, window_height);
-        glVertex2i(0, window_height);
-    glEnd();
-    
-    // Draw page info
-    char page_info[64];
-    sprintf(page_info, "Page %d/%d - %d images total", 
-            current_page + 1, total_pages, total_images);
+    // Map markers are counted too, to leave room for their previews
+    wad->images = (wad_image_t *)arena_calloc(&wad->arena, (count + 1) * sizeof(wad_image_t));
+    wad->num_images = 0;
+    wad->image_capacity = wad->images ? count : 0;
+    if (!wad->images) return 0;
     
-    glColor3f(1.0, 1.0, 1.0);
-    draw_string(10, window_height - 5, status_message);
-    draw_string(window_width - 200, window_height - 5, page_info);
+    // Previous images by lump hash; a taken one is replaced by a tombstone
+    int table_size = 16;
+    wad_image_t **unchanged = NULL;
+    wad_image_t taken = {0};
+    int reused = 0;
+    if (previous && previous->lump_hashes && wad->lump_hashes) {
+        while (table_size < previous->num_images * 2) table_size <<= 1;
+        unchanged = (wad_image_t **)calloc(table_size, sizeof(wad_image_t *));
+        for (int i = 0; unchanged && i < previous->num_images; i++) {
+            wad_image_t *old = &previous->images[i];
+            if (old->pending || old->format == IMAGE_FORMAT_MAP) continue;
+            unsigned int slot = (unsigned int)previous->lump_hashes[old->lump] & (table_size - 1);
+            while (unchanged[slot]) slot = (slot + 1) & (table_size - 1);
+            unchanged[slot] = old;
+        }
+    }
     
-    // Draw header
-    glColor3f(0.0, 0.0, 0.0);
-    glBegin(GL_QUADS);
-        glVertex2i(0, 0);
-        glVertex2i(window_width, 0);
-        glVertex2i(window_width, 25);
-        glVertex2i(0, 25);
-    glEnd();
+    // Textures are made together once the images are measured
+    wad_image_t **fresh = (wad_image_t **)malloc((count + 1) * sizeof(wad_image_t *));
+    int num_fresh = 0;
     
-    glColor3f(1.0, 1.0, 1.0);
-    char header_text[256];
-    sprintf(header_text, "DOOM WAD Image Viewer - %s - Press L to load a different WAD, H for help", 
-            strlen(wad_filename) > 0 ? wad_filename : "No WAD loaded");
-    draw_string(10, 15, header_text);
+    // Second pass: load images in the namespace each lump lives in
+    wad->lump_ns = (char (*)[9])arena_alloc(&wad->arena, (wad->header.num_lumps + 1) * 9);
+    if (!wad->lump_ns) {
+        free(fresh);
+        free(unchanged);
+        return 0;
+    }
+    wad_lump_namespaces(wad, wad->lump_ns);
     
-    // Show help screen if requested
-    if (show_help) {
-        // Semi-transparent background
-        glColor4f(0.0, 0.0, 0.5, 0.8);
-        glEnable(GL_BLEND);
-        glBegin(GL_QUADS);
-            glVertex2i(window_width/4, window_height/4);
-            glVertex2i(window_width*3/4, window_height/4);
-            glVertex2i(window_width*3/4, window_height*3/4);
-            glVertex2i(window_width/4, window_height*3/4);
-        glEnd();
-        glDisable(GL_BLEND);
+    for (int i = 0; i < wad->header.num_lumps; i++) {
+        const wad_directory_t *entry = &wad->directory[i];
+        char name[9] = {0};
+        strncpy(name, entry->name, 8);
         
-        // Help text
-        glColor3f(1.0, 1.0, 1.0);
-        const char *help_text[] = {
-            "DOOM WAD Image Viewer - Help",
-            "",
-            "Navigation:",
-            "  Page Up/Down - Move between pages",
-            "  Home/End - Go to first/last page",
-            "",
-            "Display Options:",
-            "  +/- - Change image size",
-            "  Left/Right - Change images per row",
-            "",
-            "Other Controls:",
-            "  L - Load a different WAD file",
-            "  R - Refresh available WAD files",
-            "  H - Toggle help screen",
-            "  8 - Convert PNG folder to WAD file",
-            "  Esc - Quit program",
-            "",
-            "Press any key to close this help"
-        };
+        // Markers get their preview from wad_index_maps(); the lumps after
+        // one are map data, not graphics
+        if (is_map_marker(name) || is_map_marker(wad->lump_ns[i])) continue;
+        if (!is_image_lump(name) || entry->size <= 0) continue;
         
-        int y_pos = window_height/4 + 20;
-        for (int i = 0; i < 17; i++) {
-            draw_string(window_width/4 + 20, y_pos, help_text[i]);
-            y_pos += 20;
+        wad_image_t *image = &wad->images[wad->num_images];
+        image->lump = i;
+        
+        // PK3 members take their namespace from their folder
+        if (wad->zip_entries) {
+            strcpy(image->name, name);
+            strcpy(image->ns, wad->lump_ns[i]);
+            image->wad = wad;
+            image->size = entry->size;
+            image->pending = true;
+            text_layout_build_in(&image->label, name, &wad->arena);
+            wad->num_images++;
+            continue;
+        }
+        
+        // Skip entries that point outside the file
+        if (entry->file_pos < 0 || (size_t)entry->file_pos + entry->size > wad->map.size) continue;
+        
+        // Copy lump name
+        strcpy(image->name, name);
+        image->wad = wad;
+        strcpy(image->ns, wad->lump_ns[i]);
+        
+        // Point straight into the mapped file
+        image->data = wad->map.data + entry->file_pos;
+        image->size = entry->size;
+        
+        wad_image_t *old = NULL;
+        unsigned int slot = unchanged ? (unsigned int)wad->lump_hashes[i] & (table_size - 1) : 0;
+        for (; unchanged && unchanged[slot]; slot = (slot + 1) & (table_size - 1)) {
+            wad_image_t *candidate = unchanged[slot];
+            if (candidate != &taken && previous->lump_hashes[candidate->lump] == wad->lump_hashes[i] &&
+                candidate->size == image->size && strcmp(candidate->name, name) == 0 &&
+                strcmp(candidate->ns, image->ns) == 0) {
+                old = candidate;
+                unchanged[slot] = &taken;
+                break;
+            }
+        }
+        
+        if (old) {
+            // Same bytes as before: keep the texture and what was measured
+            image->format = old->format;
+            image->width = old->width;
+            image->height = old->height;
+            image->left_offset = old->left_offset;
+            image->top_offset = old->top_offset;
+            image->is_valid = old->is_valid;
+            image->texture_id = old->texture_id;
+            old->texture_id = 0;
+            memcpy(image->scaled_textures, old->scaled_textures, sizeof(image->scaled_textures));
+            memset(old->scaled_textures, 0, sizeof(old->scaled_textures));
+            reused++;
+        } else {
+            // Try to determine image dimensions
+            detect_image_dimensions(image);
+            
+            // Create OpenGL texture for this image
+            if (image->is_valid) {
+                if (fresh) fresh[num_fresh++] = image;
+                else create_texture_from_image(image);
+            }
+        }
+        
+        // Lay out the grid caption once; it only changes if the image does
+        char label[64];
+        if (image->is_valid) {
+            sprintf(label, "%s (%dx%d)", name, image->width, image->height);
+        } else {
+            strcpy(label, name);
+        }
+        text_layout_build_in(&image->label, label, &wad->arena);
+        
+        wad->num_images++;
+    }
+    if (fresh) create_textures(fresh, num_fresh);
+    free(fresh);
+    free(unchanged);
+    return reused;
+}
+
+// Re-upload every texture of a WAD, e.g. after the palette changed
+void wad_recreate_textures(wad_file_t *wad) {
+    wad_image_t **images = (wad_image_t **)malloc((wad->num_images + 1) * sizeof(wad_image_t *));
+    int count = 0;
+    for (int i = 0; i < wad->num_images; i++) {
+        wad_image_t *image = &wad->images[i];
+        if (image->texture_id > 0) {
+            glDeleteTextures(1, &image->texture_id);
+            image->texture_id = 0;
+        }
+        free_scaled_textures(image);
+        // PNG indexes were matched against the old palette, and the
+        // perceptual hash uses the palette's brightness
+        if (image->format == IMAGE_FORMAT_PNG) image->indexed = NULL;
+        image->phash_ready = false;
+        if (image->is_valid) {
+            if (images) images[count++] = image;
+            else create_texture_from_image(image);
         }
     }
+    if (images) create_textures(images, count);
+    free(images);
+}
+
+// One image of a load_pending_images() batch
+typedef struct {
+    wad_image_t *image;
+    bool inflate;                 // Member still has to be inflated into its buffer
+    import_image_t decoded;       // PNG decoded on the worker, or empty
+} pending_load_t;
+
+static void load_pending_member(void *context, int index) {
+    pending_load_t *load = (pending_load_t *)context + index;
+    wad_image_t *image = load->image;
+    zip_entry_t *member = &image->wad->zip_entries[image->lump];
+    if (load->inflate && !zip_member_inflate(image->wad, image->lump, member->data)) member->failed = true;
+    if (member->failed || !member->data) return;
     
-    // Show file selector if requested
-    if (show_file_selector) {
-        file_selector_menu();
+    // PNG decoding costs more than the inflate; only the upload stays serial
+    image->data = member->data;
+    detect_image_dimensions(image);
+    if (image->is_valid && image->format == IMAGE_FORMAT_PNG && image_cache_enabled) {
+        decode_png(image->data, image->size, image->name, &load->decoded);
     }
-    // show folder selector if
-    if (show_folder_selector) {
-        folder_selector_menu();
+}
+
+// Read the PK3 members behind pending images, inflating and decoding them
+// in parallel on the worker pool, then upload their textures the way
+// wad_index_images() does for WAD lumps. Returns how many were loaded.
+int load_pending_images(wad_image_t **images, int count) {
+    pending_load_t *loads = (pending_load_t *)calloc(count + 1, sizeof(pending_load_t));
+    if (!loads) return 0;
+    
+    // Buffers come from the WAD arenas, which are not thread-safe, so they
+    // are handed out before the workers start
+    int num_loads = 0;
+    for (int i = 0; i < count; i++) {
+        wad_image_t *image = images[i];
+        if (!image->pending) continue;
+        image->pending = false;
+        loads[num_loads].image = image;
+        loads[num_loads].inflate = zip_member_reserve(image->wad, image->lump);
+        num_loads++;
     }
+    prepare_color_lookup();
+    parallel_for(num_loads, load_pending_member, loads);
     
-    glutSwapBuffers();
+    wad_image_t **valid = (wad_image_t **)malloc((num_loads + 1) * sizeof(wad_image_t *));
+    int loaded = 0, num_valid = 0;
+    for (int i = 0; i < num_loads; i++) {
+        wad_image_t *image = loads[i].image;
+        import_image_t *decoded = &loads[i].decoded;
+        if (image->is_valid) {
+            if (decoded->indexes && decoded->width == image->width && decoded->height == image->height) {
+                image->indexed = indexed_from_columns(decoded, &image->wad->arena);
+            }
+            if (valid) valid[num_valid++] = image;
+            else create_texture_from_image(image);
+            char label[64];
+            sprintf(label, "%s (%dx%d)", image->name, image->width, image->height);
+            text_layout_build_in(&image->label, label, &image->wad->arena);
+        }
+        import_image_free(decoded);
+        if (image->data) loaded++;
+    }
+    if (valid) create_textures(valid, num_valid);
+    free(valid);
+    free(loads);
+    return loaded;
 }
 
-void reshape(int w, int h) {
-    window_width = w;
-    window_height = h;
-    glViewport(0, 0, w, h);
-    
-    // Recalculate images per page
-    images_per_page = images_per_row * ((window_height - 50) / (image_size + image_padding));
-    if (images_per_page <= 0) images_per_page = 1;
+// Bounds-checked pointer to a lump's data by directory index. PK3
+// members are inflated on first use.
+const unsigned char *wad_lump_data(wad_file_t *wad, int index, int *size) {
+    const wad_directory_t *entry = &wad->directory[index];
+    if (wad->zip_entries) {
+        const unsigned char *data = zip_member_data(wad, index);
+        *size = data ? entry->size : 0;
+        return data;
+    }
+    if (entry->file_pos < 0 || entry->size < 0 ||
+        (size_t)entry->file_pos + entry->size > wad->map.size) {
+        *size = 0;
+        return NULL;
+    }
+    *size = entry->size;
+    return wad->map.data + entry->file_pos;
 }
 
-void keyboard(unsigned char key, int x, int y) {
-    if (show_file_selector) {
-        switch (key) {
-            case 27: // Esc
-                show_file_selector = false;
-                break;
-                
-            case 13: // Enter
-                if (num_available_wads > 0) {
-                    load_wad_file(available_wads[selected_wad_index]);
-                    show_file_selector = false;
+// Bucket every linedef into the uniform grid cells its bounding box touches.
+// Cells are 128 map units like the engine's BLOCKMAP, stored as one CSR
+// array (cell_start/cell_lines) so a lookup is two reads.
+void build_map_grid(map_data_t *map) {
+    map_grid_t *grid = &map->grid;
+    grid->cell_size = MAP_GRID_CELL;
+    grid->origin_x = map->min_x;
+    grid->origin_y = map->min_y;
+    grid->cols = (int)((map->max_x - map->min_x) / grid->cell_size) + 1;
+    grid->rows = (int)((map->max_y - map->min_y) / grid->cell_size) + 1;
+    
+    int num_cells = grid->cols * grid->rows;
+    grid->cell_start = (int *)arena_calloc(&map->wad->arena, (num_cells + 1) * sizeof(int));
+    if (!grid->cell_start) return;
+    
+    // Two passes: count per cell, then fill
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < map->num_linedefs; i++) {
+            float x1 = map->vertex_x[map->line_v1[i]], y1 = map->vertex_y[map->line_v1[i]];
+            float x2 = map->vertex_x[map->line_v2[i]], y2 = map->vertex_y[map->line_v2[i]];
+            int cx1 = (int)((fminf(x1, x2) - grid->origin_x) / grid->cell_size);
+            int cx2 = (int)((fmaxf(x1, x2) - grid->origin_x) / grid->cell_size);
+            int cy1 = (int)((fminf(y1, y2) - grid->origin_y) / grid->cell_size);
+            int cy2 = (int)((fmaxf(y1, y2) - grid->origin_y) / grid->cell_size);
+            
+            for (int cy = cy1; cy <= cy2; cy++) {
+                for (int cx = cx1; cx <= cx2; cx++) {
+                    int cell = cy * grid->cols + cx;
+                    if (pass == 0) {
+                        grid->cell_start[cell + 1]++;
+                    } else {
+                        grid->cell_lines[grid->cell_fill[cell]++] = i;
+                    }
                 }
-                break;
+            }
         }
-    } else if (show_help) {
-        // Any key closes help
-        show_help = false;
-    } else {
-        switch (key) {
-            case 27: // Esc key
-                exit(0);
+        
+        if (pass == 0) {
+            for (int c = 0; c < num_cells; c++) {
+                grid->cell_start[c + 1] += grid->cell_start[c];
+            }
+            grid->cell_lines = (int *)arena_alloc(&map->wad->arena, (grid->cell_start[num_cells] + 1) * sizeof(int));
+            grid->cell_fill = (int *)malloc(num_cells * sizeof(int));
+            if (!grid->cell_lines || !grid->cell_fill) {
+                free(grid->cell_fill);
+                grid->cell_lines = grid->cell_fill = NULL;
+                return;
+            }
+            memcpy(grid->cell_fill, grid->cell_start, num_cells * sizeof(int));
+        }
+    }
+    
+    free(grid->cell_fill);
+    grid->cell_fill = NULL;
+}
+
+// Parse the lumps following a map marker into struct-of-arrays map data.
+// Handles both DOOM and Hexen (BEHAVIOR) binary layouts; UDMF TEXTMAP maps
+// are not parsed. Returns NULL if the map has no usable geometry.
+map_data_t *parse_map(wad_file_t *wad, int marker_index) {
+    const unsigned char *lumps[NUM_MAP_LUMPS] = {0};
+    int sizes[NUM_MAP_LUMPS] = {0};
+    bool hexen = false;
+    
+    for (int i = marker_index + 1; i < wad->header.num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        if (!is_map_data_lump(name)) break;
+        
+        int slot = -1;
+        if (strcmp(name, "THINGS") == 0) slot = MAP_LUMP_THINGS;
+        else if (strcmp(name, "LINEDEFS") == 0) slot = MAP_LUMP_LINEDEFS;
+        else if (strcmp(name, "SIDEDEFS") == 0) slot = MAP_LUMP_SIDEDEFS;
+        else if (strcmp(name, "VERTEXES") == 0) slot = MAP_LUMP_VERTEXES;
+        else if (strcmp(name, "SECTORS") == 0) slot = MAP_LUMP_SECTORS;
+        else if (strcmp(name, "BEHAVIOR") == 0) hexen = true;
+        
+        if (slot >= 0) lumps[slot] = wad_lump_data(wad, i, &sizes[slot]);
+    }
+    
+    if (!lumps[MAP_LUMP_VERTEXES] || !lumps[MAP_LUMP_LINEDEFS]) return NULL;
+    
+    arena_t *arena = &wad->arena;
+    map_data_t *map = (map_data_t *)arena_calloc(arena, sizeof(map_data_t));
+    if (!map) return NULL;
+    strncpy(map->name, wad->directory[marker_index].name, 8);
+    map->wad = wad;
+    map->hexen_format = hexen;
+    
+    // Vertices: two 16-bit coordinates
+    map->num_vertices = sizes[MAP_LUMP_VERTEXES] / 4;
+    map->vertex_x = (float *)arena_alloc(arena, (map->num_vertices + 1) * sizeof(float));
+    map->vertex_y = (float *)arena_alloc(arena, (map->num_vertices + 1) * sizeof(float));
+    
+    // Linedefs: 14 bytes (DOOM) or 16 bytes (Hexen)
+    int line_size = hexen ? 16 : 14;
+    map->num_linedefs = sizes[MAP_LUMP_LINEDEFS] / line_size;
+    map->line_v1 = (int *)arena_alloc(arena, (map->num_linedefs + 1) * sizeof(int));
+    map->line_v2 = (int *)arena_alloc(arena, (map->num_linedefs + 1) * sizeof(int));
+    map->line_flags = (unsigned short *)arena_alloc(arena, (map->num_linedefs + 1) * sizeof(unsigned short));
+    map->line_special = (unsigned short *)arena_alloc(arena, (map->num_linedefs + 1) * sizeof(unsigned short));
+    map->line_front_sector = (int *)arena_alloc(arena, (map->num_linedefs + 1) * sizeof(int));
+    map->line_back_sector = (int *)arena_alloc(arena, (map->num_linedefs + 1) * sizeof(int));
+    
+    // Sectors: floor and ceiling heights are all the automap needs
+    map->num_sectors = sizes[MAP_LUMP_SECTORS] / 26;
+    map->sector_floor = (short *)arena_alloc(arena, (map->num_sectors + 1) * sizeof(short));
+    map->sector_ceiling = (short *)arena_alloc(arena, (map->num_sectors + 1) * sizeof(short));
+    
+    // Things: 10 bytes (DOOM) or 20 bytes (Hexen)
+    int thing_size = hexen ? 20 : 10;
+    map->num_things = sizes[MAP_LUMP_THINGS] / thing_size;
+    map->thing_x = (float *)arena_alloc(arena, (map->num_things + 1) * sizeof(float));
+    map->thing_y = (float *)arena_alloc(arena, (map->num_things + 1) * sizeof(float));
+    map->thing_type = (unsigned short *)arena_alloc(arena, (map->num_things + 1) * sizeof(unsigned short));
+    map->thing_angle = (unsigned short *)arena_alloc(arena, (map->num_things + 1) * sizeof(unsigned short));
+    
+    if (!map->vertex_x || !map->vertex_y || !map->line_v1 || !map->line_v2 || !map->line_flags ||
+        !map->line_special || !map->line_front_sector || !map->line_back_sector ||
+        !map->sector_floor || !map->sector_ceiling || !map->thing_x || !map->thing_y ||
+        !map->thing_type || !map->thing_angle || map->num_vertices == 0) {
+        return NULL;
+    }
+    
+    const unsigned char *p = lumps[MAP_LUMP_VERTEXES];
+    map->min_x = map->min_y = 1e9f;
+    map->max_x = map->max_y = -1e9f;
+    for (int i = 0; i < map->num_vertices; i++, p += 4) {
+        map->vertex_x[i] = read_le16(p);
+        map->vertex_y[i] = read_le16(p + 2);
+        map->min_x = fminf(map->min_x, map->vertex_x[i]);
+        map->max_x = fmaxf(map->max_x, map->vertex_x[i]);
+        map->min_y = fminf(map->min_y, map->vertex_y[i]);
+        map->max_y = fmaxf(map->max_y, map->vertex_y[i]);
+    }
+    
+    p = lumps[MAP_LUMP_SECTORS];
+    for (int i = 0; i < map->num_sectors; i++, p += 26) {
+        map->sector_floor[i] = read_le16(p);
+        map->sector_ceiling[i] = read_le16(p + 2);
+    }
+    
+    // Sidedefs are only needed to find each line's sectors
+    const unsigned char *sides = lumps[MAP_LUMP_SIDEDEFS];
+    int num_sides = sizes[MAP_LUMP_SIDEDEFS] / 30;
+    
+    p = lumps[MAP_LUMP_LINEDEFS];
+    int valid_lines = 0;
+    for (int i = 0; i < map->num_linedefs; i++, p += line_size) {
+        int v1 = read_le16u(p);
+        int v2 = read_le16u(p + 2);
+        if (v1 >= map->num_vertices || v2 >= map->num_vertices) continue;   // Broken line
+        
+        int side_offset = hexen ? 12 : 10;
+        unsigned int front = read_le16u(p + side_offset);
+        unsigned int back = read_le16u(p + side_offset + 2);
+        
+        map->line_v1[valid_lines] = v1;
+        map->line_v2[valid_lines] = v2;
+        map->line_flags[valid_lines] = read_le16u(p + 4);
+        map->line_special[valid_lines] = hexen ? p[6] : read_le16u(p + 6);
+        map->line_front_sector[valid_lines] = (front < (unsigned)num_sides) ? read_le16(sides + front * 30 + 28) : -1;
+        map->line_back_sector[valid_lines] = (back < (unsigned)num_sides) ? read_le16(sides + back * 30 + 28) : -1;
+        if (map->line_front_sector[valid_lines] >= map->num_sectors) map->line_front_sector[valid_lines] = -1;
+        if (map->line_back_sector[valid_lines] >= map->num_sectors) map->line_back_sector[valid_lines] = -1;
+        valid_lines++;
+    }
+    map->num_linedefs = valid_lines;
+    
+    p = lumps[MAP_LUMP_THINGS];
+    for (int i = 0; i < map->num_things; i++, p += thing_size) {
+        if (hexen) {
+            map->thing_x[i] = read_le16(p + 2);
+            map->thing_y[i] = read_le16(p + 4);
+            map->thing_angle[i] = read_le16u(p + 8);
+            map->thing_type[i] = read_le16u(p + 10);
+        } else {
+            map->thing_x[i] = read_le16(p);
+            map->thing_y[i] = read_le16(p + 2);
+            map->thing_angle[i] = read_le16u(p + 4);
+            map->thing_type[i] = read_le16u(p + 6);
+        }
+    }
+    
+    build_map_grid(map);
+    return map;
+}
+
+// Parse every map in a WAD
+void wad_index_maps(wad_file_t *wad) {
+    int count = 0;
+    for (int i = 0; i < wad->header.num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        if (is_map_marker(name)) count++;
+    }
+    
+    wad->maps = (map_data_t **)arena_calloc(&wad->arena, (count + 1) * sizeof(map_data_t *));
+    wad->num_maps = 0;
+    if (!wad->maps) return;
+    
+    for (int i = 0; i < wad->header.num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        if (!is_map_marker(name)) continue;
+        
+        map_data_t *map = parse_map(wad, i);
+        if (map) wad->maps[wad->num_maps++] = map;
+    }
+}
+
+// Blend one anti-aliased pixel into an 8-bit coverage buffer. Overlapping
+// lines keep the brighter value rather than saturating.
+static void plot_coverage(unsigned char *buffer, int size, int x, int y, float coverage) {
+    if (x < 0 || y < 0 || x >= size || y >= size) return;
+    int value = (int)(coverage * 255.0f + 0.5f);
+    if (value > buffer[y * size + x]) buffer[y * size + x] = value;
+}
+
+static float fpart(float x) {
+    return x - floorf(x);
+}
+
+// Xiaolin Wu's line: two pixels per step along the major axis, weighted by
+// distance from the ideal line. Intensity scales the whole line.
+void draw_line_aa(unsigned char *buffer, int size, float x0, float y0, float x1, float y1, float intensity) {
+    bool steep = fabsf(y1 - y0) > fabsf(x1 - x0);
+    float t;
+    if (steep) {
+        t = x0; x0 = y0; y0 = t;
+        t = x1; x1 = y1; y1 = t;
+    }
+    if (x0 > x1) {
+        t = x0; x0 = x1; x1 = t;
+        t = y0; y0 = y1; y1 = t;
+    }
+    
+    float dx = x1 - x0;
+    float gradient = dx > 0.0001f ? (y1 - y0) / dx : 1.0f;
+    
+    int start = (int)floorf(x0 + 0.5f);
+    int end = (int)floorf(x1 + 0.5f);
+    float y = y0 + gradient * (start - x0);
+    
+    for (int x = start; x <= end; x++, y += gradient) {
+        int iy = (int)floorf(y);
+        float f = fpart(y);
+        if (steep) {
+            plot_coverage(buffer, size, iy, x, (1.0f - f) * intensity);
+            plot_coverage(buffer, size, iy + 1, x, f * intensity);
+        } else {
+            plot_coverage(buffer, size, x, iy, (1.0f - f) * intensity);
+            plot_coverage(buffer, size, x, iy + 1, f * intensity);
+        }
+    }
+}
+
+// Rasterize one map's linedefs into its preview buffer. Walls are drawn at
+// full intensity and two-sided lines dimmer, like the automap. Touches only
+// this map's data, so previews can be built on worker threads.
+static void render_map_preview(void *context, int index) {
+    map_data_t *map = ((wad_file_t *)context)->maps[index];
+    if (!map->preview) return;
+    
+    // Fit the map into the square with a small margin, keeping its aspect ratio
+    float margin = 4.0f;
+    float span = fmaxf(map->max_x - map->min_x, map->max_y - map->min_y);
+    float scale = (MAP_PREVIEW_SIZE - 1 - 2 * margin) / fmaxf(span, 1.0f);
+    float offset_x = margin + ((MAP_PREVIEW_SIZE - 1 - 2 * margin) - (map->max_x - map->min_x) * scale) / 2;
+    float offset_y = margin + ((MAP_PREVIEW_SIZE - 1 - 2 * margin) - (map->max_y - map->min_y) * scale) / 2;
+    
+    for (int i = 0; i < map->num_linedefs; i++) {
+        bool two_sided = map->line_front_sector[i] >= 0 && map->line_back_sector[i] >= 0;
+        float x0 = offset_x + (map->vertex_x[map->line_v1[i]] - map->min_x) * scale;
+        float x1 = offset_x + (map->vertex_x[map->line_v2[i]] - map->min_x) * scale;
+        
+        // Map Y grows north, image rows grow down
+        float y0 = MAP_PREVIEW_SIZE - 1 - (offset_y + (map->vertex_y[map->line_v1[i]] - map->min_y) * scale);
+        float y1 = MAP_PREVIEW_SIZE - 1 - (offset_y + (map->vertex_y[map->line_v2[i]] - map->min_y) * scale);
+        
+        draw_line_aa(map->preview, MAP_PREVIEW_SIZE, x0, y0, x1, y1, two_sided ? 0.45f : 1.0f);
+    }
+}
+
+// Add a line-art preview image for every map in a WAD. The rasterizing runs
+// one map per worker; only the texture upload happens on this thread.
+void wad_build_map_previews(wad_file_t *wad) {
+    if (wad->num_maps == 0) return;
+    
+    // The arena isn't shared between threads, so buffers come first
+    for (int m = 0; m < wad->num_maps; m++) {
+        wad->maps[m]->preview = (unsigned char *)arena_calloc(&wad->arena, MAP_PREVIEW_SIZE * MAP_PREVIEW_SIZE);
+    }
+    parallel_for(wad->num_maps, render_map_preview, wad);
+    
+    for (int m = 0; m < wad->num_maps && wad->num_images < wad->image_capacity; m++) {
+        map_data_t *map = wad->maps[m];
+        if (!map->preview) continue;
+        
+        wad_image_t *image = &wad->images[wad->num_images];
+        memset(image, 0, sizeof(*image));
+        strcpy(image->name, map->name);
+        strcpy(image->ns, "MAP");
+        image->wad = wad;
+        image->format = IMAGE_FORMAT_MAP;
+        image->data = map->preview;
+        image->width = MAP_PREVIEW_SIZE;
+        image->height = MAP_PREVIEW_SIZE;
+        image->size = MAP_PREVIEW_SIZE * MAP_PREVIEW_SIZE;
+        image->is_valid = true;
+        create_texture_from_image(image);
+        
+        char label[64];
+        sprintf(label, "%s (%d lines)", map->name, map->num_linedefs);
+        text_layout_build_in(&image->label, label, &wad->arena);
+        
+        wad->num_images++;
+    }
+}
+
+// Merged list of maps over the stack; a later map with the same name overrides
+void rebuild_map_view() {
+    num_all_maps = 0;
+    for (int w = 0; w < num_wads; w++) {
+        num_all_maps += wad_stack[w]->num_maps;
+    }
+    
+    all_maps = (map_data_t **)arena_alloc(&view_arena, (num_all_maps + 1) * sizeof(map_data_t *));
+    if (!all_maps) {
+        num_all_maps = 0;
+        return;
+    }
+    
+    int index = 0;
+    for (int w = 0; w < num_wads; w++) {
+        for (int m = 0; m < wad_stack[w]->num_maps; m++) {
+            all_maps[index++] = wad_stack[w]->maps[m];
+        }
+    }
+    
+    for (int i = 0; i < num_all_maps; i++) {
+        all_maps[i]->overridden = false;
+        for (int j = i + 1; j < num_all_maps; j++) {
+            if (strcmp(all_maps[i]->name, all_maps[j]->name) == 0) {
+                all_maps[i]->overridden = true;
                 break;
-                
-            case 'h':
-            case 'H':
-                show_help = true;
+            }
+        }
+    }
+    
+    if (automap_index >= num_all_maps) automap_index = 0;
+}
+
+// Pick the palette for the current stack: an external playpal.lmp always
+// wins, otherwise the topmost WAD with a PLAYPAL, otherwise grayscale.
+// Returns true if the palette changed.
+bool update_stack_palette() {
+    if (external_palette) return false;
+    
+    unsigned char new_palette[256][3];
+    bool found = false;
+    
+    for (int w = num_wads - 1; w >= 0 && !found; w--) {
+        int size = 0;
+        const unsigned char *playpal = wad_find_lump(wad_stack[w], "PLAYPAL", &size);
+        if (playpal && size >= (int)sizeof(new_palette)) {
+            // PLAYPAL contains multiple palettes (usually 14). We just need the first one.
+            memcpy(new_palette, playpal, sizeof(new_palette));
+            found = true;
+        }
+    }
+    
+    if (!found) {
+        for (int i = 0; i < 256; i++) {
+            new_palette[i][0] = i;
+            new_palette[i][1] = i;
+            new_palette[i][2] = i;
+        }
+    }
+    palette_loaded = found;
+    
+    if (memcmp(new_palette, doom_palette, sizeof(new_palette)) == 0) return false;
+    memcpy(doom_palette, new_palette, sizeof(new_palette));
+    return true;
+}
+
+// FNV-1a over namespace and name; directory names need not be terminated
+static unsigned int hash_lump_key(const char *ns, const char *name) {
+    unsigned int hash = 2166136261u;
+    for (const char *c = ns; *c; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+    hash = (hash ^ '/') * 16777619u;
+    for (int i = 0; i < 8 && name[i]; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
+
+static const char *stack_lump_ns(const stack_lump_t *entry) {
+    return entry->wad->lump_ns ? entry->wad->lump_ns[entry->lump] : "";
+}
+
+// The lump the engine would use for a name in a namespace, or NULL
+const stack_lump_t *stack_find_lump(const char *ns, const char *name) {
+    if (!stack_lump_slots) return NULL;
+    unsigned int slot = hash_lump_key(ns, name) & stack_lump_slot_mask;
+    for (; stack_lump_slots[slot] >= 0; slot = (slot + 1) & stack_lump_slot_mask) {
+        const stack_lump_t *entry = &stack_lumps[stack_lump_slots[slot]];
+        if (strncmp(entry->wad->directory[entry->lump].name, name, 8) == 0 && strcmp(stack_lump_ns(entry), ns) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Merged directory of the whole stack. Walking from the top down, the
+// first lump seen with a name in a namespace wins and every other one is
+// overridden. Empty lumps are namespace markers and take no part, except
+// map markers, which stand for their map.
+static bool build_stack_lumps() {
+    num_stack_lumps = 0;
+    for (int w = 0; w < num_wads; w++) num_stack_lumps += wad_stack[w]->header.num_lumps;
+    
+    int table_size = 16;
+    while (table_size < num_stack_lumps * 2) table_size <<= 1;
+    stack_lumps = (stack_lump_t *)arena_alloc(&view_arena, (num_stack_lumps + 1) * sizeof(stack_lump_t));
+    stack_lump_slots = (int *)arena_alloc(&view_arena, table_size * sizeof(int));
+    if (!stack_lumps || !stack_lump_slots) {
+        stack_lump_slots = NULL;
+        num_stack_lumps = 0;
+        return false;
+    }
+    stack_lump_slot_mask = table_size - 1;
+    memset(stack_lump_slots, 0xFF, table_size * sizeof(int));
+    
+    int index = 0;
+    for (int w = 0; w < num_wads; w++) {
+        for (int i = 0; i < wad_stack[w]->header.num_lumps; i++) {
+            stack_lumps[index].wad = wad_stack[w];
+            stack_lumps[index].lump = i;
+            stack_lumps[index].overridden = false;
+            index++;
+        }
+    }
+    
+    overridden_count = 0;
+    for (int i = num_stack_lumps - 1; i >= 0; i--) {
+        stack_lump_t *entry = &stack_lumps[i];
+        const char *name = entry->wad->directory[entry->lump].name;
+        char clean_name[9] = {0};
+        memcpy(clean_name, name, 8);
+        if (entry->wad->directory[entry->lump].size <= 0 && !is_map_marker(clean_name)) continue;
+        
+        const char *ns = stack_lump_ns(entry);
+        unsigned int slot = hash_lump_key(ns, name) & stack_lump_slot_mask;
+        for (; stack_lump_slots[slot] >= 0; slot = (slot + 1) & stack_lump_slot_mask) {
+            const stack_lump_t *winner = &stack_lumps[stack_lump_slots[slot]];
+            if (strncmp(winner->wad->directory[winner->lump].name, name, 8) == 0 && strcmp(stack_lump_ns(winner), ns) == 0) {
+                entry->overridden = true;
+                overridden_count++;
                 break;
+            }
+        }
+        if (!entry->overridden) stack_lump_slots[slot] = i;
+    }
+    return true;
+}
 
-                case '8':
-                case '*':
-                    show_folder_selector = true;
-                    selected_input_field = 0;  // Reset to first input field
-                    strcpy(input_png_folder, "");  // Clear previous inputs
-                    strcpy(wad_output_name, "");
-                    strcpy(output_wad_folder, "");
+// Build the merged grid over the whole stack. Images are flagged as
+// overridden from the merged directory, where, like the engine, the last
+// definition of a name in a namespace wins: later WADs override earlier
+// ones, and later lumps override earlier lumps in the same WAD. Sprites,
+// flats and map data have their own namespaces. This only walks metadata;
+// nothing is decoded.
+void rebuild_lump_view() {
+    total_images = 0;
+    for (int w = 0; w < num_wads; w++) {
+        total_images += wad_stack[w]->num_images;
+    }
+    
+    // The previous view goes in one reset; nothing here is freed alone
+    arena_reset(&view_arena);
+    size_t count = total_images + 1;
+    grid_images = (wad_image_t **)arena_alloc(&view_arena, count * sizeof(wad_image_t *));
+    grid_names = (uint64_t *)arena_alloc(&view_arena, count * sizeof(uint64_t));
+    grid_width = (int *)arena_alloc(&view_arena, count * sizeof(int));
+    grid_height = (int *)arena_alloc(&view_arena, count * sizeof(int));
+    grid_format = (unsigned char *)arena_alloc(&view_arena, count);
+    grid_flags = (unsigned char *)arena_alloc(&view_arena, count);
+    grid_textures = (GLuint *)arena_alloc(&view_arena, count * sizeof(GLuint));
+    grid_keep = (unsigned char *)arena_alloc(&view_arena, count);
+    grid_diff = (unsigned char *)arena_calloc(&view_arena, count);
+    grid_similar = (unsigned char *)arena_calloc(&view_arena, count);
+    shown_images = (int *)arena_alloc(&view_arena, count * sizeof(int));
+    
+    if (!grid_images || !grid_names || !grid_width || !grid_height || !grid_format ||
+        !grid_flags || !grid_textures || !grid_keep || !grid_diff || !grid_similar || !shown_images ||
+        !build_stack_lumps()) {
+        total_images = 0;
+        num_shown_images = 0;
+        return;
+    }
+    
+    int index = 0;
+    for (int w = 0; w < num_wads; w++) {
+        for (int i = 0; i < wad_stack[w]->num_images; i++) {
+            grid_images[index] = &wad_stack[w]->images[i];
+            grid_names[index] = pack_lump_name(wad_stack[w]->images[i].name);
+            index++;
+        }
+    }
+    
+    // An image is overridden when its lump lost; a map preview stands for
+    // its marker, which has no namespace of its own
+    for (int i = 0; i < total_images; i++) {
+        wad_image_t *image = grid_images[i];
+        if (image->format == IMAGE_FORMAT_MAP) {
+            const stack_lump_t *winner = stack_find_lump("", image->name);
+            image->overridden = winner && winner->wad != image->wad;
+        } else {
+            const stack_lump_t *winner = stack_find_lump(image->ns, image->name);
+            image->overridden = winner && (winner->wad != image->wad || winner->lump != image->lump);
+        }
+    }
+    
+    for (int i = 0; i < total_images; i++) {
+        wad_image_t *image = grid_images[i];
+        grid_width[i] = image->width;
+        grid_height[i] = image->height;
+        grid_format[i] = image->format;
+        grid_flags[i] = (image->is_valid ? GRID_VALID : 0) | (image->overridden ? GRID_OVERRIDDEN : 0);
+        grid_textures[i] = image->texture_id;
+    }
+}
+
+// A sprite lump name is PPPPFR or PPPPFRFR: a 4-letter prefix, a frame
+// letter (A and up) and a rotation digit (0 for all angles, 1-8 otherwise).
+// The optional second pair names the rotation drawn mirrored.
+static bool parse_sprite_name(const char *name, int *frame1, int *rot1, int *frame2, int *rot2) {
+    size_t length = strlen(name);
+    if (length != 6 && length != 8) return false;
+    
+    *frame1 = name[4] - 'A';
+    *rot1 = name[5] - '0';
+    if (*frame1 < 0 || *frame1 >= MAX_SPRITE_FRAMES || *rot1 < 0 || *rot1 > 8) return false;
+    
+    *frame2 = *rot2 = -1;
+    if (length == 8) {
+        *frame2 = name[6] - 'A';
+        *rot2 = name[7] - '0';
+        if (*frame2 < 0 || *frame2 >= MAX_SPRITE_FRAMES || *rot2 < 0 || *rot2 > 8) return false;
+    }
+    return true;
+}
+
+static int compare_image_names(const void *a, const void *b) {
+    return strcmp((*(wad_image_t * const *)a)->name, (*(wad_image_t * const *)b)->name);
+}
+
+static void free_sprite_groups() {
+    for (int g = 0; g < num_sprite_groups; g++) {
+        if (sprite_groups[g].atlas > 0) glDeleteTextures(1, &sprite_groups[g].atlas);
+    }
+    free(sprite_groups);
+    sprite_groups = NULL;
+    num_sprite_groups = 0;
+}
+
+// Group the visible sprite lumps by prefix using only their names and
+// namespace; nothing is decoded until a group's atlas is needed.
+void rebuild_sprite_groups() {
+    free_sprite_groups();
+    show_animation = false;
+    
+    wad_image_t **sprites = (wad_image_t **)malloc((total_images > 0 ? total_images : 1) * sizeof(wad_image_t *));
+    if (!sprites) return;
+    
+    int count = 0;
+    for (int i = 0; i < total_images; i++) {
+        int f1, r1, f2, r2;
+        if (strcmp(grid_images[i]->ns, "S") == 0 && !grid_images[i]->overridden &&
+            parse_sprite_name(grid_images[i]->name, &f1, &r1, &f2, &r2)) {
+            sprites[count++] = grid_images[i];
+        }
+    }
+    qsort(sprites, count, sizeof(wad_image_t *), compare_image_names);
+    
+    // Sorted names put each prefix in one run
+    sprite_groups = (sprite_group_t *)calloc(count > 0 ? count : 1, sizeof(sprite_group_t));
+    if (!sprite_groups) {
+        free(sprites);
+        return;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        sprite_group_t *group = num_sprite_groups > 0 ? &sprite_groups[num_sprite_groups - 1] : NULL;
+        if (!group || strncmp(group->prefix, sprites[i]->name, 4) != 0) {
+            group = &sprite_groups[num_sprite_groups++];
+            memcpy(group->prefix, sprites[i]->name, 4);     // calloc left prefix[4] at zero
+        }
+        
+        int f1, r1, f2, r2;
+        parse_sprite_name(sprites[i]->name, &f1, &r1, &f2, &r2);
+        
+        group->frames[f1].rotations[r1].image = sprites[i];
+        group->frames[f1].rotations[r1].flipped = false;
+        if (f2 >= 0) {
+            group->frames[f2].rotations[r2].image = sprites[i];
+            group->frames[f2].rotations[r2].flipped = true;
+        }
+    }
+    
+    // Frame order for playback: every letter that has at least one view
+    for (int g = 0; g < num_sprite_groups; g++) {
+        sprite_group_t *group = &sprite_groups[g];
+        for (int f = 0; f < MAX_SPRITE_FRAMES; f++) {
+            for (int r = 0; r <= 8; r++) {
+                if (group->frames[f].rotations[r].image) {
+                    group->frame_order[group->num_frames++] = f;
                     break;
-                
-            case 'l':
-            case 'L':
-                show_file_selector = true;
-                selected_wad_index = 0;  // Reset selection
-                break;
-                
-            case 'r':
-            case 'R':
-                find_available_wads();
-                break;
-                
-            case '+':
-            case '=':
-                image_size += 16;
-                if (image_size > 256) image_size = 256;
-                break;
-                
-            case '-':
-            case '_':
-                image_size -= 16;
-                if (image_size < 32) image_size = 32;
+                }
+            }
+        }
+    }
+    
+    free(sprites);
+}
+
+sprite_group_t *find_sprite_group(const char *name) {
+    for (int g = 0; g < num_sprite_groups; g++) {
+        if (strncmp(sprite_groups[g].prefix, name, 4) == 0) return &sprite_groups[g];
+    }
+    return NULL;
+}
+
+// The view of a frame for a rotation: the exact rotation if present,
+// otherwise the all-angles view
+sprite_view_t *sprite_frame_view(sprite_group_t *group, int frame, int rotation) {
+    sprite_view_t *view = &group->frames[frame].rotations[rotation];
+    if (view->image) return view;
+    view = &group->frames[frame].rotations[0];
+    if (view->image) return view;
+    
+    // Some frames only have a subset of rotations; take any of them
+    for (int r = 1; r <= 8; r++) {
+        if (group->frames[frame].rotations[r].image) return &group->frames[frame].rotations[r];
+    }
+    return NULL;
+}
+
+// Pack every distinct lump of a group into one texture, left to right in
+// shelves, and record each view's UV rectangle. Mirrored views share their
+// lump's cell with the U coordinates swapped.
+bool build_sprite_atlas(sprite_group_t *group) {
+    if (group->atlas_ready) return group->atlas > 0;
+    group->atlas_ready = true;
+    
+    // PK3 frames are read in one batch before they are measured
+    wad_image_t *pending[MAX_SPRITE_FRAMES * 9];
+    int num_pending = 0;
+    for (int f = 0; f < MAX_SPRITE_FRAMES; f++) {
+        for (int r = 0; r <= 8; r++) {
+            wad_image_t *image = group->frames[f].rotations[r].image;
+            if (image && image->pending) pending[num_pending++] = image;
+        }
+    }
+    if (num_pending > 0) load_pending_images(pending, num_pending);
+    
+    GLint max_texture_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+    int shelf_limit = max_texture_size > 0 && max_texture_size < SPRITE_ATLAS_WIDTH ? max_texture_size : SPRITE_ATLAS_WIDTH;
+    
+    // Place cells, one per distinct lump (a mirrored pair is one lump)
+    wad_image_t *cells[MAX_SPRITE_FRAMES * 9];
+    int cell_x[MAX_SPRITE_FRAMES * 9], cell_y[MAX_SPRITE_FRAMES * 9];
+    int num_cells = 0;
+    int x = 0, y = 0, shelf_height = 0, atlas_width = 0;
+    
+    for (int f = 0; f < MAX_SPRITE_FRAMES; f++) {
+        for (int r = 0; r <= 8; r++) {
+            wad_image_t *image = group->frames[f].rotations[r].image;
+            if (!image || !image->is_valid) continue;
+            
+            bool placed = false;
+            for (int c = 0; c < num_cells && !placed; c++) {
+                placed = cells[c] == image;
+            }
+            if (placed) continue;
+            
+            if (x + image->width > shelf_limit && x > 0) {
+                x = 0;
+                y += shelf_height;
+                shelf_height = 0;
+            }
+            cells[num_cells] = image;
+            cell_x[num_cells] = x;
+            cell_y[num_cells] = y;
+            num_cells++;
+            
+            x += image->width;
+            if (x > atlas_width) atlas_width = x;
+            if (image->height > shelf_height) shelf_height = image->height;
+        }
+    }
+    int atlas_height = y + shelf_height;
+    if (num_cells == 0 || atlas_width > shelf_limit || atlas_height > shelf_limit) return false;
+    
+    unsigned char *pixels = (unsigned char *)calloc((size_t)atlas_width * atlas_height * 4, 1);
+    if (!pixels) return false;
+    
+    // Expand each lump straight into its cell
+    for (int c = 0; c < num_cells; c++) {
+        indexed_image_t *indexed = image_indexes(cells[c]);
+        if (!indexed) continue;
+        expand_image_rgba(cells[c], indexed, pixels + ((size_t)cell_y[c] * atlas_width + cell_x[c]) * 4, atlas_width);
+    }
+    
+    // UVs for every view, mirrored ones pointing at their source cell
+    for (int f = 0; f < MAX_SPRITE_FRAMES; f++) {
+        for (int r = 0; r <= 8; r++) {
+            sprite_view_t *view = &group->frames[f].rotations[r];
+            if (!view->image) continue;
+            
+            for (int c = 0; c < num_cells; c++) {
+                if (cells[c] != view->image) continue;
+                float u0 = (float)cell_x[c] / atlas_width;
+                float u1 = (float)(cell_x[c] + cells[c]->width) / atlas_width;
+                view->u0 = view->flipped ? u1 : u0;
+                view->u1 = view->flipped ? u0 : u1;
+                view->v0 = (float)cell_y[c] / atlas_height;
+                view->v1 = (float)(cell_y[c] + cells[c]->height) / atlas_height;
                 break;
+            }
+        }
+    }
+    
+    glGenTextures(1, &group->atlas);
+    glBindTexture(GL_TEXTURE_2D, group->atlas);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas_width, atlas_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    free(pixels);
+    
+    group->atlas_width = atlas_width;
+    group->atlas_height = atlas_height;
+    return true;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Check one sprite group's offsets against each other. Frames of one actor
+// should share an anchor: roughly the horizontal middle and near the feet.
+// A frame whose anchor sits far from the group's median, or that has no
+// offsets while its siblings do, is flagged. Writes only to the group's own
+// images, so groups are checked in parallel.
+static void validate_group_offsets(void *context, int index) {
+    sprite_group_t *group = &sprite_groups[index];
+    wad_image_t *images[MAX_SPRITE_FRAMES * 9];
+    int dx[MAX_SPRITE_FRAMES * 9], dy[MAX_SPRITE_FRAMES * 9];
+    int count = 0, with_offsets = 0;
+    
+    for (int f = 0; f < MAX_SPRITE_FRAMES; f++) {
+        for (int r = 0; r <= 8; r++) {
+            wad_image_t *image = group->frames[f].rotations[r].image;
+            if (!image || group->frames[f].rotations[r].flipped ||
+                (image->format != IMAGE_FORMAT_PATCH && image->format != IMAGE_FORMAT_PNG)) continue;
+            
+            bool seen = false;
+            for (int i = 0; i < count && !seen; i++) seen = images[i] == image;
+            if (seen) continue;
+            
+            images[count] = image;
+            dx[count] = image->left_offset - image->width / 2;
+            dy[count] = image->top_offset - image->height;
+            if (image->left_offset != 0 || image->top_offset != 0) with_offsets++;
+            count++;
+        }
+    }
+    if (count == 0) return;
+    
+    int sorted_x[MAX_SPRITE_FRAMES * 9], sorted_y[MAX_SPRITE_FRAMES * 9];
+    memcpy(sorted_x, dx, count * sizeof(int));
+    memcpy(sorted_y, dy, count * sizeof(int));
+    qsort(sorted_x, count, sizeof(int), compare_ints);
+    qsort(sorted_y, count, sizeof(int), compare_ints);
+    int median_x = sorted_x[count / 2], median_y = sorted_y[count / 2];
+    
+    for (int i = 0; i < count; i++) {
+        wad_image_t *image = images[i];
+        image->offset_problem = NULL;
+        
+        if (image->left_offset == 0 && image->top_offset == 0 && with_offsets > count / 2) {
+            image->offset_problem = "no offsets";
+        } else if (image->left_offset < 0 || image->left_offset > image->width) {
+            image->offset_problem = "anchor outside the image";
+        } else if (abs(dx[i] - median_x) > OFFSET_TOLERANCE) {
+            image->offset_problem = "horizontal jump";
+        } else if (abs(dy[i] - median_y) > OFFSET_TOLERANCE) {
+            image->offset_problem = "vertical jump";
+        }
+    }
+}
+
+// Validate every sprite group's offsets and write the outliers to a report
+void validate_sprite_offsets() {
+    double start = now_seconds();
+    
+    // PK3 sprites have to be read before their offsets are known
+    wad_image_t **pending = (wad_image_t **)malloc((total_images + 1) * sizeof(wad_image_t *));
+    if (pending) {
+        int count = 0;
+        for (int i = 0; i < total_images; i++) {
+            if (grid_images[i]->pending && strcmp(grid_images[i]->ns, "S") == 0) pending[count++] = grid_images[i];
+        }
+        if (count > 0) load_pending_images(pending, count);
+        free(pending);
+    }
+    parallel_for(num_sprite_groups, validate_group_offsets, NULL);
+    double elapsed = (now_seconds() - start) * 1000.0;
+    
+    FILE *report = fopen(OFFSET_REPORT_FILENAME, "w");
+    if (report) {
+        fprintf(report, "# sprite offset outliers: group lump left top width height problem\n");
+    }
+    
+    int checked = 0, outliers = 0;
+    for (int i = 0; i < total_images; i++) {
+        wad_image_t *image = grid_images[i];
+        if (strcmp(image->ns, "S") != 0 || image->overridden ||
+            (image->format != IMAGE_FORMAT_PATCH && image->format != IMAGE_FORMAT_PNG)) continue;
+        checked++;
+        if (!image->offset_problem) continue;
+        
+        outliers++;
+        if (report) {
+            fprintf(report, "%.4s\t%s\t%d\t%d\t%d\t%d\t%s\t%s\n", image->name, image->name,
+                    image->left_offset, image->top_offset, image->width, image->height,
+                    image->offset_problem, image->wad->filename);
+        }
+    }
+    if (report) fclose(report);
+    
+    sprintf(status_message, "Offset check: %d sprites in %d groups, %d outliers (%.1f ms)%s",
+            checked, num_sprite_groups, outliers, elapsed,
+            report && outliers > 0 ? " - see " OFFSET_REPORT_FILENAME : "");
+    invalidate_layers();
+}
+
+// Pack a lump name into 8 bytes (uppercase, zero padded) so names can be
+// compared a whole word at a time
+uint64_t pack_lump_name(const char *name) {
+    uint64_t packed = 0;
+    for (int i = 0; i < 8 && name[i]; i++) {
+        packed |= (uint64_t)(unsigned char)toupper((unsigned char)name[i]) << (8 * i);
+    }
+    return packed;
+}
+
+// keep[i] &= names[i] starts with prefix. Two names per SSE2 compare.
+static void scan_name_prefix(const uint64_t *names, int count, uint64_t prefix, uint64_t mask,
+                             unsigned char *keep) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128i prefix_vec = _mm_set1_epi64x((long long)prefix);
+    __m128i mask_vec = _mm_set1_epi64x((long long)mask);
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(names + i)), mask_vec);
+        int equal = _mm_movemask_epi8(_mm_cmpeq_epi32(v, prefix_vec));
+        keep[i] &= (equal & 0x00FF) == 0x00FF;
+        keep[i + 1] &= (equal & 0xFF00) == 0xFF00;
+    }
+#endif
+    for (; i < count; i++) {
+        keep[i] &= (names[i] & mask) == prefix;
+    }
+}
+
+// Match c against a [...] class starting just after the '['.
+// Sets *end to the character after the closing ']'.
+static bool class_match(const char *cls, char c, const char **end) {
+    bool negate = false, found = false;
+    if (*cls == '^' || *cls == '!') {
+        negate = true;
+        cls++;
+    }
+    
+    const char *p = cls;
+    do {
+        if (*p == '\0') break;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            if (c >= p[0] && c <= p[2]) found = true;
+            p += 3;
+        } else {
+            if (c == *p) found = true;
+            p++;
+        }
+    } while (*p != ']');
+    
+    *end = *p ? p + 1 : p;
+    return found != negate;
+}
+
+// Shell-style wildcards: * ? and [...]
+bool glob_match(const char *pattern, const char *text) {
+    while (*pattern) {
+        if (*pattern == '*') {
+            while (*pattern == '*') pattern++;
+            if (!*pattern) return true;
+            for (; *text; text++) {
+                if (glob_match(pattern, text)) return true;
+            }
+            return false;
+        }
+        if (!*text) return false;
+        
+        if (*pattern == '?') {
+            pattern++;
+        } else if (*pattern == '[') {
+            if (!class_match(pattern + 1, *text, &pattern)) return false;
+        } else {
+            if (*pattern != *text) return false;
+            pattern++;
+        }
+        text++;
+    }
+    return *text == '\0';
+}
+
+// Minimal regular expressions, enough for 8-character names: literals,
+// '.', [...] classes, \ escapes, the quantifiers * + ?, and ^ $ anchors.
+static const char *regex_atom_end(const char *re) {
+    if (*re == '\\' && re[1]) return re + 2;
+    if (*re == '[') {
+        const char *end;
+        class_match(re + 1, '\0', &end);
+        return end;
+    }
+    return re + 1;
+}
+
+static bool regex_atom_match(const char *atom, char c) {
+    const char *end;
+    if (*atom == '.') return true;
+    if (*atom == '\\') return atom[1] == c;
+    if (*atom == '[') return class_match(atom + 1, c, &end);
+    return *atom == c;
+}
+
+static bool regex_match_here(const char *re, const char *text) {
+    if (*re == '\0') return true;
+    if (re[0] == '$' && re[1] == '\0') return *text == '\0';
+    
+    const char *next = regex_atom_end(re);
+    if (*next == '*' || *next == '+' || *next == '?') {
+        int min = (*next == '+') ? 1 : 0;
+        int max = (*next == '?') ? 1 : 255;
+        int n = 0;
+        while (text[n] && n < max && regex_atom_match(re, text[n])) n++;
+        
+        // Greedy, backing off one character at a time
+        for (; n >= min; n--) {
+            if (regex_match_here(next + 1, text + n)) return true;
+        }
+        return false;
+    }
+    
+    if (*text && regex_atom_match(re, *text)) return regex_match_here(next, text + 1);
+    return false;
+}
+
+bool regex_match(const char *re, const char *text) {
+    if (*re == '^') return regex_match_here(re + 1, text);
+    do {
+        if (regex_match_here(re, text)) return true;
+    } while (*text++);
+    return false;
+}
+
+// Parse the search box into a query. Terms are separated by spaces and
+// must all match:
+//   TROO        name prefix            TROO*A?   glob
+//   /^TROO.1$/  regular expression     64x64     exact size
+//   w>=64 h<32  width/height bounds    type:flat detected format (patch, flat, raw, map)
+void parse_lump_query(const char *text, lump_query_t *query) {
+    memset(query, 0, sizeof(*query));
+    query->max_width = query->max_height = INT_MAX;
+    query->format = -1;
+    
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", text);
+    for (char *c = buffer; *c; c++) *c = toupper((unsigned char)*c);
+    
+    for (char *term = strtok(buffer, " "); term; term = strtok(NULL, " ")) {
+        int w, h, value;
+        char dim, op[3] = {0};
+        
+        if (strncmp(term, "TYPE:", 5) == 0) {
+            if (strcmp(term + 5, "PATCH") == 0) query->format = IMAGE_FORMAT_PATCH;
+            else if (strcmp(term + 5, "FLAT") == 0) query->format = IMAGE_FORMAT_FLAT;
+            else if (strcmp(term + 5, "RAW") == 0) query->format = IMAGE_FORMAT_RAW;
+            else if (strcmp(term + 5, "MAP") == 0) query->format = IMAGE_FORMAT_MAP;
+            else if (strcmp(term + 5, "PNG") == 0) query->format = IMAGE_FORMAT_PNG;
+        } else if (sscanf(term, "%dX%d", &w, &h) == 2 && strspn(term, "0123456789X") == strlen(term)) {
+            query->min_width = query->max_width = w;
+            query->min_height = query->max_height = h;
+        } else if ((term[0] == 'W' || term[0] == 'H') &&
+                   sscanf(term, "%c%2[<>=]%d", &dim, op, &value) == 3) {
+            int *min = (dim == 'W') ? &query->min_width : &query->min_height;
+            int *max = (dim == 'W') ? &query->max_width : &query->max_height;
+            if (strcmp(op, ">") == 0) *min = value + 1;
+            else if (strcmp(op, ">=") == 0) *min = value;
+            else if (strcmp(op, "<") == 0) *max = value - 1;
+            else if (strcmp(op, "<=") == 0) *max = value;
+            else *min = *max = value;
+        } else if (query->num_patterns < MAX_QUERY_PATTERNS) {
+            lump_pattern_t *pattern = &query->patterns[query->num_patterns++];
+            
+            if (term[0] == '/') {
+                pattern->kind = PATTERN_REGEX;
+                snprintf(pattern->text, sizeof(pattern->text), "%s", term + 1);
+                int len = strlen(pattern->text);
+                if (len > 0 && pattern->text[len - 1] == '/') pattern->text[len - 1] = '\0';
+            } else if (strpbrk(term, "*?[")) {
+                pattern->kind = PATTERN_GLOB;
+                snprintf(pattern->text, sizeof(pattern->text), "%s", term);
+            } else {
+                pattern->kind = PATTERN_PREFIX;
+                snprintf(pattern->text, sizeof(pattern->text), "%s", term);
+                int len = strlen(term);
+                if (len > 8) {
+                    // Longer than any lump name: can never match
+                    pattern->mask = 0;
+                    pattern->prefix = 1;
+                } else {
+                    pattern->prefix = pack_lump_name(term);
+                    pattern->mask = (len == 8) ? ~(uint64_t)0 : (((uint64_t)1 << (8 * len)) - 1);
+                }
+            }
+        }
+    }
+}
+
+// Narrow the grid to the lumps matching search_query. Prefix terms run as a
+// vector scan over the packed names; the slower terms only look at what is left.
+void apply_lump_filter() {
+    double start_time = now_seconds();
+    lump_query_t query;
+    parse_lump_query(search_query, &query);
+    
+    num_shown_images = 0;
+    if (!shown_images || !grid_keep) return;
+    
+    unsigned char *keep = grid_keep;
+    memset(keep, 1, total_images);
+    
+    for (int p = 0; p < query.num_patterns; p++) {
+        if (query.patterns[p].kind == PATTERN_PREFIX) {
+            scan_name_prefix(grid_names, total_images, query.patterns[p].prefix, query.patterns[p].mask, keep);
+        }
+    }
+    
+    for (int i = 0; i < total_images; i++) {
+        if (!keep[i]) continue;
+        
+        if (grid_width[i] < query.min_width || grid_width[i] > query.max_width ||
+            grid_height[i] < query.min_height || grid_height[i] > query.max_height) continue;
+        if (query.format >= 0 && grid_format[i] != query.format) continue;
+        if (diff_mode && grid_diff[i] == DIFF_SAME) continue;
+        if (similar_image && !grid_similar[i]) continue;
+        
+        bool matched = true;
+        if (query.num_patterns > 0) {
+            char name[9];
+            memcpy(name, &grid_names[i], 8);
+            name[8] = '\0';
+            
+            for (int p = 0; p < query.num_patterns && matched; p++) {
+                if (query.patterns[p].kind == PATTERN_GLOB) {
+                    matched = glob_match(query.patterns[p].text, name);
+                } else if (query.patterns[p].kind == PATTERN_REGEX) {
+                    matched = regex_match(query.patterns[p].text, name);
+                }
+            }
+        }
+        
+        if (matched) shown_images[num_shown_images++] = i;
+    }
+    
+    // Look-alikes go closest first; a counting sort keeps grid order within a distance
+    if (similar_image) {
+        int starts[66] = {0};
+        for (int i = 0; i < num_shown_images; i++) starts[grid_similar[shown_images[i]]]++;
+        for (int d = 0, total = 0; d < 66; d++) {
+            int count = starts[d];
+            starts[d] = total;
+            total += count;
+        }
+        int *sorted = (int *)malloc((num_shown_images + 1) * sizeof(int));
+        if (sorted) {
+            for (int i = 0; i < num_shown_images; i++) sorted[starts[grid_similar[shown_images[i]]]++] = shown_images[i];
+            memcpy(shown_images, sorted, num_shown_images * sizeof(int));
+            free(sorted);
+        }
+    }
+
+    search_time_ms = (now_seconds() - start_time) * 1000.0;
+}
+
+// Describe the stack for the header and window title, e.g. "DOOM2.WAD + mod.wad"
+void update_stack_description() {
+    wad_filename[0] = '\0';
+    for (int w = 0; w < num_wads; w++) {
+        if (w > 0) strncat(wad_filename, " + ", sizeof(wad_filename) - strlen(wad_filename) - 1);
+        strncat(wad_filename, wad_stack[w]->filename, sizeof(wad_filename) - strlen(wad_filename) - 1);
+    }
+    
+    if (num_wads > 0) {
+        sprintf(window_title, "DOOM WAD Image Viewer - %.200s (%d WADs, %d images)",
+                wad_filename, num_wads, total_images);
+    } else {
+        strcpy(window_title, "DOOM WAD Image Viewer");
+    }
+    if (!offscreen) glutSetWindowTitle(window_title);
+}
+
+void wad_stack_changed() {
+    rebuild_lump_view();
+    rebuild_sprite_groups();
+    selected_image = NULL;
+    similar_image = NULL;
+    rebuild_map_view();
+    update_stack_diff();
+    apply_lump_filter();
+    update_stack_description();
+    reload_watch_refresh();
+    invalidate_layers();
+    
+    // Update status message; in diff mode it reports the diff instead
+    if (diff_mode) return;
+    if (!palette_loaded) {
+        sprintf(status_message, "Loaded %d images from %d WADs, %d of %d lumps overridden (using grayscale - no palette found)", 
+                total_images, num_wads, overridden_count, num_stack_lumps);
+    } else {
+        sprintf(status_message, "Loaded %d images from %d WADs, %d of %d lumps overridden, with color palette", 
+                total_images, num_wads, overridden_count, num_stack_lumps);
+    }
+    size_t held = 0;
+    for (int w = 0; w < num_wads; w++) held += wad_stack[w]->arena.used;
+    sprintf(status_message + strlen(status_message), ", %.1f MB in WAD arenas", held / (1024.0 * 1024.0));
+}
+
+// Return the stack position of a loaded WAD, or -1
+int wad_stack_find(const char *filename) {
+    for (int w = 0; w < num_wads; w++) {
+        if (strcmp(wad_stack[w]->filename, filename) == 0) return w;
+    }
+    return -1;
+}
+
+// Load a WAD on top of the stack. Only the new file is indexed; the files
+// below it are only re-uploaded if it brings a different PLAYPAL.
+bool wad_stack_push(const char *filename) {
+    if (num_wads >= MAX_WAD_STACK) {
+        sprintf(status_message, "Error: Too many WADs loaded (max %d)", MAX_WAD_STACK);
+        return false;
+    }
+    if (wad_stack_find(filename) >= 0) {
+        sprintf(status_message, "%s is already loaded", filename);
+        return false;
+    }
+    
+    wad_file_t *wad = wad_open(filename);
+    if (!wad) return false;
+    
+    wad_stack[num_wads++] = wad;
+    
+    if (update_stack_palette()) {
+        for (int w = 0; w < num_wads - 1; w++) {
+            wad_recreate_textures(wad_stack[w]);
+        }
+    }
+    
+    wad_index_images(wad, NULL);
+    wad_index_maps(wad);
+    wad_build_map_previews(wad);
+    wad_stack_changed();
+    return true;
+}
+
+// Drop one WAD from the stack, leaving the others loaded
+void wad_stack_remove(int index) {
+    if (index < 0 || index >= num_wads) return;
+    
+    wad_close(wad_stack[index]);
+    for (int w = index; w < num_wads - 1; w++) {
+        wad_stack[w] = wad_stack[w + 1];
+    }
+    num_wads--;
+    
+    if (update_stack_palette()) {
+        for (int w = 0; w < num_wads; w++) {
+            wad_recreate_textures(wad_stack[w]);
+        }
+    }
+    
+    wad_stack_changed();
+}
+
+// Clean up all loaded WAD resources
+void unload_current_wad() {
+    for (int w = 0; w < num_wads; w++) {
+        wad_close(wad_stack[w]);
+        wad_stack[w] = NULL;
+    }
+    num_wads = 0;
+    
+    arena_reset(&view_arena);
+    grid_images = NULL;
+    grid_names = NULL;
+    grid_width = grid_height = NULL;
+    grid_format = grid_flags = grid_keep = grid_diff = grid_similar = NULL;
+    similar_image = NULL;
+    grid_textures = NULL;
+    shown_images = NULL;
+    total_images = 0;
+    num_shown_images = 0;
+    overridden_count = 0;
+    stack_lumps = NULL;
+    num_stack_lumps = 0;
+    stack_lump_slots = NULL;
+    all_maps = NULL;
+    num_all_maps = 0;
+    automap_index = 0;
+    free_sprite_groups();
+    show_animation = false;
+    selected_image = NULL;
+    current_page = 0;
+    wad_filename[0] = '\0';
+    invalidate_layers();
+}
+
+// Replace the whole stack with a single WAD
+void load_wad_file(const char *filename) {
+    // First unload any currently loaded WAD
+    unload_current_wad();
+    wad_stack_push(filename);
+}
+
+// Re-read a WAD that changed on disk in place in the stack. Lumps with
+// the same content hash keep their textures, so only what changed is
+// decoded and uploaded. The page, selection and animation are kept.
+bool wad_reload(int index) {
+    double start = now_seconds();
+    wad_file_t *old = wad_stack[index];
+    wad_file_t *wad = wad_open(old->filename);
+    if (!wad) return false;   // Probably still being written; the next change retries
+    
+    char selected_name[9] = "", selected_ns[9] = "";
+    if (selected_image) {
+        strcpy(selected_name, selected_image->name);
+        strcpy(selected_ns, selected_image->ns);
+    }
+    bool animating = show_animation;
+    int frame = animation_frame, rotation = animation_rotation;
+    bool paused = animation_paused;
+    int page = current_page;
+    
+    wad_stack[index] = wad;
+    bool palette_changed = update_stack_palette();
+    int reused = wad_index_images(wad, palette_changed ? NULL : old);
+    wad_index_maps(wad);
+    wad_build_map_previews(wad);
+    wad_close(old);
+    if (palette_changed) {
+        for (int w = 0; w < num_wads; w++) {
+            if (w != index) wad_recreate_textures(wad_stack[w]);
+        }
+    }
+    
+    wad_stack_changed();
+    current_page = page;
+    for (int i = total_images - 1; i >= 0 && selected_name[0]; i--) {
+        if (strcmp(grid_images[i]->name, selected_name) == 0 && strcmp(grid_images[i]->ns, selected_ns) == 0) {
+            selected_image = grid_images[i];
+            break;
+        }
+    }
+    if (animating && selected_image) {
+        start_animation(selected_image);
+        if (show_animation && frame < animation_group->num_frames) {
+            animation_frame = frame;
+            animation_rotation = rotation;
+            animation_paused = paused;
+        }
+    }
+    
+    int lumps = wad->num_images - wad->num_maps;
+    sprintf(status_message, "Reloaded %.120s: %d of %d images changed (%.0f ms)",
+            wad->filename, lumps - reused, lumps, (now_seconds() - start) * 1000.0);
+    return true;
+}
+
+// Watch the folders of the loaded WADs. Build tools often write a new
+// file and rename it over the old one, which a watch on the file itself
+// would miss.
+void reload_watch_refresh() {
+#ifdef __linux__
+    if (reload_watch_fd >= 0) close(reload_watch_fd);
+    reload_watch_fd = live_reload && num_wads > 0 ? inotify_init1(IN_NONBLOCK | IN_CLOEXEC) : -1;
+    for (int w = 0; w < num_wads; w++) {
+        char folder[256];
+        snprintf(folder, sizeof(folder), "%s", wad_stack[w]->filename);
+        char *slash = strrchr(folder, '/');
+        if (slash) *slash = '\0';
+        else strcpy(folder, ".");
+        wad_stack[w]->watch = reload_watch_fd >= 0 ?
+            inotify_add_watch(reload_watch_fd, slash == folder ? "/" : folder, IN_CLOSE_WRITE | IN_MOVED_TO) : -1;
+    }
+#endif
+}
+
+// Timer: note WADs that changed on disk and reload each once it has been
+// quiet for a moment, so a build that is still writing is not read
+void reload_tick(int value) {
+    double now = now_seconds();
+#ifdef __linux__
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while (reload_watch_fd >= 0 && (length = read(reload_watch_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            for (int w = 0; w < num_wads && event->len > 0; w++) {
+                const char *base = strrchr(wad_stack[w]->filename, '/');
+                base = base ? base + 1 : wad_stack[w]->filename;
+                if (wad_stack[w]->watch == event->wd && strcmp(event->name, base) == 0) {
+                    wad_stack[w]->reload_at = now + RELOAD_SETTLE_SECONDS;
+                }
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+#else
+    // No change notifications here; compare size and time instead
+    for (int w = 0; w < num_wads && live_reload; w++) {
+        struct stat st;
+        if (wad_stack[w]->reload_at == 0 && stat(wad_stack[w]->filename, &st) == 0 &&
+            ((size_t)st.st_size != wad_stack[w]->map.size || (long long)st.st_mtime != wad_stack[w]->mtime)) {
+            wad_stack[w]->reload_at = now + RELOAD_SETTLE_SECONDS;
+        }
+    }
+#endif
+    
+    bool reloaded = false;
+    for (int w = 0; w < num_wads; w++) {
+        if (wad_stack[w]->reload_at > 0 && now >= wad_stack[w]->reload_at) {
+            wad_stack[w]->reload_at = 0;
+            reloaded = wad_reload(w) || reloaded;
+        }
+    }
+    if (reloaded) glutPostRedisplay();
+    glutTimerFunc(RELOAD_POLL_MS, reload_tick, 0);
+}
+
+// Fill a stack-local image record for a lump, for headless tools that
+// decode without the viewer's textures. True for the formats whose pixels
+// are known for certain: patches, flats and PNGs.
+static bool lump_image_setup(wad_image_t *image, wad_file_t *wad, int lump, const unsigned char *data, const char *ns) {
+    strncpy(image->name, wad->directory[lump].name, 8);
+    strcpy(image->ns, ns);
+    image->wad = wad;
+    image->lump = lump;
+    image->data = (unsigned char *)data;
+    image->size = wad->directory[lump].size;
+    detect_image_dimensions(image);
+    return image->is_valid && (image->format == IMAGE_FORMAT_PATCH || image->format == IMAGE_FORMAT_FLAT ||
+                               image->format == IMAGE_FORMAT_PNG);
+}
+
+// Lump contents are compared by hash when both sides hashed them the same
+// way; a WAD against a PK3 falls back to the bytes
+static bool diff_lumps_equal(wad_file_t *a, int lump_a, wad_file_t *b, int lump_b, bool same_hashes) {
+    if (a->directory[lump_a].size != b->directory[lump_b].size) return false;
+    if (same_hashes) return a->lump_hashes[lump_a] == b->lump_hashes[lump_b];
+    int size_a, size_b;
+    const unsigned char *data_a = wad_lump_data(a, lump_a, &size_a);
+    const unsigned char *data_b = wad_lump_data(b, lump_b, &size_b);
+    return data_a && data_b && size_a == size_b && memcmp(data_a, data_b, size_a) == 0;
+}
+
+// Compare two WADs lump by lump. Lumps pair up by namespace, name and
+// occurrence; a pair whose contents differ is changed, and pairs outside
+// the longest run that kept its order are moved. Unpaired lumps are added
+// or removed, unless the same bytes turn up on the other side under
+// another name. Only the directories and the content hashes wad_open()
+// computed are read. Everything is allocated from the given arena.
+bool wad_diff(wad_file_t *a, wad_file_t *b, wad_diff_t *diff, arena_t *arena) {
+    double start = now_seconds();
+    memset(diff, 0, sizeof(*diff));
+    diff->a = a;
+    diff->b = b;
+    
+    int count_a = a->header.num_lumps;
+    int count_b = b->header.num_lumps;
+    int table_size = 16;
+    while (table_size < (count_a > count_b ? count_a : count_b) * 2) table_size <<= 1;
+    int mask = table_size - 1;
+    
+    char (*ns_a)[9] = diff->ns_a = (char (*)[9])arena_alloc(arena, (count_a + 1) * 9);
+    char (*ns_b)[9] = diff->ns_b = (char (*)[9])arena_alloc(arena, (count_b + 1) * 9);
+    int *pair_a = (int *)arena_alloc(arena, (count_a + 1) * sizeof(int));   // Paired B lump, or -1
+    int *pair_b = (int *)arena_alloc(arena, (count_b + 1) * sizeof(int));
+    int *next_b = (int *)arena_alloc(arena, (count_b + 1) * sizeof(int));   // Next B lump with the same key
+    int *slot_first = (int *)arena_alloc(arena, table_size * sizeof(int));
+    int *slot_last = (int *)arena_alloc(arena, table_size * sizeof(int));
+    int *slot_next = (int *)arena_alloc(arena, table_size * sizeof(int));   // Next B lump to pair
+    int *sequence = (int *)arena_alloc(arena, (count_a + 1) * sizeof(int));
+    int *tails = (int *)arena_alloc(arena, (count_a + 1) * sizeof(int));
+    int *previous = (int *)arena_alloc(arena, (count_a + 1) * sizeof(int));
+    unsigned char *in_order = (unsigned char *)arena_calloc(arena, count_b + 1);
+    diff->kind_a = (unsigned char *)arena_calloc(arena, count_a + 1);
+    diff->kind_b = (unsigned char *)arena_calloc(arena, count_b + 1);
+    if (!ns_a || !ns_b || !pair_a || !pair_b || !next_b || !slot_first || !slot_last || !slot_next ||
+        !sequence || !tails || !previous || !in_order || !diff->kind_a || !diff->kind_b) return false;
+    
+    wad_lump_namespaces(a, ns_a);
+    wad_lump_namespaces(b, ns_b);
+    bool same_hashes = a->lump_hashes && b->lump_hashes && (a->zip_entries != NULL) == (b->zip_entries != NULL);
+    
+    // Chain B's lumps by key, in directory order
+    for (int s = 0; s < table_size; s++) slot_first[s] = -1;
+    for (int i = 0; i < count_b; i++) {
+        pair_b[i] = -1;
+        next_b[i] = -1;
+        unsigned int slot = hash_lump_key(ns_b[i], b->directory[i].name) & mask;
+        while (slot_first[slot] >= 0 &&
+               (strncmp(b->directory[slot_first[slot]].name, b->directory[i].name, 8) != 0 ||
+                strcmp(ns_b[slot_first[slot]], ns_b[i]) != 0)) {
+            slot = (slot + 1) & mask;
+        }
+        if (slot_first[slot] < 0) {
+            slot_first[slot] = slot_next[slot] = i;
+        } else {
+            next_b[slot_last[slot]] = i;
+        }
+        slot_last[slot] = i;
+    }
+    
+    // The n-th A lump with a key pairs with the n-th B lump with it
+    int num_pairs = 0;
+    for (int i = 0; i < count_a; i++) {
+        pair_a[i] = -1;
+        unsigned int slot = hash_lump_key(ns_a[i], a->directory[i].name) & mask;
+        while (slot_first[slot] >= 0 &&
+               (strncmp(b->directory[slot_first[slot]].name, a->directory[i].name, 8) != 0 ||
+                strcmp(ns_b[slot_first[slot]], ns_a[i]) != 0)) {
+            slot = (slot + 1) & mask;
+        }
+        if (slot_first[slot] >= 0 && slot_next[slot] >= 0) {
+            int j = slot_next[slot];
+            slot_next[slot] = next_b[j];
+            pair_a[i] = j;
+            pair_b[j] = i;
+            sequence[num_pairs++] = j;
+        }
+    }
+    
+    // Longest increasing run of B positions in A's order (patience sorting);
+    // whatever is not on it has moved
+    int length = 0;
+    for (int p = 0; p < num_pairs; p++) {
+        int low = 0, high = length;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (sequence[tails[middle]] < sequence[p]) low = middle + 1;
+            else high = middle;
+        }
+        previous[p] = low > 0 ? tails[low - 1] : -1;
+        tails[low] = p;
+        if (low == length) length++;
+    }
+    for (int p = length > 0 ? tails[length - 1] : -1; p >= 0; p = previous[p]) {
+        in_order[sequence[p]] = 1;
+    }
+    
+    for (int j = 0; j < count_b; j++) {
+        int i = pair_b[j];
+        if (i < 0) {
+            diff->kind_b[j] = DIFF_ADDED;
+        } else if (!diff_lumps_equal(a, i, b, j, same_hashes)) {
+            diff->kind_b[j] = DIFF_CHANGED;
+        } else if (!in_order[j]) {
+            diff->kind_b[j] = DIFF_MOVED;
+        }
+        if (i >= 0) diff->kind_a[i] = diff->kind_b[j];
+    }
+    for (int i = 0; i < count_a; i++) {
+        if (pair_a[i] < 0) diff->kind_a[i] = DIFF_REMOVED;
+    }
+    
+    // A removed lump whose bytes were added elsewhere was renamed. The
+    // slot table is reused, keyed by content hash; taken lumps become -2.
+    if (same_hashes) {
+        for (int s = 0; s < table_size; s++) slot_first[s] = -1;
+        for (int i = 0; i < count_a; i++) {
+            if (diff->kind_a[i] != DIFF_REMOVED || a->directory[i].size <= 0) continue;
+            unsigned int slot = (unsigned int)a->lump_hashes[i] & mask;
+            while (slot_first[slot] != -1) slot = (slot + 1) & mask;
+            slot_first[slot] = i;
+        }
+        for (int j = 0; j < count_b; j++) {
+            if (diff->kind_b[j] != DIFF_ADDED || b->directory[j].size <= 0) continue;
+            unsigned int slot = (unsigned int)b->lump_hashes[j] & mask;
+            for (; slot_first[slot] != -1; slot = (slot + 1) & mask) {
+                int i = slot_first[slot];
+                if (i >= 0 && diff_lumps_equal(a, i, b, j, true)) {
+                    slot_first[slot] = -2;
+                    pair_a[i] = j;
+                    pair_b[j] = i;
+                    diff->kind_a[i] = diff->kind_b[j] = DIFF_RENAMED;
+                    break;
+                }
+            }
+        }
+    }
+    
+    // List what differs: removed lumps first, then B's directory
+    int num_entries = 0;
+    for (int i = 0; i < count_a; i++) num_entries += diff->kind_a[i] == DIFF_REMOVED;
+    for (int j = 0; j < count_b; j++) num_entries += diff->kind_b[j] != DIFF_SAME;
+    diff->entries = (lump_diff_t *)arena_calloc(arena, (num_entries + 1) * sizeof(lump_diff_t));
+    if (!diff->entries) return false;
+    
+    for (int i = 0; i < count_a; i++) {
+        if (diff->kind_a[i] != DIFF_REMOVED) continue;
+        lump_diff_t *entry = &diff->entries[diff->num_entries++];
+        entry->kind = DIFF_REMOVED;
+        entry->lump_a = i;
+        entry->lump_b = -1;
+        entry->pixels_changed = -1;
+    }
+    for (int j = 0; j < count_b; j++) {
+        if (diff->kind_b[j] == DIFF_SAME) continue;
+        lump_diff_t *entry = &diff->entries[diff->num_entries++];
+        entry->kind = diff->kind_b[j];
+        entry->lump_a = pair_b[j];
+        entry->lump_b = j;
+        entry->moved = entry->kind == DIFF_CHANGED && !in_order[j];
+        entry->pixels_changed = -1;
+    }
+    
+    for (int i = 0; i < count_a; i++) diff->counts[diff->kind_a[i]] += diff->kind_a[i] == DIFF_REMOVED;
+    for (int j = 0; j < count_b; j++) diff->counts[diff->kind_b[j]]++;
+    diff->seconds = now_seconds() - start;
+    return true;
+}
+
+// One wad_diff_pixels() run; lump data is looked up before the workers start
+typedef struct {
+    wad_diff_t *diff;
+    const unsigned char **data_a;     // Per entry, NULL if not compared
+    const unsigned char **data_b;
+    const char *image_folder;         // Where to write diff images, or NULL
+} pixel_diff_job_t;
+
+// Palette indexes on a canvas, -1 where the image is transparent
+static void indexed_to_canvas(const indexed_image_t *indexed, short *canvas, int width, int height) {
+    for (int i = 0; i < width * height; i++) canvas[i] = -1;
+    for (int x = 0; x < indexed->width; x++) {
+        for (unsigned int s = indexed->column_first[x]; s < indexed->column_first[x + 1]; s++) {
+            const pixel_span_t *span = &indexed->spans[s];
+            for (int y = span->top; y < span->top + span->length; y++) {
+                canvas[y * width + x] = indexed->pixels[y * indexed->width + x];
+            }
+        }
+    }
+}
+
+// Write 32-bit BGRA pixels, top row first, as an uncompressed TGA
+static bool write_tga(const char *path, const unsigned char *pixels, int width, int height) {
+    unsigned char header[18] = {0};
+    header[2] = 2;
+    header[12] = width & 0xFF;
+    header[13] = width >> 8;
+    header[14] = height & 0xFF;
+    header[15] = height >> 8;
+    header[16] = 32;
+    header[17] = 0x28;   // Top-left origin, 8 alpha bits
+    
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+    bool written = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+                   fwrite(pixels, 4, (size_t)width * height, file) == (size_t)width * height;
+    return fclose(file) == 0 && written;
+}
+
+// Decode both sides of one changed image lump, count the pixels that
+// differ and optionally write the diff image: changed pixels in red over
+// a dimmed copy of the new image
+static void diff_entry_pixels(void *context, int index) {
+    pixel_diff_job_t *job = (pixel_diff_job_t *)context;
+    lump_diff_t *entry = &job->diff->entries[index];
+    if (!job->data_a[index] || !job->data_b[index]) return;
+    
+    wad_image_t image_a = {0}, image_b = {0};
+    if (!lump_image_setup(&image_a, job->diff->a, entry->lump_a, job->data_a[index], job->diff->ns_a[entry->lump_a]) ||
+        !lump_image_setup(&image_b, job->diff->b, entry->lump_b, job->data_b[index], job->diff->ns_b[entry->lump_b])) return;
+    
+    // Each worker decodes into its own arena
+    arena_t arena = {0};
+    indexed_image_t *indexed_a = decode_image_indexed(&image_a, &arena);
+    indexed_image_t *indexed_b = decode_image_indexed(&image_b, &arena);
+    int width = image_a.width > image_b.width ? image_a.width : image_b.width;
+    int height = image_a.height > image_b.height ? image_a.height : image_b.height;
+    short *canvas_a = (short *)arena_alloc(&arena, (size_t)width * height * sizeof(short));
+    short *canvas_b = (short *)arena_alloc(&arena, (size_t)width * height * sizeof(short));
+    if (!indexed_a || !indexed_b || !canvas_a || !canvas_b) {
+        arena_free(&arena);
+        return;
+    }
+    
+    entry->width_a = image_a.width;
+    entry->height_a = image_a.height;
+    entry->left_a = image_a.left_offset;
+    entry->top_a = image_a.top_offset;
+    entry->width_b = image_b.width;
+    entry->height_b = image_b.height;
+    entry->left_b = image_b.left_offset;
+    entry->top_b = image_b.top_offset;
+    
+    indexed_to_canvas(indexed_a, canvas_a, width, height);
+    indexed_to_canvas(indexed_b, canvas_b, width, height);
+    entry->pixels_changed = 0;
+    entry->box_x0 = width;
+    entry->box_y0 = height;
+    entry->box_x1 = entry->box_y1 = -1;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (canvas_a[y * width + x] == canvas_b[y * width + x]) continue;
+            entry->pixels_changed++;
+            if (x < entry->box_x0) entry->box_x0 = x;
+            if (y < entry->box_y0) entry->box_y0 = y;
+            if (x > entry->box_x1) entry->box_x1 = x;
+            if (y > entry->box_y1) entry->box_y1 = y;
+        }
+    }
+    
+    unsigned char *pixels = job->image_folder ? (unsigned char *)arena_alloc(&arena, (size_t)width * height * 4) : NULL;
+    if (pixels) {
+        for (int i = 0; i < width * height; i++) {
+            unsigned char *pixel = pixels + (size_t)i * 4;
+            int shown = canvas_b[i] >= 0 ? canvas_b[i] : canvas_a[i];
+            if (canvas_a[i] != canvas_b[i]) {
+                pixel[0] = 0; pixel[1] = 0; pixel[2] = 255; pixel[3] = 255;
+            } else if (shown >= 0) {
+                pixel[0] = doom_palette[shown][2] / 3;
+                pixel[1] = doom_palette[shown][1] / 3;
+                pixel[2] = doom_palette[shown][0] / 3;
+                pixel[3] = 255;
+            } else {
+                pixel[0] = pixel[1] = pixel[2] = pixel[3] = 0;
+            }
+        }
+        
+        // NS_NAME.tga, with anything a file system might mind replaced
+        char file_name[32];
+        snprintf(file_name, sizeof(file_name), "%s%s%s.tga", image_b.ns, image_b.ns[0] ? "_" : "", image_b.name);
+        for (char *c = file_name; *c && strcmp(c, ".tga") != 0; c++) {
+            if (!isalnum((unsigned char)*c) && *c != '_' && *c != '-') *c = '_';
+        }
+        char path[1024];
+        if (!join_path(path, sizeof(path), job->image_folder, file_name)) {
+            fprintf(stderr, "Path too long for %s in %s\n", file_name, job->image_folder);
+        } else if (!write_tga(path, pixels, width, height)) {
+            fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        }
+    }
+    arena_free(&arena);
+}
+
+// Pixel-level comparison of every changed image lump of a diff, on the
+// worker pool. Patches, flats and PNGs are decoded to palette indexes and
+// laid over each other at their top-left corners, so a pixel differs if
+// its index or its transparency does. With a folder, a TGA per changed
+// image is written there as well.
+void wad_diff_pixels(wad_diff_t *diff, const char *image_folder) {
+    pixel_diff_job_t job = {diff, NULL, NULL, image_folder};
+    job.data_a = (const unsigned char **)calloc(diff->num_entries + 1, sizeof(unsigned char *));
+    job.data_b = (const unsigned char **)calloc(diff->num_entries + 1, sizeof(unsigned char *));
+    if (!job.data_a || !job.data_b) {
+        free(job.data_a);
+        free(job.data_b);
+        return;
+    }
+    
+    // PK3 members are inflated here, where the arenas can be used
+    for (int e = 0; e < diff->num_entries; e++) {
+        lump_diff_t *entry = &diff->entries[e];
+        if (entry->kind != DIFF_CHANGED) continue;
+        char name[9] = {0};
+        strncpy(name, diff->b->directory[entry->lump_b].name, 8);
+        if (!is_image_lump(name)) continue;
+        int size;
+        job.data_a[e] = wad_lump_data(diff->a, entry->lump_a, &size);
+        job.data_b[e] = job.data_a[e] ? wad_lump_data(diff->b, entry->lump_b, &size) : NULL;
+    }
+    prepare_color_lookup();
+    parallel_for(diff->num_entries, diff_entry_pixels, &job);
+    free(job.data_a);
+    free(job.data_b);
+}
+
+// Diff the top two WADs of the stack and mark the grid with the result.
+// Turns diff mode off when there are fewer than two WADs.
+void update_stack_diff() {
+    if (!diff_mode) return;
+    if (num_wads < 2 || !grid_diff) {
+        diff_mode = false;
+        sprintf(status_message, "Diff needs two WADs in the stack (Ins in the WAD list adds one)");
+        return;
+    }
+    
+    wad_file_t *a = wad_stack[num_wads - 2];
+    wad_file_t *b = wad_stack[num_wads - 1];
+    if (!wad_diff(a, b, &stack_diff, &view_arena)) {
+        diff_mode = false;
+        snprintf(status_message, sizeof(status_message), "Error: Not enough memory to diff %.*s and %.*s",
+                 100, a->filename, 100, b->filename);
+        return;
+    }
+    
+    // The new WAD's images show what it adds and changes; the old one's
+    // only what it loses
+    for (int i = 0; i < total_images; i++) {
+        wad_image_t *image = grid_images[i];
+        grid_diff[i] = DIFF_SAME;
+        if (image->format == IMAGE_FORMAT_MAP) continue;
+        if (image->wad == b) {
+            grid_diff[i] = stack_diff.kind_b[image->lump];
+        } else if (image->wad == a && stack_diff.kind_a[image->lump] == DIFF_REMOVED) {
+            grid_diff[i] = DIFF_REMOVED;
+        }
+    }
+    
+    sprintf(status_message, "Diff %.60s -> %.60s: %d added, %d removed, %d changed, %d moved, %d renamed (%.1f ms)",
+            a->filename, b->filename, stack_diff.counts[DIFF_ADDED], stack_diff.counts[DIFF_REMOVED],
+            stack_diff.counts[DIFF_CHANGED], stack_diff.counts[DIFF_MOVED], stack_diff.counts[DIFF_RENAMED],
+            stack_diff.seconds * 1000.0);
+}
+
+// Number of bits two perceptual hashes differ in
+static int hash_distance(uint64_t a, uint64_t b) {
+#ifdef __GNUC__
+    return __builtin_popcountll(a ^ b);
+#else
+    uint64_t x = a ^ b;
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (int)((x * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+// dHash of a decoded image: shrink it to 9x8 by averaging brightness
+// through the palette, then take one bit per pair of neighbouring cells
+// in a row, set where the right one is brighter. Copies hash the same,
+// and recolouring through a translation keeps most bits. Transparent
+// pixels count as black. Returns 0 for images with no detail, which
+// never match anything.
+uint64_t image_phash(const indexed_image_t *indexed) {
+    int width = indexed->width, height = indexed->height;
+    if (width < 2 || height < 2) return 0;
+    
+    int brightness[256];
+    for (int i = 0; i < 256; i++) {
+        brightness[i] = (doom_palette[i][0] * 299 + doom_palette[i][1] * 587 + doom_palette[i][2] * 114) / 1000;
+    }
+    
+    // Cells take every source pixel whose scaled position falls in them
+    long long sums[8][9] = {{0}};
+    long long columns[9] = {0}, rows[8] = {0};
+    for (int x = 0; x < width; x++) columns[x * 9 / width]++;
+    for (int y = 0; y < height; y++) rows[y * 8 / height]++;
+    for (int x = 0; x < width; x++) {
+        int cell_x = x * 9 / width;
+        for (unsigned int s = indexed->column_first[x]; s < indexed->column_first[x + 1]; s++) {
+            const pixel_span_t *span = &indexed->spans[s];
+            const unsigned char *source = indexed->pixels + span->top * width + x;
+            for (int y = span->top; y < span->top + span->length; y++, source += width) {
+                sums[y * 8 / height][cell_x] += brightness[*source];
+            }
+        }
+    }
+    
+    uint64_t hash = 0;
+    for (int row = 0; row < 8; row++) {
+        for (int column = 0; column < 8; column++) {
+            // Compare averages without dividing: a/na < b/nb
+            long long left = sums[row][column] * (columns[column + 1] ? columns[column + 1] : 1);
+            long long right = sums[row][column + 1] * (columns[column] ? columns[column] : 1);
+            if (!columns[column] || !columns[column + 1]) left = right = 0;   // Narrower than the grid
+            hash = (hash << 1) | (left < right);
+        }
+    }
+    return hash;
+}
+
+static void hash_image_task(void *context, int index) {
+    wad_image_t *image = ((wad_image_t **)context)[index];
+    
+    // The cached decode is only read; anything else goes in a local arena
+    arena_t arena = {0};
+    const indexed_image_t *indexed = image->indexed;
+    if (!indexed && image->is_valid && image->format != IMAGE_FORMAT_MAP) indexed = decode_image_indexed(image, &arena);
+    image->phash = indexed ? image_phash(indexed) : 0;
+    image->phash_ready = true;
+    arena_free(&arena);
+}
+
+// Compute the perceptual hash of every image in the list that doesn't
+// have one yet, on the worker pool. PK3 members are read first.
+void hash_images(wad_image_t **images, int count) {
+    wad_image_t **missing = (wad_image_t **)malloc((count + 1) * sizeof(wad_image_t *));
+    if (!missing) return;
+    
+    int num_missing = 0;
+    for (int i = 0; i < count; i++) {
+        if (images[i]->pending) missing[num_missing++] = images[i];
+    }
+    if (num_missing > 0) load_pending_images(missing, num_missing);
+    
+    num_missing = 0;
+    for (int i = 0; i < count; i++) {
+        if (!images[i]->phash_ready) missing[num_missing++] = images[i];
+    }
+    prepare_color_lookup();
+    parallel_for(num_missing, hash_image_task, missing);
+    free(missing);
+}
+
+bool phash_tree_init(phash_tree_t *tree, int capacity, arena_t *arena) {
+    tree->nodes = (phash_node_t *)arena_alloc(arena, (capacity + 1) * sizeof(phash_node_t));
+    tree->count = 0;
+    tree->capacity = tree->nodes ? capacity : 0;
+    return tree->nodes != NULL;
+}
+
+void phash_tree_insert(phash_tree_t *tree, uint64_t hash, int item) {
+    if (tree->count >= tree->capacity) return;
+    phash_node_t *node = &tree->nodes[tree->count];
+    node->hash = hash;
+    node->item = item;
+    node->first_child = node->next_sibling = node->next_same = -1;
+    node->distance = 0;
+    int added = tree->count++;
+    if (added == 0) return;
+    
+    // Walk down the children at our distance until there is none. Copies
+    // of a hash hang off its node instead, or they would form one long chain.
+    int parent = 0;
+    for (;;) {
+        int distance = hash_distance(tree->nodes[parent].hash, hash);
+        if (distance == 0) {
+            node->next_same = tree->nodes[parent].next_same;
+            tree->nodes[parent].next_same = added;
+            return;
+        }
+        int child = tree->nodes[parent].first_child;
+        while (child >= 0 && tree->nodes[child].distance != distance) child = tree->nodes[child].next_sibling;
+        if (child < 0) {
+            node->distance = distance;
+            node->next_sibling = tree->nodes[parent].first_child;
+            tree->nodes[parent].first_child = added;
+            return;
+        }
+        parent = child;
+    }
+}
+
+// Items whose hash is within radius bits of the given one, up to
+// max_items of them. Returns how many were found.
+int phash_tree_query(const phash_tree_t *tree, uint64_t hash, int radius, int *items, int max_items) {
+    if (tree->count == 0) return 0;
+    int *stack = (int *)malloc(tree->count * sizeof(int));
+    if (!stack) return 0;
+    
+    int found = 0, depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0 && found < max_items) {
+        const phash_node_t *node = &tree->nodes[stack[--depth]];
+        int distance = hash_distance(node->hash, hash);
+        if (distance <= radius) {
+            items[found++] = node->item;
+            for (int same = node->next_same; same >= 0 && found < max_items; same = tree->nodes[same].next_same) {
+                items[found++] = tree->nodes[same].item;
+            }
+        }
+        
+        // Triangle inequality: only children between distance - radius and
+        // distance + radius can hold a match
+        for (int child = node->first_child; child >= 0; child = tree->nodes[child].next_sibling) {
+            if (abs(tree->nodes[child].distance - distance) <= radius) stack[depth++] = child;
+        }
+    }
+    free(stack);
+    return found;
+}
+
+// Narrow the grid to the images that look like the selected one, closest
+// first. Hashes are kept on the images, so only the first search over a
+// stack decodes everything.
+void find_similar_images() {
+    if (!selected_image) {
+        sprintf(status_message, "Click an image first to find the ones that look like it");
+        return;
+    }
+    
+    double start = now_seconds();
+    hash_images(grid_images, total_images);
+    wad_image_t *target = selected_image;
+    if (!target->phash) {
+        sprintf(status_message, "%s has too little detail to compare", target->name);
+        return;
+    }
+    
+    arena_t arena = {0};
+    phash_tree_t tree;
+    int *items = (int *)malloc((total_images + 1) * sizeof(int));
+    if (!items || !phash_tree_init(&tree, total_images, &arena)) {
+        free(items);
+        arena_free(&arena);
+        sprintf(status_message, "Error: Not enough memory to compare images");
+        return;
+    }
+    for (int i = 0; i < total_images; i++) {
+        if (grid_images[i]->phash) phash_tree_insert(&tree, grid_images[i]->phash, i);
+    }
+    
+    int found = phash_tree_query(&tree, target->phash, PHASH_DISTANCE, items, total_images);
+    memset(grid_similar, 0, total_images);
+    for (int i = 0; i < found; i++) {
+        grid_similar[items[i]] = 1 + hash_distance(grid_images[items[i]]->phash, target->phash);
+    }
+    free(items);
+    arena_free(&arena);
+    
+    similar_image = target;
+    apply_lump_filter();
+    current_page = 0;
+    sprintf(status_message, "%d images look like %s (within %d of 64 bits, %.0f ms) - F to show all",
+            found - 1, target->name, PHASH_DISTANCE, (now_seconds() - start) * 1000.0);
+}
+
+// Fixed 8-pixel-wide font in 8x14 cells, ASCII 32..126. It stands in for
+// GLUT_BITMAP_8_BY_13 at the same advance, but its glyphs are drawn here.
+// One byte per row, top row first; the bottom FONT_DESCENT rows hang below the baseline.
+static const unsigned char font_8x13[FONT_NUM_GLYPHS][FONT_CELL_H] = {
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // ' '
+    {0x00,0x00,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x00,0x10,0x00,0x00,0x00}, // '!'
+    {0x00,0x00,0x24,0x24,0x24,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '"'
+    {0x00,0x00,0x00,0x24,0x24,0x7e,0x24,0x7e,0x24,0x24,0x00,0x00,0x00,0x00}, // '#'
+    {0x00,0x00,0x10,0x3c,0x50,0x50,0x38,0x14,0x14,0x78,0x10,0x00,0x00,0x00}, // '$'
+    {0x00,0x00,0x22,0x52,0x24,0x08,0x08,0x10,0x24,0x2a,0x44,0x00,0x00,0x00}, // '%'
+    {0x00,0x00,0x00,0x00,0x30,0x48,0x48,0x30,0x4a,0x44,0x3a,0x00,0x00,0x00}, // '&'
+    {0x00,0x00,0x38,0x30,0x40,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '''
+    {0x00,0x00,0x04,0x08,0x08,0x10,0x10,0x10,0x08,0x08,0x04,0x00,0x00,0x00}, // '('
+    {0x00,0x00,0x20,0x10,0x10,0x08,0x08,0x08,0x10,0x10,0x20,0x00,0x00,0x00}, // ')'
+    {0x00,0x00,0x00,0x00,0x24,0x18,0x7e,0x18,0x24,0x00,0x00,0x00,0x00,0x00}, // '*'
+    {0x00,0x00,0x00,0x00,0x10,0x10,0x7c,0x10,0x10,0x00,0x00,0x00,0x00,0x00}, // '+'
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x38,0x30,0x40,0x00,0x00}, // ','
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x7e,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '-'
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x10,0x38,0x10,0x00,0x00}, // '.'
+    {0x00,0x00,0x02,0x02,0x04,0x08,0x10,0x20,0x40,0x80,0x80,0x00,0x00,0x00}, // '/'
+    {0x00,0x00,0x18,0x24,0x42,0x42,0x42,0x42,0x42,0x24,0x18,0x00,0x00,0x00}, // '0'
+    {0x00,0x00,0x10,0x30,0x50,0x10,0x10,0x10,0x10,0x10,0x7c,0x00,0x00,0x00}, // '1'
+    {0x00,0x00,0x3c,0x42,0x42,0x02,0x04,0x18,0x20,0x40,0x7e,0x00,0x00,0x00}, // '2'
+    {0x00,0x00,0x7e,0x02,0x04,0x08,0x1c,0x02,0x02,0x42,0x3c,0x00,0x00,0x00}, // '3'
+    {0x00,0x00,0x04,0x0c,0x14,0x24,0x44,0x44,0x7e,0x04,0x04,0x00,0x00,0x00}, // '4'
+    {0x00,0x00,0x7e,0x40,0x40,0x5c,0x62,0x02,0x02,0x42,0x3c,0x00,0x00,0x00}, // '5'
+    {0x00,0x00,0x1c,0x20,0x40,0x40,0x5c,0x62,0x42,0x42,0x3c,0x00,0x00,0x00}, // '6'
+    {0x00,0x00,0x7e,0x02,0x04,0x08,0x08,0x10,0x10,0x20,0x20,0x00,0x00,0x00}, // '7'
+    {0x00,0x00,0x3c,0x42,0x42,0x42,0x3c,0x42,0x42,0x42,0x3c,0x00,0x00,0x00}, // '8'
+    {0x00,0x00,0x3c,0x42,0x42,0x46,0x3a,0x02,0x02,0x04,0x38,0x00,0x00,0x00}, // '9'
+    {0x00,0x00,0x00,0x00,0x10,0x38,0x10,0x00,0x00,0x10,0x38,0x10,0x00,0x00}, // ':'
+    {0x00,0x00,0x00,0x00,0x10,0x38,0x10,0x00,0x00,0x38,0x30,0x40,0x00,0x00}, // ';'
+    {0x00,0x00,0x02,0x04,0x08,0x10,0x20,0x10,0x08,0x04,0x02,0x00,0x00,0x00}, // '<'
+    {0x00,0x00,0x00,0x00,0x00,0x7e,0x00,0x00,0x7e,0x00,0x00,0x00,0x00,0x00}, // '='
+    {0x00,0x00,0x40,0x20,0x10,0x08,0x04,0x08,0x10,0x20,0x40,0x00,0x00,0x00}, // '>'
+    {0x00,0x00,0x3c,0x42,0x42,0x02,0x04,0x08,0x08,0x00,0x08,0x00,0x00,0x00}, // '?'
+    {0x00,0x00,0x3c,0x42,0x42,0x4e,0x52,0x56,0x4a,0x40,0x3c,0x00,0x00,0x00}, // '@'
+    {0x00,0x00,0x18,0x24,0x42,0x42,0x42,0x7e,0x42,0x42,0x42,0x00,0x00,0x00}, // 'A'
+    {0x00,0x00,0xfc,0x42,0x42,0x42,0x7c,0x42,0x42,0x42,0xfc,0x00,0x00,0x00}, // 'B'
+    {0x00,0x00,0x3c,0x42,0x40,0x40,0x40,0x40,0x40,0x42,0x3c,0x00,0x00,0x00}, // 'C'
+    {0x00,0x00,0xfc,0x42,0x42,0x42,0x42,0x42,0x42,0x42,0xfc,0x00,0x00,0x00}, // 'D'
+    {0x00,0x00,0x7e,0x40,0x40,0x40,0x78,0x40,0x40,0x40,0x7e,0x00,0x00,0x00}, // 'E'
+    {0x00,0x00,0x7e,0x40,0x40,0x40,0x78,0x40,0x40,0x40,0x40,0x00,0x00,0x00}, // 'F'
+    {0x00,0x00,0x3c,0x42,0x40,0x40,0x40,0x4e,0x42,0x46,0x3a,0x00,0x00,0x00}, // 'G'
+    {0x00,0x00,0x42,0x42,0x42,0x42,0x7e,0x42,0x42,0x42,0x42,0x00,0x00,0x00}, // 'H'
+    {0x00,0x00,0x7c,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x7c,0x00,0x00,0x00}, // 'I'
+    {0x00,0x00,0x1f,0x04,0x04,0x04,0x04,0x04,0x04,0x44,0x38,0x00,0x00,0x00}, // 'J'
+    {0x00,0x00,0x42,0x44,0x48,0x50,0x60,0x50,0x48,0x44,0x42,0x00,0x00,0x00}, // 'K'
+    {0x00,0x00,0x40,0x40,0x40,0x40,0x40,0x40,0x40,0x40,0x7e,0x00,0x00,0x00}, // 'L'
+    {0x00,0x00,0x82,0x82,0xc6,0xaa,0x92,0x92,0x82,0x82,0x82,0x00,0x00,0x00}, // 'M'
+    {0x00,0x00,0x42,0x42,0x62,0x52,0x4a,0x46,0x42,0x42,0x42,0x00,0x00,0x00}, // 'N'
+    {0x00,0x00,0x3c,0x42,0x42,0x42,0x42,0x42,0x42,0x42,0x3c,0x00,0x00,0x00}, // 'O'
+    {0x00,0x00,0x7c,0x42,0x42,0x42,0x7c,0x40,0x40,0x40,0x40,0x00,0x00,0x00}, // 'P'
+    {0x00,0x00,0x3c,0x42,0x42,0x42,0x42,0x42,0x52,0x4a,0x3c,0x02,0x00,0x00}, // 'Q'
+    {0x00,0x00,0x7c,0x42,0x42,0x42,0x7c,0x50,0x48,0x44,0x42,0x00,0x00,0x00}, // 'R'
+    {0x00,0x00,0x3c,0x42,0x40,0x40,0x3c,0x02,0x02,0x42,0x3c,0x00,0x00,0x00}, // 'S'
+    {0x00,0x00,0xfe,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x00,0x00,0x00}, // 'T'
+    {0x00,0x00,0x42,0x42,0x42,0x42,0x42,0x42,0x42,0x42,0x3c,0x00,0x00,0x00}, // 'U'
+    {0x00,0x00,0x82,0x82,0x44,0x44,0x44,0x28,0x28,0x28,0x10,0x00,0x00,0x00}, // 'V'
+    {0x00,0x00,0x82,0x82,0x82,0x82,0x92,0x92,0x92,0xaa,0x44,0x00,0x00,0x00}, // 'W'
+    {0x00,0x00,0x82,0x82,0x44,0x28,0x10,0x28,0x44,0x82,0x82,0x00,0x00,0x00}, // 'X'
+    {0x00,0x00,0x82,0x82,0x44,0x28,0x10,0x10,0x10,0x10,0x10,0x00,0x00,0x00}, // 'Y'
+    {0x00,0x00,0x7e,0x02,0x04,0x08,0x10,0x20,0x40,0x40,0x7e,0x00,0x00,0x00}, // 'Z'
+    {0x00,0x00,0x3c,0x20,0x20,0x20,0x20,0x20,0x20,0x20,0x3c,0x00,0x00,0x00}, // '['
+    {0x00,0x00,0x80,0x80,0x40,0x20,0x10,0x08,0x04,0x02,0x02,0x00,0x00,0x00}, // backslash
+    {0x00,0x00,0x78,0x08,0x08,0x08,0x08,0x08,0x08,0x08,0x78,0x00,0x00,0x00}, // ']'
+    {0x00,0x00,0x10,0x28,0x44,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '^'
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xfe,0x00,0x00}, // '_'
+    {0x00,0x00,0x38,0x18,0x04,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '`'
+    {0x00,0x00,0x00,0x00,0x00,0x3c,0x02,0x3e,0x42,0x46,0x3a,0x00,0x00,0x00}, // 'a'
+    {0x00,0x00,0x40,0x40,0x40,0x5c,0x62,0x42,0x42,0x62,0x5c,0x00,0x00,0x00}, // 'b'
+    {0x00,0x00,0x00,0x00,0x00,0x3c,0x42,0x40,0x40,0x42,0x3c,0x00,0x00,0x00}, // 'c'
+    {0x00,0x00,0x02,0x02,0x02,0x3a,0x46,0x42,0x42,0x46,0x3a,0x00,0x00,0x00}, // 'd'
+    {0x00,0x00,0x00,0x00,0x00,0x3c,0x42,0x7e,0x40,0x42,0x3c,0x00,0x00,0x00}, // 'e'
+    {0x00,0x00,0x1c,0x22,0x20,0x20,0x7c,0x20,0x20,0x20,0x20,0x00,0x00,0x00}, // 'f'
+    {0x00,0x00,0x00,0x00,0x00,0x3a,0x44,0x44,0x38,0x40,0x3c,0x42,0x3c,0x00}, // 'g'
+    {0x00,0x00,0x40,0x40,0x40,0x5c,0x62,0x42,0x42,0x42,0x42,0x00,0x00,0x00}, // 'h'
+    {0x00,0x00,0x00,0x10,0x00,0x30,0x10,0x10,0x10,0x10,0x7c,0x00,0x00,0x00}, // 'i'
+    {0x00,0x00,0x00,0x04,0x00,0x0c,0x04,0x04,0x04,0x04,0x44,0x44,0x38,0x00}, // 'j'
+    {0x00,0x00,0x40,0x40,0x40,0x44,0x48,0x70,0x48,0x44,0x42,0x00,0x00,0x00}, // 'k'
+    {0x00,0x00,0x30,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x7c,0x00,0x00,0x00}, // 'l'
+    {0x00,0x00,0x00,0x00,0x00,0xec,0x92,0x92,0x92,0x92,0x82,0x00,0x00,0x00}, // 'm'
+    {0x00,0x00,0x00,0x00,0x00,0x5c,0x62,0x42,0x42,0x42,0x42,0x00,0x00,0x00}, // 'n'
+    {0x00,0x00,0x00,0x00,0x00,0x3c,0x42,0x42,0x42,0x42,0x3c,0x00,0x00,0x00}, // 'o'
+    {0x00,0x00,0x00,0x00,0x00,0x5c,0x62,0x42,0x62,0x5c,0x40,0x40,0x40,0x00}, // 'p'
+    {0x00,0x00,0x00,0x00,0x00,0x3a,0x46,0x42,0x46,0x3a,0x02,0x02,0x02,0x00}, // 'q'
+    {0x00,0x00,0x00,0x00,0x00,0x5c,0x22,0x20,0x20,0x20,0x20,0x00,0x00,0x00}, // 'r'
+    {0x00,0x00,0x00,0x00,0x00,0x3c,0x42,0x30,0x0c,0x42,0x3c,0x00,0x00,0x00}, // 's'
+    {0x00,0x00,0x00,0x20,0x20,0x7c,0x20,0x20,0x20,0x22,0x1c,0x00,0x00,0x00}, // 't'
+    {0x00,0x00,0x00,0x00,0x00,0x44,0x44,0x44,0x44,0x44,0x3a,0x00,0x00,0x00}, // 'u'
+    {0x00,0x00,0x00,0x00,0x00,0x44,0x44,0x44,0x28,0x28,0x10,0x00,0x00,0x00}, // 'v'
+    {0x00,0x00,0x00,0x00,0x00,0x82,0x82,0x92,0x92,0xaa,0x44,0x00,0x00,0x00}, // 'w'
+    {0x00,0x00,0x00,0x00,0x00,0x42,0x24,0x18,0x18,0x24,0x42,0x00,0x00,0x00}, // 'x'
+    {0x00,0x00,0x00,0x00,0x00,0x42,0x42,0x42,0x46,0x3a,0x02,0x42,0x3c,0x00}, // 'y'
+    {0x00,0x00,0x00,0x00,0x00,0x7e,0x04,0x08,0x10,0x20,0x7e,0x00,0x00,0x00}, // 'z'
+    {0x00,0x00,0x0e,0x10,0x10,0x08,0x30,0x08,0x10,0x10,0x0e,0x00,0x00,0x00}, // '{'
+    {0x00,0x00,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x00,0x00,0x00}, // '|'
+    {0x00,0x00,0x70,0x08,0x08,0x10,0x0c,0x10,0x08,0x08,0x70,0x00,0x00,0x00}, // '}'
+    {0x00,0x00,0x24,0x54,0x48,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '~'
+};
+
+GLuint font_atlas_texture = 0;
+text_vertex_t *text_batch = NULL;   // All text quads for the current frame
+int text_batch_count = 0;           // Vertices queued this frame
+int text_batch_capacity = 0;
+int text_batch_flushed = 0;         // Vertices already drawn by text_flush()
+
+// Rasterize the bitmap font into a single alpha texture. Called once after the GL context exists.
+void text_init() {
+    unsigned char *pixels = (unsigned char *)calloc(FONT_ATLAS_SIZE * FONT_ATLAS_SIZE, 1);
+    if (!pixels) return;
+    
+    for (int g = 0; g < FONT_NUM_GLYPHS; g++) {
+        int cell_x = (g % FONT_ATLAS_COLS) * FONT_CELL_W;
+        int cell_y = (g / FONT_ATLAS_COLS) * FONT_CELL_H;
+        
+        for (int row = 0; row < FONT_CELL_H; row++) {
+            unsigned char bits = font_8x13[g][row];
+            for (int col = 0; col < FONT_CELL_W; col++) {
+                if (bits & (0x80 >> col)) {
+                    pixels[(cell_y + row) * FONT_ATLAS_SIZE + cell_x + col] = 255;
+                }
+            }
+        }
+    }
+    
+    glGenTextures(1, &font_atlas_texture);
+    glBindTexture(GL_TEXTURE_2D, font_atlas_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, FONT_ATLAS_SIZE, FONT_ATLAS_SIZE,
+                 0, GL_ALPHA, GL_UNSIGNED_BYTE, pixels);
+    
+    free(pixels);
+}
+
+// Build the glyph quads for a string relative to its baseline origin.
+// The result can be kept and re-queued every frame with draw_text_layout().
+// Write the glyph quads of a string into layout->vertices, which must have
+// room for four vertices per character
+static void text_layout_fill(text_layout_t *layout, const char *text) {
+    int len = strlen(text);
+    layout->num_vertices = 0;
+    
+    const float texel = 1.0f / FONT_ATLAS_SIZE;
+    float pen_x = 0;
+    for (int i = 0; i < len; i++, pen_x += FONT_CELL_W) {
+        unsigned char c = (unsigned char)text[i];
+        if (c < FONT_FIRST_CHAR || c >= FONT_FIRST_CHAR + FONT_NUM_GLYPHS || c == ' ') continue;
+        
+        int g = c - FONT_FIRST_CHAR;
+        float u0 = (g % FONT_ATLAS_COLS) * FONT_CELL_W * texel;
+        float v0 = (g / FONT_ATLAS_COLS) * FONT_CELL_H * texel;
+        float u1 = u0 + FONT_CELL_W * texel;
+        float v1 = v0 + FONT_CELL_H * texel;
+        float top = FONT_DESCENT - FONT_CELL_H;
+        
+        text_vertex_t *v = &layout->vertices[layout->num_vertices];
+        v[0] = (text_vertex_t){pen_x, top, u0, v0, {0}};
+        v[1] = (text_vertex_t){pen_x + FONT_CELL_W, top, u1, v0, {0}};
+        v[2] = (text_vertex_t){pen_x + FONT_CELL_W, FONT_DESCENT, u1, v1, {0}};
+        v[3] = (text_vertex_t){pen_x, FONT_DESCENT, u0, v1, {0}};
+        layout->num_vertices += 4;
+    }
+}
+
+void text_layout_build(text_layout_t *layout, const char *text) {
+    layout->num_vertices = 0;
+    layout->vertices = (text_vertex_t *)realloc(layout->vertices, strlen(text) * 4 * sizeof(text_vertex_t));
+    if (!layout->vertices) return;
+    text_layout_fill(layout, text);
+}
+
+// Same, for layouts that live as long as an arena and are never freed alone
+void text_layout_build_in(text_layout_t *layout, const char *text, arena_t *arena) {
+    layout->num_vertices = 0;
+    layout->vertices = (text_vertex_t *)arena_alloc(arena, (strlen(text) * 4 + 1) * sizeof(text_vertex_t));
+    if (!layout->vertices) return;
+    text_layout_fill(layout, text);
+}
+
+void text_layout_free(text_layout_t *layout) {
+    free(layout->vertices);
+    layout->vertices = NULL;
+    layout->num_vertices = 0;
+}
+
+// Queue a prebuilt layout at (x, y) in the current GL color
+void draw_text_layout(float x, float y, const text_layout_t *layout) {
+    if (layout->num_vertices == 0) return;
+    
+    if (text_batch_count + layout->num_vertices > text_batch_capacity) {
+        int new_capacity = text_batch_capacity ? text_batch_capacity * 2 : 4096;
+        while (new_capacity < text_batch_count + layout->num_vertices) new_capacity *= 2;
+        text_vertex_t *grown = (text_vertex_t *)realloc(text_batch, new_capacity * sizeof(text_vertex_t));
+        if (!grown) return;
+        text_batch = grown;
+        text_batch_capacity = new_capacity;
+    }
+    
+    // Strings are drawn in whatever color the caller last set, as glutBitmapCharacter did
+    float color[4];
+    glGetFloatv(GL_CURRENT_COLOR, color);
+    unsigned char rgba[4] = {
+        (unsigned char)(color[0] * 255.0f), (unsigned char)(color[1] * 255.0f),
+        (unsigned char)(color[2] * 255.0f), (unsigned char)(color[3] * 255.0f)
+    };
+    
+    // Snap to whole pixels so glyphs stay crisp with GL_NEAREST
+    x = floorf(x);
+    y = floorf(y);
+    
+    text_vertex_t *dest = &text_batch[text_batch_count];
+    for (int i = 0; i < layout->num_vertices; i++) {
+        dest[i].x = layout->vertices[i].x + x;
+        dest[i].y = layout->vertices[i].y + y;
+        dest[i].u = layout->vertices[i].u;
+        dest[i].v = layout->vertices[i].v;
+        memcpy(dest[i].rgba, rgba, 4);
+    }
+    text_batch_count += layout->num_vertices;
+}
+
+void draw_string(float x, float y, const char *text) {
+    static text_layout_t scratch = {0};
+    text_layout_build(&scratch, text);
+    draw_text_layout(x, y, &scratch);
+}
+
+// Start a new frame's text batch
+void text_begin_frame() {
+    text_batch_count = 0;
+    text_batch_flushed = 0;
+}
+
+// Draw all text queued since the last flush in one call.
+// Flush before drawing anything that should cover the queued text.
+void text_flush() {
+    int count = text_batch_count - text_batch_flushed;
+    if (count <= 0 || font_atlas_texture == 0) return;
+    
+    GLboolean blend_was_enabled = glIsEnabled(GL_BLEND);
+    float current_color[4];
+    glGetFloatv(GL_CURRENT_COLOR, current_color);
+    glEnable(GL_BLEND);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, font_atlas_texture);
+    
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(text_vertex_t), &text_batch[0].x);
+    glTexCoordPointer(2, GL_FLOAT, sizeof(text_vertex_t), &text_batch[0].u);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(text_vertex_t), text_batch[0].rgba);
+    
+    glDrawArrays(GL_QUADS, text_batch_flushed, count);
+    
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisable(GL_TEXTURE_2D);
+    if (!blend_was_enabled) glDisable(GL_BLEND);
+    glColor4fv(current_color);  // The color array leaves the current color undefined
+    
+    text_batch_flushed = text_batch_count;
+}
+
+// The file selector menu
+// Rows of the WAD list that fit in the selector box
+int wad_list_visible_rows() {
+    int rows = (window_height / 2 - 110) / 20;
+    return rows > 0 ? rows : 1;
+}
+
+// Keep the selected WAD inside the visible part of the list
+void wad_list_scroll_to_selection() {
+    int rows = wad_list_visible_rows();
+    if (selected_wad_index < wad_list_scroll) wad_list_scroll = selected_wad_index;
+    if (selected_wad_index >= wad_list_scroll + rows) wad_list_scroll = selected_wad_index - rows + 1;
+    if (wad_list_scroll < 0) wad_list_scroll = 0;
+}
+
+// The file selector menu
+void file_selector_menu() {
+    // Semi-transparent background
+    glColor4f(0.0, 0.0, 0.5, 0.8);
+    glEnable(GL_BLEND);
+    glBegin(GL_QUADS);
+        glVertex2f(window_width/4, window_height/4);
+        glVertex2f(window_width*3/4, window_height/4);
+        glVertex2f(window_width*3/4, window_height*3/4);
+        glVertex2f(window_width/4, window_height*3/4);
+    glEnd();
+    glDisable(GL_BLEND);
+    
+    // Title
+    glColor3f(1.0, 1.0, 0.0);
+    draw_string(window_width/4 + 20, window_height/4 + 20, "Select a WAD file to load:");
+    
+    // Filter box: typing narrows the list
+    char filter_line[320];
+    snprintf(filter_line, sizeof(filter_line), "Filter: %s_  (%d of %d)",
+             wad_filter, num_filtered_wads, num_available_wads);
+    glColor3f(0.7, 1.0, 0.7);
+    draw_string(window_width/4 + 20, window_height/4 + 40, filter_line);
+    
+    int rows = wad_list_visible_rows();
+    int max_chars = (window_width / 2 - 40) / FONT_CELL_W;
+    
+    // Visible slice of the filtered WAD list
+    for (int row = 0; row < rows && wad_list_scroll + row < num_filtered_wads; row++) {
+        int i = wad_list_scroll + row;
+        const wad_info_t *info = &available_wads[filtered_wads[i]];
+        int y = window_height/4 + 60 + row*20;
+        
+        if (i == selected_wad_index) {
+            // Highlight selected item
+            glColor3f(1.0, 1.0, 0.0);
+            glBegin(GL_QUADS);
+                glVertex2f(window_width/4 + 10, y - 3);
+                glVertex2f(window_width*3/4 - 10, y - 3);
+                glVertex2f(window_width*3/4 - 10, y + 15);
+                glVertex2f(window_width/4 + 10, y + 15);
+            glEnd();
+            glColor3f(0.0, 0.0, 0.0);
+        } else {
+            glColor3f(1.0, 1.0, 1.0);
+        }
+        
+        // Summary from the header probe, right-aligned
+        char details[64];
+        snprintf(details, sizeof(details), " %s %5d lumps %3d maps%s",
+                 info->type == WAD_TYPE_IWAD ? "IWAD" : info->type == WAD_TYPE_PK3 ? "PK3 " : "PWAD",
+                 info->num_lumps, info->num_maps, info->has_palette ? " PAL" : "");
+        
+        // Show the stack position of WADs that are already loaded, and keep
+        // the end of long paths since that is where the file name is
+        char prefix[8] = "    ";
+        int stack_index = wad_stack_find(info->path);
+        if (stack_index >= 0) {
+            snprintf(prefix, sizeof(prefix), "[%d] ", stack_index + 1);
+        }
+        
+        int path_chars = max_chars - (int)strlen(prefix) - (int)strlen(details);
+        int path_len = strlen(info->path);
+        char entry[1100];
+        if (path_chars < 4) {
+            snprintf(entry, sizeof(entry), "%s", prefix);
+        } else if (path_len > path_chars) {
+            snprintf(entry, sizeof(entry), "%s...%s", prefix, info->path + path_len - (path_chars - 3));
+        } else {
+            snprintf(entry, sizeof(entry), "%s%s", prefix, info->path);
+        }
+        draw_string(window_width/4 + 20, y, entry);
+        draw_string(window_width*3/4 - 20 - (int)strlen(details) * FONT_CELL_W, y, details);
+    }
+    
+    // Instructions
+    glColor3f(0.7, 0.7, 1.0);
+    draw_string(window_width/4 + 20, window_height*3/4 - 40, "Type to filter, Enter load, Ins add PWAD, Del remove, Esc cancel");
+    text_flush();
+}
+
+// Work out paging for the current window size. Cheap; runs every frame.
+void update_page_layout() {
+    // Calculate how many images we can display per page
+    images_per_page = images_per_row * ((window_height - 50) / (image_size + image_padding));
+    if (images_per_page <= 0) images_per_page = 1;
+    
+    // Calculate total pages
+    total_pages = 1;
+    if (num_shown_images > 0) {
+        total_pages = (num_shown_images + images_per_page - 1) / images_per_page;
+    }
+    
+    // Make sure current page is valid
+    if (current_page >= total_pages) current_page = total_pages - 1;
+    if (current_page < 0) current_page = 0;
+}
+
+// Read the PK3 members on the current page before it is drawn, and bring
+// the grid arrays up to date for images loaded since the view was built
+void load_page_images() {
+    if (automap_mode || !shown_images) return;
+    
+    int start = current_page * images_per_page;
+    int end = start + images_per_page < num_shown_images ? start + images_per_page : num_shown_images;
+    if (start >= end) return;
+    
+    wad_image_t **pending = (wad_image_t **)malloc((end - start) * sizeof(wad_image_t *));
+    if (!pending) return;
+    int count = 0;
+    for (int i = start; i < end; i++) {
+        wad_image_t *image = grid_images[shown_images[i]];
+        if (image->pending) pending[count++] = image;
+    }
+    if (count > 0) load_pending_images(pending, count);
+    free(pending);
+    
+    bool changed = false;
+    for (int i = start; i < end; i++) {
+        int k = shown_images[i];
+        wad_image_t *image = grid_images[k];
+        if (grid_textures[k] == image->texture_id && ((grid_flags[k] & GRID_VALID) != 0) == image->is_valid) continue;
+        grid_width[k] = image->width;
+        grid_height[k] = image->height;
+        grid_format[k] = image->format;
+        grid_flags[k] = (image->is_valid ? GRID_VALID : 0) | (image->overridden ? GRID_OVERRIDDEN : 0);
+        grid_textures[k] = image->texture_id;
+        changed = true;
+    }
+    
+    // Upscale the enlarged images that have no texture at their factor yet
+    if (pixel_scaler != SCALER_NONE) {
+        wad_image_t **scale = (wad_image_t **)malloc((end - start) * sizeof(wad_image_t *));
+        int *factors = (int *)malloc((end - start) * sizeof(int));
+        int num_scale = 0;
+        for (int i = start; scale && factors && i < end; i++) {
+            int k = shown_images[i];
+            int factor = scaler_factor(grid_magnification(k));
+            if (factor == 0 || !(grid_flags[k] & GRID_VALID) || grid_textures[k] == 0 ||
+                grid_format[k] == IMAGE_FORMAT_MAP || grid_images[k]->scaled_textures[factor - 2] > 0) continue;
+            scale[num_scale] = grid_images[k];
+            factors[num_scale++] = factor;
+        }
+        if (num_scale > 0 && upscale_images(scale, factors, num_scale)) changed = true;
+        free(scale);
+        free(factors);
+    }
+    if (changed) invalidate_layers();
+}
+
+// How many times larger than its size grid cell k draws its image
+float grid_magnification(int k) {
+    if (offset_view && (grid_format[k] == IMAGE_FORMAT_PATCH || grid_format[k] == IMAGE_FORMAT_PNG)) {
+        return (float)image_size / OFFSET_VIEW_UNITS;
+    }
+    int longest = grid_width[k] > grid_height[k] ? grid_width[k] : grid_height[k];
+    return longest > 0 ? (float)image_size / longest : 0.0f;
+}
+
+void draw_grid() {
+    if (automap_mode) {
+        draw_automap();
+        return;
+    }
+    
+    glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glEnable(GL_BLEND);
+    
+    // Calculate starting image index
+    int start_idx = current_page * images_per_page;
+    
+    // Draw images for current page
+    for (int i = 0; i < images_per_page && start_idx + i < num_shown_images; i++) {
+        int row = i / images_per_row;
+        int col = i % images_per_row;
+        
+        // Calculate position but ensure integer coordinates
+        int x = col * (image_size + image_padding) + image_padding;
+        int y = row * (image_size + image_padding) + image_padding + 30; // 30px for header
+        
+        int k = shown_images[start_idx + i];
+        wad_image_t *img = grid_images[k];
+        bool overridden = (grid_flags[k] & GRID_OVERRIDDEN) != 0;
+        
+        if ((grid_flags[k] & GRID_VALID) && grid_textures[k] > 0) {
+            // Calculate aspect ratio
+            float aspect_ratio = (float)grid_width[k] / (float)grid_height[k];
+            
+            // Calculate display dimensions while preserving aspect ratio
+            int display_width, display_height;
+            
+            if (aspect_ratio >= 1.0) {
+                // Wider than tall
+                display_width = image_size;
+                display_height = (int)(image_size / aspect_ratio);
+            } else {
+                // Taller than wide
+                display_height = image_size;
+                display_width = (int)(image_size * aspect_ratio);
+            }
+            
+            // Center the image in its allocated space - ensure integer coordinates
+            int x_offset = (image_size - display_width) / 2;
+            int y_offset = (image_size - display_height) / 2;
+            
+            // Offset view places patches like the engine: the anchor sits on a
+            // shared baseline in the middle of the cell, at a common scale
+            bool anchored = offset_view && (grid_format[k] == IMAGE_FORMAT_PATCH || grid_format[k] == IMAGE_FORMAT_PNG);
+            float unit = (float)image_size / OFFSET_VIEW_UNITS;
+            int anchor_x = image_size / 2;
+            int anchor_y = image_size * 7 / 8;
+            if (anchored) {
+                display_width = (int)(grid_width[k] * unit);
+                display_height = (int)(grid_height[k] * unit);
+                x_offset = anchor_x - (int)(img->left_offset * unit);
+                y_offset = anchor_y - (int)(img->top_offset * unit);
+                
+                // Keep sprites in their own cell
+                glEnable(GL_SCISSOR_TEST);
+                glScissor(x, window_height - (y + image_size), image_size, image_size);
+            }
+            
+            // Enlarged images use their upscale when the pixel-art scaler is on
+            GLuint texture = grid_textures[k];
+            int factor = scaler_factor(grid_magnification(k));
+            if (factor > 0 && img->scaled_textures[factor - 2] > 0) texture = img->scaled_textures[factor - 2];
+            
+            // Draw image - use integer coordinates to ensure pixel-perfect alignment
+            glEnable(GL_TEXTURE_2D);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            
+            // Force glTexParameteri to enforce nearest-neighbor interpolation
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            
+            // Overridden lumps are dimmed; the engine never sees them
+            if (overridden) {
+                glColor3f(0.35, 0.35, 0.35);
+            } else {
+                glColor3f(1.0, 1.0, 1.0);
+            }
+            glBegin(GL_QUADS);
+                glTexCoord2f(0.0, 0.0); glVertex2i(x + x_offset, y + y_offset);
+                glTexCoord2f(1.0, 0.0); glVertex2i(x + x_offset + display_width, y + y_offset);
+                glTexCoord2f(1.0, 1.0); glVertex2i(x + x_offset + display_width, y + y_offset + display_height);
+                glTexCoord2f(0.0, 1.0); glVertex2i(x + x_offset, y + y_offset + display_height);
+            glEnd();
+            
+            glDisable(GL_TEXTURE_2D);
+            
+            if (anchored) {
+                glDisable(GL_SCISSOR_TEST);
+                
+                // Baseline and crosshair at the anchor
+                glColor3f(0.3, 0.3, 0.3);
+                glBegin(GL_LINES);
+                    glVertex2f(x, y + anchor_y + 0.5f);
+                    glVertex2f(x + image_size, y + anchor_y + 0.5f);
+                glEnd();
+                if (img->offset_problem) {
+                    glColor3f(1.0, 0.5, 0.0);
+                } else {
+                    glColor3f(0.0, 1.0, 1.0);
+                }
+                glBegin(GL_LINES);
+                    glVertex2f(x + anchor_x - 6, y + anchor_y + 0.5f);
+                    glVertex2f(x + anchor_x + 7, y + anchor_y + 0.5f);
+                    glVertex2f(x + anchor_x + 0.5f, y + anchor_y - 6);
+                    glVertex2f(x + anchor_x + 0.5f, y + anchor_y + 7);
+                glEnd();
+            }
+            
+            // Draw image name
+            if (overridden) {
+                glColor3f(0.6, 0.6, 0.6);
+            } else {
+                glColor3f(1.0, 1.0, 0.0);
+            }
+            draw_text_layout(x, y + image_size + 12, &img->label);
+        } else {
+            // Draw placeholder for invalid image
+            glColor3f(0.5, 0.5, 0.5);
+            glBegin(GL_QUADS);
+                glVertex2i(x, y);
+                glVertex2i(x + image_size, y);
+                glVertex2i(x + image_size, y + image_size);
+                glVertex2i(x, y + image_size);
+            glEnd();
+            
+            glColor3f(1.0, 0.0, 0.0);
+            draw_string(x, y + image_size / 2, "Invalid Image");
+            draw_text_layout(x, y + image_size / 2 + 15, &img->label);
+        }
+        
+        // Frame lumps replaced by a later WAD in the stack
+        if (overridden) {
+            glColor3f(0.8, 0.1, 0.1);
+            glBegin(GL_LINE_LOOP);
+                glVertex2f(x + 0.5f, y + 0.5f);
+                glVertex2f(x + image_size - 0.5f, y + 0.5f);
+                glVertex2f(x + image_size - 0.5f, y + image_size - 0.5f);
+                glVertex2f(x + 0.5f, y + image_size - 0.5f);
+            glEnd();
+        }
+        
+        // Diff mode frames each image by what the top WAD did to it
+        if (diff_mode && grid_diff[k] != DIFF_SAME) {
+            static const float diff_colors[NUM_DIFF_KINDS][3] = {
+                {0.0f, 0.0f, 0.0f},     // Same, not shown
+                {0.2f, 0.9f, 0.2f},     // Added
+                {0.9f, 0.2f, 0.2f},     // Removed
+                {1.0f, 0.85f, 0.1f},    // Changed
+                {0.3f, 0.5f, 1.0f},     // Moved
+                {0.2f, 0.9f, 0.9f}      // Renamed
+            };
+            glColor3fv(diff_colors[grid_diff[k]]);
+            for (float inset = 0.5f; inset < 2.0f; inset += 1.0f) {
+                glBegin(GL_LINE_LOOP);
+                    glVertex2f(x + inset, y + inset);
+                    glVertex2f(x + image_size - inset, y + inset);
+                    glVertex2f(x + image_size - inset, y + image_size - inset);
+                    glVertex2f(x + inset, y + image_size - inset);
+                glEnd();
+            }
+        }
+    }
+    text_flush();
+}
+
+// Build the map's vertex buffer once: two vertices per linedef, colored
+// like the engine's automap, followed by one point per thing
+void build_map_buffer(map_data_t *map) {
+    int num_vertices = map->num_linedefs * 2 + map->num_things;
+    map->buffer = (map_vertex_t *)arena_alloc(&map->wad->arena, (num_vertices + 1) * sizeof(map_vertex_t));
+    if (!map->buffer) return;
+    
+    for (int i = 0; i < map->num_linedefs; i++) {
+        unsigned char r, g, b;
+        int front = map->line_front_sector[i], back = map->line_back_sector[i];
+        
+        if (front < 0 || back < 0) {
+            r = 220; g = 40; b = 40;     // One-sided wall
+        } else if (map->sector_floor[front] != map->sector_floor[back]) {
+            r = 190; g = 120; b = 60;    // Floor height change
+        } else if (map->sector_ceiling[front] != map->sector_ceiling[back]) {
+            r = 230; g = 230; b = 80;    // Ceiling height change
+        } else {
+            r = 90; g = 90; b = 90;      // No height change
+        }
+        
+        map_vertex_t *v = &map->buffer[i * 2];
+        v[0] = (map_vertex_t){map->vertex_x[map->line_v1[i]], map->vertex_y[map->line_v1[i]], {r, g, b, 255}};
+        v[1] = (map_vertex_t){map->vertex_x[map->line_v2[i]], map->vertex_y[map->line_v2[i]], {r, g, b, 255}};
+    }
+    
+    for (int i = 0; i < map->num_things; i++) {
+        map->buffer[map->num_linedefs * 2 + i] = (map_vertex_t){map->thing_x[i], map->thing_y[i], {60, 220, 60, 255}};
+    }
+    
+    // Upload once; the CPU copy stays for drivers without vertex buffer objects
+    if (vbo_supported) {
+        gl_gen_buffers(1, &map->vbo);
+        gl_bind_buffer(GL_ARRAY_BUFFER, map->vbo);
+        gl_buffer_data(GL_ARRAY_BUFFER, num_vertices * sizeof(map_vertex_t), map->buffer, GL_STATIC_DRAW);
+        gl_bind_buffer(GL_ARRAY_BUFFER, 0);
+    }
+    map->buffer_ready = true;
+}
+
+// Center the automap on a map and zoom so the whole map fits
+void automap_fit() {
+    if (automap_index >= num_all_maps) return;
+    map_data_t *map = all_maps[automap_index];
+    
+    automap_center_x = (map->min_x + map->max_x) / 2;
+    automap_center_y = (map->min_y + map->max_y) / 2;
+    float zoom_x = (window_width - 40) / fmaxf(map->max_x - map->min_x, 1.0f);
+    float zoom_y = (window_height - 90) / fmaxf(map->max_y - map->min_y, 1.0f);
+    automap_zoom = fminf(zoom_x, zoom_y);
+}
+
+// Window pixel to map coordinates for the current pan and zoom
+void automap_to_map(int x, int y, float *map_x, float *map_y) {
+    *map_x = automap_center_x + (x - window_width / 2.0f) / automap_zoom;
+    *map_y = automap_center_y - (y - window_height / 2.0f) / automap_zoom;
+}
+
+// Gather the linedefs in grid cells overlapping a map rectangle. Lines
+// spanning several cells are reported once. Returns the number of lines.
+int map_lines_in_rect(map_data_t *map, float x1, float y1, float x2, float y2, int *out) {
+    map_grid_t *grid = &map->grid;
+    if (!grid->cell_start || !grid->cell_lines) return 0;
+    
+    if (!map->line_stamp) {
+        map->line_stamp = (unsigned int *)arena_calloc(&map->wad->arena, (map->num_linedefs + 1) * sizeof(unsigned int));
+        if (!map->line_stamp) return 0;
+    }
+    unsigned int stamp = ++map->stamp;
+    
+    int cx1 = (int)floorf((x1 - grid->origin_x) / grid->cell_size);
+    int cx2 = (int)floorf((x2 - grid->origin_x) / grid->cell_size);
+    int cy1 = (int)floorf((y1 - grid->origin_y) / grid->cell_size);
+    int cy2 = (int)floorf((y2 - grid->origin_y) / grid->cell_size);
+    if (cx1 < 0) cx1 = 0;
+    if (cy1 < 0) cy1 = 0;
+    if (cx2 >= grid->cols) cx2 = grid->cols - 1;
+    if (cy2 >= grid->rows) cy2 = grid->rows - 1;
+    
+    int count = 0;
+    for (int cy = cy1; cy <= cy2; cy++) {
+        for (int cx = cx1; cx <= cx2; cx++) {
+            int cell = cy * grid->cols + cx;
+            for (int k = grid->cell_start[cell]; k < grid->cell_start[cell + 1]; k++) {
+                int line = grid->cell_lines[k];
+                if (map->line_stamp[line] != stamp) {
+                    map->line_stamp[line] = stamp;
+                    out[count++] = line;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// Closest linedef within a few pixels of a window position, or -1
+int automap_pick_line(int x, int y) {
+    if (automap_index >= num_all_maps) return -1;
+    map_data_t *map = all_maps[automap_index];
+    
+    float px, py;
+    automap_to_map(x, y, &px, &py);
+    float radius = 6.0f / automap_zoom;
+    
+    int *candidates = (int *)malloc((map->num_linedefs + 1) * sizeof(int));
+    if (!candidates) return -1;
+    int count = map_lines_in_rect(map, px - radius, py - radius, px + radius, py + radius, candidates);
+    
+    int best = -1;
+    float best_distance = radius;
+    for (int k = 0; k < count; k++) {
+        int line = candidates[k];
+        float x1 = map->vertex_x[map->line_v1[line]], y1 = map->vertex_y[map->line_v1[line]];
+        float x2 = map->vertex_x[map->line_v2[line]], y2 = map->vertex_y[map->line_v2[line]];
+        
+        // Distance from the point to the segment
+        float dx = x2 - x1, dy = y2 - y1;
+        float length2 = dx * dx + dy * dy;
+        float t = length2 > 0 ? ((px - x1) * dx + (py - y1) * dy) / length2 : 0;
+        if (t < 0) t = 0;
+        if (t > 1) t = 1;
+        float ex = x1 + t * dx - px, ey = y1 + t * dy - py;
+        float distance = sqrtf(ex * ex + ey * ey);
+        
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = line;
+        }
+    }
+    
+    free(candidates);
+    return best;
+}
+
+void draw_automap() {
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    
+    if (automap_index >= num_all_maps) {
+        glColor3f(1.0, 1.0, 1.0);
+        draw_string(20, 60, "No maps in the loaded WADs. Press M to return to the grid.");
+        text_flush();
+        return;
+    }
+    
+    map_data_t *map = all_maps[automap_index];
+    if (!map->buffer_ready) build_map_buffer(map);
+    if (!map->buffer) return;
+    
+    glPushMatrix();
+    glTranslatef(window_width / 2.0f, window_height / 2.0f, 0);
+    glScalef(automap_zoom, -automap_zoom, 1);
+    glTranslatef(-automap_center_x, -automap_center_y, 0);
+    
+    const map_vertex_t *base = map->buffer;
+    if (map->vbo) {
+        gl_bind_buffer(GL_ARRAY_BUFFER, map->vbo);
+        base = NULL;   // Offsets into the bound buffer
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(map_vertex_t), &base->x);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(map_vertex_t), base->rgba);
+    
+    // When zoomed in, draw only the lines in grid cells on screen
+    float x1, y1, x2, y2;
+    automap_to_map(0, window_height, &x1, &y1);
+    automap_to_map(window_width, 0, &x2, &y2);
+    float visible_area = (x2 - x1) * (y2 - y1);
+    float map_area = fmaxf(map->max_x - map->min_x, 1.0f) * fmaxf(map->max_y - map->min_y, 1.0f);
+    
+    int lines_drawn = map->num_linedefs;
+    int *visible = NULL;
+    if (visible_area < map_area * 0.5f &&
+        (visible = (int *)malloc((map->num_linedefs + 1) * sizeof(int))) != NULL) {
+        int count = map_lines_in_rect(map, x1, y1, x2, y2, visible);
+        
+        // Each line owns vertices 2i and 2i+1 in the buffer
+        unsigned int *indices = (unsigned int *)malloc((count * 2 + 1) * sizeof(unsigned int));
+        if (indices) {
+            for (int k = 0; k < count; k++) {
+                indices[k * 2] = visible[k] * 2;
+                indices[k * 2 + 1] = visible[k] * 2 + 1;
+            }
+            glDrawElements(GL_LINES, count * 2, GL_UNSIGNED_INT, indices);
+            free(indices);
+            lines_drawn = count;
+        }
+        free(visible);
+    } else {
+        glDrawArrays(GL_LINES, 0, map->num_linedefs * 2);
+    }
+    
+    if (automap_show_things && map->num_things > 0) {
+        glPointSize(3.0f);
+        glDrawArrays(GL_POINTS, map->num_linedefs * 2, map->num_things);
+    }
+    
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (map->vbo) gl_bind_buffer(GL_ARRAY_BUFFER, 0);
+    glPopMatrix();
+    
+    // Highlight the picked line on top
+    if (automap_picked_line >= 0 && automap_picked_line < map->num_linedefs) {
+        int line = automap_picked_line;
+        float sx1 = (map->vertex_x[map->line_v1[line]] - automap_center_x) * automap_zoom + window_width / 2.0f;
+        float sy1 = window_height / 2.0f - (map->vertex_y[map->line_v1[line]] - automap_center_y) * automap_zoom;
+        float sx2 = (map->vertex_x[map->line_v2[line]] - automap_center_x) * automap_zoom + window_width / 2.0f;
+        float sy2 = window_height / 2.0f - (map->vertex_y[map->line_v2[line]] - automap_center_y) * automap_zoom;
+        glLineWidth(3.0f);
+        glColor3f(0.3, 0.8, 1.0);
+        glBegin(GL_LINES);
+            glVertex2f(sx1, sy1);
+            glVertex2f(sx2, sy2);
+        glEnd();
+        glLineWidth(1.0f);
+    }
+    
+    char info[256];
+    snprintf(info, sizeof(info), "%s from %.100s%s - %d linedefs (%d drawn), %d things, %d sectors",
+             map->name, map->wad->filename, map->overridden ? " [overridden]" : "",
+             map->num_linedefs, lines_drawn, map->num_things, map->num_sectors);
+    glColor3f(1.0, 1.0, 1.0);
+    draw_string(10, 45, info);
+    glColor3f(0.7, 0.7, 1.0);
+    draw_string(10, 62, "[ ] change map, drag/arrows pan, wheel/+/- zoom, Home fit, T things, M grid");
+    text_flush();
+}
+
+void draw_status_bar() {
+    // Draw status bar
+    glColor3f(0.0, 0.0, 0.0);
+    glBegin(GL_QUADS);
+        glVertex2i(0, window_height - 20);
+        glVertex2i(window_width, window_height - 20);
+        glVertex2i(window_width, window_height);
+        glVertex2i(0, window_height);
+    glEnd();
+    
+    // Draw page info
+    char page_info[64];
+    if (num_shown_images != total_images) {
+        sprintf(page_info, "Page %d/%d - %d of %d images", 
+                current_page + 1, total_pages, num_shown_images, total_images);
+    } else {
+        sprintf(page_info, "Page %d/%d - %d images total", 
+                current_page + 1, total_pages, total_images);
+    }
+    
+    glColor3f(1.0, 1.0, 1.0);
+    draw_string(10, window_height - 5, status_message);
+    draw_string(window_width - 10 - (int)strlen(page_info) * FONT_CELL_W, window_height - 5, page_info);
+    text_flush();
+}
+
+void draw_header() {
+    // Draw header
+    glColor3f(0.0, 0.0, 0.0);
+    glBegin(GL_QUADS);
+        glVertex2i(0, 0);
+        glVertex2i(window_width, 0);
+        glVertex2i(window_width, 25);
+        glVertex2i(0, 25);
+    glEnd();
+    
+    glColor3f(1.0, 1.0, 1.0);
+    char header_text[sizeof(wad_filename) + 96];
+    snprintf(header_text, sizeof(header_text), "DOOM WAD Image Viewer - %s - Press L to load a different WAD, H for help", 
+            strlen(wad_filename) > 0 ? wad_filename : "No WAD loaded");
+    draw_string(10, 15, header_text);
+    text_flush();
+}
+
+bool overlay_visible() {
+    return show_help || show_file_selector || show_folder_selector || search_active || show_animation;
+}
+
+// Search box, just above the status bar
+void search_bar() {
+    glColor4f(0.0, 0.0, 0.0, 0.85);
+    glEnable(GL_BLEND);
+    glBegin(GL_QUADS);
+        glVertex2i(0, window_height - 42);
+        glVertex2i(window_width, window_height - 42);
+        glVertex2i(window_width, window_height - 20);
+        glVertex2i(0, window_height - 20);
+    glEnd();
+    glDisable(GL_BLEND);
+    
+    char line[400];
+    snprintf(line, sizeof(line), "Search: %s_", search_query);
+    glColor3f(1.0, 1.0, 0.0);
+    draw_string(10, window_height - 26, line);
+    
+    snprintf(line, sizeof(line), "%d matches (%.2f ms)  TROO  TROO?1  /^TROO[A-D]/  w>=64  64x64  type:flat",
+             num_shown_images, search_time_ms);
+    glColor3f(0.7, 0.7, 1.0);
+    draw_string(window_width - 10 - (int)strlen(line) * FONT_CELL_W, window_height - 26, line);
+    text_flush();
+}
+
+// Advance the animation one engine tic; only redraw when the frame changes
+void animation_tick(int value) {
+    if (!show_animation) {
+        animation_timer_running = false;
+        return;
+    }
+    glutTimerFunc(1000 / TICRATE, animation_tick, 0);
+    
+    if (animation_paused || !animation_group || animation_group->num_frames == 0) return;
+    if (++animation_tic >= animation_tics_per_frame) {
+        animation_tic = 0;
+        animation_frame = (animation_frame + 1) % animation_group->num_frames;
+        glutPostRedisplay();
+    }
+}
+
+// Open the animation preview for the sprite a lump belongs to
+void start_animation(const wad_image_t *image) {
+    sprite_group_t *group = image ? find_sprite_group(image->name) : NULL;
+    if (!group || strcmp(image->ns, "S") != 0) {
+        sprintf(status_message, "Click a sprite first, then press A to animate it");
+        return;
+    }
+    if (!build_sprite_atlas(group)) {
+        sprintf(status_message, "Could not build the frame atlas for %s", group->prefix);
+        return;
+    }
+    
+    animation_group = group;
+    animation_frame = 0;
+    animation_tic = 0;
+    animation_paused = false;
+    animation_rotation = 1;
+    show_animation = true;
+    if (!animation_timer_running) {
+        animation_timer_running = true;
+        glutTimerFunc(1000 / TICRATE, animation_tick, 0);
+    }
+}
+
+void draw_animation() {
+    sprite_group_t *group = animation_group;
+    int left = window_width / 4, top = window_height / 4;
+    int right = window_width * 3 / 4, bottom = window_height * 3 / 4;
+    
+    glColor4f(0.0, 0.0, 0.0, 0.85);
+    glEnable(GL_BLEND);
+    glBegin(GL_QUADS);
+        glVertex2i(left, top);
+        glVertex2i(right, top);
+        glVertex2i(right, bottom);
+        glVertex2i(left, bottom);
+    glEnd();
+    
+    int frame = group->frame_order[animation_frame % group->num_frames];
+    sprite_view_t *view = sprite_frame_view(group, frame, animation_rotation);
+    
+    if (view && view->image) {
+        // One scale for the whole playback; frames are placed by their patch
+        // offsets around a fixed anchor, mirrored views with the offset flipped
+        int area_height = bottom - top - 70;
+        int scale = area_height / OFFSET_VIEW_UNITS;
+        if (scale > 4) scale = 4;
+        if (scale < 1) scale = 1;
+        wad_image_t *image = view->image;
+        int width = image->width * scale, height = image->height * scale;
+        int anchor_x = (left + right) / 2, anchor_y = bottom - 40;
+        int x = anchor_x - width / 2;
+        int y = anchor_y - height;
+        if (image->format == IMAGE_FORMAT_PATCH || image->format == IMAGE_FORMAT_PNG) {
+            x = anchor_x - (view->flipped ? image->width - image->left_offset : image->left_offset) * scale;
+            y = anchor_y - image->top_offset * scale;
+        }
+        
+        // The whole group lives in one texture; each frame is just new UVs
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, group->atlas);
+        glColor3f(1.0, 1.0, 1.0);
+        glBegin(GL_QUADS);
+            glTexCoord2f(view->u0, view->v0); glVertex2i(x, y);
+            glTexCoord2f(view->u1, view->v0); glVertex2i(x + width, y);
+            glTexCoord2f(view->u1, view->v1); glVertex2i(x + width, y + height);
+            glTexCoord2f(view->u0, view->v1); glVertex2i(x, y + height);
+        glEnd();
+        glDisable(GL_TEXTURE_2D);
+    }
+    
+    char line[256];
+    snprintf(line, sizeof(line), "%s frame %c (%d of %d), rotation %d: %s%s",
+             group->prefix, 'A' + frame, animation_frame % group->num_frames + 1, group->num_frames,
+             animation_rotation, view && view->image ? view->image->name : "-",
+             view && view->flipped ? " mirrored" : "");
+    glColor3f(1.0, 1.0, 0.0);
+    draw_string(left + 10, top + 20, line);
+    
+    snprintf(line, sizeof(line), "%d tics/frame%s - Left/Right rotate, +/- speed, Space pause, Esc close",
+             animation_tics_per_frame, animation_paused ? " (paused)" : "");
+    glColor3f(0.8, 0.8, 0.8);
+    draw_string(left + 10, bottom - 12, line);
+    text_flush();
+}
+
+void draw_overlays() {
+    // Show help screen if requested
+    if (show_help) {
+        // Semi-transparent background
+        glColor4f(0.0, 0.0, 0.5, 0.8);
+        glEnable(GL_BLEND);
+        glBegin(GL_QUADS);
+            glVertex2i(window_width/4, window_height/4);
+            glVertex2i(window_width*3/4, window_height/4);
+            glVertex2i(window_width*3/4, window_height*3/4);
+            glVertex2i(window_width/4, window_height*3/4);
+        glEnd();
+        glDisable(GL_BLEND);
+        
+        // Help text
+        glColor3f(1.0, 1.0, 1.0);
+        const char *help_text[] = {
+            "DOOM WAD Image Viewer - Help",
+            "",
+            "Navigation:",
+            "  Page Up/Down - Move between pages",
+            "  Home/End - Go to first/last page",
+            "",
+            "Display Options:",
+            "  +/- - Change image size",
+            "  Left/Right - Change images per row",
+            "  / - Search lumps (TROO, TROO?1, /regex/, w>=64, 64x64, type:flat)",
+            "  M - Automap ([ ] change map, drag to pan, wheel to zoom, T things)",
+            "  A - Animate the selected sprite's frames",
+            "  O - Offset view (anchor patches on a baseline), V - Check sprite offsets",
+            "  X - Pixel-art scaler for enlarged images (off, Scale2x/EPX, Scale3x)",
+            "  D - Diff the top two WADs (green added, red removed, yellow changed,",
+            "      blue moved, cyan renamed)",
+            "  F - Show images that look like the selected one (F again to go back)",
+            "",
+            "Other Controls:",
+            "  L - Load a WAD (Ins adds it as a PWAD, Del removes it)",
+            "  U - Unload the topmost PWAD",
+            "  R - Refresh available WAD files",
+            "  H - Toggle help screen",
+            "  8 - Convert PNG/TGA/BMP folder to WAD file",
+            "  Esc - Quit program",
+            "",
+            "Press any key to close this help"
+        };
+        
+        int y_pos = window_height/4 + 20;
+        for (int i = 0; i < sizeof(help_text)/sizeof(help_text[0]); i++) {
+            draw_string(window_width/4 + 20, y_pos, help_text[i]);
+            y_pos += 20;
+        }
+        text_flush();
+    }
+    
+    // Show file selector if requested
+    if (show_file_selector) {
+        file_selector_menu();
+    }
+    // show folder selector if
+    if (show_folder_selector) {
+        folder_selector_menu();
+    }
+    if (search_active) {
+        search_bar();
+    }
+    if (show_animation) {
+        draw_animation();
+    }
+}
+
+// Extension entry points come from GLUT, or from EGL when there is no window
+gl_proc_t gl_proc_address(const char *name) {
+    if (offscreen_proc_address) return offscreen_proc_address(name);
+    return (gl_proc_t)glutGetProcAddress(name);
+}
+
+// Load the framebuffer object and vertex buffer entry points. opengl32.dll only exports GL 1.1,
+// so these always have to be looked up at runtime.
+void load_gl_extensions() {
+    gl_gen_framebuffers = (PFNGLGENFRAMEBUFFERSEXTPROC)gl_proc_address("glGenFramebuffersEXT");
+    gl_delete_framebuffers = (PFNGLDELETEFRAMEBUFFERSEXTPROC)gl_proc_address("glDeleteFramebuffersEXT");
+    gl_bind_framebuffer = (PFNGLBINDFRAMEBUFFEREXTPROC)gl_proc_address("glBindFramebufferEXT");
+    gl_framebuffer_texture_2d = (PFNGLFRAMEBUFFERTEXTURE2DEXTPROC)gl_proc_address("glFramebufferTexture2DEXT");
+    gl_check_framebuffer_status = (PFNGLCHECKFRAMEBUFFERSTATUSEXTPROC)gl_proc_address("glCheckFramebufferStatusEXT");
+    gl_blend_func_separate = (PFNGLBLENDFUNCSEPARATEPROC)gl_proc_address("glBlendFuncSeparate");
+    gl_gen_buffers = (PFNGLGENBUFFERSPROC)gl_proc_address("glGenBuffers");
+    gl_delete_buffers = (PFNGLDELETEBUFFERSPROC)gl_proc_address("glDeleteBuffers");
+    gl_bind_buffer = (PFNGLBINDBUFFERPROC)gl_proc_address("glBindBuffer");
+    gl_buffer_data = (PFNGLBUFFERDATAPROC)gl_proc_address("glBufferData");
+    gl_compressed_tex_image_2d = (PFNGLCOMPRESSEDTEXIMAGE2DPROC)gl_proc_address("glCompressedTexImage2D");
+    
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    layers_supported = extensions && strstr(extensions, "GL_EXT_framebuffer_object") &&
+                       gl_gen_framebuffers && gl_delete_framebuffers && gl_bind_framebuffer &&
+                       gl_framebuffer_texture_2d && gl_check_framebuffer_status && gl_blend_func_separate;
+    
+    // Vertex buffers are core since GL 1.5; older drivers use client arrays
+    const char *version = (const char *)glGetString(GL_VERSION);
+    vbo_supported = version && (version[0] > '1' || (version[0] == '1' && version[2] >= '5')) &&
+                    gl_gen_buffers && gl_delete_buffers && gl_bind_buffer && gl_buffer_data;
+    
+    // S3TC has been in Mesa, llvmpipe included, since 17.3
+    texture_compression_supported = extensions && strstr(extensions, "GL_EXT_texture_compression_s3tc") &&
+                                    gl_compressed_tex_image_2d;
+}
+
+// Force every cached layer to be redrawn on the next frame
+void invalidate_layers() {
+    layer_generation++;
+}
+
+static int next_pow2(int v) {
+    int p = 1;
+    while (p < v) p <<= 1;
+    return p;
+}
+
+// (Re)create a layer's render target if the area it covers has grown
+bool layer_resize(render_layer_t *layer, int x, int y, int width, int height) {
+    layer->x = x;
+    layer->y = y;
+    layer->width = width;
+    layer->height = height;
+    
+    int tex_width = next_pow2(width);
+    int tex_height = next_pow2(height);
+    if (layer->fbo && tex_width <= layer->tex_width && tex_height <= layer->tex_height) {
+        return true;
+    }
+    
+    if (layer->fbo) {
+        gl_delete_framebuffers(1, &layer->fbo);
+        glDeleteTextures(1, &layer->texture);
+        layer->fbo = 0;
+        layer->texture = 0;
+    }
+    
+    layer->tex_width = tex_width;
+    layer->tex_height = tex_height;
+    layer->signature[0] = '\0';
+    
+    glGenTextures(1, &layer->texture);
+    glBindTexture(GL_TEXTURE_2D, layer->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, tex_width, tex_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    
+    gl_gen_framebuffers(1, &layer->fbo);
+    gl_bind_framebuffer(GL_FRAMEBUFFER_EXT, layer->fbo);
+    gl_framebuffer_texture_2d(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, layer->texture, 0);
+    bool complete = gl_check_framebuffer_status(GL_FRAMEBUFFER_EXT) == GL_FRAMEBUFFER_COMPLETE_EXT;
+    gl_bind_framebuffer(GL_FRAMEBUFFER_EXT, window_framebuffer);
+    
+    return complete;
+}
+
+// Returns true (and remembers the signature) if the layer's contents are stale
+bool layer_needs_redraw(render_layer_t *layer, const char *signature) {
+    if (strcmp(layer->signature, signature) == 0) return false;
+    strncpy(layer->signature, signature, sizeof(layer->signature) - 1);
+    layer->signature[sizeof(layer->signature) - 1] = '\0';
+    return true;
+}
+
+// Redirect drawing into the layer. Window coordinates keep working unchanged.
+void layer_begin(render_layer_t *layer, bool transparent) {
+    gl_bind_framebuffer(GL_FRAMEBUFFER_EXT, layer->fbo);
+    glViewport(0, 0, layer->width, layer->height);
+    
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluOrtho2D(layer->x, layer->x + layer->width, layer->y + layer->height, layer->y);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    
+    if (transparent) {
+        // Keep the layer premultiplied so it composites like it was drawn in place
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        gl_blend_func_separate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    }
+}
+
+void layer_end() {
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    gl_bind_framebuffer(GL_FRAMEBUFFER_EXT, window_framebuffer);
+}
+
+void layer_composite(const render_layer_t *layer, bool transparent) {
+    float u = (float)layer->width / layer->tex_width;
+    float v = (float)layer->height / layer->tex_height;
+    
+    if (transparent) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    } else {
+        glDisable(GL_BLEND);
+    }
+    
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, layer->texture);
+    glColor3f(1.0, 1.0, 1.0);
+    glBegin(GL_QUADS);
+        glTexCoord2f(0, v); glVertex2i(layer->x, layer->y);
+        glTexCoord2f(u, v); glVertex2i(layer->x + layer->width, layer->y);
+        glTexCoord2f(u, 0); glVertex2i(layer->x + layer->width, layer->y + layer->height);
+        glTexCoord2f(0, 0); glVertex2i(layer->x, layer->y + layer->height);
+    glEnd();
+    glDisable(GL_TEXTURE_2D);
+    
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+void set_window_projection() {
+    glViewport(0, 0, window_width, window_height);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluOrtho2D(0, window_width, window_height, 0);
+    
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+}
+
+// Draw the whole scene straight into the back buffer (no FBO support)
+void display_direct() {
+    set_window_projection();
+    draw_grid();
+    draw_status_bar();
+    draw_header();
+    if (overlay_visible()) {
+        draw_overlays();
+    }
+}
+
+// Show the finished frame. Offscreen there is nothing to swap; finishing
+// makes the frame's time include the GPU work.
+void present_frame() {
+    if (offscreen) glFinish();
+    else glutSwapBuffers();
+}
+
+// Each part of the screen lives in its own cached layer and is only redrawn
+// when the state it depends on changes. A keystroke in a dialog redraws the
+// dialog layer and then just composites four textured quads.
+void display() {
+    text_begin_frame();
+    update_page_layout();
+    load_page_images();
+    
+    if (!layers_supported ||
+        !layer_resize(&layers[LAYER_GRID], 0, 0, window_width, window_height) ||
+        !layer_resize(&layers[LAYER_HEADER], 0, 0, window_width, 25) ||
+        !layer_resize(&layers[LAYER_STATUS], 0, window_height - 20, window_width, 20) ||
+        !layer_resize(&layers[LAYER_OVERLAY], 0, 0, window_width, window_height)) {
+        display_direct();
+        present_frame();
+        return;
+    }
+    
+    char signature[LAYER_SIGNATURE_SIZE];
+    
+    // Grid: scroll position, layout and the set of loaded images, or the automap view
+    if (automap_mode) {
+        snprintf(signature, sizeof(signature), "map %d %d %d %d %d %d %g %g %g",
+                 layer_generation, window_width, window_height, automap_index,
+                 automap_show_things, automap_picked_line,
+                 automap_center_x, automap_center_y, automap_zoom);
+    } else {
+        snprintf(signature, sizeof(signature), "%d %d %d %d %d %d %d %d %s",
+                 layer_generation, window_width, window_height, current_page,
+                 images_per_page, images_per_row, image_size, num_shown_images, search_query);
+        snprintf(signature + strlen(signature), sizeof(signature) - strlen(signature), " %d %d %p %d",
+                 offset_view, diff_mode, (void *)similar_image, pixel_scaler);
+    }
+    if (layer_needs_redraw(&layers[LAYER_GRID], signature)) {
+        layer_begin(&layers[LAYER_GRID], false);
+        draw_grid();
+        layer_end();
+    }
+    
+    snprintf(signature, sizeof(signature), "%d %d %d %d %d %d %s",
+             layer_generation, window_width, window_height,
+             current_page, total_pages, num_shown_images, status_message);
+    if (layer_needs_redraw(&layers[LAYER_STATUS], signature)) {
+        layer_begin(&layers[LAYER_STATUS], false);
+        draw_status_bar();
+        layer_end();
+    }
+    
+    snprintf(signature, sizeof(signature), "%d %d %s", layer_generation, window_width, wad_filename);
+    if (layer_needs_redraw(&layers[LAYER_HEADER], signature)) {
+        layer_begin(&layers[LAYER_HEADER], false);
+        draw_header();
+        layer_end();
+    }
+    
+    if (overlay_visible()) {
+        snprintf(signature, sizeof(signature), "%d %d %d %d %d %d %d %d %d %d %d %d %d %p %d %d %d %d\n%s\n%s\n%s\n%s\n%s",
+                 layer_generation, window_width, window_height,
+                 show_help, show_file_selector, show_folder_selector, search_active,
+                 selected_wad_index, wad_list_scroll, num_filtered_wads, selected_input_field,
+                 num_shown_images, show_animation, (void *)animation_group, animation_frame,
+                 animation_rotation, animation_tics_per_frame, animation_paused,
+                 wad_filter, input_png_folder, wad_output_name, output_wad_folder,
+                 search_query);
+        if (layer_needs_redraw(&layers[LAYER_OVERLAY], signature)) {
+            layer_begin(&layers[LAYER_OVERLAY], true);
+            draw_overlays();
+            layer_end();
+        }
+    }
+    
+    // Composite the cached layers
+    set_window_projection();
+    layer_composite(&layers[LAYER_GRID], false);
+    layer_composite(&layers[LAYER_STATUS], false);
+    layer_composite(&layers[LAYER_HEADER], false);
+    if (overlay_visible()) {
+        layer_composite(&layers[LAYER_OVERLAY], true);
+    }
+    
+    present_frame();
+}
+
+void reshape(int w, int h) {
+    window_width = w;
+    window_height = h;
+    glViewport(0, 0, w, h);
+    
+    // Recalculate images per page
+    images_per_page = images_per_row * ((window_height - 50) / (image_size + image_padding));
+    if (images_per_page <= 0) images_per_page = 1;
+}
+
+void keyboard(unsigned char key, int x, int y) {
+    if (show_file_selector) {
+        switch (key) {
+            case 27: // Esc
+                show_file_selector = false;
+                break;
+                
+            case 13: // Enter
+                if (num_filtered_wads > 0) {
+                    load_wad_file(available_wads[filtered_wads[selected_wad_index]].path);
+                    show_file_selector = false;
+                }
+                break;
+                
+            case 127: // Delete
+                // Remove from the stack, keeping everything else loaded
+                if (num_filtered_wads > 0) {
+                    wad_stack_remove(wad_stack_find(available_wads[filtered_wads[selected_wad_index]].path));
+                }
+                break;
+                
+            case 8: // Backspace
+                if (strlen(wad_filter) > 0) {
+                    wad_filter[strlen(wad_filter)-1] = '\0';
+                    apply_wad_filter();
+                }
+                break;
+                
+            default:
+                // Anything printable goes into the filter
+                if (isprint(key) && strlen(wad_filter) < sizeof(wad_filter) - 1) {
+                    wad_filter[strlen(wad_filter)+1] = '\0';
+                    wad_filter[strlen(wad_filter)] = key;
+                    apply_wad_filter();
+                }
+                break;
+        }
+    } else if (search_active) {
+        switch (key) {
+            case 27: // Esc clears the search
+                search_query[0] = '\0';
+                search_active = false;
+                break;
+                
+            case 13: // Enter keeps the filter and returns to the grid
+                search_active = false;
+                break;
+                
+            case 8: // Backspace
+                if (strlen(search_query) > 0) {
+                    search_query[strlen(search_query)-1] = '\0';
+                }
+                break;
+                
+            default:
+                if (isprint(key) && strlen(search_query) < sizeof(search_query) - 1) {
+                    search_query[strlen(search_query)+1] = '\0';
+                    search_query[strlen(search_query)] = key;
+                }
+                break;
+        }
+        apply_lump_filter();
+        current_page = 0;
+    } else if (show_animation) {
+        switch (key) {
+            case 27: // Esc
+            case 'a':
+            case 'A':
+                show_animation = false;
+                break;
+                
+            case ' ':
+                animation_paused = !animation_paused;
+                break;
+                
+            case '+':
+            case '=':
+                // Faster: fewer tics per frame
+                if (animation_tics_per_frame > 1) animation_tics_per_frame--;
+                break;
+                
+            case '-':
+            case '_':
+                if (animation_tics_per_frame < TICRATE) animation_tics_per_frame++;
+                break;
+        }
+    } else if (show_help) {
+        // Any key closes help
+        show_help = false;
+    } else if (automap_mode && key != 27 && key != 'h' && key != 'H') {
+        switch (key) {
+            case 'm':
+            case 'M':
+                automap_mode = false;
+                break;
+                
+            case '[':
+            case ']':
+                if (num_all_maps > 0) {
+                    automap_index = (automap_index + (key == ']' ? 1 : num_all_maps - 1)) % num_all_maps;
+                    automap_picked_line = -1;
+                    automap_fit();
+                }
+                break;
+                
+            case 't':
+            case 'T':
+                automap_show_things = !automap_show_things;
+                break;
+                
+            case '+':
+            case '=':
+                automap_zoom *= 1.25f;
+                break;
+                
+            case '-':
+            case '_':
+                automap_zoom /= 1.25f;
+                break;
+        }
+    } else {
+        switch (key) {
+            case 27: // Esc key
+                exit(0);
+                break;
+                
+            case 'h':
+            case 'H':
+                show_help = true;
+                break;
+                
+            case '/':
+                search_active = true;
+                break;
+                
+            case 'a':
+            case 'A':
+                start_animation(selected_image);
+                break;
+                
+            case 'o':
+            case 'O':
+                offset_view = !offset_view;
+                break;
+                
+            case 'v':
+            case 'V':
+                validate_sprite_offsets();
+                break;
+                
+            case 'x':
+            case 'X':
+                pixel_scaler = (pixel_scaler + 1) % NUM_SCALERS;
+                sprintf(status_message, "Pixel-art scaler: %s", scaler_descriptions[pixel_scaler]);
+                break;
+                
+            case 'd':
+            case 'D':
+                diff_mode = !diff_mode;
+                if (diff_mode) {
+                    update_stack_diff();
+                } else {
+                    sprintf(status_message, "Diff mode off");
+                }
+                apply_lump_filter();
+                current_page = 0;
+                break;
+                
+            case 'f':
+            case 'F':
+                if (similar_image) {
+                    similar_image = NULL;
+                    apply_lump_filter();
+                    current_page = 0;
+                    sprintf(status_message, "Showing all images");
+                } else {
+                    find_similar_images();
+                }
+                break;
+                
+            case 'm':
+            case 'M':
+                automap_mode = true;
+                automap_picked_line = -1;
+                automap_fit();
+                if (num_all_maps == 0) {
+                    sprintf(status_message, "No maps in the loaded WADs");
+                }
+                break;
+
+                case '8':
+                case '*':
+                    show_folder_selector = true;
+                    selected_input_field = 0;  // Reset to first input field
+                    strcpy(input_png_folder, "");  // Clear previous inputs
+                    strcpy(wad_output_name, "");
+                    strcpy(output_wad_folder, "");
+                    break;
+                
+            case 'l':
+            case 'L':
+                show_file_selector = true;
+                wad_filter[0] = '\0';
+                apply_wad_filter();  // Reset filter and selection
+                break;
+                
+            case 'r':
+            case 'R':
+                find_available_wads();
+                break;
+                
+            case 'u':
+            case 'U':
+                // Drop the topmost PWAD
+                if (num_wads > 1) {
+                    wad_stack_remove(num_wads - 1);
+                }
+                break;
+                
+            case '+':
+            case '=':
+                image_size += 16;
+                if (image_size > 256) image_size = 256;
+                break;
+                
+            case '-':
+            case '_':
+                image_size -= 16;
+                if (image_size < 32) image_size = 32;
+                break;
+        }
+    }
+
+    if (show_folder_selector) {
+        switch(key) {
+            case 9:  // Tab key
+                selected_input_field = (selected_input_field + 1) % 3;
+                break;
+            
+            case 27:  // Escape key
+                show_folder_selector = false;
+                break;
+            
+            case 13:  // Enter key
+                // Validate and perform conversion
+                if (strlen(input_png_folder) > 0 && 
+                    strlen(wad_output_name) > 0 && 
+                    strlen(output_wad_folder) > 0) {
+                    int result = pngtopwad(input_png_folder, wad_output_name, output_wad_folder);
+                    if (result) {
+                        sprintf(status_message, "Successfully converted images to %s/%s.wad", 
+                                output_wad_folder, wad_output_name);
+                    } else {
+                        sprintf(status_message, "Failed to convert images");
+                    }
+                    show_folder_selector = false;
+                }
+                break;
+            
+            case 8:  // Backspace key
+                switch(selected_input_field) {
+                    case 0:  // Input PNG Folder
+                        if (strlen(input_png_folder) > 0)
+                            input_png_folder[strlen(input_png_folder)-1] = '\0';
+                        break;
+                    case 1:  // WAD Output Name
+                        if (strlen(wad_output_name) > 0)
+                            wad_output_name[strlen(wad_output_name)-1] = '\0';
+                        break;
+                    case 2:  // Output WAD Folder
+                        if (strlen(output_wad_folder) > 0)
+                            output_wad_folder[strlen(output_wad_folder)-1] = '\0';
+                        break;
+                }
+                break;
+            
+            default:
+                // Prevent input of very long paths
+                switch(selected_input_field) {
+                    case 0:  // Input PNG Folder
+                        if (strlen(input_png_folder) < sizeof(input_png_folder) - 1 && 
+                            (isalnum(key) || key == '/' || key == '.' || key == '_' || key == '-' || key == ' ')) {
+                            input_png_folder[strlen(input_png_folder)] = key;
+                            input_png_folder[strlen(input_png_folder)+1] = '\0';
+                        }
+                        break;
+                    case 1:  // WAD Output Name
+                        if (strlen(wad_output_name) < sizeof(wad_output_name) - 1 && 
+                            (isalnum(key) || key == '_')) {
+                            wad_output_name[strlen(wad_output_name)] = key;
+                            wad_output_name[strlen(wad_output_name)+1] = '\0';
+                        }
+                        break;
+                    case 2:  // Output WAD Folder
+                        if (strlen(output_wad_folder) < sizeof(output_wad_folder) - 1 && 
+                            (isalnum(key) || key == '/' || key == '.' || key == '_' || key == '-' || key == ' ')) {
+                            output_wad_folder[strlen(output_wad_folder)] = key;
+                            output_wad_folder[strlen(output_wad_folder)+1] = '\0';
+                        }
+                        break;
+                }
+                break;
+        }
+        glutPostRedisplay();
+        return;
+    }
+    
+    glutPostRedisplay();
+}
+
+void special_keys(int key, int x, int y) {
+    if (show_file_selector) {
+        switch (key) {
+            case GLUT_KEY_UP:
+                selected_wad_index--;
+                if (selected_wad_index < 0) {
+                    selected_wad_index = num_filtered_wads - 1;
+                }
+                break;
+                
+            case GLUT_KEY_DOWN:
+                selected_wad_index++;
+                if (selected_wad_index >= num_filtered_wads) {
+                    selected_wad_index = 0;
+                }
+                break;
+                
+            case GLUT_KEY_PAGE_UP:
+                selected_wad_index -= wad_list_visible_rows();
+                if (selected_wad_index < 0) selected_wad_index = 0;
+                break;
+                
+            case GLUT_KEY_PAGE_DOWN:
+                selected_wad_index += wad_list_visible_rows();
+                if (selected_wad_index >= num_filtered_wads) selected_wad_index = num_filtered_wads - 1;
+                break;
+                
+            case GLUT_KEY_HOME:
+                selected_wad_index = 0;
+                break;
+                
+            case GLUT_KEY_END:
+                selected_wad_index = num_filtered_wads - 1;
+                break;
+                
+            case GLUT_KEY_INSERT:
+                // Add as a PWAD on top of the current stack
+                if (num_filtered_wads > 0) {
+                    wad_stack_push(available_wads[filtered_wads[selected_wad_index]].path);
+                }
+                break;
+        }
+        if (selected_wad_index < 0) selected_wad_index = 0;
+        wad_list_scroll_to_selection();
+    } else if (show_animation) {
+        switch (key) {
+            case GLUT_KEY_LEFT:
+                animation_rotation = animation_rotation > 1 ? animation_rotation - 1 : 8;
+                break;
+                
+            case GLUT_KEY_RIGHT:
+                animation_rotation = animation_rotation < 8 ? animation_rotation + 1 : 1;
+                break;
+        }
+    } else if (automap_mode) {
+        // Arrows pan by an eighth of the window
+        float step = window_width / 8.0f / automap_zoom;
+        switch (key) {
+            case GLUT_KEY_LEFT:  automap_center_x -= step; break;
+            case GLUT_KEY_RIGHT: automap_center_x += step; break;
+            case GLUT_KEY_UP:    automap_center_y += step; break;
+            case GLUT_KEY_DOWN:  automap_center_y -= step; break;
+            case GLUT_KEY_HOME:  automap_fit(); break;
+                
+            case GLUT_KEY_PAGE_UP:
+            case GLUT_KEY_PAGE_DOWN:
+                if (num_all_maps > 0) {
+                    automap_index = (automap_index + (key == GLUT_KEY_PAGE_DOWN ? 1 : num_all_maps - 1)) % num_all_maps;
+                    automap_picked_line = -1;
+                    automap_fit();
+                }
+                break;
+        }
+    } else {
+        switch (key) {
+            case GLUT_KEY_PAGE_UP:
+                current_page--;
+                if (current_page < 0) current_page = 0;
+                break;
+                
+            case GLUT_KEY_PAGE_DOWN:
+                current_page++;
+                // Upper bound check happens in display()
+                break;
+                
+            case GLUT_KEY_HOME:
+                current_page = 0;
+                break;
+                
+            case GLUT_KEY_END:
+                // Set to a high value, will be clamped in display()
+                current_page = 9999;
+                break;
+                
+            case GLUT_KEY_LEFT:
+                images_per_row--;
+                if (images_per_row < 1) images_per_row = 1;
+                break;
+                
+            case GLUT_KEY_RIGHT:
+                images_per_row++;
+                if (images_per_row > 8) images_per_row = 8;
+                break;
+        }
+    }
+    
+    glutPostRedisplay();
+}
+
+void mouse(int button, int state, int x, int y) {
+    if (automap_mode) {
+        if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
+            automap_dragging = true;
+            drag_x = x;
+            drag_y = y;
+            
+            // Report the linedef under the cursor
+            automap_picked_line = automap_pick_line(x, y);
+            if (automap_picked_line >= 0) {
+                map_data_t *map = all_maps[automap_index];
+                int line = automap_picked_line;
+                int front = map->line_front_sector[line], back = map->line_back_sector[line];
+                sprintf(status_message, "%s linedef %d: flags 0x%04x, special %d, front sector %d, back sector %d",
+                        map->name, line, map->line_flags[line], map->line_special[line], front, back);
+            }
+        } else if (button == GLUT_LEFT_BUTTON && state == GLUT_UP) {
+            automap_dragging = false;
+        } else if (state == GLUT_DOWN && (button == 3 || button == 4)) {
+            // Wheel zooms around the cursor
+            float before_x, before_y, after_x, after_y;
+            automap_to_map(x, y, &before_x, &before_y);
+            automap_zoom *= (button == 3) ? 1.25f : 0.8f;
+            automap_to_map(x, y, &after_x, &after_y);
+            automap_center_x += before_x - after_x;
+            automap_center_y += before_y - after_y;
+        }
+        glutPostRedisplay();
+        return;
+    }
+    
+    if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
+        // Calculate which image was clicked (if any)
+        int row = (y - 30) / (image_size + image_padding);
+        int col = x / (image_size + image_padding);
+        
+        if (row >= 0 && col >= 0 && col < images_per_row) {
+            int idx = current_page * images_per_page + row * images_per_row + col;
+            if (idx >= 0 && idx < num_shown_images) {
+                // Display info about the clicked image
+                wad_image_t *img = grid_images[shown_images[idx]];
+                selected_image = img;
+                sprintf(status_message, "Selected: %s (%dx%d, %d bytes) from %.150s%s", 
+                        img->name, img->width, img->height, img->size, img->wad->filename,
+                        img->overridden ? " [overridden]" : "");
+                if (img->format == IMAGE_FORMAT_PATCH || img->format == IMAGE_FORMAT_PNG) {
+                    snprintf(status_message + strlen(status_message), sizeof(status_message) - strlen(status_message),
+                             ", offset %d,%d%s%s", img->left_offset, img->top_offset,
+                             img->offset_problem ? " - " : "", img->offset_problem ? img->offset_problem : "");
+                }
+                
+                // A map preview also picks the map the automap opens on
+                if (img->format == IMAGE_FORMAT_MAP) {
+                    for (int m = 0; m < num_all_maps; m++) {
+                        if (all_maps[m]->preview == img->data) automap_index = m;
+                    }
+                    sprintf(status_message, "Selected map %s from %.150s%s - press M for the automap",
+                            img->name, img->wad->filename, img->overridden ? " [overridden]" : "");
+                }
+            }
+        }
+    }
+    
+    glutPostRedisplay();
+}
+
+// Drag to pan the automap
+void motion(int x, int y) {
+    if (!automap_mode || !automap_dragging) return;
+    
+    automap_center_x -= (x - drag_x) / automap_zoom;
+    automap_center_y += (y - drag_y) / automap_zoom;
+    drag_x = x;
+    drag_y = y;
+    glutPostRedisplay();
+}
+
+
+// BMP header structures, packed to match the on-disk layout
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t file_type;     // Must be 0x4D42 ('BM')
+    uint32_t file_size;     // Size of the file in bytes
+    uint16_t reserved1;     // Reserved, must be zero
+    uint16_t reserved2;     // Reserved, must be zero
+    uint32_t offset_data;   // Offset to image data in bytes
+} BMP_FILE_HEADER;
+
+typedef struct {
+    uint32_t header_size;   // Size of this header
+    int32_t width;          // Image width
+    int32_t height;         // Image height
+    uint16_t planes;        // Must be 1
+    uint16_t bit_count;     // Bits per pixel
+    uint32_t compression;   // Compression method
+    uint32_t image_size;    // Size of image data
+    int32_t x_pixels_per_m; // Pixels per meter in X
+    int32_t y_pixels_per_m; // Pixels per meter in Y
+    uint32_t colors_used;   // Number of colors in color palette
+    uint32_t colors_important; // Number of important colors
+} BMP_INFO_HEADER;
+#pragma pack(pop)
+
+// One file of a folder import, decoded and encoded by a worker unless
+// the build manifest shows the lump from the previous build still fits
+typedef struct {
+    char path[1024];
+    char filename[256];            // Manifest key, relative to the input folder
+    char name[9];
+    long long size;
+    long long mtime;
+    uint64_t hash;                 // Of the source file, 0 until known
+    unsigned char *patch;
+    int patch_size;
+    bool indexed;
+    bool has_previous;             // Listed in the manifest of the previous build
+    uint64_t previous_hash;
+    long long previous_offset;     // Lump in the previous WAD
+    int previous_size;
+    bool previous_indexed;
+    bool reuse;                    // Copy the previous lump instead of converting
+} import_job_t;
+
+enum {
+    BUILD_MARKERS_NONE,
+    BUILD_MARKERS_SPRITES,         // S_START/S_END
+    BUILD_MARKERS_PATCHES          // P_START/P_END
+};
+
+// How build_pwad() turns a folder into a WAD
+typedef struct {
+    const char *input_folder;
+    const char *output_path;
+    const char *prefix;            // Prepended to every lump name, or NULL
+    bool keep_case;                // Keep filename case in lump names
+    bool color_key;                // Pure cyan is transparent in sources without alpha
+    int markers;                   // BUILD_MARKERS_*
+    bool rebuild;                  // Ignore the manifest
+    bool dry_run;                  // Only report what would happen
+    bool verbose;                  // Log every lump
+} build_options_t;
+
+typedef struct {
+    int sources;
+    int converted;
+    int reused;
+    int failed;
+    int duplicates;                // Lump names used by more than one file
+    int indexed;                   // Converted without colour matching
+    long long bytes_written;
+    double seconds;
+} build_stats_t;
+
+// Nearest palette index for every 15-bit colour, rebuilt when the palette changes
+static unsigned char color_lookup[32768];
+static unsigned char color_lookup_palette[256][3];
+static bool color_lookup_ready = false;
+
+// Palette colours by exact 24-bit value, so a pixel that is a palette entry
+// keeps that index rather than its 15-bit bucket's. color_lookup_exact
+// marks the buckets that hold one.
+#define COLOR_EXACT_SLOTS 512
+static int color_exact_rgb[COLOR_EXACT_SLOTS];       // -1 for an empty slot
+static unsigned char color_exact_index[COLOR_EXACT_SLOTS];
+static bool color_lookup_exact[32768];
+
+// Set from build_options_t.color_key for the import about to run
+static bool import_color_key = false;
+
+// With --cyan-key, pure cyan marks transparency in sources without alpha, as DeuTex does
+static bool is_color_key(int r, int g, int b) {
+    return import_color_key && r == 0 && g == 255 && b == 255;
+}
+
+static int nearest_palette_index(int r, int g, int b) {
+    int best = 0;
+    int best_distance = INT_MAX;
+    for (int i = 0; i < 256; i++) {
+        int dr = r - doom_palette[i][0];
+        int dg = g - doom_palette[i][1];
+        int db = b - doom_palette[i][2];
+        int distance = dr * dr + dg * dg + db * db;
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = i;
+            if (distance == 0) break;
+        }
+    }
+    return best;
+}
+
+// One red slice of the 15-bit lookup
+static void build_color_lookup_slice(void *context, int red) {
+    for (int green = 0; green < 32; green++) {
+        for (int blue = 0; blue < 32; blue++) {
+            color_lookup[(red << 10) | (green << 5) | blue] =
+                nearest_palette_index((red << 3) | 4, (green << 3) | 4, (blue << 3) | 4);
+        }
+    }
+}
+
+// Must run before the import workers start; they only read the table
+void prepare_color_lookup() {
+    if (color_lookup_ready && memcmp(color_lookup_palette, doom_palette, sizeof(color_lookup_palette)) == 0) {
+        return;
+    }
+    parallel_for(32, build_color_lookup_slice, NULL);
+    
+    // The first entry of a repeated colour wins, as in nearest_palette_index()
+    memset(color_exact_rgb, 0xFF, sizeof(color_exact_rgb));
+    memset(color_lookup_exact, 0, sizeof(color_lookup_exact));
+    for (int i = 0; i < 256; i++) {
+        int r = doom_palette[i][0], g = doom_palette[i][1], b = doom_palette[i][2];
+        int rgb = r << 16 | g << 8 | b;
+        unsigned int slot = ((unsigned int)rgb * 2654435761u >> 23) & (COLOR_EXACT_SLOTS - 1);
+        while (color_exact_rgb[slot] >= 0 && color_exact_rgb[slot] != rgb) slot = (slot + 1) & (COLOR_EXACT_SLOTS - 1);
+        if (color_exact_rgb[slot] >= 0) continue;
+        color_exact_rgb[slot] = rgb;
+        color_exact_index[slot] = i;
+        color_lookup_exact[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)] = true;
+    }
+    memcpy(color_lookup_palette, doom_palette, sizeof(color_lookup_palette));
+    color_lookup_ready = true;
+}
+
+// Palette index for a truecolor pixel: the entry itself if the colour is
+// in the palette, else the nearest colour to its bucket's centre
+static inline int truecolor_index(int r, int g, int b) {
+    int bucket = ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+    if (color_lookup_exact[bucket]) {
+        int rgb = r << 16 | g << 8 | b;
+        unsigned int slot = ((unsigned int)rgb * 2654435761u >> 23) & (COLOR_EXACT_SLOTS - 1);
+        for (; color_exact_rgb[slot] >= 0; slot = (slot + 1) & (COLOR_EXACT_SLOTS - 1)) {
+            if (color_exact_rgb[slot] == rgb) return color_exact_index[slot];
+        }
+    }
+    return color_lookup[bucket];
+}
+
+// Map a source palette onto the DOOM palette. Entries that already match
+// keep their index; returns true when every entry does.
+static bool build_palette_remap(const unsigned char *colors, int stride, int count, unsigned char *remap) {
+    bool identity = true;
+    for (int i = 0; i < 256; i++) {
+        if (i >= count) {
+            remap[i] = i;
+            continue;
+        }
+        const unsigned char *color = colors + (size_t)i * stride;
+        if (color[0] == doom_palette[i][0] && color[1] == doom_palette[i][1] && color[2] == doom_palette[i][2]) {
+            remap[i] = i;
+        } else {
+            remap[i] = nearest_palette_index(color[0], color[1], color[2]);
+            identity = false;
+        }
+    }
+    return identity;
+}
+
+static bool import_image_alloc(import_image_t *image, int width, int height) {
+    if (width <= 0 || height <= 0 || width > DECODE_MAX_DIMENSION || height > DECODE_MAX_DIMENSION) {
+        return false;
+    }
+    image->width = width;
+    image->height = height;
+    image->indexes = malloc((size_t)width * height);
+    image->visible = malloc((size_t)width * height);
+    return image->indexes && image->visible;
+}
+
+void import_image_free(import_image_t *image) {
+    free(image->indexes);
+    free(image->visible);
+    image->indexes = NULL;
+    image->visible = NULL;
+}
+
+// Turn truecolor rows into column-major palette indexes plus a visibility
+// byte per pixel, one square tile at a time so both the rows being read
+// and the columns being written stay in cache. Colour matching happens in
+// the same pass. row_stride is negative for bottom-up sources.
+static void transpose_truecolor(const unsigned char *top_row, ptrdiff_t row_stride, int bytes_per_pixel,
+                                int red_offset, bool has_alpha, import_image_t *image) {
+    int width = image->width, height = image->height;
+    int blue_offset = 2 - red_offset;
+    for (int tile_y = 0; tile_y < height; tile_y += TRANSPOSE_TILE) {
+        int tile_bottom = tile_y + TRANSPOSE_TILE < height ? tile_y + TRANSPOSE_TILE : height;
+
+        for (int tile_x = 0; tile_x < width; tile_x += TRANSPOSE_TILE) {
+            int tile_right = tile_x + TRANSPOSE_TILE < width ? tile_x + TRANSPOSE_TILE : width;
+
+            for (int y = tile_y; y < tile_bottom; y++) {
+                const unsigned char *pixel = top_row + y * row_stride + tile_x * bytes_per_pixel;
+
+                for (int x = tile_x; x < tile_right; x++, pixel += bytes_per_pixel) {
+                    size_t out = (size_t)x * height + y;
+                    int r = pixel[red_offset], g = pixel[1], b = pixel[blue_offset];
+
+                    image->visible[out] = has_alpha ? pixel[3] >= 128 : !is_color_key(r, g, b);
+                    image->indexes[out] = truecolor_index(r, g, b);
+                }
+            }
+        }
+    }
+}
+
+// Same tiled transpose for one-byte-per-pixel sources, through a palette
+// remap and a per-entry visibility table instead of colour matching
+static void transpose_indexed(const unsigned char *top_row, ptrdiff_t row_stride,
+                              const unsigned char *remap, const unsigned char *entry_visible,
+                              import_image_t *image) {
+    int width = image->width, height = image->height;
+    for (int tile_y = 0; tile_y < height; tile_y += TRANSPOSE_TILE) {
+        int tile_bottom = tile_y + TRANSPOSE_TILE < height ? tile_y + TRANSPOSE_TILE : height;
+
+        for (int tile_x = 0; tile_x < width; tile_x += TRANSPOSE_TILE) {
+            int tile_right = tile_x + TRANSPOSE_TILE < width ? tile_x + TRANSPOSE_TILE : width;
+
+            for (int y = tile_y; y < tile_bottom; y++) {
+                const unsigned char *pixel = top_row + y * row_stride + tile_x;
+
+                for (int x = tile_x; x < tile_right; x++, pixel++) {
+                    size_t out = (size_t)x * height + y;
+                    image->visible[out] = entry_visible[*pixel];
+                    image->indexes[out] = remap[*pixel];
+                }
+            }
+        }
+    }
+}
+
+// Raw DEFLATE (RFC 1951) decoder. Codes up to INFLATE_FAST_BITS long are
+// resolved with one table lookup, longer ones bit by bit.
+typedef struct {
+    uint16_t fast[1 << INFLATE_FAST_BITS]; // (symbol << 4) | code length, 0 for longer codes
+    uint16_t count[16];                    // Number of codes of each length
+    uint16_t symbol[288];                  // Symbols in canonical code order
+} huffman_t;
+
+typedef struct {
+    const unsigned char *in, *in_end;
+    uint64_t bits;
+    int bit_count;
+    int overrun;                           // Zero bytes fed past the end of the input
+} bit_reader_t;
+
+static const uint16_t inflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t inflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t inflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t inflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static void bits_refill(bit_reader_t *reader) {
+    while (reader->bit_count <= 56) {
+        unsigned byte = 0;
+        if (reader->in < reader->in_end) {
+            byte = *reader->in++;
+        } else {
+            reader->overrun++;
+        }
+        reader->bits |= (uint64_t)byte << reader->bit_count;
+        reader->bit_count += 8;
+    }
+}
+
+static unsigned bits_take(bit_reader_t *reader, int count) {
+    if (reader->bit_count < count) bits_refill(reader);
+    unsigned value = (unsigned)(reader->bits & ((1ull << count) - 1));
+    reader->bits >>= count;
+    reader->bit_count -= count;
+    return value;
+}
+
+// True once bits past the end of the input have been consumed
+static bool bits_exhausted(const bit_reader_t *reader) {
+    return reader->overrun * 8 > reader->bit_count;
+}
+
+static bool huffman_build(huffman_t *huffman, const unsigned char *lengths, int count) {
+    uint16_t offsets[16];
+    memset(huffman->count, 0, sizeof(huffman->count));
+    memset(huffman->fast, 0, sizeof(huffman->fast));
+    for (int i = 0; i < count; i++) huffman->count[lengths[i]]++;
+    huffman->count[0] = 0;
+
+    // Over-subscribed sets are invalid; incomplete ones are allowed
+    int left = 1;
+    for (int length = 1; length < 16; length++) {
+        left = (left << 1) - huffman->count[length];
+        if (left < 0) return false;
+    }
+
+    offsets[1] = 0;
+    for (int length = 1; length < 15; length++) offsets[length + 1] = offsets[length] + huffman->count[length];
+    for (int i = 0; i < count; i++) {
+        if (lengths[i]) huffman->symbol[offsets[lengths[i]]++] = i;
+    }
+
+    // Canonical codes are read LSB first, so the table is indexed by the
+    // reversed code with every combination of the unused high bits
+    int code = 0, index = 0;
+    for (int length = 1; length <= INFLATE_FAST_BITS; length++) {
+        for (int k = 0; k < huffman->count[length]; k++, code++, index++) {
+            int reversed = 0;
+            for (int bit = 0; bit < length; bit++) {
+                if (code & (1 << bit)) reversed |= 1 << (length - 1 - bit);
+            }
+            for (int fill = reversed; fill < (1 << INFLATE_FAST_BITS); fill += 1 << length) {
+                huffman->fast[fill] = (uint16_t)((huffman->symbol[index] << 4) | length);
+            }
+        }
+        code <<= 1;
+    }
+    return true;
+}
+
+static int huffman_decode(bit_reader_t *reader, const huffman_t *huffman) {
+    if (reader->bit_count < 16) bits_refill(reader);
+    unsigned entry = huffman->fast[reader->bits & ((1 << INFLATE_FAST_BITS) - 1)];
+    if (entry) {
+        reader->bits >>= entry & 15;
+        reader->bit_count -= entry & 15;
+        return entry >> 4;
+    }
+
+    int code = 0, first = 0, index = 0;
+    for (int length = 1; length < 16; length++) {
+        code |= bits_take(reader, 1);
+        int count = huffman->count[length];
+        if (code - count < first) return huffman->symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+// Returns the number of bytes written to dst, or -1 if the stream is
+// damaged or does not fit
+long inflate_raw(const unsigned char *src, size_t src_size, unsigned char *dst, size_t dst_size) {
+    static const unsigned char code_length_order[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    bit_reader_t reader = {src, src + src_size, 0, 0, 0};
+    huffman_t literals, distances;
+    size_t out = 0;
+    bool final;
+
+    do {
+        final = bits_take(&reader, 1);
+        int type = bits_take(&reader, 2);
+
+        if (type == 0) {
+            // Stored block: drop to a byte boundary and hand buffered
+            // whole bytes back to the input
+            bits_take(&reader, reader.bit_count & 7);
+            unsigned length = bits_take(&reader, 16);
+            unsigned check = bits_take(&reader, 16);
+            int buffered = reader.bit_count / 8 - reader.overrun;
+            if (buffered < 0 || (length ^ 0xFFFF) != check) return -1;
+            reader.in -= buffered;
+            reader.bits = 0;
+            reader.bit_count = 0;
+            reader.overrun = 0;
+            if ((size_t)(reader.in_end - reader.in) < length || dst_size - out < length) return -1;
+            memcpy(dst + out, reader.in, length);
+            reader.in += length;
+            out += length;
+            continue;
+        }
+
+        unsigned char lengths[320] = {0};
+        if (type == 1) {
+            // Fixed codes
+            for (int i = 0; i < 288; i++) lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+            huffman_build(&literals, lengths, 288);
+            for (int i = 0; i < 30; i++) lengths[i] = 5;
+            huffman_build(&distances, lengths, 30);
+        } else if (type == 2) {
+            int literal_count = bits_take(&reader, 5) + 257;
+            int distance_count = bits_take(&reader, 5) + 1;
+            int code_length_count = bits_take(&reader, 4) + 4;
+            for (int i = 0; i < code_length_count; i++) {
+                lengths[code_length_order[i]] = bits_take(&reader, 3);
+            }
+            if (!huffman_build(&literals, lengths, 19)) return -1;
+
+            int total = literal_count + distance_count;
+            for (int i = 0; i < total;) {
+                int symbol = huffman_decode(&reader, &literals);
+                if (symbol < 0 || bits_exhausted(&reader)) return -1;
+                if (symbol < 16) {
+                    lengths[i++] = symbol;
+                    continue;
+                }
+                int value = 0, repeat;
+                if (symbol == 16) {
+                    if (i == 0) return -1;
+                    value = lengths[i - 1];
+                    repeat = 3 + bits_take(&reader, 2);
+                } else if (symbol == 17) {
+                    repeat = 3 + bits_take(&reader, 3);
+                } else {
+                    repeat = 11 + bits_take(&reader, 7);
+                }
+                if (i + repeat > total) return -1;
+                while (repeat--) lengths[i++] = value;
+            }
+            if (lengths[256] == 0) return -1;
+            if (!huffman_build(&literals, lengths, literal_count) ||
+                !huffman_build(&distances, lengths + literal_count, distance_count)) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+
+        for (;;) {
+            int symbol = huffman_decode(&reader, &literals);
+            if (symbol < 0 || bits_exhausted(&reader)) return -1;
+            if (symbol < 256) {
+                if (out >= dst_size) return -1;
+                dst[out++] = symbol;
+            } else if (symbol == 256) {
+                break;
+            } else {
+                symbol -= 257;
+                if (symbol >= 29) return -1;
+                size_t length = inflate_length_base[symbol] + bits_take(&reader, inflate_length_extra[symbol]);
+                int distance_symbol = huffman_decode(&reader, &distances);
+                if (distance_symbol < 0 || distance_symbol >= 30) return -1;
+                size_t distance = inflate_dist_base[distance_symbol] +
+                                  bits_take(&reader, inflate_dist_extra[distance_symbol]);
+                if (distance > out || length > dst_size - out) return -1;
+
+                // Byte by byte, since the source may overlap what is being written
+                unsigned char *to = dst + out;
+                const unsigned char *from = to - distance;
+                for (size_t i = 0; i < length; i++) to[i] = from[i];
+                out += length;
+            }
+        }
+    } while (!final);
+
+    return bits_exhausted(&reader) ? -1 : (long)out;
+}
+
+// zlib wrapper (RFC 1950) around a DEFLATE stream, as used by PNG
+static long zlib_inflate(const unsigned char *src, size_t src_size, unsigned char *dst, size_t dst_size) {
+    if (src_size < 6) return -1;
+    if ((src[0] & 15) != 8 || ((src[0] << 8) | src[1]) % 31 != 0 || (src[1] & 0x20)) return -1;
+    return inflate_raw(src + 2, src_size - 2, dst, dst_size);
+}
+
+// PNG writing: CRC-32 for the chunks, Adler-32 for the zlib trailer, and a
+// compressor that emits one fixed-Huffman block with greedy LZ77 matches.
+// Palette indexes and screenshots are mostly runs, which this catches.
+static uint32_t crc32_table[256];
+
+// Fill the CRC table. Call once before encoding on the worker pool.
+static void crc32_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc32_table[n] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t size) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// CRC-32C (Castagnoli) for verify. SSE4.2 computes it with one
+// instruction per 8 bytes; elsewhere slicing-by-8 tables do 8 bytes a step.
+static uint32_t crc32c_tables[8][256];
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *data, size_t size);
+static const char *crc32c_method = "tables";
+
+static uint32_t crc32c_update_tables(uint32_t crc, const unsigned char *data, size_t size) {
+    crc = ~crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        uint32_t low = crc ^ read_le32(data), high = read_le32(data + 4);
+        crc = crc32c_tables[7][low & 0xFF] ^ crc32c_tables[6][(low >> 8) & 0xFF] ^
+              crc32c_tables[5][(low >> 16) & 0xFF] ^ crc32c_tables[4][low >> 24] ^
+              crc32c_tables[3][high & 0xFF] ^ crc32c_tables[2][(high >> 8) & 0xFF] ^
+              crc32c_tables[1][(high >> 16) & 0xFF] ^ crc32c_tables[0][high >> 24];
+    }
+    for (; size > 0; size--, data++) crc = crc32c_tables[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+// The instruction's latency is three times its throughput, so long
+// buffers run as three interleaved streams whose CRCs are joined after
+// each round. Joining shifts a CRC past a run of zero bytes, a linear
+// map over GF(2) kept as four byte tables per run length.
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+static uint32_t crc32c_long_shift[4][256];
+static uint32_t crc32c_short_shift[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++) {
+        if (vector & 1) sum ^= *matrix;
+    }
+    return sum;
+}
+
+// Tables for the operator that appends length zero bytes (a power of two)
+static void crc32c_shift_init(uint32_t tables[4][256], size_t length) {
+    uint32_t op[32], square[32];
+    op[0] = 0x82F63B78u;
+    for (int n = 1; n < 32; n++) op[n] = 1u << (n - 1);
+    for (size_t bits = 1; bits < length * 8; bits <<= 1) {
+        for (int n = 0; n < 32; n++) square[n] = gf2_matrix_times(op, op[n]);
+        memcpy(op, square, sizeof(op));
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int b = 0; b < 4; b++) tables[b][n] = gf2_matrix_times(op, n << (8 * b));
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t tables[4][256], uint32_t crc) {
+    return tables[0][crc & 0xFF] ^ tables[1][(crc >> 8) & 0xFF] ^
+           tables[2][(crc >> 16) & 0xFF] ^ tables[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(uint32_t crc, const unsigned char *data, size_t size) {
+    crc = ~crc;
+#ifdef __x86_64__
+    static const struct {
+        size_t length;
+        uint32_t (*tables)[256];
+    } rounds[] = {{CRC32C_LONG, crc32c_long_shift}, {CRC32C_SHORT, crc32c_short_shift}};
+    for (int r = 0; r < 2; r++) {
+        size_t length = rounds[r].length;
+        for (; size >= 3 * length; size -= 3 * length, data += 3 * length) {
+            uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+            for (size_t i = 0; i < length; i += 8) {
+                uint64_t word0, word1, word2;
+                memcpy(&word0, data + i, 8);
+                memcpy(&word1, data + length + i, 8);
+                memcpy(&word2, data + 2 * length + i, 8);
+                crc0 = _mm_crc32_u64(crc0, word0);
+                crc1 = _mm_crc32_u64(crc1, word1);
+                crc2 = _mm_crc32_u64(crc2, word2);
+            }
+            crc = crc32c_shift(rounds[r].tables, (uint32_t)crc0) ^ (uint32_t)crc1;
+            crc = crc32c_shift(rounds[r].tables, crc) ^ (uint32_t)crc2;
+        }
+    }
+    
+    uint64_t wide = crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+#endif
+    for (; size >= 4; size -= 4, data += 4) crc = _mm_crc32_u32(crc, read_le32(data));
+    for (; size > 0; size--, data++) crc = _mm_crc32_u8(crc, *data);
+    return ~crc;
+}
+#endif
+
+// Fill the tables and pick the fastest method. Call once before hashing
+// on the worker pool.
+static void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0x82F63B78u ^ (c >> 1) : c >> 1;
+        crc32c_tables[0][n] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int n = 0; n < 256; n++) {
+            uint32_t c = crc32c_tables[t - 1][n];
+            crc32c_tables[t][n] = (c >> 8) ^ crc32c_tables[0][c & 0xFF];
+        }
+    }
+    crc32c_update = crc32c_update_tables;
+#ifdef HAVE_SSE42_CRC
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_shift_init(crc32c_long_shift, CRC32C_LONG);
+        crc32c_shift_init(crc32c_short_shift, CRC32C_SHORT);
+        crc32c_update = crc32c_update_sse42;
+        crc32c_method = "SSE4.2";
+    }
+#endif
+}
+
+static uint32_t adler32(const unsigned char *data, size_t size) {
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        // Largest run before b can overflow
+        size_t run = size < 5552 ? size : 5552;
+        size -= run;
+        while (run--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+typedef struct {
+    unsigned char *out;
+    size_t size;
+    uint32_t bits;
+    int bit_count;
+} bit_writer_t;
+
+static void bits_put(bit_writer_t *writer, uint32_t value, int count) {
+    writer->bits |= value << writer->bit_count;
+    writer->bit_count += count;
+    while (writer->bit_count >= 8) {
+        writer->out[writer->size++] = (unsigned char)writer->bits;
+        writer->bits >>= 8;
+        writer->bit_count -= 8;
+    }
+}
+
+// Huffman codes are stored most significant bit first
+static void bits_put_code(bit_writer_t *writer, uint32_t code, int length) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++) reversed = (reversed << 1) | ((code >> i) & 1);
+    bits_put(writer, reversed, length);
+}
+
+static void deflate_symbol(bit_writer_t *writer, int symbol) {
+    if (symbol < 144) bits_put_code(writer, 0x30 + symbol, 8);
+    else if (symbol < 256) bits_put_code(writer, 0x190 + symbol - 144, 9);
+    else if (symbol < 280) bits_put_code(writer, symbol - 256, 7);
+    else bits_put_code(writer, 0xC0 + symbol - 280, 8);
+}
+
+static uint32_t deflate_hash(const unsigned char *p) {
+    return ((uint32_t)(p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Compress into a raw DEFLATE stream. out needs size + size / 8 + 16
+// bytes: no code costs more than 9 bits per input byte. Returns the bytes
+// written. Safe to run on the worker pool.
+size_t deflate_fixed(const unsigned char *src, size_t size, unsigned char *out) {
+    bit_writer_t writer = {out, 0, 0, 0};
+    int *head = (int *)malloc((1 << DEFLATE_HASH_BITS) * sizeof(int));
+    int *prev = (int *)malloc(DEFLATE_WINDOW * sizeof(int));
+    bool matching = head && prev;     // Without the tables, everything goes out as literals
+    if (matching) memset(head, 0xFF, (1 << DEFLATE_HASH_BITS) * sizeof(int));
+    
+    bits_put(&writer, 1, 1);          // Final block
+    bits_put(&writer, 1, 2);          // Fixed codes
+    size_t pos = 0;
+    while (pos < size) {
+        size_t best_length = 0, best_distance = 0;
+        if (matching && pos + 3 <= size) {
+            uint32_t hash = deflate_hash(src + pos);
+            size_t max_length = size - pos < 258 ? size - pos : 258;
+            int candidate = head[hash];
+            for (int chain = 0; candidate >= 0 && chain < DEFLATE_MAX_CHAIN; chain++) {
+                size_t distance = pos - candidate;
+                if (distance > DEFLATE_WINDOW) break;
+                if (src[candidate + best_length] == src[pos + best_length]) {
+                    size_t length = 0;
+                    while (length < max_length && src[candidate + length] == src[pos + length]) length++;
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = distance;
+                        if (length == max_length) break;
+                    }
+                }
+                candidate = prev[candidate % DEFLATE_WINDOW];
+            }
+            prev[pos % DEFLATE_WINDOW] = head[hash];
+            head[hash] = (int)pos;
+        }
+        
+        if (best_length < 3) {
+            deflate_symbol(&writer, src[pos++]);
+            continue;
+        }
+        int code = 28;
+        while (inflate_length_base[code] > best_length) code--;
+        deflate_symbol(&writer, 257 + code);
+        bits_put(&writer, best_length - inflate_length_base[code], inflate_length_extra[code]);
+        code = 29;
+        while (inflate_dist_base[code] > best_distance) code--;
+        bits_put_code(&writer, code, 5);
+        bits_put(&writer, best_distance - inflate_dist_base[code], inflate_dist_extra[code]);
+        
+        // The covered positions go into the chains too, so later data can match them
+        for (size_t end = pos + best_length, p = pos + 1; p < end && p + 3 <= size; p++) {
+            uint32_t hash = deflate_hash(src + p);
+            prev[p % DEFLATE_WINDOW] = head[hash];
+            head[hash] = (int)p;
+        }
+        pos += best_length;
+    }
+    deflate_symbol(&writer, 256);
+    if (writer.bit_count > 0) bits_put(&writer, 0, 8 - writer.bit_count);
+    
+    free(head);
+    free(prev);
+    return writer.size;
+}
+
+static void put_be32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// Append a chunk; data may be NULL if the payload is already in place
+static size_t png_chunk(unsigned char *out, size_t size, const char *type, const unsigned char *data, size_t length) {
+    put_be32(out + size, (uint32_t)length);
+    memcpy(out + size + 4, type, 4);
+    if (data) memcpy(out + size + 8, data, length);
+    put_be32(out + size + 8 + length, crc32_update(0, out + size + 4, length + 4));
+    return size + 12 + length;
+}
+
+// Bytes png_encode() may write for an image with this many channels
+static size_t png_bound(int width, int height, int channels) {
+    size_t raw = (size_t)height * (1 + (size_t)width * channels);
+    return raw + raw / 8 + 2048;
+}
+
+// Write a PNG around scanlines that already start with their filter
+// byte. Colour type 2 is RGB, 6 RGBA, and 3 palette indexes through the
+// current palette, with transparent_index (or none if -1) see-through.
+// out needs png_bound() bytes; returns the file size.
+size_t png_encode(unsigned char *out, const unsigned char *scanlines, int width, int height,
+                  int color_type, int transparent_index) {
+    int channels = color_type == 6 ? 4 : color_type == 2 ? 3 : 1;
+    size_t raw_size = (size_t)height * (1 + (size_t)width * channels);
+    memcpy(out, "\x89PNG\r\n\x1a\n", 8);
+    
+    unsigned char ihdr[13] = {0};
+    put_be32(ihdr, width);
+    put_be32(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = color_type;
+    size_t size = png_chunk(out, 8, "IHDR", ihdr, sizeof(ihdr));
+    if (color_type == 3) {
+        size = png_chunk(out, size, "PLTE", &doom_palette[0][0], sizeof(doom_palette));
+        if (transparent_index >= 0) {
+            unsigned char alpha[256];
+            memset(alpha, 255, sizeof(alpha));
+            alpha[transparent_index] = 0;
+            size = png_chunk(out, size, "tRNS", alpha, transparent_index + 1);
+        }
+    }
+    
+    // The zlib stream is compressed straight into the IDAT payload
+    unsigned char *idat = out + size + 8;
+    idat[0] = 0x78;
+    idat[1] = 0x01;
+    size_t length = 2 + deflate_fixed(scanlines, raw_size, idat + 2);
+    put_be32(idat + length, adler32(scanlines, raw_size));
+    size = png_chunk(out, size, "IDAT", NULL, length + 4);
+    return png_chunk(out, size, "IEND", NULL, 0);
+}
+
+static unsigned char *read_whole_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *data = length > 0 ? malloc(length) : NULL;
+    if (data && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = data ? (size_t)length : 0;
+    return data;
+}
+
+int read_png_dimensions(const char* filename, int* width, int* height) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    unsigned char header[24];
+    FILE *file = fopen(filename, "rb");
+    if (!file) return 0;
+    size_t got = fread(header, 1, sizeof(header), file);
+    fclose(file);
+    if (got != sizeof(header) || memcmp(header, signature, 8) != 0 || memcmp(header + 12, "IHDR", 4) != 0) {
+        return 0;
+    }
+    *width = read_be32(header + 16);
+    *height = read_be32(header + 20);
+    return 1;
+}
+
+static int paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+bool decode_png(const unsigned char *data, size_t size, const char *path, import_image_t *image) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (size < 33 || memcmp(data, signature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0) {
+        fprintf(stderr, "Not a PNG file: %s\n", path);
+        return false;
+    }
+
+    int width = read_be32(data + 16);
+    int height = read_be32(data + 20);
+    int depth = data[24], color_type = data[25], interlace = data[28];
+    int channels = color_type == 0 ? 1 : color_type == 2 ? 3 : color_type == 3 ? 1 : color_type == 4 ? 2 : 4;
+    bool depth_ok = color_type == 3 ? depth <= 8 : color_type == 0 ? true : depth >= 8;
+    if (color_type == 1 || color_type == 5 || color_type > 6 || !depth_ok ||
+        (depth & (depth - 1)) != 0 || depth > 16) {
+        fprintf(stderr, "Unsupported PNG format in %s (type %d, depth %d)\n", path, color_type, depth);
+        return false;
+    }
+    if (interlace) {
+        fprintf(stderr, "Interlaced PNGs are not supported: %s\n", path);
+        return false;
+    }
+    if (width <= 0 || height <= 0 || width > DECODE_MAX_DIMENSION || height > DECODE_MAX_DIMENSION) {
+        fprintf(stderr, "Invalid image dimensions in %s: %dx%d\n", path, width, height);
+        return false;
+    }
+
+    // Walk the chunks: palette, transparency, offsets and the compressed stream
+    unsigned char palette[256][3] = {{0}};
+    unsigned char palette_alpha[256];
+    int palette_count = 0;
+    bool has_transparency = false;
+    int key_gray = -1, key_red = -1, key_green = -1, key_blue = -1;
+    memset(palette_alpha, 255, sizeof(palette_alpha));
+
+    unsigned char *compressed = malloc(size);
+    size_t compressed_size = 0;
+    if (!compressed) return false;
+
+    size_t pos = 8;
+    while (pos + 12 <= size) {
+        uint32_t length = read_be32(data + pos);
+        const unsigned char *type = data + pos + 4;
+        const unsigned char *chunk = data + pos + 8;
+        if (length > size - pos - 12) break;
+
+        if (memcmp(type, "PLTE", 4) == 0) {
+            palette_count = length / 3 > 256 ? 256 : length / 3;
+            memcpy(palette, chunk, palette_count * 3);
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            has_transparency = true;
+            if (color_type == 3) {
+                memcpy(palette_alpha, chunk, length > 256 ? 256 : length);
+            } else if (color_type == 0 && length >= 2) {
+                key_gray = (chunk[0] << 8) | chunk[1];
+            } else if (color_type == 2 && length >= 6) {
+                key_red = (chunk[0] << 8) | chunk[1];
+                key_green = (chunk[2] << 8) | chunk[3];
+                key_blue = (chunk[4] << 8) | chunk[5];
+            }
+        } else if (memcmp(type, "grAb", 4) == 0 && length >= 8) {
+            // ZDoom stores patch offsets here
+            image->left_offset = (int32_t)read_be32(chunk);
+            image->top_offset = (int32_t)read_be32(chunk + 4);
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            memcpy(compressed + compressed_size, chunk, length);
+            compressed_size += length;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+        pos += 12 + length;
+    }
+
+    // Inflate all scanlines, each prefixed by its filter type
+    int bits_per_pixel = channels * depth;
+    size_t stride = ((size_t)width * bits_per_pixel + 7) / 8;
+    int filter_step = bits_per_pixel >= 8 ? bits_per_pixel / 8 : 1;
+    size_t raw_size = (stride + 1) * height;
+    unsigned char *raw = malloc(raw_size);
+    if (!raw || zlib_inflate(compressed, compressed_size, raw, raw_size) != (long)raw_size) {
+        fprintf(stderr, "Damaged PNG image data in %s\n", path);
+        free(compressed);
+        free(raw);
+        return false;
+    }
+    free(compressed);
+
+    // Undo the filters in place; rows end up packed at stride + 1
+    for (int y = 0; y < height; y++) {
+        unsigned char *row = raw + y * (stride + 1) + 1;
+        const unsigned char *previous = y > 0 ? row - (stride + 1) : NULL;
+        int filter = row[-1];
+        for (size_t i = 0; i < stride; i++) {
+            int left = i >= (size_t)filter_step ? row[i - filter_step] : 0;
+            int up = previous ? previous[i] : 0;
+            int up_left = previous && i >= (size_t)filter_step ? previous[i - filter_step] : 0;
+            switch (filter) {
+                case 1: row[i] += left; break;
+                case 2: row[i] += up; break;
+                case 3: row[i] += (left + up) / 2; break;
+                case 4: row[i] += paeth_predictor(left, up, up_left); break;
+            }
+        }
+    }
+
+    if (!import_image_alloc(image, width, height)) {
+        free(raw);
+        import_image_free(image);
+        return false;
+    }
+
+    if (color_type == 3 || (color_type == 0 && depth <= 8)) {
+        // One index per pixel, widening packed depths in place from the right
+        unsigned char *indexes = malloc((size_t)width * height);
+        if (!indexes) {
+            free(raw);
+            import_image_free(image);
+            return false;
+        }
+        int per_byte = 8 / depth, mask = (1 << depth) - 1;
+        for (int y = 0; y < height; y++) {
+            const unsigned char *row = raw + y * (stride + 1) + 1;
+            unsigned char *out = indexes + (size_t)y * width;
+            for (int x = 0; x < width; x++) {
+                int shift = 8 - depth * (x % per_byte + 1);
+                out[x] = (row[x / per_byte] >> shift) & mask;
+            }
+        }
+
+        unsigned char remap[256], entry_visible[256];
+        if (color_type == 0) {
+            // Grayscale is an implicit ramp palette
+            int levels = 1 << depth;
+            for (int i = 0; i < levels; i++) {
+                int level = i * 255 / (levels - 1);
+                palette[i][0] = palette[i][1] = palette[i][2] = level;
+                palette_alpha[i] = i == key_gray ? 0 : 255;
+            }
+            palette_count = levels;
+        }
+        image->indexed = build_palette_remap(palette[0], 3, palette_count, remap);
+        for (int i = 0; i < 256; i++) {
+            entry_visible[i] = has_transparency ? palette_alpha[i] >= 128
+                                                : !is_color_key(palette[i][0], palette[i][1], palette[i][2]);
+        }
+        transpose_indexed(indexes, width, remap, entry_visible, image);
+        free(indexes);
+    } else {
+        // Everything else becomes 8-bit RGBA rows
+        unsigned char *rgba = malloc((size_t)width * height * 4);
+        if (!rgba) {
+            free(raw);
+            import_image_free(image);
+            return false;
+        }
+        int sample_bytes = depth / 8;
+        for (int y = 0; y < height; y++) {
+            const unsigned char *row = raw + y * (stride + 1) + 1;
+            unsigned char *out = rgba + (size_t)y * width * 4;
+            for (int x = 0; x < width; x++, out += 4) {
+                const unsigned char *pixel = row + (size_t)x * channels * sample_bytes;
+                int samples[4];
+                for (int c = 0; c < channels; c++) {
+                    samples[c] = sample_bytes == 2 ? (pixel[c * 2] << 8) | pixel[c * 2 + 1] : pixel[c];
+                }
+                int shift = sample_bytes == 2 ? 8 : 0;
+                if (channels <= 2) {
+                    out[0] = out[1] = out[2] = samples[0] >> shift;
+                    out[3] = channels == 2 ? samples[1] >> shift : samples[0] == key_gray ? 0 : 255;
+                } else {
+                    out[0] = samples[0] >> shift;
+                    out[1] = samples[1] >> shift;
+                    out[2] = samples[2] >> shift;
+                    if (channels == 4) {
+                        out[3] = samples[3] >> shift;
+                    } else {
+                        bool keyed = samples[0] == key_red && samples[1] == key_green && samples[2] == key_blue;
+                        out[3] = keyed ? 0 : 255;
+                    }
+                }
+            }
+        }
+        bool has_alpha = channels == 2 || channels == 4 || has_transparency;
+        transpose_truecolor(rgba, (ptrdiff_t)width * 4, 4, 0, has_alpha, image);
+        free(rgba);
+    }
+
+    free(raw);
+    return true;
+}
+
+int validate_bmp_header(const unsigned char *data, size_t size, BMP_FILE_HEADER* file_header, BMP_INFO_HEADER* info_header) {
+    if (size < sizeof(BMP_FILE_HEADER) + sizeof(BMP_INFO_HEADER)) {
+        fprintf(stderr, "Error reading BMP headers\n");
+        return 0;
+    }
+    memcpy(file_header, data, sizeof(BMP_FILE_HEADER));
+    memcpy(info_header, data + sizeof(BMP_FILE_HEADER), sizeof(BMP_INFO_HEADER));
+
+    // Validate file type (must be 'BM')
+    if (file_header->file_type != 0x4D42) {
+        fprintf(stderr, "Invalid BMP file type\n");
+        return 0;
+    }
+
+    // Validate image attributes more carefully
+    if (info_header->planes != 1) {
+        fprintf(stderr, "Invalid number of planes: %u (must be 1)\n", info_header->planes);
+        return 0;
+    }
+
+    if (info_header->bit_count != 8 && info_header->bit_count != 24 && info_header->bit_count != 32) {
+        fprintf(stderr, "Unsupported bit depth: %u (expected 8, 24 or 32)\n", info_header->bit_count);
+        return 0;
+    }
+
+    // Run-length encoded BMPs are not supported
+    if (info_header->compression != 0 && info_header->compression != 3) {
+        fprintf(stderr, "Unsupported BMP compression: %u\n", info_header->compression);
+        return 0;
+    }
+
+    // Ensure sane image dimensions
+    if (info_header->width <= 0 || info_header->width > DECODE_MAX_DIMENSION ||
+        info_header->height == 0 || abs(info_header->height) > DECODE_MAX_DIMENSION) {
+        fprintf(stderr, "Invalid image dimensions: %dx%d\n",
+                info_header->width, info_header->height);
+        return 0;
+    }
+
+    return 1;
+}
+
+static bool decode_bmp(const unsigned char *data, size_t size, const char *path, import_image_t *image) {
+    BMP_FILE_HEADER file_header;
+    BMP_INFO_HEADER info_header;
+    if (!validate_bmp_header(data, size, &file_header, &info_header)) {
+        fprintf(stderr, "Skipping %s\n", path);
+        return false;
+    }
+
+    // Positive heights are stored bottom-up
+    int width = info_header.width;
+    int height = abs(info_header.height);
+    int bit_count = info_header.bit_count;
+    size_t row_size = ((width * bit_count + 31) / 32) * 4;  // 32-bit aligned row size
+    size_t expected = row_size * (height - 1) + ((size_t)width * bit_count + 7) / 8;
+    if (file_header.offset_data > size || size - file_header.offset_data < expected) {
+        fprintf(stderr, "Failed to read pixel data from %s\n", path);
+        return false;
+    }
+    const unsigned char *pixels = data + file_header.offset_data;
+    const unsigned char *top_row = info_header.height > 0 ? pixels + row_size * (height - 1) : pixels;
+    ptrdiff_t row_stride = info_header.height > 0 ? -(ptrdiff_t)row_size : (ptrdiff_t)row_size;
+
+    if (!import_image_alloc(image, width, height)) return false;
+
+    if (bit_count == 8) {
+        // Colour table entries are BGRX and follow the info header
+        size_t table = sizeof(BMP_FILE_HEADER) + info_header.header_size;
+        int colors = info_header.colors_used ? (int)info_header.colors_used : 256;
+        if (colors > 256) colors = 256;
+        if (table > size || (size - table) / 4 < (size_t)colors) {
+            fprintf(stderr, "Missing BMP colour table in %s\n", path);
+            import_image_free(image);
+            return false;
+        }
+        unsigned char palette[256][3] = {{0}};
+        unsigned char remap[256], entry_visible[256];
+        for (int i = 0; i < colors; i++) {
+            palette[i][0] = data[table + i * 4 + 2];
+            palette[i][1] = data[table + i * 4 + 1];
+            palette[i][2] = data[table + i * 4];
+        }
+        image->indexed = build_palette_remap(palette[0], 3, colors, remap);
+        for (int i = 0; i < 256; i++) {
+            entry_visible[i] = !is_color_key(palette[i][0], palette[i][1], palette[i][2]);
+        }
+        transpose_indexed(top_row, row_stride, remap, entry_visible, image);
+    } else {
+        // BGR(A); 24-bit images only have the colour key for transparency
+        transpose_truecolor(top_row, row_stride, bit_count / 8, 2, bit_count == 32, image);
+    }
+    return true;
+}
+
+static bool decode_tga(const unsigned char *data, size_t size, const char *path, import_image_t *image) {
+    if (size < 18) {
+        fprintf(stderr, "Not a TGA file: %s\n", path);
+        return false;
+    }
+    int id_length = data[0];
+    int colormap_type = data[1];
+    int image_type = data[2];
+    int colormap_first = read_le16u(data + 3);
+    int colormap_length = read_le16u(data + 5);
+    int colormap_bits = data[7];
+    int width = read_le16u(data + 12);
+    int height = read_le16u(data + 14);
+    int pixel_bits = data[16];
+    int descriptor = data[17];
+
+    bool rle = image_type >= 9;
+    int base_type = rle ? image_type - 8 : image_type;
+    bool paletted = base_type == 1;
+    bool gray = base_type == 3;
+    if (base_type < 1 || base_type > 3 ||
+        ((paletted || gray) ? pixel_bits != 8 : (pixel_bits != 24 && pixel_bits != 32)) ||
+        (paletted && (colormap_type != 1 || (colormap_bits != 24 && colormap_bits != 32))) ||
+        (descriptor & 0x10)) {
+        fprintf(stderr, "Unsupported TGA format in %s (type %d, %d bits)\n", path, image_type, pixel_bits);
+        return false;
+    }
+    if (width <= 0 || height <= 0 || width > DECODE_MAX_DIMENSION || height > DECODE_MAX_DIMENSION) {
+        fprintf(stderr, "Invalid image dimensions in %s: %dx%d\n", path, width, height);
+        return false;
+    }
+
+    size_t pos = 18 + id_length;
+    unsigned char palette[256][3] = {{0}};
+    unsigned char palette_alpha[256];
+    memset(palette_alpha, 255, sizeof(palette_alpha));
+    if (colormap_type == 1) {
+        int entry_bytes = (colormap_bits + 7) / 8;
+        if (pos + (size_t)colormap_length * entry_bytes > size) {
+            fprintf(stderr, "Truncated TGA colour map in %s\n", path);
+            return false;
+        }
+        for (int i = 0; i < colormap_length; i++) {
+            int index = colormap_first + i;
+            const unsigned char *entry = data + pos + (size_t)i * entry_bytes;
+            if (index < 256 && entry_bytes >= 3) {
+                palette[index][0] = entry[2];
+                palette[index][1] = entry[1];
+                palette[index][2] = entry[0];
+                if (entry_bytes == 4) palette_alpha[index] = entry[3];
+            }
+        }
+        pos += (size_t)colormap_length * entry_bytes;
+    }
+
+    // Expand run-length packets so both cases read from plain rows
+    int bytes_per_pixel = pixel_bits / 8;
+    size_t pixel_size = (size_t)width * height * bytes_per_pixel;
+    const unsigned char *pixels = data + pos;
+    unsigned char *expanded = NULL;
+    if (rle) {
+        expanded = malloc(pixel_size);
+        if (!expanded) return false;
+        size_t out = 0;
+        while (out < pixel_size && pos < size) {
+            int packet = data[pos++];
+            int count = (packet & 0x7F) + 1;
+            size_t bytes = (size_t)count * bytes_per_pixel;
+            if (bytes > pixel_size - out) bytes = pixel_size - out;
+            if (packet & 0x80) {
+                if (pos + bytes_per_pixel > size) break;
+                for (size_t i = 0; i < bytes; i++) expanded[out + i] = data[pos + i % bytes_per_pixel];
+                pos += bytes_per_pixel;
+            } else {
+                if (pos + bytes > size) break;
+                memcpy(expanded + out, data + pos, bytes);
+                pos += bytes;
+            }
+            out += bytes;
+        }
+        if (out < pixel_size) {
+            fprintf(stderr, "Truncated TGA image data in %s\n", path);
+            free(expanded);
+            return false;
+        }
+        pixels = expanded;
+    } else if (pos > size || size - pos < pixel_size) {
+        fprintf(stderr, "Truncated TGA image data in %s\n", path);
+        return false;
+    }
+
+    // Bottom-up unless descriptor bit 5 says the origin is at the top
+    size_t row_size = (size_t)width * bytes_per_pixel;
+    bool top_down = (descriptor & 0x20) != 0;
+    const unsigned char *top_row = top_down ? pixels : pixels + row_size * (height - 1);
+    ptrdiff_t row_stride = top_down ? (ptrdiff_t)row_size : -(ptrdiff_t)row_size;
+
+    if (!import_image_alloc(image, width, height)) {
+        free(expanded);
+        import_image_free(image);
+        return false;
+    }
+
+    if (paletted || gray) {
+        unsigned char remap[256], entry_visible[256];
+        bool has_alpha = paletted && colormap_bits == 32;
+        if (gray) {
+            for (int i = 0; i < 256; i++) palette[i][0] = palette[i][1] = palette[i][2] = i;
+        }
+        image->indexed = build_palette_remap(palette[0], 3, 256, remap);
+        for (int i = 0; i < 256; i++) {
+            entry_visible[i] = has_alpha ? palette_alpha[i] >= 128
+                                         : !is_color_key(palette[i][0], palette[i][1], palette[i][2]);
+        }
+        transpose_indexed(top_row, row_stride, remap, entry_visible, image);
+    } else {
+        transpose_truecolor(top_row, row_stride, bytes_per_pixel, 2, bytes_per_pixel == 4, image);
+    }
+
+    free(expanded);
+    return true;
+}
+
+// Append one post to a patch column. Posts that start below row 254 use
+// the tall-patch convention: a top delta no larger than the previous top
+// is relative to it, so empty posts step the reference row down first.
+static int write_patch_post(unsigned char *patch_data, int offset, int *last_top, int top, int count,
+                            const unsigned char *pixels) {
+    if (top > 254) {
+        if (*last_top < 254) {
+            // Empty absolute post at 254 to start relative addressing
+            patch_data[offset++] = 254;
+            patch_data[offset++] = 0;
+            patch_data[offset++] = 0;
+            patch_data[offset++] = 0;
+            *last_top = 254;
+        }
+        while (top - *last_top > 254) {
+            patch_data[offset++] = 254;
+            patch_data[offset++] = 0;
+            patch_data[offset++] = 0;
+            patch_data[offset++] = 0;
+            *last_top += 254;
+        }
+        patch_data[offset++] = top - *last_top;
+    } else {
+        patch_data[offset++] = top;
+    }
+    *last_top = top;
+
+    patch_data[offset++] = count;
+    patch_data[offset++] = 0; // Dummy before pixels
+    memcpy(patch_data + offset, pixels, count);
+    offset += count;
+    patch_data[offset++] = 0; // Dummy after pixels
+    return offset;
+}
+
+// Encode column-major indexes as a DOOM patch
+static bool encode_doom_patch(const import_image_t *image, unsigned char **output_data, int *output_size) {
+    int width = image->width, height = image->height;
+
+    // Worst case per column: a post per visible pixel (9 bytes for the
+    // pixel and header, with tall-patch steps), plus the terminator
+    unsigned char* patch_data = malloc(8 + (size_t)width * 4 + (size_t)width * (height * 9 + 16));
+    int* column_offsets = malloc(width * sizeof(int));
+    if (!patch_data || !column_offsets) {
+        free(patch_data);
+        free(column_offsets);
+        return false;
+    }
+
+    // Patch header: width, height, left and top offset, then the column table
+    int current_offset = 0;
+    short header[4] = {width, height, image->left_offset, image->top_offset};
+    memcpy(patch_data, header, 8);
+    current_offset = 8 + width * 4;
+
+    // Encode each column's runs of visible pixels as posts
+    for (int x = 0; x < width; x++) {
+        const unsigned char* column = image->indexes + (size_t)x * height;
+        const unsigned char* column_visible = image->visible + (size_t)x * height;
+        column_offsets[x] = current_offset;
+        int last_top = -1;
+
+        int y = 0;
+        while (y < height) {
+            if (!column_visible[y]) {
+                y++;
+                continue;
+            }
+
+            // A post holds at most 255 pixels; longer runs become several posts
+            int span_start = y;
+            while (y < height && column_visible[y] && y - span_start < 255) y++;
+            current_offset = write_patch_post(patch_data, current_offset, &last_top,
+                                              span_start, y - span_start, column + span_start);
+        }
+
+        // Column terminator
+        patch_data[current_offset++] = 0xFF;
+    }
+
+    // Update column offsets
+    memcpy(patch_data + 8, column_offsets, width * 4);
+    free(column_offsets);
+
+    *output_data = patch_data;
+    *output_size = current_offset;
+    return true;
+}
+
+// Which decoder handles a file, by extension; NULL if none
+typedef bool (*image_decoder_fn)(const unsigned char *data, size_t size, const char *path, import_image_t *image);
+
+static image_decoder_fn import_decoder_for(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    if (!dot) return NULL;
+    if (strcasecmp(dot, ".png") == 0) return decode_png;
+    if (strcasecmp(dot, ".bmp") == 0) return decode_bmp;
+    if (strcasecmp(dot, ".tga") == 0) return decode_tga;
+    return NULL;
+}
+
+// 64-bit FNV-1a
+static uint64_t hash_bytes64(const unsigned char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) hash = (hash ^ data[i]) * 1099511628211ull;
+    return hash;
+}
+
+static int compare_import_job_names(const void *a, const void *b) {
+    const import_job_t *job_a = *(const import_job_t *const *)a;
+    const import_job_t *job_b = *(const import_job_t *const *)b;
+    int order = strncmp(job_a->name, job_b->name, 8);
+    return order ? order : strcmp(job_a->filename, job_b->filename);
+}
+
+// Files whose names truncate to the same lump would shadow each other
+static int report_duplicate_lump_names(import_job_t *jobs, int count) {
+    import_job_t **sorted = malloc(count * sizeof(import_job_t *));
+    if (!sorted) return 0;
+    for (int i = 0; i < count; i++) sorted[i] = &jobs[i];
+    qsort(sorted, count, sizeof(import_job_t *), compare_import_job_names);
+
+    int duplicates = 0;
+    for (int i = 1; i < count; i++) {
+        if (strncmp(sorted[i - 1]->name, sorted[i]->name, 8) == 0) {
+            fprintf(stderr, "Duplicate lump name %.8s from %s and %s\n",
+                    sorted[i]->name, sorted[i - 1]->filename, sorted[i]->filename);
+            duplicates++;
+        }
+    }
+    free(sorted);
+    return duplicates;
+}
+
+// Decode and encode one file; runs on the worker pool
+static void import_file(void *context, int index) {
+    import_job_t *job = (import_job_t *)context + index;
+    if (job->reuse) return;
+
+    size_t size;
+    unsigned char *data = read_whole_file(job->path, &size);
+    if (!data) {
+        fprintf(stderr, "Could not open image file: %s\n", job->path);
+        return;
+    }
+
+    // Touched but not changed: the previous lump is still right
+    job->hash = hash_bytes64(data, size);
+    if (job->has_previous && job->hash == job->previous_hash) {
+        job->reuse = true;
+        free(data);
+        return;
+    }
+
+    import_image_t image = {0};
+    image_decoder_fn decode = import_decoder_for(job->path);
+    if (decode(data, size, job->path, &image)) {
+        if (image.width > IMPORT_MAX_DIMENSION || image.height > IMPORT_MAX_DIMENSION) {
+            fprintf(stderr, "Image too large for a patch in %s: %dx%d\n", job->path, image.width, image.height);
+        } else if (encode_doom_patch(&image, &job->patch, &job->patch_size)) {
+            job->indexed = image.indexed;
+        }
+    }
+    import_image_free(&image);
+    free(data);
+}
+
+static int compare_import_jobs(const void *a, const void *b) {
+    return strcmp(((const import_job_t *)a)->filename, ((const import_job_t *)b)->filename);
+}
+
+// What the conversion of a file depends on besides its bytes: the palette
+// and whether cyan is a colour key
+static uint64_t build_settings_hash() {
+    return hash_bytes64(doom_palette[0], sizeof(doom_palette)) ^ (import_color_key ? 1 : 0);
+}
+
+// Fill previous-build details into the jobs from the manifest next to the
+// WAD. Nothing is used if the WAD, the palette or the colour key changed
+// since, since the recorded lumps would no longer match. Returns the number of files that
+// are unchanged by size and mtime.
+static int load_build_manifest(const char *manifest_path, const char *wad_path, import_job_t *jobs, int count) {
+    FILE *file = fopen(manifest_path, "r");
+    if (!file) return 0;
+
+    char line[1400];
+    if (!fgets(line, sizeof(line), file) || strncmp(line, BUILD_MANIFEST_HEADER, strlen(BUILD_MANIFEST_HEADER)) != 0) {
+        fclose(file);
+        return 0;
+    }
+
+    // wad \t size \t mtime \t settings hash
+    struct stat st;
+    long long wad_size, wad_mtime;
+    unsigned long long settings_hash;
+    if (!fgets(line, sizeof(line), file) ||
+        sscanf(line, "wad\t%lld\t%lld\t%llx", &wad_size, &wad_mtime, &settings_hash) != 3 ||
+        stat(wad_path, &st) != 0 || wad_size != (long long)st.st_size || wad_mtime != (long long)st.st_mtime ||
+        settings_hash != build_settings_hash()) {
+        fclose(file);
+        return 0;
+    }
+
+    int unchanged = 0;
+    while (fgets(line, sizeof(line), file)) {
+        // filename \t size \t mtime \t hash \t lump offset \t lump size \t indexed
+        char *tab = strchr(line, '\t');
+        if (!tab) continue;
+        *tab = '\0';
+
+        import_job_t key;
+        strncpy(key.filename, line, sizeof(key.filename) - 1);
+        key.filename[sizeof(key.filename) - 1] = '\0';
+        import_job_t *job = (import_job_t *)bsearch(&key, jobs, count, sizeof(import_job_t), compare_import_jobs);
+        if (!job) continue;
+
+        long long size, mtime, offset;
+        unsigned long long hash;
+        int lump_size, indexed;
+        if (sscanf(tab + 1, "%lld\t%lld\t%llx\t%lld\t%d\t%d",
+                   &size, &mtime, &hash, &offset, &lump_size, &indexed) != 6) continue;
+        if (offset < 0 || lump_size <= 0 || offset + lump_size > wad_size) continue;
+
+        job->has_previous = true;
+        job->previous_hash = hash;
+        job->previous_offset = offset;
+        job->previous_size = lump_size;
+        job->previous_indexed = indexed != 0;
+        // A file written in the same second as the WAD may have changed
+        // again unnoticed, so only older ones are trusted without hashing
+        if (size == job->size && mtime == job->mtime && mtime < wad_mtime) {
+            job->hash = hash;
+            job->reuse = true;
+            unchanged++;
+        }
+    }
+
+    fclose(file);
+    return unchanged;
+}
+
+static void save_build_manifest(const char *manifest_path, const char *wad_path,
+                                const import_job_t *jobs, int count, const long long *lump_offsets) {
+    struct stat st;
+    if (stat(wad_path, &st) != 0) return;
+    FILE *file = fopen(manifest_path, "w");
+    if (!file) return;
+
+    fprintf(file, "%s\n", BUILD_MANIFEST_HEADER);
+    fprintf(file, "wad\t%lld\t%lld\t%016llx\n", (long long)st.st_size, (long long)st.st_mtime,
+            (unsigned long long)build_settings_hash());
+    for (int i = 0; i < count; i++) {
+        if (lump_offsets[i] < 0) continue;
+        fprintf(file, "%s\t%lld\t%lld\t%016llx\t%lld\t%d\t%d\n", jobs[i].filename, jobs[i].size, jobs[i].mtime,
+                (unsigned long long)jobs[i].hash, lump_offsets[i], jobs[i].patch_size, jobs[i].indexed ? 1 : 0);
+    }
+    fclose(file);
+}
+
+// Convert every PNG, TGA and BMP in a folder to DOOM patches in a PWAD.
+// Files are decoded in parallel; lumps are listed in filename order. A
+// manifest next to the WAD lets the next build reconvert only the files
+// that changed and keep the other lumps as they are.
+int build_pwad(const build_options_t *options, build_stats_t *stats) {
+    DIR* dir;
+    struct dirent* entry;
+    const char *output_path = options->output_path;
+    char temp_path[1040];
+    char manifest_path[1040];
+    FILE* pwad_file;
+    double start_time = now_seconds();
+    memset(stats, 0, sizeof(*stats));
+    import_color_key = options->color_key;
+
+    // Open input directory
+    dir = opendir(options->input_folder);
+    if (!dir) {
+        fprintf(stderr, "Error opening input folder %s: %s\n", options->input_folder, strerror(errno));
+        return 0;
+    }
+
+    // Collect the files any decoder understands
+    import_job_t *jobs = NULL;
+    int job_count = 0, job_capacity = 0;
+    size_t prefix_length = strlen(options->prefix ? options->prefix : "");
+    while ((entry = readdir(dir)) != NULL) {
+        if (!import_decoder_for(entry->d_name) || strlen(entry->d_name) >= sizeof(jobs->filename)) continue;
+
+        struct stat st;
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", options->input_folder, entry->d_name);
+        if (stat(path, &st) != 0) continue;
+
+        if (job_count == job_capacity) {
+            job_capacity = job_capacity ? job_capacity * 2 : 64;
+            import_job_t *grown = realloc(jobs, job_capacity * sizeof(import_job_t));
+            if (!grown) break;
+            jobs = grown;
+        }
+        import_job_t *job = &jobs[job_count++];
+        memset(job, 0, sizeof(*job));
+        strcpy(job->path, path);
+        strcpy(job->filename, entry->d_name);
+        job->size = st.st_size;
+        job->mtime = st.st_mtime;
+
+        // Lump name: the prefix and the filename up to its extension,
+        // uppercased unless asked not to
+        snprintf(job->name, sizeof(job->name), "%s%s", prefix_length ? options->prefix : "", entry->d_name);
+        for (size_t i = prefix_length; i < 8 && job->name[i]; i++) {
+            if (job->name[i] == '.') {
+                job->name[i] = '\0';
+                break;
+            }
+        }
+        if (!options->keep_case) {
+            for (int i = 0; job->name[i]; i++) job->name[i] = toupper((unsigned char)job->name[i]);
+        }
+    }
+    closedir(dir);
+
+    if (job_count == 0) {
+        fprintf(stderr, "No PNG, TGA or BMP files in %s\n", options->input_folder);
+        free(jobs);
+        return 0;
+    }
+    qsort(jobs, job_count, sizeof(import_job_t), compare_import_jobs);
+    stats->sources = job_count;
+    stats->duplicates = report_duplicate_lump_names(jobs, job_count);
+
+    // Unchanged lumps come from the previous WAD, found through the
+    // manifest next to it
+    snprintf(manifest_path, sizeof(manifest_path), "%s%s", output_path, BUILD_MANIFEST_SUFFIX);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", output_path);
+    int unchanged = options->rebuild ? 0 : load_build_manifest(manifest_path, output_path, jobs, job_count);
+    long long previous_data_end = 0;
+    bool any_previous = false;
+    for (int i = 0; i < job_count && !any_previous; i++) any_previous = jobs[i].has_previous;
+    if (any_previous) {
+        FILE *previous = fopen(output_path, "rb");
+        PWADHeader previous_header;
+        if (previous && fread(&previous_header, sizeof(previous_header), 1, previous) == 1) {
+            previous_data_end = previous_header.directory_pos;
+        }
+        if (previous) fclose(previous);
+    }
+    if (previous_data_end <= 0) {
+        for (int i = 0; i < job_count; i++) jobs[i].has_previous = jobs[i].reuse = false;
+        unchanged = 0;
+    }
+
+    if (options->dry_run) {
+        // Files that would need reading at least; touched ones may still be kept
+        for (int i = 0; i < job_count; i++) {
+            printf("%-7s %s -> %.8s\n", jobs[i].reuse ? "keep" : "convert", jobs[i].filename, jobs[i].name);
+            if (jobs[i].reuse) stats->reused++;
+        }
+        stats->converted = job_count - stats->reused;
+        stats->seconds = now_seconds() - start_time;
+        free(jobs);
+        return 1;
+    }
+
+    if (unchanged < job_count) {
+        prepare_color_lookup();
+        parallel_for(job_count, import_file, jobs);
+    }
+
+    // The new WAD is always written next to the old one and renamed over
+    // it, so a failed build leaves the old file whole. Kept lumps are
+    // copied from a mapping of the old file; the viewer may have it mapped
+    // too, which the rename does not disturb.
+    bool any_reused = false;
+    for (int i = 0; i < job_count; i++) any_reused |= jobs[i].reuse;
+    mapped_file_t previous_wad = {0};
+    if (any_reused && (!map_file(output_path, &previous_wad) || previous_wad.size < (size_t)previous_data_end)) {
+        fprintf(stderr, "Could not read previous WAD %s\n", output_path);
+        for (int i = 0; i < job_count; i++) free(jobs[i].patch);
+        free(jobs);
+        unmap_file(&previous_wad);
+        return 0;
+    }
+
+    pwad_file = fopen(temp_path, "wb");
+    if (!pwad_file) {
+        fprintf(stderr, "Error creating WAD file %s: %s\n", output_path, strerror(errno));
+        for (int i = 0; i < job_count; i++) free(jobs[i].patch);
+        free(jobs);
+        unmap_file(&previous_wad);
+        return 0;
+    }
+
+    // PWAD header
+    PWADHeader header;
+    strncpy(header.magic, "PWAD", 4);
+    header.num_lumps = 0;
+    header.directory_pos = sizeof(PWADHeader);
+
+    // Write placeholder header
+    fwrite(&header, sizeof(PWADHeader), 1, pwad_file);
+
+    // Allocate lump entries, with room for a marker pair
+    LumpEntry* lumps = calloc(job_count + 2, sizeof(LumpEntry));
+    long long* lump_offsets = malloc(job_count * sizeof(long long));
+    if (!lumps || !lump_offsets) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(pwad_file);
+        remove(temp_path);
+        for (int i = 0; i < job_count; i++) free(jobs[i].patch);
+        free(jobs);
+        free(lumps);
+        free(lump_offsets);
+        unmap_file(&previous_wad);
+        return 0;
+    }
+
+    static const char *marker_names[][2] = {{NULL, NULL}, {"S_START", "S_END"}, {"P_START", "P_END"}};
+    int lump_index = 0;
+    if (options->markers != BUILD_MARKERS_NONE) {
+        const char *marker = marker_names[options->markers][0];
+        memcpy(lumps[lump_index++].name, marker, strlen(marker));
+    }
+
+    // Place the patches in order, reused or converted, skipping failures
+    long long current_pos = sizeof(PWADHeader);
+    for (int i = 0; i < job_count; i++) {
+        import_job_t *job = &jobs[i];
+        long long lump_pos = current_pos;
+        lump_offsets[i] = -1;
+        if (job->reuse) {
+            job->patch_size = job->previous_size;
+            job->indexed = job->previous_indexed;
+            stats->reused++;
+            fwrite(previous_wad.data + job->previous_offset, 1, job->patch_size, pwad_file);
+            current_pos += job->patch_size;
+            stats->bytes_written += job->patch_size;
+        } else if (!job->patch) {
+            fprintf(stderr, "Failed to convert %s\n", job->path);
+            stats->failed++;
+            continue;
+        } else {
+            current_pos += job->patch_size;
+            fwrite(job->patch, 1, job->patch_size, pwad_file);
+            stats->converted++;
+            stats->bytes_written += job->patch_size;
+        }
+        if (options->verbose) {
+            printf("%-7s %s -> %.8s (%d bytes)\n", job->reuse ? "kept" : "built", job->filename, job->name,
+                   job->patch_size);
+        }
+
+        memcpy(lumps[lump_index].name, job->name, strlen(job->name));
+        lumps[lump_index].lump_pos = lump_pos;
+        lumps[lump_index].lump_size = job->patch_size;
+        lump_offsets[i] = lump_pos;
+
+        lump_index++;
+        if (job->indexed) stats->indexed++;
+        free(job->patch);
+        job->patch = NULL;
+    }
+    if (options->markers != BUILD_MARKERS_NONE) {
+        const char *marker = marker_names[options->markers][1];
+        memcpy(lumps[lump_index++].name, marker, strlen(marker));
+    }
+
+    // Write directory entries
+    fseek(pwad_file, current_pos, SEEK_SET);
+    fwrite(lumps, sizeof(LumpEntry), lump_index, pwad_file);
+
+    // Update header with correct directory position
+    fseek(pwad_file, 0, SEEK_SET);
+    header.num_lumps = lump_index;
+    header.directory_pos = current_pos;
+    fwrite(&header, sizeof(PWADHeader), 1, pwad_file);
+    stats->bytes_written += sizeof(LumpEntry) * lump_index + sizeof(PWADHeader);
+
+    bool written = !ferror(pwad_file);
+    written = fclose(pwad_file) == 0 && written;
+    unmap_file(&previous_wad);
+#ifdef _WIN32
+    if (written) remove(output_path);
+#endif
+    if (written && rename(temp_path, output_path) != 0) written = false;
+    if (!written) remove(temp_path);
+    if (written) {
+        save_build_manifest(manifest_path, output_path, jobs, job_count, lump_offsets);
+    } else {
+        // Whatever is on disk no longer matches the manifest
+        fprintf(stderr, "Error writing WAD file %s: %s\n", output_path, strerror(errno));
+        remove(manifest_path);
+    }
+
+    // Cleanup
+    free(lumps);
+    free(lump_offsets);
+    free(jobs);
+
+    stats->seconds = now_seconds() - start_time;
+    return written && stats->converted + stats->reused > 0;
+}
+
+int pngtopwad(const char* input_folder, const char* wad_name, const char* output_folder) {
+    char output_path[1024];
+    snprintf(output_path, sizeof(output_path), "%s/%s.wad", output_folder, wad_name);
+
+    build_options_t options = {0};
+    options.input_folder = input_folder;
+    options.output_path = output_path;
+    build_stats_t stats;
+    int result = build_pwad(&options, &stats);
+
+    printf("%s %s with %d of %d images as DOOM patches (%d reused, %d without colour matching) in %.3fs\n",
+           stats.reused > 0 ? "Updated" : "Created", output_path, stats.converted + stats.reused, stats.sources,
+           stats.reused, stats.indexed, stats.seconds);
+    return result;
+}
+
+static void build_usage() {
+    fprintf(stderr,
+            "usage: eyeglass build <input folder> -o <output.wad> [options]\n"
+            "  -o, --output <file>    WAD to write or update\n"
+            "  -j, --jobs <n>         Worker threads (default: one per CPU)\n"
+            "  --palette <file>       PLAYPAL lump or WAD to take the palette from\n"
+            "  --markers <kind>       Wrap the lumps in sprite (S_START/S_END) or\n"
+            "                         patch (P_START/P_END) markers: sprites, patches, none\n"
+            "  --prefix <text>        Prepend text to every lump name\n"
+            "  --keep-case            Do not uppercase lump names\n"
+            "  --cyan-key             Make pure cyan (0,255,255) transparent in images without alpha\n"
+            "  --rebuild              Ignore the build manifest and convert everything\n"
+            "  -n, --dry-run          List what would be converted or kept, write nothing\n"
+            "  -v, --verbose          Log every lump\n");
+}
+
+// Fill doom_palette from a raw PLAYPAL lump or from a WAD that has one
+static bool load_palette_file(const char *path) {
+    size_t size;
+    unsigned char *data = read_whole_file(path, &size);
+    if (!data) return false;
+    bool loaded = false;
+    if (size >= 12 && (memcmp(data, "IWAD", 4) == 0 || memcmp(data, "PWAD", 4) == 0)) {
+        loaded = extract_palette_from_wad(path);
+    } else if (size >= sizeof(doom_palette)) {
+        memcpy(doom_palette, data, sizeof(doom_palette));
+        loaded = true;
+    }
+    free(data);
+    return loaded;
+}
+
+// eyeglass build: headless folder-to-PWAD conversion for scripts and CI.
+// Exits 0 on success, 1 if anything failed to convert, 2 on bad usage.
+int build_command(int argc, char **argv) {
+    build_options_t options = {0};
+    const char *palette_path = NULL;
+
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+            options.output_path = value;
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+            worker_limit = value ? atoi(value) : 0;
+            if (worker_limit <= 0) {
+                fprintf(stderr, "--jobs needs a positive number\n");
+                return 2;
+            }
+        } else if (strcmp(arg, "--palette") == 0) {
+            palette_path = value;
+        } else if (strcmp(arg, "--prefix") == 0) {
+            options.prefix = value;
+        } else if (strcmp(arg, "--markers") == 0) {
+            if (value && strcmp(value, "sprites") == 0) {
+                options.markers = BUILD_MARKERS_SPRITES;
+            } else if (value && strcmp(value, "patches") == 0) {
+                options.markers = BUILD_MARKERS_PATCHES;
+            } else if (value && strcmp(value, "none") == 0) {
+                options.markers = BUILD_MARKERS_NONE;
+            } else {
+                fprintf(stderr, "--markers takes sprites, patches or none\n");
+                return 2;
+            }
+        } else {
+            takes_value = false;
+            if (strcmp(arg, "--keep-case") == 0) {
+                options.keep_case = true;
+            } else if (strcmp(arg, "--cyan-key") == 0) {
+                options.color_key = true;
+            } else if (strcmp(arg, "--rebuild") == 0) {
+                options.rebuild = true;
+            } else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--dry-run") == 0) {
+                options.dry_run = true;
+            } else if (strcmp(arg, "-v") == 0 || strcmp(arg, "--verbose") == 0) {
+                options.verbose = true;
+            } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                build_usage();
+                return 0;
+            } else if (arg[0] == '-' || options.input_folder) {
+                fprintf(stderr, "Unexpected argument: %s\n", arg);
+                build_usage();
+                return 2;
+            } else {
+                options.input_folder = arg;
+            }
+        }
+        if (takes_value) {
+            if (!value) {
+                fprintf(stderr, "%s needs a value\n", arg);
+                return 2;
+            }
+            i++;
+        }
+    }
+
+    if (!options.input_folder || !options.output_path) {
+        build_usage();
+        return 2;
+    }
+
+    if (palette_path) {
+        if (!load_palette_file(palette_path)) {
+            fprintf(stderr, "No palette in %s\n", palette_path);
+            return 2;
+        }
+    } else {
+        load_doom_palette();
+        if (!palette_loaded) {
+            fprintf(stderr, "No playpal.lmp found; matching colours against a grayscale ramp\n");
+            for (int i = 0; i < 256; i++) {
+                doom_palette[i][0] = doom_palette[i][1] = doom_palette[i][2] = i;
+            }
+        }
+    }
+
+    build_stats_t stats;
+    int result = build_pwad(&options, &stats);
+    if (!result) return 1;
+
+    if (options.dry_run) {
+        printf("%s: would convert %d and keep %d of %d images\n",
+               options.output_path, stats.converted, stats.reused, stats.sources);
+    } else {
+        // A rate only means something when images were converted
+        char rate[32] = "";
+        if (stats.converted > 0 && stats.seconds > 0) {
+            snprintf(rate, sizeof(rate), " (%.0f images/s)", stats.converted / stats.seconds);
+        }
+        printf("%s: %d images converted, %d kept, %d failed; %lld bytes written in %.3fs%s\n",
+               options.output_path, stats.converted, stats.reused, stats.failed,
+               stats.bytes_written, stats.seconds, rate);
+    }
+    return stats.failed > 0 || stats.duplicates > 0 ? 1 : 0;
+}
+
+static void diff_usage() {
+    fprintf(stderr,
+            "usage: eyeglass diff <old.wad> <new.wad> [options]\n"
+            "  -j, --jobs <n>         Worker threads (default: one per CPU)\n"
+            "  --palette <file>       PLAYPAL lump or WAD to decode images with\n"
+            "  --images <folder>      Write a TGA per changed image, changed pixels in red\n"
+            "  --no-pixels            Compare lump contents only, without decoding images\n"
+            "  -q, --quiet            Print only the summary\n");
+}
+
+// "NS/NAME", or just the name in the global namespace
+static void diff_lump_label(const wad_file_t *wad, char (*ns)[9], int lump, char *out) {
+    char name[9] = {0};
+    strncpy(name, wad->directory[lump].name, 8);
+    sprintf(out, "%s%s%s", ns[lump], ns[lump][0] ? "/" : "", name);
+}
+
+// eyeglass diff: list the lumps two WADs or PK3s differ in, with a pixel
+// count for changed images. Exits 0 if they are the same, 1 if they
+// differ, 2 on bad usage or an unreadable file, like diff(1).
+int diff_command(int argc, char **argv) {
+    const char *paths[2] = {NULL, NULL};
+    const char *palette_path = NULL;
+    const char *image_folder = NULL;
+    bool pixels = true;
+    bool quiet = false;
+    
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+            worker_limit = value ? atoi(value) : 0;
+            if (worker_limit <= 0) {
+                fprintf(stderr, "--jobs needs a positive number\n");
+                return 2;
+            }
+        } else if (strcmp(arg, "--palette") == 0) {
+            palette_path = value;
+        } else if (strcmp(arg, "--images") == 0) {
+            image_folder = value;
+        } else {
+            takes_value = false;
+            if (strcmp(arg, "--no-pixels") == 0) {
+                pixels = false;
+            } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) {
+                quiet = true;
+            } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                diff_usage();
+                return 0;
+            } else if (arg[0] == '-' || paths[1]) {
+                fprintf(stderr, "Unexpected argument: %s\n", arg);
+                diff_usage();
+                return 2;
+            } else {
+                paths[paths[0] ? 1 : 0] = arg;
+            }
+        }
+        if (takes_value) {
+            if (!value) {
+                fprintf(stderr, "%s needs a value\n", arg);
+                return 2;
+            }
+            i++;
+        }
+    }
+    
+    if (!paths[1]) {
+        diff_usage();
+        return 2;
+    }
+    if (image_folder && !is_directory(image_folder)) {
+        fprintf(stderr, "%s is not a folder\n", image_folder);
+        return 2;
+    }
+    
+    // Same palette choice as the viewer: playpal.lmp, then the WADs themselves
+    if (palette_path) {
+        if (!load_palette_file(palette_path)) {
+            fprintf(stderr, "No palette in %s\n", palette_path);
+            return 2;
+        }
+    } else if (pixels) {
+        load_doom_palette();
+        if (!palette_loaded && !extract_palette_from_wad(paths[1]) && !extract_palette_from_wad(paths[0])) {
+            for (int i = 0; i < 256; i++) {
+                doom_palette[i][0] = doom_palette[i][1] = doom_palette[i][2] = i;
+            }
+        }
+    }
+    
+    // Opening hashes every lump on the worker pool, which is most of the work
+    double start = now_seconds();
+    wad_file_t *a = wad_open(paths[0]);
+    wad_file_t *b = a ? wad_open(paths[1]) : NULL;
+    if (!a || !b) {
+        fprintf(stderr, "Could not open %s\n", a ? paths[1] : paths[0]);
+        wad_close(a);
+        return 2;
+    }
+    
+    arena_t arena = {0};
+    wad_diff_t diff;
+    if (!wad_diff(a, b, &diff, &arena)) {
+        fprintf(stderr, "Not enough memory to diff %s and %s\n", paths[0], paths[1]);
+        arena_free(&arena);
+        wad_close(a);
+        wad_close(b);
+        return 2;
+    }
+    if (pixels) wad_diff_pixels(&diff, image_folder);
+    double seconds = now_seconds() - start;
+    
+    for (int e = 0; e < diff.num_entries && !quiet; e++) {
+        const lump_diff_t *entry = &diff.entries[e];
+        char label_a[20] = "", label_b[20] = "";
+        if (entry->lump_a >= 0) diff_lump_label(a, diff.ns_a, entry->lump_a, label_a);
+        if (entry->lump_b >= 0) diff_lump_label(b, diff.ns_b, entry->lump_b, label_b);
+        
+        switch (entry->kind) {
+            case DIFF_ADDED:
+                printf("added    %s\n", label_b);
+                break;
+            case DIFF_REMOVED:
+                printf("removed  %s\n", label_a);
+                break;
+            case DIFF_MOVED:
+                printf("moved    %s (lump %d -> %d)\n", label_b, entry->lump_a, entry->lump_b);
+                break;
+            case DIFF_RENAMED:
+                printf("renamed  %s -> %s\n", label_a, label_b);
+                break;
+            case DIFF_CHANGED:
+                printf("changed  %s", label_b);
+                if (entry->pixels_changed > 0) {
+                    printf(": %d pixel%s in %d,%d-%d,%d", entry->pixels_changed, entry->pixels_changed == 1 ? "" : "s",
+                           entry->box_x0, entry->box_y0, entry->box_x1, entry->box_y1);
+                } else if (entry->pixels_changed == 0) {
+                    printf(": same pixels");
+                }
+                if (entry->pixels_changed >= 0 && (entry->width_a != entry->width_b || entry->height_a != entry->height_b)) {
+                    printf(", size %dx%d -> %dx%d", entry->width_a, entry->height_a, entry->width_b, entry->height_b);
+                }
+                if (entry->pixels_changed >= 0 && (entry->left_a != entry->left_b || entry->top_a != entry->top_b)) {
+                    printf(", offsets %d,%d -> %d,%d", entry->left_a, entry->top_a, entry->left_b, entry->top_b);
+                }
+                if (entry->pixels_changed < 0) {
+                    printf(": %d -> %d bytes", a->directory[entry->lump_a].size, b->directory[entry->lump_b].size);
+                }
+                printf(entry->moved ? " (moved)\n" : "\n");
+                break;
+        }
+    }
+    
+    double megabytes = (a->map.size + b->map.size) / (1024.0 * 1024.0);
+    printf("%s -> %s: %d added, %d removed, %d changed, %d moved, %d renamed, %d unchanged; "
+           "%.1f MB in %.3fs (%.0f MB/s)\n",
+           paths[0], paths[1], diff.counts[DIFF_ADDED], diff.counts[DIFF_REMOVED], diff.counts[DIFF_CHANGED],
+           diff.counts[DIFF_MOVED], diff.counts[DIFF_RENAMED], diff.counts[DIFF_SAME],
+           megabytes, seconds, seconds > 0 ? megabytes / seconds : 0);
+    
+    int result = diff.num_entries > 0 ? 1 : 0;
+    arena_free(&arena);
+    wad_close(a);
+    wad_close(b);
+    return result;
+}
+
+// One image of the duplicate report
+typedef struct {
+    int file;                     // Index into the report's file list
+    char name[9];
+    char ns[9];
+    int width, height;
+    uint64_t phash;               // 0 if not decodable or too plain
+    bool inflate;                 // PK3 member still to be inflated
+    const unsigned char *data;
+} dupe_image_t;
+
+typedef struct {
+    wad_file_t *wad;
+    dupe_image_t *images;
+    int *lumps;                   // Directory index per image
+} dupe_job_t;
+
+static void hash_dupe_image(void *context, int index) {
+    dupe_job_t *job = (dupe_job_t *)context;
+    dupe_image_t *item = &job->images[index];
+    int lump = job->lumps[index];
+    if (item->inflate) {
+        zip_entry_t *member = &job->wad->zip_entries[lump];
+        if (!zip_member_inflate(job->wad, lump, member->data)) return;
+    }
+    
+    wad_image_t image = {0};
+    if (!item->data || !lump_image_setup(&image, job->wad, lump, item->data, item->ns)) return;
+    arena_t arena = {0};
+    indexed_image_t *indexed = decode_image_indexed(&image, &arena);
+    if (indexed) {
+        item->width = image.width;
+        item->height = image.height;
+        item->phash = image_phash(indexed);
+    }
+    arena_free(&arena);
+}
+
+static int compare_group_sizes(const void *a, const void *b) {
+    const int *x = (const int *)a, *y = (const int *)b;
+    return x[1] != y[1] ? y[1] - x[1] : x[0] - y[0];
+}
+
+static void dupes_usage() {
+    fprintf(stderr,
+            "usage: eyeglass dupes <wad, pk3 or folder>... [options]\n"
+            "  -d, --distance <n>     Bits two hashes may differ in and still match (default %d)\n"
+            "  -j, --jobs <n>         Worker threads (default: one per CPU)\n"
+            "  --palette <file>       PLAYPAL lump or WAD to judge brightness with\n"
+            "  -o, --output <file>    Write the report here instead of to stdout\n",
+            PHASH_DISTANCE);
+}
+
+// eyeglass dupes: group the graphics of many WADs by perceptual hash to
+// find copies and recolours. Folders are searched for WADs and PK3s.
+// Exits 0 on success, 1 if a file could not be read, 2 on bad usage.
+int dupes_command(int argc, char **argv) {
+    const char *palette_path = NULL;
+    const char *output_path = NULL;
+    int radius = PHASH_DISTANCE;
+    wad_info_t *files = NULL;
+    int num_files = 0, file_capacity = 0;
+    
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-d") == 0 || strcmp(arg, "--distance") == 0) {
+            radius = value ? atoi(value) : -1;
+            if (radius < 0 || radius > 64) {
+                fprintf(stderr, "--distance takes 0 to 64\n");
+                return 2;
+            }
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+            worker_limit = value ? atoi(value) : 0;
+            if (worker_limit <= 0) {
+                fprintf(stderr, "--jobs needs a positive number\n");
+                return 2;
+            }
+        } else if (strcmp(arg, "--palette") == 0) {
+            palette_path = value;
+        } else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+            output_path = value;
+        } else {
+            takes_value = false;
+            if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                dupes_usage();
+                return 0;
+            } else if (arg[0] == '-') {
+                fprintf(stderr, "Unexpected argument: %s\n", arg);
+                dupes_usage();
+                return 2;
+            } else if (is_directory(arg)) {
+                collect_wad_files(arg, &files, &num_files, &file_capacity);
+            } else {
+                add_wad_candidate(&files, &num_files, &file_capacity, arg, 0, 0);
+            }
+        }
+        if (takes_value) {
+            if (!value) {
+                fprintf(stderr, "%s needs a value\n", arg);
+                return 2;
+            }
+            i++;
+        }
+    }
+    
+    if (num_files == 0) {
+        dupes_usage();
+        return 2;
+    }
+    qsort(files, num_files, sizeof(wad_info_t), compare_wad_info_path);
+    
+    if (palette_path) {
+        if (!load_palette_file(palette_path)) {
+            fprintf(stderr, "No palette in %s\n", palette_path);
+            return 2;
+        }
+    } else {
+        load_doom_palette();
+        if (!palette_loaded && !extract_palette_from_wad(files[0].path)) {
+            fprintf(stderr, "No playpal.lmp found; judging brightness by palette index\n");
+            for (int i = 0; i < 256; i++) {
+                doom_palette[i][0] = doom_palette[i][1] = doom_palette[i][2] = i;
+            }
+        }
+    }
+    prepare_color_lookup();
+    
+    // One file at a time, so only one is mapped; its images hash in parallel
+    double start = now_seconds();
+    dupe_image_t *images = NULL;
+    int num_images = 0, image_capacity = 0, failed = 0;
+    for (int f = 0; f < num_files; f++) {
+        wad_file_t *wad = wad_open(files[f].path);
+        if (!wad) {
+            fprintf(stderr, "Could not open %s\n", files[f].path);
+            failed++;
+            continue;
+        }
+        
+        int num_lumps = wad->header.num_lumps;
+        char (*ns)[9] = (char (*)[9])arena_alloc(&wad->arena, (num_lumps + 1) * 9);
+        int *lumps = (int *)arena_alloc(&wad->arena, (num_lumps + 1) * sizeof(int));
+        if (num_images + num_lumps > image_capacity) {
+            int capacity = image_capacity ? image_capacity : 1024;
+            while (capacity < num_images + num_lumps) capacity *= 2;
+            dupe_image_t *grown = (dupe_image_t *)realloc(images, capacity * sizeof(dupe_image_t));
+            if (grown) {
+                images = grown;
+                image_capacity = capacity;
+            }
+        }
+        if (!ns || !lumps || num_images + num_lumps > image_capacity) {
+            fprintf(stderr, "Not enough memory for %s\n", files[f].path);
+            failed++;
+            wad_close(wad);
+            continue;
+        }
+        wad_lump_namespaces(wad, ns);
+        
+        // PK3 buffers come from the WAD's arena, so they are handed out here
+        dupe_job_t job = {wad, images + num_images, lumps};
+        int count = 0;
+        for (int i = 0; i < num_lumps; i++) {
+            char name[9] = {0};
+            strncpy(name, wad->directory[i].name, 8);
+            if (wad->directory[i].size <= 0 || !is_image_lump(name) || is_map_data_lump(name)) continue;
+            
+            dupe_image_t *item = &job.images[count];
+            memset(item, 0, sizeof(*item));
+            item->file = f;
+            strcpy(item->name, name);
+            strcpy(item->ns, ns[i]);
+            if (wad->zip_entries) {
+                item->inflate = zip_member_reserve(wad, i);
+                item->data = wad->zip_entries[i].data;
+            } else {
+                int size;
+                item->data = wad_lump_data(wad, i, &size);
+            }
+            lumps[count++] = i;
+        }
+        parallel_for(count, hash_dupe_image, &job);
+        
+        for (int i = 0; i < count; i++) {
+            if (job.images[i].phash) images[num_images++] = job.images[i];
+        }
+        wad_close(wad);
+    }
+    double hash_seconds = now_seconds() - start;
+    
+    // Greedy grouping: each image not yet placed gathers the unplaced
+    // images within reach of it
+    arena_t arena = {0};
+    phash_tree_t tree;
+    int *group_of = (int *)malloc((num_images + 1) * sizeof(int));
+    int *found = (int *)malloc((num_images + 1) * sizeof(int));
+    int *members = (int *)malloc((num_images + 1) * sizeof(int));   // Images in group order
+    int *groups = (int *)malloc((num_images + 1) * 3 * sizeof(int)); // First member, size, leader
+    if (!group_of || !found || !members || !groups || !phash_tree_init(&tree, num_images, &arena)) {
+        fprintf(stderr, "Not enough memory to group %d images\n", num_images);
+        return 2;
+    }
+    for (int i = 0; i < num_images; i++) {
+        group_of[i] = -1;
+        phash_tree_insert(&tree, images[i].phash, i);
+    }
+    
+    int num_groups = 0, num_members = 0, duplicates = 0;
+    for (int i = 0; i < num_images; i++) {
+        if (group_of[i] >= 0) continue;
+        int count = phash_tree_query(&tree, images[i].phash, radius, found, num_images);
+        int first = num_members;
+        members[num_members++] = i;
+        group_of[i] = num_groups;
+        for (int k = 0; k < count; k++) {
+            if (group_of[found[k]] >= 0) continue;
+            group_of[found[k]] = num_groups;
+            members[num_members++] = found[k];
+        }
+        if (num_members - first < 2) {
+            num_members = first;    // Nothing looks like it
+            continue;
+        }
+        qsort(members + first, num_members - first, sizeof(int), compare_ints);
+        groups[num_groups * 3] = first;
+        groups[num_groups * 3 + 1] = num_members - first;
+        groups[num_groups * 3 + 2] = i;
+        duplicates += num_members - first;
+        num_groups++;
+    }
+    
+    // Biggest groups first; the sort moves whole (first, size, leader) triples
+    qsort(groups, num_groups, 3 * sizeof(int), compare_group_sizes);
+    
+    FILE *report = output_path ? fopen(output_path, "w") : stdout;
+    if (!report) {
+        fprintf(stderr, "Could not write %s: %s\n", output_path, strerror(errno));
+        return 2;
+    }
+    fprintf(report, "# %d groups of look-alike images among %d images in %d files (within %d bits)\n",
+            num_groups, num_images, num_files - failed, radius);
+    for (int g = 0; g < num_groups; g++) {
+        int first = groups[g * 3], size = groups[g * 3 + 1];
+        const dupe_image_t *leader = &images[groups[g * 3 + 2]];
+        fprintf(report, "\ngroup %d: %d images\n", g + 1, size);
+        for (int m = first; m < first + size; m++) {
+            const dupe_image_t *item = &images[members[m]];
+            fprintf(report, "  %2d  %s  %s%s%s  %dx%d\n", hash_distance(item->phash, leader->phash),
+                    files[item->file].path, item->ns, item->ns[0] ? "/" : "", item->name, item->width, item->height);
+        }
+    }
+    if (output_path) fclose(report);
+    
+    printf("Hashed %d images from %d files in %.2fs (%.0f images/s); %d groups hold %d look-alikes\n",
+           num_images, num_files - failed, hash_seconds, hash_seconds > 0 ? num_images / hash_seconds : 0,
+           num_groups, duplicates);
+    
+    free(group_of);
+    free(found);
+    free(members);
+    free(groups);
+    free(images);
+    arena_free(&arena);
+    for (int f = 0; f < num_files; f++) free(files[f].path);
+    free(files);
+    return failed > 0 ? 1 : 0;
+}
+
+// Map a catalog file and check that every section lies inside it
+bool catalog_open(const char *path, catalog_t *catalog) {
+    memset(catalog, 0, sizeof(*catalog));
+    if (!map_file(path, &catalog->map)) return false;
+    
+    const unsigned char *data = catalog->map.data;
+    size_t size = catalog->map.size;
+    const catalog_header_t *header = (const catalog_header_t *)data;
+    if (size < sizeof(catalog_header_t) || memcmp(header->magic, CATALOG_MAGIC, 4) != 0 ||
+        header->wads_offset > size || (size - header->wads_offset) / sizeof(catalog_wad_t) < header->num_wads ||
+        header->names_offset > size || (size - header->names_offset) / sizeof(catalog_name_t) < header->num_names ||
+        header->postings_offset > size || (size - header->postings_offset) / sizeof(uint32_t) < header->num_postings ||
+        header->strings_offset > size || size - header->strings_offset < header->strings_size ||
+        header->strings_size == 0 || data[header->strings_offset + header->strings_size - 1] != '\0' ||
+        (header->wads_offset | header->names_offset | header->postings_offset) % 8 != 0) {
+        unmap_file(&catalog->map);
+        return false;
+    }
+    
+    catalog->header = header;
+    catalog->wads = (const catalog_wad_t *)(data + header->wads_offset);
+    catalog->names = (const catalog_name_t *)(data + header->names_offset);
+    catalog->postings = (const uint32_t *)(data + header->postings_offset);
+    catalog->strings = (const char *)(data + header->strings_offset);
+    
+    // Postings and paths are trusted from here on
+    for (uint32_t n = 0; n < header->num_names; n++) {
+        if (catalog->names[n].first_posting > header->num_postings ||
+            header->num_postings - catalog->names[n].first_posting < catalog->names[n].num_postings) {
+            catalog_close(catalog);
+            return false;
+        }
+    }
+    for (uint32_t p = 0; p < header->num_postings; p++) {
+        if (catalog->postings[p] >= header->num_wads) {
+            catalog_close(catalog);
+            return false;
+        }
+    }
+    for (uint32_t w = 0; w < header->num_wads; w++) {
+        if (catalog->wads[w].path >= header->strings_size) {
+            catalog_close(catalog);
+            return false;
+        }
+    }
+    return true;
+}
+
+void catalog_close(catalog_t *catalog) {
+    unmap_file(&catalog->map);
+    memset(catalog, 0, sizeof(*catalog));
+}
+
+static int compare_catalog_names(const void *a, const void *b) {
+    uint64_t x = ((const catalog_name_t *)a)->name, y = ((const catalog_name_t *)b)->name;
+    return x < y ? -1 : x > y;
+}
+
+// The entry for a lump name, or NULL if no WAD in the catalog has it
+const catalog_name_t *catalog_find(const catalog_t *catalog, const char *name) {
+    catalog_name_t key = {pack_lump_name(name), 0, 0};
+    return (const catalog_name_t *)bsearch(&key, catalog->names, catalog->header->num_names,
+                                           sizeof(catalog_name_t), compare_catalog_names);
+}
+
+// Evaluate a query against every WAD in the catalog. Terms are separated
+// by spaces and must all hold; a leading ! negates one.
+//   NAME or a glob like D_*     has a lump of that name
+//   palette                     has a PLAYPAL
+//   type:iwad, type:pwad, type:pk3
+//   maps>32, lumps<=100, sprites>0, flats=0   (> >= < <= =)
+// Sets matches[w] for each WAD and returns how many matched, or -1 if a
+// term could not be understood.
+int catalog_query(const catalog_t *catalog, const char *query, unsigned char *matches) {
+    int num_wads = catalog->header->num_wads;
+    unsigned char *term_matches = (unsigned char *)malloc(num_wads + 1);
+    if (!term_matches) return -1;
+    memset(matches, 1, num_wads);
+    
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", query);
+    for (char *c = buffer; *c; c++) *c = toupper((unsigned char)*c);
+    
+    for (char *term = strtok(buffer, " \t"); term; term = strtok(NULL, " \t")) {
+        bool negate = term[0] == '!';
+        if (negate) term++;
+        memset(term_matches, 0, num_wads);
+        
+        const char *op = strpbrk(term, "<>=");
+        if (op && op > term && strchr("0123456789", op[op[1] == '=' ? 2 : 1]) && op[op[1] == '=' ? 2 : 1]) {
+            // Stat comparison
+            int length = (int)(op - term);
+            bool or_equal = op[1] == '=';
+            long long value = atoll(op + (or_equal ? 2 : 1));
+            int field = -1;
+            const char *fields[] = {"LUMPS", "MAPS", "SPRITES", "FLATS"};
+            for (int f = 0; f < 4; f++) {
+                if ((int)strlen(fields[f]) == length && strncmp(term, fields[f], length) == 0) field = f;
+            }
+            if (field < 0 || (op[0] == '=' && or_equal)) {
+                fprintf(stderr, "Unknown query term: %s\n", term);
+                free(term_matches);
+                return -1;
+            }
+            for (int w = 0; w < num_wads; w++) {
+                const catalog_wad_t *wad = &catalog->wads[w];
+                long long stat = field == 0 ? wad->num_lumps : field == 1 ? wad->num_maps :
+                                 field == 2 ? wad->num_sprites : wad->num_flats;
+                term_matches[w] = op[0] == '>' ? (or_equal ? stat >= value : stat > value) :
+                                  op[0] == '<' ? (or_equal ? stat <= value : stat < value) : stat == value;
+            }
+        } else if (strncmp(term, "TYPE:", 5) == 0) {
+            int type = strcmp(term + 5, "IWAD") == 0 ? WAD_TYPE_IWAD : strcmp(term + 5, "PWAD") == 0 ? WAD_TYPE_PWAD :
+                       strcmp(term + 5, "PK3") == 0 ? WAD_TYPE_PK3 : -1;
+            if (type < 0) {
+                fprintf(stderr, "Unknown WAD type: %s (iwad, pwad or pk3)\n", term + 5);
+                free(term_matches);
+                return -1;
+            }
+            for (int w = 0; w < num_wads; w++) term_matches[w] = catalog->wads[w].type == (uint32_t)type;
+        } else if (strcmp(term, "PALETTE") == 0) {
+            for (int w = 0; w < num_wads; w++) term_matches[w] = (catalog->wads[w].flags & CATALOG_HAS_PALETTE) != 0;
+        } else if (strpbrk(term, "*?[")) {
+            // Globs run over the name table, which is far smaller than the postings
+            for (uint32_t n = 0; n < catalog->header->num_names; n++) {
+                char name[9];
+                memcpy(name, &catalog->names[n].name, 8);
+                name[8] = '\0';
+                if (!glob_match(term, name)) continue;
+                const uint32_t *posting = catalog->postings + catalog->names[n].first_posting;
+                for (uint32_t p = 0; p < catalog->names[n].num_postings; p++) term_matches[posting[p]] = 1;
+            }
+        } else {
+            const catalog_name_t *entry = catalog_find(catalog, term);
+            for (uint32_t p = 0; entry && p < entry->num_postings; p++) {
+                term_matches[catalog->postings[entry->first_posting + p]] = 1;
+            }
+        }
+        
+        for (int w = 0; w < num_wads; w++) matches[w] &= term_matches[w] != negate;
+    }
+    free(term_matches);
+    
+    int count = 0;
+    for (int w = 0; w < num_wads; w++) count += matches[w];
+    return count;
+}
+
+// One WAD while a catalog is built
+typedef struct {
+    wad_info_t info;
+    int num_sprites;
+    int num_flats;
+    uint64_t *names;              // Distinct packed lump names, sorted; malloc'd
+    int num_names;
+} catalog_scan_t;
+
+static int compare_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Read one file's directory for the catalog. Runs on the worker pool;
+// files carried over from the previous catalog are skipped.
+static void catalog_scan_file(void *context, int index) {
+    catalog_scan_t *scan = &((catalog_scan_t *)context)[index];
+    if (scan->info.type != WAD_TYPE_UNKNOWN) return;
+    scan->info.type = WAD_TYPE_INVALID;
+    
+    // Only the directory pages of the mapping are ever touched
+    wad_file_t wad = {0};
+    if (!map_file(scan->info.path, &wad.map)) return;
+    if (wad.map.size >= 4 && (memcmp(wad.map.data, "PK\3\4", 4) == 0 || memcmp(wad.map.data, "PK\5\6", 4) == 0)) {
+        if (zip_read_directory(&wad)) scan->info.type = WAD_TYPE_PK3;
+    } else if (wad.map.size >= sizeof(wad_header_t)) {
+        memcpy(&wad.header, wad.map.data, sizeof(wad_header_t));
+        size_t directory_bytes = (size_t)wad.header.num_lumps * sizeof(wad_directory_t);
+        if ((strncmp(wad.header.identifier, "IWAD", 4) == 0 || strncmp(wad.header.identifier, "PWAD", 4) == 0) &&
+            wad.header.num_lumps >= 0 && wad.header.directory_offset >= 0 &&
+            (size_t)wad.header.directory_offset + directory_bytes <= wad.map.size &&
+            (wad.directory = (wad_directory_t *)arena_alloc(&wad.arena, directory_bytes + 1)) != NULL) {
+            memcpy(wad.directory, wad.map.data + wad.header.directory_offset, directory_bytes);
+            scan->info.type = strncmp(wad.header.identifier, "IWAD", 4) == 0 ? WAD_TYPE_IWAD : WAD_TYPE_PWAD;
+        }
+    }
+    
+    int num_lumps = wad.header.num_lumps;
+    char (*ns)[9] = scan->info.type != WAD_TYPE_INVALID ? (char (*)[9])arena_alloc(&wad.arena, (num_lumps + 1) * 9) : NULL;
+    scan->names = ns ? (uint64_t *)malloc((num_lumps + 1) * sizeof(uint64_t)) : NULL;
+    if (!scan->names) {
+        scan->info.type = WAD_TYPE_INVALID;
+        arena_free(&wad.arena);
+        unmap_file(&wad.map);
+        return;
+    }
+    
+    wad_lump_namespaces(&wad, ns);
+    scan->info.num_lumps = num_lumps;
+    for (int i = 0; i < num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad.directory[i].name, 8);
+        scan->names[i] = pack_lump_name(name);
+        if (is_map_marker(name)) {
+            scan->info.num_maps++;
+        } else if (strcmp(name, "PLAYPAL") == 0) {
+            scan->info.has_palette = true;
+        } else if (wad.directory[i].size > 0 && strcmp(ns[i], "S") == 0) {
+            scan->num_sprites++;
+        } else if (wad.directory[i].size > 0 && strcmp(ns[i], "F") == 0) {
+            scan->num_flats++;
+        }
+    }
+    
+    qsort(scan->names, num_lumps, sizeof(uint64_t), compare_uint64);
+    scan->num_names = 0;
+    for (int i = 0; i < num_lumps; i++) {
+        if (scan->num_names == 0 || scan->names[scan->num_names - 1] != scan->names[i]) {
+            scan->names[scan->num_names++] = scan->names[i];
+        }
+    }
+    arena_free(&wad.arena);
+    unmap_file(&wad.map);
+}
+
+// Take over what an earlier catalog knows about files that have not
+// changed since. Their names come from walking the posting lists once.
+// Returns how many files were carried over.
+static int catalog_reuse(const char *catalog_path, catalog_scan_t *scans, int count) {
+    catalog_t old;
+    if (!catalog_open(catalog_path, &old)) return 0;
+    
+    int num_old = old.header->num_wads;
+    int *old_to_new = (int *)malloc((num_old + 1) * sizeof(int));
+    if (!old_to_new) {
+        catalog_close(&old);
+        return 0;
+    }
+    
+    // Both lists are sorted by path, so one merge pass pairs them up
+    int reused = 0;
+    for (int o = 0, s = 0; o < num_old; o++) {
+        const catalog_wad_t *wad = &old.wads[o];
+        const char *path = old.strings + wad->path;
+        while (s < count && strcmp(scans[s].info.path, path) < 0) s++;
+        old_to_new[o] = -1;
+        if (s < count && strcmp(scans[s].info.path, path) == 0 &&
+            scans[s].info.size == wad->size && scans[s].info.mtime == wad->mtime && wad->type != WAD_TYPE_INVALID) {
+            scans[s].names = (uint64_t *)malloc((wad->num_lumps + 1) * sizeof(uint64_t));
+            if (!scans[s].names) continue;
+            scans[s].info.type = wad->type;
+            scans[s].info.num_lumps = wad->num_lumps;
+            scans[s].info.num_maps = wad->num_maps;
+            scans[s].info.has_palette = (wad->flags & CATALOG_HAS_PALETTE) != 0;
+            scans[s].num_sprites = wad->num_sprites;
+            scans[s].num_flats = wad->num_flats;
+            old_to_new[o] = s;
+            reused++;
+        }
+    }
+    
+    // Names are stored in order, so each file's list comes out sorted
+    for (uint32_t n = 0; n < old.header->num_names; n++) {
+        const uint32_t *posting = old.postings + old.names[n].first_posting;
+        for (uint32_t p = 0; p < old.names[n].num_postings; p++) {
+            int s = old_to_new[posting[p]];
+            if (s >= 0 && scans[s].num_names < scans[s].info.num_lumps) {
+                scans[s].names[scans[s].num_names++] = old.names[n].name;
+            }
+        }
+    }
+    free(old_to_new);
+    catalog_close(&old);
+    return reused;
+}
+
+// One (name, WAD) pair while the posting lists are merged
+typedef struct {
+    uint64_t name;
+    uint32_t wad;
+} catalog_pair_t;
+
+static int compare_catalog_pairs(const void *a, const void *b) {
+    const catalog_pair_t *x = (const catalog_pair_t *)a, *y = (const catalog_pair_t *)b;
+    if (x->name != y->name) return x->name < y->name ? -1 : 1;
+    return x->wad < y->wad ? -1 : x->wad > y->wad;
+}
+
+static bool write_padding(FILE *file, uint64_t *offset) {
+    static const unsigned char zeros[8] = {0};
+    size_t padding = (8 - *offset % 8) % 8;
+    *offset += padding;
+    return fwrite(zeros, 1, padding, file) == padding;
+}
+
+// Scan every WAD and PK3 below the given folders and write the catalog.
+// Files whose size and time match the previous catalog are not reopened.
+static bool catalog_build(const char *catalog_path, char **folders, int num_folders, bool rebuild,
+                          int *num_scanned, int *num_reused, int *num_listed) {
+    wad_info_t *files = NULL;
+    int count = 0, capacity = 0;
+    for (int f = 0; f < num_folders; f++) {
+        if (is_directory(folders[f])) {
+            collect_wad_files(folders[f], &files, &count, &capacity);
+        } else {
+            struct stat st;
+            if (stat(folders[f], &st) == 0) add_wad_candidate(&files, &count, &capacity, folders[f], st.st_size, (long long)st.st_mtime);
+        }
+    }
+    if (count > 0) qsort(files, count, sizeof(wad_info_t), compare_wad_info_path);
+    
+    // Drop duplicates from overlapping folders
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique > 0 && strcmp(files[unique - 1].path, files[i].path) == 0) {
+            free(files[i].path);
+        } else {
+            files[unique++] = files[i];
+        }
+    }
+    count = unique;
+    
+    catalog_scan_t *scans = (catalog_scan_t *)calloc(count + 1, sizeof(catalog_scan_t));
+    if (!scans) return false;
+    for (int i = 0; i < count; i++) scans[i].info = files[i];
+    free(files);
+    
+    *num_reused = rebuild ? 0 : catalog_reuse(catalog_path, scans, count);
+    parallel_for(count, catalog_scan_file, scans);
+    *num_scanned = count - *num_reused;
+    
+    // Merge every file's names into posting lists
+    size_t num_pairs = 0;
+    int num_wads = 0;
+    for (int i = 0; i < count; i++) {
+        if (scans[i].info.type != WAD_TYPE_INVALID) num_pairs += scans[i].num_names;
+    }
+    catalog_pair_t *pairs = (catalog_pair_t *)malloc((num_pairs + 1) * sizeof(catalog_pair_t));
+    catalog_wad_t *wads = (catalog_wad_t *)calloc(count + 1, sizeof(catalog_wad_t));
+    size_t strings_capacity = 1;
+    for (int i = 0; i < count; i++) strings_capacity += strlen(scans[i].info.path) + 1;
+    char *strings = (char *)malloc(strings_capacity);
+    bool written = pairs && wads && strings;
+    
+    uint32_t strings_size = 0;
+    num_pairs = 0;
+    for (int i = 0; i < count && written; i++) {
+        if (scans[i].info.type == WAD_TYPE_INVALID || !scans[i].names) continue;
+        catalog_wad_t *wad = &wads[num_wads];
+        wad->path = strings_size;
+        strcpy(strings + strings_size, scans[i].info.path);
+        strings_size += strlen(scans[i].info.path) + 1;
+        wad->type = scans[i].info.type;
+        wad->size = scans[i].info.size;
+        wad->mtime = scans[i].info.mtime;
+        wad->num_lumps = scans[i].info.num_lumps;
+        wad->num_maps = scans[i].info.num_maps;
+        wad->num_sprites = scans[i].num_sprites;
+        wad->num_flats = scans[i].num_flats;
+        wad->flags = scans[i].info.has_palette ? CATALOG_HAS_PALETTE : 0;
+        for (int n = 0; n < scans[i].num_names; n++) {
+            pairs[num_pairs].name = scans[i].names[n];
+            pairs[num_pairs].wad = num_wads;
+            num_pairs++;
+        }
+        num_wads++;
+    }
+    if (strings_size == 0 && strings) strings[strings_size++] = '\0';
+    if (written) qsort(pairs, num_pairs, sizeof(catalog_pair_t), compare_catalog_pairs);
+    
+    int num_names = 0;
+    for (size_t p = 0; p < num_pairs && written; p++) {
+        num_names += p == 0 || pairs[p].name != pairs[p - 1].name;
+    }
+    catalog_name_t *names = written ? (catalog_name_t *)calloc(num_names + 1, sizeof(catalog_name_t)) : NULL;
+    uint32_t *postings = written ? (uint32_t *)malloc((num_pairs + 1) * sizeof(uint32_t)) : NULL;
+    written = names && postings;
+    num_names = 0;
+    for (size_t p = 0; p < num_pairs && written; p++) {
+        if (p == 0 || pairs[p].name != pairs[p - 1].name) {
+            names[num_names].name = pairs[p].name;
+            names[num_names].first_posting = (uint32_t)p;
+            num_names++;
+        }
+        names[num_names - 1].num_postings++;
+        postings[p] = pairs[p].wad;
+    }
+    
+    // Written beside the old one and renamed over it, so a reader never
+    // maps half a catalog
+    char temp_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", catalog_path);
+    FILE *file = written ? fopen(temp_path, "wb") : NULL;
+    if (file) {
+        catalog_header_t header = {0};
+        memcpy(header.magic, CATALOG_MAGIC, 4);
+        header.num_wads = num_wads;
+        header.num_names = num_names;
+        header.num_postings = (uint32_t)num_pairs;
+        header.strings_size = strings_size;
+        uint64_t offset = sizeof(header);
+        header.wads_offset = offset;
+        offset += (uint64_t)num_wads * sizeof(catalog_wad_t);
+        header.names_offset = offset;
+        offset += (uint64_t)num_names * sizeof(catalog_name_t);
+        header.postings_offset = offset;
+        offset += num_pairs * sizeof(uint32_t);
+        offset += (8 - offset % 8) % 8;
+        header.strings_offset = offset;
+        
+        uint64_t position = sizeof(header);
+        written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(wads, sizeof(catalog_wad_t), num_wads, file) == (size_t)num_wads &&
+                  fwrite(names, sizeof(catalog_name_t), num_names, file) == (size_t)num_names &&
+                  fwrite(postings, sizeof(uint32_t), num_pairs, file) == num_pairs;
+        position = header.postings_offset + num_pairs * sizeof(uint32_t);
+        written = written && write_padding(file, &position) &&
+                  fwrite(strings, 1, strings_size, file) == strings_size;
+        written = fclose(file) == 0 && written;
+#ifdef _WIN32
+        if (written) remove(catalog_path);
+#endif
+        if (written && rename(temp_path, catalog_path) != 0) written = false;
+        if (!written) remove(temp_path);
+    } else {
+        written = false;
+    }
+    
+    *num_listed = num_wads;
+    for (int i = 0; i < count; i++) {
+        free(scans[i].info.path);
+        free(scans[i].names);
+    }
+    free(scans);
+    free(pairs);
+    free(wads);
+    free(strings);
+    free(names);
+    free(postings);
+    return written;
+}
+
+static void catalog_usage() {
+    fprintf(stderr,
+            "usage: eyeglass catalog build <folder or wad>... [-o catalog] [-j n] [--rebuild]\n"
+            "       eyeglass catalog query [-c catalog] [-l] <term>...\n"
+            "  -o, -c <file>          Catalog to write or read (default " CATALOG_FILENAME ")\n"
+            "  -j, --jobs <n>         Worker threads (default: one per CPU)\n"
+            "  --rebuild              Rescan every file instead of reusing the old catalog\n"
+            "  -l, --long             Show type and counts next to each path\n"
+            "Query terms, all of which must hold (! negates one):\n"
+            "  NAME or D_*            Has a lump with that name\n"
+            "  palette                Has a PLAYPAL\n"
+            "  type:iwad|pwad|pk3\n"
+            "  maps>32, lumps<=100, sprites>0, flats=0\n");
+}
+
+// eyeglass catalog: build a catalog of a WAD library, or ask it which
+// WADs have a lump, a palette or many maps without opening any of them.
+// Query exits 0 if anything matched, 1 if nothing did, 2 on bad usage.
+int catalog_command(int argc, char **argv) {
+    if (argc < 1 || (strcmp(argv[0], "build") != 0 && strcmp(argv[0], "query") != 0)) {
+        catalog_usage();
+        return argc >= 1 && (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) ? 0 : 2;
+    }
+    bool building = strcmp(argv[0], "build") == 0;
+    const char *catalog_path = CATALOG_FILENAME;
+    bool rebuild = false;
+    bool long_format = false;
+    char **operands = (char **)calloc(argc + 1, sizeof(char *));
+    int num_operands = 0;
+    if (!operands) return 2;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-o") == 0 || strcmp(arg, "-c") == 0 || strcmp(arg, "--catalog") == 0) {
+            catalog_path = value;
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+            worker_limit = value ? atoi(value) : 0;
+            if (worker_limit <= 0) {
+                fprintf(stderr, "--jobs needs a positive number\n");
+                free(operands);
+                return 2;
+            }
+        } else {
+            takes_value = false;
+            if (strcmp(arg, "--rebuild") == 0) {
+                rebuild = true;
+            } else if (strcmp(arg, "-l") == 0 || strcmp(arg, "--long") == 0) {
+                long_format = true;
+            } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                catalog_usage();
+                free(operands);
+                return 0;
+            } else if (arg[0] == '-' && arg[1] != '\0' && building) {
+                fprintf(stderr, "Unexpected argument: %s\n", arg);
+                catalog_usage();
+                free(operands);
+                return 2;
+            } else {
+                operands[num_operands++] = argv[i];
+            }
+        }
+        if (takes_value) {
+            if (!value) {
+                fprintf(stderr, "%s needs a value\n", arg);
+                free(operands);
+                return 2;
+            }
+            i++;
+        }
+    }
+    
+    double start = now_seconds();
+    if (building) {
+        if (num_operands == 0) {
+            catalog_usage();
+            free(operands);
+            return 2;
+        }
+        int scanned = 0, reused = 0, listed = 0;
+        bool written = catalog_build(catalog_path, operands, num_operands, rebuild, &scanned, &reused, &listed);
+        free(operands);
+        if (!written) {
+            fprintf(stderr, "Could not write %s\n", catalog_path);
+            return 1;
+        }
+        printf("%s: %d WADs (%d scanned, %d unchanged) in %.3fs\n",
+               catalog_path, listed, scanned, reused, now_seconds() - start);
+        return 0;
+    }
+    
+    catalog_t catalog;
+    if (!catalog_open(catalog_path, &catalog)) {
+        fprintf(stderr, "%s is missing or not a catalog; run \"eyeglass catalog build\" first\n", catalog_path);
+        free(operands);
+        return 2;
+    }
+    
+    // The terms may come as one argument or several
+    char query[256] = "";
+    for (int i = 0; i < num_operands; i++) {
+        snprintf(query + strlen(query), sizeof(query) - strlen(query), "%s%s", i > 0 ? " " : "", operands[i]);
+    }
+    free(operands);
+    
+    int num_wads = catalog.header->num_wads;
+    unsigned char *matches = (unsigned char *)malloc(num_wads + 1);
+    int found = matches ? catalog_query(&catalog, query, matches) : -1;
+    double seconds = now_seconds() - start;
+    if (found < 0) {
+        free(matches);
+        catalog_close(&catalog);
+        return 2;
+    }
+    
+    const char *type_names[] = {"?", "?", "IWAD", "PWAD", "PK3"};
+    for (int w = 0; w < num_wads; w++) {
+        if (!matches[w]) continue;
+        const catalog_wad_t *wad = &catalog.wads[w];
+        if (long_format) {
+            printf("%-4s %6u lumps %4u maps %5u sprites %4u flats %s  %s\n",
+                   wad->type <= WAD_TYPE_PK3 ? type_names[wad->type] : "?", wad->num_lumps, wad->num_maps,
+                   wad->num_sprites, wad->num_flats, wad->flags & CATALOG_HAS_PALETTE ? "PLAYPAL" : "       ",
+                   catalog.strings + wad->path);
+        } else {
+            printf("%s\n", catalog.strings + wad->path);
+        }
+    }
+    fprintf(stderr, "%d of %d WADs match (%.2f ms)\n", found, num_wads, seconds * 1000.0);
+    
+    free(matches);
+    catalog_close(&catalog);
+    return found > 0 ? 0 : 1;
+}
+
+// Growing text for the JSON listings and reports
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} json_buffer_t;
+
+static void json_printf(json_buffer_t *buffer, const char *format, ...) {
+    while (!buffer->failed) {
+        va_list args;
+        va_start(args, format);
+        size_t room = buffer->capacity - buffer->length;
+        int length = vsnprintf(buffer->data ? buffer->data + buffer->length : NULL, room, format, args);
+        va_end(args);
+        if (length < 0) {
+            buffer->failed = true;
+        } else if ((size_t)length < room) {
+            buffer->length += length;
+            return;
+        } else {
+            size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+            while (capacity <= buffer->length + length) capacity *= 2;
+            char *data = (char *)realloc(buffer->data, capacity);
+            if (!data) buffer->failed = true;
+            buffer->data = data ? data : buffer->data;
+            buffer->capacity = data ? capacity : buffer->capacity;
+        }
+    }
+}
+
+// A quoted JSON string; lump names can hold any byte
+static void json_string(json_buffer_t *buffer, const char *text) {
+    json_printf(buffer, "\"");
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') json_printf(buffer, "\\%c", *c);
+        else if (*c < 32 || *c >= 127) json_printf(buffer, "\\u%04x", *c);
+        else json_printf(buffer, "%c", *c);
+    }
+    json_printf(buffer, "\"");
+}
+
+#ifdef __linux__
+// Response bodies shared between the serve cache and the connections
+// sending them, freed when the last holder lets go. Only the event loop
+// touches the counts.
+typedef struct {
+    int refs;
+    size_t size;
+    unsigned char data[];
+} serve_blob_t;
+
+static serve_blob_t *serve_blob_alloc(size_t size) {
+    serve_blob_t *blob = (serve_blob_t *)malloc(sizeof(serve_blob_t) + size + 1);
+    if (!blob) return NULL;
+    blob->refs = 1;
+    blob->size = size;
+    return blob;
+}
+
+static void serve_blob_release(serve_blob_t *blob) {
+    if (blob && --blob->refs == 0) free(blob);
+}
+
+static serve_blob_t *json_finish(json_buffer_t *buffer) {
+    serve_blob_t *blob = buffer->failed ? NULL : serve_blob_alloc(buffer->length);
+    if (blob) memcpy(blob->data, buffer->data, buffer->length);
+    free(buffer->data);
+    return blob;
+}
+
+// Thumbnail edges for an image scaled down to fit a square cell; smaller
+// images keep their size
+static void serve_thumb_size(int width, int height, int cell, int *thumb_width, int *thumb_height) {
+    int longest = width > height ? width : height;
+    *thumb_width = longest > cell ? (width * cell + longest - 1) / longest : width;
+    *thumb_height = longest > cell ? (height * cell + longest - 1) / longest : height;
+}
+
+// Encode palette indexes as a PNG. Clear pixels take a palette entry the
+// image does not use, made transparent; an image using all 256 goes out
+// as RGBA instead.
+static serve_blob_t *serve_encode_png(const unsigned char *indexes, const unsigned char *opaque, int width, int height) {
+    bool used[256] = {false};
+    bool any_clear = false;
+    size_t num_pixels = (size_t)width * height;
+    for (size_t i = 0; i < num_pixels; i++) {
+        if (opaque[i]) used[indexes[i]] = true;
+        else any_clear = true;
+    }
+    int transparent = -1;
+    for (int t = 0; any_clear && transparent < 0 && t < 256; t++) {
+        if (!used[t]) transparent = t;
+    }
+    int channels = any_clear && transparent < 0 ? 4 : 1;
+    
+    size_t stride = 1 + (size_t)width * channels;
+    unsigned char *scanlines = (unsigned char *)malloc(stride * height + 1);
+    serve_blob_t *blob = serve_blob_alloc(png_bound(width, height, channels));
+    if (!scanlines || !blob) {
+        free(scanlines);
+        serve_blob_release(blob);
+        return NULL;
+    }
+    for (int y = 0; y < height; y++) {
+        unsigned char *row = scanlines + y * stride;
+        const unsigned char *source = indexes + (size_t)y * width;
+        const unsigned char *shown = opaque + (size_t)y * width;
+        *row++ = 0;    // No filter: indexes do not predict well
+        for (int x = 0; x < width; x++) {
+            if (channels == 1) {
+                *row++ = shown[x] ? source[x] : transparent;
+            } else {
+                memcpy(row, doom_palette[source[x]], 3);
+                row[3] = shown[x] ? 255 : 0;
+                row += 4;
+            }
+        }
+    }
+    blob->size = png_encode(blob->data, scanlines, width, height, channels == 1 ? 3 : 6, transparent);
+    free(scanlines);
+    
+    serve_blob_t *shrunk = (serve_blob_t *)realloc(blob, sizeof(serve_blob_t) + blob->size + 1);
+    return shrunk ? shrunk : blob;
+}
+
+// Kinds of cached response, the top byte of a cache key
+enum {
+    SERVE_PNG = 1,        // Whole image
+    SERVE_THUMB_PNG,
+    SERVE_THUMB,          // Thumbnail indexes and coverage, for atlas pages
+    SERVE_ATLAS,
+    SERVE_LUMP            // Raw bytes of a PK3 image not yet inflated; never cached
+};
+
+static uint64_t serve_key(int kind, int wad, int index) {
+    return (uint64_t)kind << 56 | (uint64_t)wad << 32 | (uint32_t)index;
+}
+
+// Shared cache of encoded responses, open addressing, least recently
+// used entries dropped in bulk when it outgrows its budget
+typedef struct {
+    uint64_t key;                 // 0 for an empty slot
+    serve_blob_t *blob;
+    uint64_t last_used;
+} serve_cache_slot_t;
+
+typedef struct {
+    serve_cache_slot_t *slots;
+    int capacity;                 // Power of two
+    int count;
+    size_t bytes;
+    size_t budget;
+    uint64_t clock;
+    long long hits, misses;
+} serve_cache_t;
+
+static int serve_cache_find(const serve_cache_t *cache, uint64_t key) {
+    int mask = cache->capacity - 1;
+    int slot = (int)((key * 0x9E3779B97F4A7C15ull) >> 40) & mask;
+    while (cache->slots[slot].key && cache->slots[slot].key != key) slot = (slot + 1) & mask;
+    return slot;
+}
+
+static bool serve_cache_resize(serve_cache_t *cache, int capacity) {
+    serve_cache_slot_t *slots = (serve_cache_slot_t *)calloc(capacity, sizeof(serve_cache_slot_t));
+    if (!slots) return false;
+    serve_cache_slot_t *old = cache->slots;
+    int old_capacity = cache->capacity;
+    cache->slots = slots;
+    cache->capacity = capacity;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].key) cache->slots[serve_cache_find(cache, old[i].key)] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+static serve_blob_t *serve_cache_get(serve_cache_t *cache, uint64_t key) {
+    serve_cache_slot_t *slot = &cache->slots[serve_cache_find(cache, key)];
+    if (!slot->key) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    slot->last_used = ++cache->clock;
+    return slot->blob;
+}
+
+static int compare_cache_age(const void *a, const void *b) {
+    uint64_t x = ((const serve_cache_slot_t *)a)->last_used, y = ((const serve_cache_slot_t *)b)->last_used;
+    return x < y ? -1 : x > y;
+}
+
+// Drop the least recently used entries until a quarter of the budget is free
+static void serve_cache_evict(serve_cache_t *cache) {
+    serve_cache_slot_t *live = (serve_cache_slot_t *)malloc((cache->count + 1) * sizeof(serve_cache_slot_t));
+    if (!live) return;
+    int count = 0;
+    for (int i = 0; i < cache->capacity; i++) {
+        if (cache->slots[i].key) live[count++] = cache->slots[i];
+    }
+    qsort(live, count, sizeof(serve_cache_slot_t), compare_cache_age);
+    
+    int first = 0;
+    while (first < count && cache->bytes > cache->budget / 4 * 3) {
+        cache->bytes -= live[first].blob->size;
+        serve_blob_release(live[first++].blob);
+    }
+    memset(cache->slots, 0, cache->capacity * sizeof(serve_cache_slot_t));
+    cache->count = count - first;
+    for (int i = first; i < count; i++) cache->slots[serve_cache_find(cache, live[i].key)] = live[i];
+    free(live);
+}
+
+// Keep a blob under a key; the cache takes its own reference
+static void serve_cache_put(serve_cache_t *cache, uint64_t key, serve_blob_t *blob) {
+    if (!blob || blob->size > cache->budget / 2) return;
+    if ((cache->count + 1) * 2 > cache->capacity && !serve_cache_resize(cache, cache->capacity * 2)) return;
+    serve_cache_slot_t *slot = &cache->slots[serve_cache_find(cache, key)];
+    if (slot->key) {
+        cache->bytes -= slot->blob->size;
+        serve_blob_release(slot->blob);
+    } else {
+        cache->count++;
+    }
+    blob->refs++;
+    slot->key = key;
+    slot->blob = blob;
+    slot->last_used = ++cache->clock;
+    cache->bytes += blob->size;
+    if (cache->bytes > cache->budget) serve_cache_evict(cache);
+}
+
+// One image lump of a served WAD. A deflated PK3 member gets its buffer
+// at startup but is inflated and measured by the first batch that needs
+// it; the epoll thread files what the batch found.
+typedef struct {
+    int lump;
+    int width, height;            // Known once measured
+    int left_offset, top_offset;
+    const unsigned char *data;    // Lump bytes, or the buffer they inflate into
+    bool inflated;                // data holds the bytes
+    bool measured;                // Decodes, and the sizes above are set
+    bool failed;                  // Did not inflate or is no image after all
+} serve_image_t;
+
+typedef struct {
+    wad_file_t *wad;
+    int fd;                       // Kept open so raw lumps go out with sendfile()
+    char (*ns)[9];
+    serve_image_t *images;        // In directory order
+    int num_images;
+    int *image_of_lump;           // Index into images, -1 for other lumps
+    int *task_of_image;           // Decode task in the batch being gathered, -1 if none
+    int *running_task_of_image;   // Decode task in the batch being decoded, -1 if none
+    serve_blob_t *listing;        // Directory as JSON
+    bool listing_stale;           // Images were measured since it was built
+} serve_wad_t;
+
+// Work for one image in a batch, run on the worker pool
+typedef struct {
+    int wad, image;
+    bool want_png, want_thumb_png, want_thumb;
+    serve_blob_t *png, *thumb_png;
+    serve_blob_t *thumb;          // Given when cached, else made if wanted or needed
+    bool inflated, measured, failed;   // What this task found out about the image
+    int width, height, left_offset, top_offset;
+} serve_task_t;
+
+typedef struct {
+    int wad, page;
+    serve_blob_t **thumbs;        // Per cell, NULL where the image did not decode
+    int *cell_task;               // Decode task per cell, -1 where the thumbnail is pinned from the cache
+    int num_cells;
+    serve_blob_t *png;
+} serve_atlas_task_t;
+
+// Requests of one round. The epoll thread gathers one batch while the
+// previous one decodes on the batch thread; neither touches the other's.
+typedef struct server_s server_t;
+typedef struct {
+    server_t *server;
+    serve_task_t *tasks;
+    int num_tasks, task_capacity;
+    serve_atlas_task_t *atlases;
+    int num_atlases, atlas_capacity;
+    struct serve_connection_s **waiting;  // Connections whose response is in the batch
+    int num_waiting, waiting_capacity;
+} serve_batch_t;
+
+typedef struct serve_connection_s {
+    int fd;
+    char request[SERVE_REQUEST_MAX];
+    int request_length;
+    char header[512];
+    int header_length, header_sent;
+    const unsigned char *body;    // Sent after the header, unless file_fd is set
+    size_t body_length, body_sent;
+    serve_blob_t *blob;           // Keeps body alive if it came from the cache
+    int file_fd;                  // sendfile() source, or -1
+    off_t file_offset;
+    bool responding;
+    bool keep_alive;
+    bool head_only;
+    int pending_kind;             // SERVE_* awaited from the batch, 0 if none
+    int pending_task;
+    uint32_t events;              // Registered with epoll
+} serve_connection_t;
+
+struct server_s {
+    serve_wad_t *wads;
+    int num_wads;
+    int thumb_size;
+    serve_blob_t *index;          // WAD list as JSON
+    serve_cache_t cache;          // Only the epoll thread uses it
+    serve_batch_t gathering;      // Filled by the requests of this round
+    serve_batch_t running;        // Decoding on the batch thread
+    bool batch_running;           // Set by the epoll thread, cleared when it collects the batch
+    bool batch_start;             // Guarded by batch_mutex, as is batch_done
+    bool batch_done;
+    mutex_t batch_mutex;
+    cond_t batch_cond;
+    int batch_fd;                 // eventfd the batch thread signals when done
+    int epoll_fd;
+    long long requests;
+};
+
+static const char *serve_wad_type(const wad_file_t *wad) {
+    return wad->zip_entries ? "PK3" : wad->is_iwad ? "IWAD" : "PWAD";
+}
+
+// Startup pass over one WAD: which lumps decode, and their sizes. Only
+// headers in the mapping are read; deflated members are left for later.
+typedef struct {
+    serve_wad_t *site;
+    serve_image_t *candidates;
+    bool *inflate;                // PK3 member still to be inflated
+    bool *valid;
+} serve_setup_t;
+
+static void serve_setup_image(void *context, int index) {
+    serve_setup_t *setup = (serve_setup_t *)context;
+    serve_image_t *item = &setup->candidates[index];
+    wad_file_t *wad = setup->site->wad;
+    if (setup->inflate[index]) {
+        setup->valid[index] = true;
+        return;
+    }
+    
+    wad_image_t image = {0};
+    if (!item->data || !lump_image_setup(&image, wad, item->lump, item->data, setup->site->ns[item->lump])) return;
+    item->width = image.width;
+    item->height = image.height;
+    item->left_offset = image.left_offset;
+    item->top_offset = image.top_offset;
+    item->inflated = true;
+    item->measured = true;
+    setup->valid[index] = true;
+}
+
+// Directory as JSON. Atlas cells follow the image order, so clients can
+// place thumbnails without asking again; PK3 images not measured yet have
+// only their cell.
+static bool serve_build_listing(server_t *server, serve_wad_t *site) {
+    wad_file_t *wad = site->wad;
+    int id = (int)(site - server->wads);
+    int cells = SERVE_ATLAS_COLUMNS * SERVE_ATLAS_COLUMNS;
+    json_buffer_t json = {0};
+    json_printf(&json, "{\"id\":%d,\"file\":", id);
+    json_string(&json, wad->filename);
+    json_printf(&json, ",\"type\":\"%s\",\"thumb_size\":%d,\"atlas_columns\":%d,\"lumps\":[",
+                serve_wad_type(wad), server->thumb_size, SERVE_ATLAS_COLUMNS);
+    for (int i = 0; i < wad->header.num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        json_printf(&json, "%s\n{\"index\":%d,\"name\":", i > 0 ? "," : "", i);
+        json_string(&json, name);
+        json_printf(&json, ",\"ns\":");
+        json_string(&json, site->ns[i]);
+        json_printf(&json, ",\"size\":%d", wad->directory[i].size);
+        int image = site->image_of_lump[i];
+        const serve_image_t *item = image >= 0 ? &site->images[image] : NULL;
+        if (item && item->measured) {
+            int thumb_width, thumb_height, cell = image % cells;
+            serve_thumb_size(item->width, item->height, server->thumb_size, &thumb_width, &thumb_height);
+            json_printf(&json, ",\"image\":{\"width\":%d,\"height\":%d,\"left\":%d,\"top\":%d,"
+                        "\"atlas\":[%d,%d,%d,%d,%d]}",
+                        item->width, item->height, item->left_offset, item->top_offset, image / cells,
+                        cell % SERVE_ATLAS_COLUMNS * server->thumb_size, cell / SERVE_ATLAS_COLUMNS * server->thumb_size,
+                        thumb_width, thumb_height);
+        } else if (item && !item->failed) {
+            int cell = image % cells;
+            json_printf(&json, ",\"image\":{\"atlas\":[%d,%d,%d]}", image / cells,
+                        cell % SERVE_ATLAS_COLUMNS * server->thumb_size, cell / SERVE_ATLAS_COLUMNS * server->thumb_size);
+        }
+        json_printf(&json, "}");
+    }
+    json_printf(&json, "]}\n");
+    serve_blob_release(site->listing);
+    site->listing = json_finish(&json);
+    site->listing_stale = false;
+    return site->listing != NULL;
+}
+
+static bool serve_open_wad(server_t *server, serve_wad_t *site, const char *path) {
+    site->wad = wad_open(path);
+    if (!site->wad) return false;
+    wad_file_t *wad = site->wad;
+    site->fd = open(path, O_RDONLY | O_CLOEXEC);
+    
+    int num_lumps = wad->header.num_lumps;
+    site->ns = (char (*)[9])arena_alloc(&wad->arena, (num_lumps + 1) * 9);
+    site->image_of_lump = (int *)arena_alloc(&wad->arena, (num_lumps + 1) * sizeof(int));
+    site->task_of_image = (int *)arena_alloc(&wad->arena, (num_lumps + 1) * sizeof(int));
+    site->running_task_of_image = (int *)arena_alloc(&wad->arena, (num_lumps + 1) * sizeof(int));
+    site->images = (serve_image_t *)arena_calloc(&wad->arena, (num_lumps + 1) * sizeof(serve_image_t));
+    serve_setup_t setup = {site, site->images,
+                           (bool *)arena_calloc(&wad->arena, num_lumps + 1),
+                           (bool *)arena_calloc(&wad->arena, num_lumps + 1)};
+    if (site->fd < 0 || !site->ns || !site->image_of_lump || !site->task_of_image || !site->running_task_of_image ||
+        !site->images ||
+        !setup.inflate || !setup.valid) {
+        return false;
+    }
+    wad_lump_namespaces(wad, site->ns);
+    
+    // PK3 buffers come from the WAD's arena, so they are handed out here,
+    // but nothing is inflated until a request needs it
+    int count = 0;
+    for (int i = 0; i < num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        site->image_of_lump[i] = -1;
+        if (wad->directory[i].size <= 0 || !is_image_lump(name) || is_map_data_lump(name)) continue;
+        
+        serve_image_t *item = &site->images[count];
+        item->lump = i;
+        if (wad->zip_entries) {
+            setup.inflate[count] = zip_member_reserve(wad, i);
+            item->data = wad->zip_entries[i].data;
+        } else {
+            int size;
+            item->data = wad_lump_data(wad, i, &size);
+        }
+        count++;
+    }
+    parallel_for(count, serve_setup_image, &setup);
+    
+    for (int c = 0; c < count; c++) {
+        int lump = site->images[c].lump;
+        if (!setup.valid[c]) continue;
+        site->image_of_lump[lump] = site->num_images;
+        site->task_of_image[site->num_images] = -1;
+        site->running_task_of_image[site->num_images] = -1;
+        site->images[site->num_images++] = site->images[c];
+    }
+    
+    return serve_build_listing(server, site);
+}
+
+static void serve_decode_task(void *context, int index) {
+    serve_batch_t *batch = (serve_batch_t *)context;
+    server_t *server = batch->server;
+    serve_task_t *task = &batch->tasks[index];
+    serve_wad_t *site = &server->wads[task->wad];
+    const serve_image_t *item = &site->images[task->image];
+    
+    // The first batch to need a PK3 image inflates and measures it; only
+    // the epoll thread writes the image record
+    bool inflated = item->inflated, measured = item->measured;
+    if (!inflated) {
+        inflated = task->inflated = zip_member_inflate(site->wad, item->lump, (unsigned char *)item->data);
+        task->failed = !inflated;
+    }
+    if (inflated && !measured) {
+        wad_image_t image = {0};
+        measured = task->measured = lump_image_setup(&image, site->wad, item->lump, item->data, site->ns[item->lump]);
+        task->width = image.width;
+        task->height = image.height;
+        task->left_offset = image.left_offset;
+        task->top_offset = image.top_offset;
+        task->failed = !measured;
+    }
+    if (!measured) return;
+    
+    if (task->want_png || (!task->thumb && (task->want_thumb || task->want_thumb_png))) {
+        wad_image_t image = {0};
+        arena_t arena = {0};
+        indexed_image_t *indexed = NULL;
+        if (lump_image_setup(&image, site->wad, item->lump, item->data, site->ns[item->lump])) {
+            indexed = decode_image_indexed(&image, &arena);
+        }
+        
+        // Coverage from the opaque runs
+        int width = indexed ? indexed->width : 0, height = indexed ? indexed->height : 0;
+        unsigned char *opaque = indexed ? (unsigned char *)arena_calloc(&arena, (size_t)width * height + 1) : NULL;
+        for (int x = 0; opaque && x < width; x++) {
+            for (unsigned int s = indexed->column_first[x]; s < indexed->column_first[x + 1]; s++) {
+                for (int y = indexed->spans[s].top; y < indexed->spans[s].top + indexed->spans[s].length; y++) {
+                    opaque[y * width + x] = 1;
+                }
+            }
+        }
+        if (opaque && task->want_png) task->png = serve_encode_png(indexed->pixels, opaque, width, height);
+        
+        // Thumbnail: two size bytes each, then indexes, then coverage
+        int thumb_width, thumb_height;
+        serve_thumb_size(width, height, server->thumb_size, &thumb_width, &thumb_height);
+        size_t thumb_pixels = (size_t)thumb_width * thumb_height;
+        if (opaque && !task->thumb && (task->thumb = serve_blob_alloc(4 + thumb_pixels * 2)) != NULL) {
+            unsigned char *out = task->thumb->data;
+            out[0] = thumb_width & 0xFF;
+            out[1] = thumb_width >> 8;
+            out[2] = thumb_height & 0xFF;
+            out[3] = thumb_height >> 8;
+            for (int y = 0; y < thumb_height; y++) {
+                int source_y = y * height / thumb_height;
+                for (int x = 0; x < thumb_width; x++) {
+                    int source = source_y * width + x * width / thumb_width;
+                    out[4 + y * thumb_width + x] = indexed->pixels[source];
+                    out[4 + thumb_pixels + y * thumb_width + x] = opaque[source];
+                }
+            }
+        }
+        arena_free(&arena);
+    }
+    
+    if (task->want_thumb_png && task->thumb) {
+        const unsigned char *data = task->thumb->data;
+        int thumb_width = data[0] | data[1] << 8, thumb_height = data[2] | data[3] << 8;
+        task->thumb_png = serve_encode_png(data + 4, data + 4 + thumb_width * thumb_height, thumb_width, thumb_height);
+    }
+}
+
+static void serve_atlas_task(void *context, int index) {
+    serve_batch_t *batch = (serve_batch_t *)context;
+    serve_atlas_task_t *task = &batch->atlases[index];
+    int cell = batch->server->thumb_size;
+    int rows = (task->num_cells + SERVE_ATLAS_COLUMNS - 1) / SERVE_ATLAS_COLUMNS;
+    int width = (task->num_cells < SERVE_ATLAS_COLUMNS ? task->num_cells : SERVE_ATLAS_COLUMNS) * cell;
+    int height = rows * cell;
+    unsigned char *indexes = (unsigned char *)calloc((size_t)width * height * 2 + 1, 1);
+    if (!indexes) return;
+    unsigned char *opaque = indexes + (size_t)width * height;
+    
+    for (int c = 0; c < task->num_cells; c++) {
+        if (!task->thumbs[c]) continue;
+        const unsigned char *data = task->thumbs[c]->data;
+        int thumb_width = data[0] | data[1] << 8, thumb_height = data[2] | data[3] << 8;
+        int x0 = c % SERVE_ATLAS_COLUMNS * cell, y0 = c / SERVE_ATLAS_COLUMNS * cell;
+        for (int y = 0; y < thumb_height; y++) {
+            size_t to = (size_t)(y0 + y) * width + x0;
+            memcpy(indexes + to, data + 4 + y * thumb_width, thumb_width);
+            memcpy(opaque + to, data + 4 + thumb_width * thumb_height + y * thumb_width, thumb_width);
+        }
+    }
+    task->png = serve_encode_png(indexes, opaque, width, height);
+    free(indexes);
+}
+
+static const char *serve_status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 431: return "Request Header Fields Too Large";
+        default: return "Internal Server Error";
+    }
+}
+
+// Start a response. The body is either bytes (held by blob if given) or,
+// with file_fd set, a range of a file for sendfile().
+static void serve_respond(serve_connection_t *conn, int status, const char *content_type,
+                          const unsigned char *body, size_t length, serve_blob_t *blob, int file_fd, off_t offset) {
+    if (status >= 400 && status != 404) conn->keep_alive = false;
+    conn->header_length = snprintf(conn->header, sizeof(conn->header),
+                                   "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                                   "Access-Control-Allow-Origin: *\r\n%s\r\n",
+                                   status, serve_status_text(status), content_type, length,
+                                   conn->keep_alive ? "" : "Connection: close\r\n");
+    conn->header_sent = 0;
+    conn->body = body;
+    conn->body_length = conn->head_only ? 0 : length;
+    conn->body_sent = 0;
+    conn->blob = blob;
+    if (blob) blob->refs++;
+    conn->file_fd = file_fd;
+    conn->file_offset = offset;
+    conn->responding = true;
+}
+
+static void serve_error(serve_connection_t *conn, int status, const char *message) {
+    serve_respond(conn, status, "text/plain", (const unsigned char *)message, strlen(message), NULL, -1, 0);
+}
+
+static int serve_queue_image(server_t *server, int wad, int image) {
+    serve_batch_t *batch = &server->gathering;
+    serve_wad_t *site = &server->wads[wad];
+    if (site->task_of_image[image] >= 0) return site->task_of_image[image];
+    if (batch->num_tasks == batch->task_capacity) {
+        int capacity = batch->task_capacity ? batch->task_capacity * 2 : 256;
+        serve_task_t *grown = (serve_task_t *)realloc(batch->tasks, capacity * sizeof(serve_task_t));
+        if (!grown) return -1;
+        batch->tasks = grown;
+        batch->task_capacity = capacity;
+    }
+    serve_task_t *task = &batch->tasks[batch->num_tasks];
+    memset(task, 0, sizeof(*task));
+    task->wad = wad;
+    task->image = image;
+    task->thumb = serve_cache_get(&server->cache, serve_key(SERVE_THUMB, wad, image));
+    if (task->thumb) task->thumb->refs++;
+    site->task_of_image[image] = batch->num_tasks;
+    return batch->num_tasks++;
+}
+
+static bool serve_watch(server_t *server, serve_connection_t *conn, uint32_t events) {
+    if (conn->events == events) return true;
+    struct epoll_event event = {0};
+    event.events = events;
+    event.data.ptr = conn;
+    conn->events = events;
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == 0;
+}
+
+// Park a connection on a batch. Its socket is disarmed meanwhile, since
+// nothing is read from it until the answer is out; serve_process arms it
+// again once the batch is collected.
+static bool serve_wait(serve_batch_t *batch, serve_connection_t *conn, int kind, int task) {
+    if (task < 0 || !serve_watch(batch->server, conn, EPOLLONESHOT)) return false;
+    if (batch->num_waiting == batch->waiting_capacity) {
+        int capacity = batch->waiting_capacity ? batch->waiting_capacity * 2 : 64;
+        serve_connection_t **grown = (serve_connection_t **)realloc(batch->waiting, capacity * sizeof(*grown));
+        if (!grown) return false;
+        batch->waiting = grown;
+        batch->waiting_capacity = capacity;
+    }
+    batch->waiting[batch->num_waiting++] = conn;
+    conn->pending_kind = kind;
+    conn->pending_task = task;
+    return true;
+}
+
+// A lump by directory index, or by name (the last one, as the engine finds it)
+static int serve_find_lump(const wad_file_t *wad, const char *text) {
+    char *end;
+    long index = strtol(text, &end, 10);
+    if (*text && *end == '\0') return index >= 0 && index < wad->header.num_lumps ? (int)index : -1;
+    if (strlen(text) > 8) return -1;
+    uint64_t packed = pack_lump_name(text);
+    for (int i = wad->header.num_lumps - 1; i >= 0; i--) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        if (pack_lump_name(name) == packed) return i;
+    }
+    return -1;
+}
+
+static void serve_route(server_t *server, serve_connection_t *conn, char *target) {
+    char *query = strchr(target, '?');
+    if (query) *query = '\0';
+    char *parts[4];
+    int num_parts = 0;
+    for (char *part = strtok(target, "/"); part; part = strtok(NULL, "/")) {
+        if (num_parts == 4) {
+            serve_error(conn, 404, "Not found\n");
+            return;
+        }
+        parts[num_parts++] = part;
+    }
+    
+    if (num_parts == 0) {
+        serve_respond(conn, 200, "application/json", server->index->data, server->index->size, server->index, -1, 0);
+        return;
+    }
+    char *end;
+    long wad = num_parts >= 2 ? strtol(parts[1], &end, 10) : -1;
+    if (num_parts < 2 || *end != '\0' || wad < 0 || wad >= server->num_wads) {
+        serve_error(conn, 404, "Not found\n");
+        return;
+    }
+    serve_wad_t *site = &server->wads[wad];
+    
+    if (strcmp(parts[0], "wad") == 0 && num_parts == 2) {
+        if (site->listing_stale && !serve_build_listing(server, site)) {
+            serve_error(conn, 500, "Out of memory\n");
+            return;
+        }
+        serve_respond(conn, 200, "application/json", site->listing->data, site->listing->size, site->listing, -1, 0);
+        return;
+    }
+    if (strcmp(parts[0], "atlas") == 0 && num_parts == 3) {
+        int cells = SERVE_ATLAS_COLUMNS * SERVE_ATLAS_COLUMNS;
+        long page = strtol(parts[2], &end, 10);
+        if (*end != '\0' || page < 0 || page * cells >= site->num_images) {
+            serve_error(conn, 404, "No such atlas page\n");
+            return;
+        }
+        serve_blob_t *blob = serve_cache_get(&server->cache, serve_key(SERVE_ATLAS, wad, page));
+        if (blob) {
+            serve_respond(conn, 200, "image/png", blob->data, blob->size, blob, -1, 0);
+            return;
+        }
+        
+        // Every thumbnail on the page is made first, in the same batch.
+        // Cached ones are pinned now, so eviction can't take them before
+        // the batch is done with them.
+        serve_batch_t *batch = &server->running;
+        int a;
+        for (a = 0; server->batch_running && a < batch->num_atlases; a++) {
+            if (batch->atlases[a].wad == wad && batch->atlases[a].page == page) break;
+        }
+        if (server->batch_running && a < batch->num_atlases) {
+            if (!serve_wait(batch, conn, SERVE_ATLAS, a)) serve_error(conn, 500, "Out of memory\n");
+            return;
+        }
+        batch = &server->gathering;
+        for (a = 0; a < batch->num_atlases; a++) {
+            if (batch->atlases[a].wad == wad && batch->atlases[a].page == page) break;
+        }
+        if (a == batch->num_atlases) {
+            if (batch->num_atlases == batch->atlas_capacity) {
+                int capacity = batch->atlas_capacity ? batch->atlas_capacity * 2 : 16;
+                serve_atlas_task_t *grown = (serve_atlas_task_t *)realloc(batch->atlases, capacity * sizeof(*grown));
+                if (!grown) {
+                    serve_error(conn, 500, "Out of memory\n");
+                    return;
+                }
+                batch->atlases = grown;
+                batch->atlas_capacity = capacity;
+            }
+            serve_atlas_task_t *task = &batch->atlases[batch->num_atlases];
+            memset(task, 0, sizeof(*task));
+            task->wad = wad;
+            task->page = page;
+            task->num_cells = site->num_images - page * cells < cells ? site->num_images - page * cells : cells;
+            task->thumbs = (serve_blob_t **)calloc(task->num_cells, sizeof(serve_blob_t *));
+            task->cell_task = (int *)malloc(task->num_cells * sizeof(int));
+            if (!task->thumbs || !task->cell_task) {
+                free(task->thumbs);
+                free(task->cell_task);
+                serve_error(conn, 500, "Out of memory\n");
+                return;
+            }
+            batch->num_atlases++;
+            for (int c = 0; c < task->num_cells; c++) {
+                int image = page * cells + c;
+                serve_blob_t *thumb = serve_cache_get(&server->cache, serve_key(SERVE_THUMB, wad, image));
+                if (thumb) thumb->refs++;
+                task->thumbs[c] = thumb;
+                task->cell_task[c] = thumb ? -1 : serve_queue_image(server, wad, image);
+                if (task->cell_task[c] >= 0) server->gathering.tasks[task->cell_task[c]].want_thumb = true;
+            }
+        }
+        if (!serve_wait(batch, conn, SERVE_ATLAS, a)) serve_error(conn, 500, "Out of memory\n");
+        return;
+    }
+    
+    int lump = num_parts == 3 ? serve_find_lump(site->wad, parts[2]) : -1;
+    if (lump < 0) {
+        serve_error(conn, 404, "No such lump\n");
+        return;
+    }
+    int image = site->image_of_lump[lump];
+    if (strcmp(parts[0], "lump") == 0) {
+        // A PK3 image not inflated yet is inflated by the batch, not here;
+        // a task that wants nothing else only inflates and measures
+        const serve_image_t *item = image >= 0 ? &site->images[image] : NULL;
+        if (item && !item->inflated && !item->failed) {
+            int task = site->running_task_of_image[image];
+            serve_batch_t *batch = task >= 0 ? &server->running : &server->gathering;
+            if (task < 0) task = serve_queue_image(server, wad, image);
+            if (!serve_wait(batch, conn, SERVE_LUMP, task)) serve_error(conn, 500, "Out of memory\n");
+            return;
+        }
+        
+        // Bytes that sit in the file go out with sendfile(), never copied
+        int size;
+        const unsigned char *data = wad_lump_data(site->wad, lump, &size);
+        if (!data) {
+            serve_error(conn, 500, "Lump could not be read\n");
+        } else if (data >= site->wad->map.data && data < site->wad->map.data + site->wad->map.size) {
+            serve_respond(conn, 200, "application/octet-stream", NULL, size, NULL, site->fd, data - site->wad->map.data);
+        } else {
+            serve_respond(conn, 200, "application/octet-stream", data, size, NULL, -1, 0);
+        }
+        return;
+    }
+    
+    bool thumb = strcmp(parts[0], "thumb") == 0;
+    if (!thumb && strcmp(parts[0], "png") != 0) {
+        serve_error(conn, 404, "Not found\n");
+    } else if (image < 0 || site->images[image].failed) {
+        serve_error(conn, 404, "Not an image lump\n");
+    } else {
+        int kind = thumb ? SERVE_THUMB_PNG : SERVE_PNG;
+        serve_blob_t *blob = serve_cache_get(&server->cache, serve_key(kind, wad, image));
+        if (blob) {
+            serve_respond(conn, 200, "image/png", blob->data, blob->size, blob, -1, 0);
+            return;
+        }
+        
+        // An image the batch thread is already making is waited for there
+        int running = site->running_task_of_image[image];
+        if (running >= 0) {
+            const serve_task_t *task = &server->running.tasks[running];
+            if (thumb ? task->want_thumb_png : task->want_png) {
+                if (!serve_wait(&server->running, conn, kind, running)) serve_error(conn, 500, "Out of memory\n");
+                return;
+            }
+        }
+        int task = serve_queue_image(server, wad, image);
+        if (task >= 0 && thumb) server->gathering.tasks[task].want_thumb_png = true;
+        if (task >= 0 && !thumb) server->gathering.tasks[task].want_png = true;
+        if (!serve_wait(&server->gathering, conn, kind, task)) serve_error(conn, 500, "Out of memory\n");
+    }
+}
+
+// Parse one request head (NUL-terminated, without the blank line) and
+// start its response or queue it for the batch
+static void serve_handle(server_t *server, serve_connection_t *conn, char *request) {
+    char method[8], target[256], version[16];
+    char *line_end = strstr(request, "\r\n");
+    if (line_end) *line_end = '\0';
+    conn->keep_alive = false;
+    conn->head_only = false;
+    if (sscanf(request, "%7s %255s %15s", method, target, version) != 3 || strncmp(version, "HTTP/1.", 7) != 0) {
+        serve_error(conn, 400, "Bad request\n");
+        return;
+    }
+    
+    conn->keep_alive = strcmp(version, "HTTP/1.0") != 0;
+    for (char *line = line_end ? line_end + 2 : NULL; line && *line;) {
+        char *next = strstr(line, "\r\n");
+        if (next) *next = '\0';
+        if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *value = line + 11;
+            while (*value == ' ' || *value == '\t') value++;
+            if (strncasecmp(value, "close", 5) == 0) conn->keep_alive = false;
+            if (strncasecmp(value, "keep-alive", 10) == 0) conn->keep_alive = true;
+        }
+        line = next ? next + 2 : NULL;
+    }
+    
+    conn->head_only = strcmp(method, "HEAD") == 0;
+    if (strcmp(method, "GET") != 0 && !conn->head_only) {
+        serve_error(conn, 405, "Only GET and HEAD\n");
+        return;
+    }
+    serve_route(server, conn, target);
+}
+
+// Send what the socket takes: 1 when the response is out, 0 when the
+// socket is full, -1 on error
+static int serve_send(serve_connection_t *conn) {
+    while (conn->header_sent < conn->header_length) {
+        bool more = conn->body_sent < conn->body_length;
+        ssize_t sent = send(conn->fd, conn->header + conn->header_sent, conn->header_length - conn->header_sent,
+                            MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        conn->header_sent += (int)sent;
+    }
+    while (conn->body_sent < conn->body_length) {
+        ssize_t sent;
+        if (conn->file_fd >= 0) {
+            off_t offset = conn->file_offset + (off_t)conn->body_sent;
+            sent = sendfile(conn->fd, conn->file_fd, &offset, conn->body_length - conn->body_sent);
+        } else {
+            sent = send(conn->fd, conn->body + conn->body_sent, conn->body_length - conn->body_sent, MSG_NOSIGNAL);
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        if (sent == 0) return -1;
+        conn->body_sent += sent;
+    }
+    serve_blob_release(conn->blob);
+    conn->blob = NULL;
+    conn->responding = false;
+    return 1;
+}
+
+// Work through a connection's requests until one has to wait for the
+// socket or for the batch. Returns false once the connection should close.
+static bool serve_process(server_t *server, serve_connection_t *conn) {
+    for (;;) {
+        if (conn->responding) {
+            int state = serve_send(conn);
+            if (state < 0) return false;
+            if (state == 0) return serve_watch(server, conn, EPOLLOUT);
+            server->requests++;
+            if (!conn->keep_alive) return false;
+        }
+        if (conn->pending_kind) return true;
+        
+        // Pipelined requests are answered in order
+        int end = -1;
+        for (int i = 0; i + 3 < conn->request_length && end < 0; i++) {
+            if (memcmp(conn->request + i, "\r\n\r\n", 4) == 0) end = i;
+        }
+        if (end < 0) {
+            if (conn->request_length == SERVE_REQUEST_MAX) {
+                serve_error(conn, 431, "Request too large\n");
+                conn->request_length = 0;
+                continue;
+            }
+            return serve_watch(server, conn, EPOLLIN);
+        }
+        conn->request[end] = '\0';
+        serve_handle(server, conn, conn->request);
+        conn->request_length -= end + 4;
+        memmove(conn->request, conn->request + end + 4, conn->request_length);
+    }
+}
+
+static bool serve_read(server_t *server, serve_connection_t *conn) {
+    while (conn->request_length < SERVE_REQUEST_MAX) {
+        ssize_t received = recv(conn->fd, conn->request + conn->request_length,
+                                SERVE_REQUEST_MAX - conn->request_length, 0);
+        if (received > 0) {
+            conn->request_length += (int)received;
+        } else if (received < 0 && errno == EINTR) {
+            continue;
+        } else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return false;    // Closed by the client, or failed
+        }
+    }
+    return serve_process(server, conn);
+}
+
+static void serve_close(serve_connection_t *conn) {
+    close(conn->fd);
+    serve_blob_release(conn->blob);
+    free(conn);
+}
+
+// Decode a batch on the worker pool, then lay out its atlas pages from
+// the thumbnails made or pinned for them. Runs on the batch thread, so
+// the epoll thread keeps answering cached requests meanwhile; neither the
+// cache nor any reference count is touched here.
+static THREAD_PROC(serve_batch_thread) {
+    server_t *server = (server_t *)arg;
+    serve_batch_t *batch = &server->running;
+    for (;;) {
+        mutex_lock(&server->batch_mutex);
+        while (!server->batch_start) cond_wait(&server->batch_cond, &server->batch_mutex);
+        server->batch_start = false;
+        mutex_unlock(&server->batch_mutex);
+        
+        parallel_for(batch->num_tasks, serve_decode_task, batch);
+        for (int a = 0; a < batch->num_atlases; a++) {
+            serve_atlas_task_t *atlas = &batch->atlases[a];
+            for (int c = 0; c < atlas->num_cells; c++) {
+                if (atlas->cell_task[c] >= 0) atlas->thumbs[c] = batch->tasks[atlas->cell_task[c]].thumb;
+            }
+        }
+        parallel_for(batch->num_atlases, serve_atlas_task, batch);
+        
+        mutex_lock(&server->batch_mutex);
+        server->batch_done = true;
+        mutex_unlock(&server->batch_mutex);
+        uint64_t one = 1;
+        while (write(server->batch_fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+    }
+    return 0;
+}
+
+// Hand the gathered batch to the batch thread, if it is idle
+static void serve_start_batch(server_t *server) {
+    serve_batch_t *batch = &server->gathering;
+    if (server->batch_running || (batch->num_tasks == 0 && batch->num_atlases == 0)) return;
+    
+    // Requests from now on gather a new batch, even for the same images
+    for (int t = 0; t < batch->num_tasks; t++) {
+        serve_wad_t *site = &server->wads[batch->tasks[t].wad];
+        site->task_of_image[batch->tasks[t].image] = -1;
+        site->running_task_of_image[batch->tasks[t].image] = t;
+    }
+    serve_batch_t spare = server->running;
+    server->running = *batch;
+    *batch = spare;
+    
+    server->batch_running = true;
+    mutex_lock(&server->batch_mutex);
+    server->batch_start = true;
+    cond_broadcast(&server->batch_cond);
+    mutex_unlock(&server->batch_mutex);
+}
+
+// File a finished batch's results in the cache, answer its waiting
+// connections and drop its pins
+static void serve_finish_batch(server_t *server) {
+    mutex_lock(&server->batch_mutex);
+    bool done = server->batch_done;
+    server->batch_done = false;
+    mutex_unlock(&server->batch_mutex);
+    if (!done) return;
+    
+    // What the batch found out about PK3 images it inflated or measured
+    serve_batch_t *batch = &server->running;
+    for (int t = 0; t < batch->num_tasks; t++) {
+        serve_task_t *task = &batch->tasks[t];
+        serve_wad_t *site = &server->wads[task->wad];
+        serve_image_t *item = &site->images[task->image];
+        if (task->inflated) item->inflated = true;
+        if (task->measured) {
+            item->measured = true;
+            item->width = task->width;
+            item->height = task->height;
+            item->left_offset = task->left_offset;
+            item->top_offset = task->top_offset;
+        }
+        if (task->failed) {
+            item->failed = true;
+            if (!item->inflated) site->wad->zip_entries[item->lump].failed = true;
         }
+        if (task->measured || task->failed) site->listing_stale = true;
     }
+    for (int t = 0; t < batch->num_tasks; t++) {
+        serve_task_t *task = &batch->tasks[t];
+        serve_cache_put(&server->cache, serve_key(SERVE_PNG, task->wad, task->image), task->png);
+        serve_cache_put(&server->cache, serve_key(SERVE_THUMB_PNG, task->wad, task->image), task->thumb_png);
+        serve_cache_put(&server->cache, serve_key(SERVE_THUMB, task->wad, task->image), task->thumb);
+    }
+    for (int a = 0; a < batch->num_atlases; a++) {
+        serve_atlas_task_t *atlas = &batch->atlases[a];
+        serve_cache_put(&server->cache, serve_key(SERVE_ATLAS, atlas->wad, atlas->page), atlas->png);
+    }
+    
+    for (int w = 0; w < batch->num_waiting; w++) {
+        serve_connection_t *conn = batch->waiting[w];
+        int kind = conn->pending_kind;
+        conn->pending_kind = 0;
+        if (kind == SERVE_LUMP) {
+            const serve_task_t *task = &batch->tasks[conn->pending_task];
+            const serve_image_t *item = &server->wads[task->wad].images[task->image];
+            int size = server->wads[task->wad].wad->directory[item->lump].size;
+            if (item->inflated) serve_respond(conn, 200, "application/octet-stream", item->data, size, NULL, -1, 0);
+            else serve_error(conn, 500, "Lump could not be read\n");
+            continue;
+        }
+        serve_blob_t *blob = kind == SERVE_ATLAS ? batch->atlases[conn->pending_task].png :
+                             kind == SERVE_PNG ? batch->tasks[conn->pending_task].png :
+                             batch->tasks[conn->pending_task].thumb_png;
+        if (blob) serve_respond(conn, 200, "image/png", blob->data, blob->size, blob, -1, 0);
+        else serve_error(conn, 500, "Image could not be decoded\n");
+    }
+    
+    for (int t = 0; t < batch->num_tasks; t++) {
+        serve_task_t *task = &batch->tasks[t];
+        server->wads[task->wad].running_task_of_image[task->image] = -1;
+        serve_blob_release(task->png);
+        serve_blob_release(task->thumb_png);
+        serve_blob_release(task->thumb);
+    }
+    for (int a = 0; a < batch->num_atlases; a++) {
+        serve_atlas_task_t *atlas = &batch->atlases[a];
+        for (int c = 0; c < atlas->num_cells; c++) {
+            if (atlas->cell_task[c] < 0) serve_blob_release(atlas->thumbs[c]);
+        }
+        serve_blob_release(atlas->png);
+        free(atlas->thumbs);
+        free(atlas->cell_task);
+    }
+    batch->num_tasks = 0;
+    batch->num_atlases = 0;
+    server->batch_running = false;
+    
+    // Sending may read further pipelined requests, which gather for the next batch
+    int num_answered = batch->num_waiting;
+    batch->num_waiting = 0;
+    for (int w = 0; w < num_answered; w++) {
+        if (!serve_process(server, batch->waiting[w])) serve_close(batch->waiting[w]);
+    }
+}
 
-    if (show_folder_selector) {
-        switch(key) {
-            case 9:  // Tab key
-                selected_input_field = (selected_input_field + 1) % 3;
-                break;
-            
-            case 27:  // Escape key
-                show_folder_selector = false;
-                break;
-            
-            case 13:  // Enter key
-                // Validate and perform conversion
-                if (strlen(input_png_folder) > 0 && 
-                    strlen(wad_output_name) > 0 && 
-                    strlen(output_wad_folder) > 0) {
-                    int result = bmp32_to_pwad(input_png_folder, wad_output_name, output_wad_folder);
-                    if (result) {
-                        sprintf(status_message, "Successfully converted PNGs to %s/%s.wad", 
-                                output_wad_folder, wad_output_name);
-                    } else {
-                        sprintf(status_message, "Failed to convert PNGs");
+#endif
+
+static void serve_usage() {
+    fprintf(stderr,
+            "usage: eyeglass serve <wad or pk3>... [options]\n"
+            "  -p, --port <n>         Port to listen on (default %d)\n"
+            "  --bind <address>       Address to listen on (default 127.0.0.1)\n"
+            "  --thumb-size <n>       Thumbnail and atlas cell edge (default %d)\n"
+            "  --cache-mb <n>         Memory for encoded images (default %d)\n"
+            "  -j, --jobs <n>         Worker threads for decoding (default: one per CPU)\n"
+            "  --palette <file>       PLAYPAL lump or WAD to colour images with\n"
+            "Routes:\n"
+            "  /                      The WADs being served, as JSON\n"
+            "  /wad/<w>               Directory of WAD w with image sizes and atlas cells\n"
+            "  /lump/<w>/<lump>       Raw lump bytes; lump is an index or a name\n"
+            "  /png/<w>/<lump>        Image lump as PNG\n"
+            "  /thumb/<w>/<lump>      Thumbnail as PNG\n"
+            "  /atlas/<w>/<page>      16x16 thumbnails per page as PNG\n",
+            SERVE_DEFAULT_PORT, SERVE_THUMB_SIZE, SERVE_CACHE_MB);
+}
+
+// eyeglass serve: a small HTTP server for WAD previews in other tools.
+// One epoll loop owns every connection; requests that need decoding are
+// gathered per round and handed as one batch to a thread that decodes it
+// on the worker pool, while the loop goes on serving from the cache.
+int serve_command(int argc, char **argv) {
+#ifdef __linux__
+    const char *palette_path = NULL;
+    const char *bind_address = "127.0.0.1";
+    int port = SERVE_DEFAULT_PORT;
+    int cache_mb = SERVE_CACHE_MB;
+    server_t server = {0};
+    server.thumb_size = SERVE_THUMB_SIZE;
+    server.gathering.server = &server;
+    server.running.server = &server;
+    char **paths = (char **)calloc(argc + 1, sizeof(char *));
+    int num_paths = 0;
+    if (!paths) return 2;
+    
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-p") == 0 || strcmp(arg, "--port") == 0) {
+            port = value ? atoi(value) : 0;
+        } else if (strcmp(arg, "--bind") == 0) {
+            bind_address = value;
+        } else if (strcmp(arg, "--thumb-size") == 0) {
+            server.thumb_size = value ? atoi(value) : 0;
+        } else if (strcmp(arg, "--cache-mb") == 0) {
+            cache_mb = value ? atoi(value) : 0;
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+            worker_limit = value ? atoi(value) : 0;
+            if (worker_limit <= 0) {
+                fprintf(stderr, "--jobs needs a positive number\n");
+                return 2;
+            }
+        } else if (strcmp(arg, "--palette") == 0) {
+            palette_path = value;
+        } else {
+            takes_value = false;
+            if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                serve_usage();
+                return 0;
+            } else if (arg[0] == '-') {
+                fprintf(stderr, "Unexpected argument: %s\n", arg);
+                serve_usage();
+                return 2;
+            } else {
+                paths[num_paths++] = argv[i];
+            }
+        }
+        if (takes_value) {
+            if (!value) {
+                fprintf(stderr, "%s needs a value\n", arg);
+                return 2;
+            }
+            i++;
+        }
+    }
+    if (num_paths == 0 || port <= 0 || port > 65535 || server.thumb_size < 1 || server.thumb_size > 256 || cache_mb < 1) {
+        serve_usage();
+        return 2;
+    }
+    
+    if (palette_path) {
+        if (!load_palette_file(palette_path)) {
+            fprintf(stderr, "No palette in %s\n", palette_path);
+            return 2;
+        }
+    } else {
+        load_doom_palette();
+        if (!palette_loaded && !extract_palette_from_wad(paths[0])) {
+            fprintf(stderr, "No playpal.lmp found; using a grayscale palette\n");
+            for (int i = 0; i < 256; i++) {
+                doom_palette[i][0] = doom_palette[i][1] = doom_palette[i][2] = i;
+            }
+        }
+    }
+    prepare_color_lookup();
+    crc32_init();
+    
+    double start = now_seconds();
+    server.wads = (serve_wad_t *)calloc(num_paths, sizeof(serve_wad_t));
+    if (!server.wads || !serve_cache_resize(&server.cache, 1024)) return 2;
+    server.cache.budget = (size_t)cache_mb << 20;
+    int total_images = 0;
+    for (int i = 0; i < num_paths; i++) {
+        if (!serve_open_wad(&server, &server.wads[i], paths[i])) {
+            fprintf(stderr, "Could not open %s\n", paths[i]);
+            return 2;
+        }
+        total_images += server.wads[i].num_images;
+        server.num_wads++;
+    }
+    
+    json_buffer_t json = {0};
+    json_printf(&json, "{\"thumb_size\":%d,\"atlas_columns\":%d,\"wads\":[", server.thumb_size, SERVE_ATLAS_COLUMNS);
+    for (int w = 0; w < server.num_wads; w++) {
+        const wad_file_t *wad = server.wads[w].wad;
+        json_printf(&json, "%s\n{\"id\":%d,\"file\":", w > 0 ? "," : "", w);
+        json_string(&json, wad->filename);
+        json_printf(&json, ",\"type\":\"%s\",\"lumps\":%d,\"images\":%d}",
+                    serve_wad_type(wad), wad->header.num_lumps, server.wads[w].num_images);
+    }
+    json_printf(&json, "]}\n");
+    server.index = json_finish(&json);
+    
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (!server.index || listener < 0 || inet_pton(AF_INET, bind_address, &address.sin_addr) != 1 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0 ||
+        bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on %s:%d: %s\n", bind_address, port, strerror(errno));
+        return 2;
+    }
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;    // The listener
+    if (server.epoll_fd < 0 || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listener, &event) != 0) {
+        fprintf(stderr, "Could not start the event loop: %s\n", strerror(errno));
+        return 2;
+    }
+    server.batch_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event.data.ptr = &server;    // The batch thread
+    thread_t batch_thread;
+    mutex_init(&server.batch_mutex);
+    cond_init(&server.batch_cond);
+    if (server.batch_fd < 0 || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.batch_fd, &event) != 0 ||
+        !thread_start(&batch_thread, serve_batch_thread, &server)) {
+        fprintf(stderr, "Could not start the decoding thread: %s\n", strerror(errno));
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    printf("Serving %d images from %d files on http://%s:%d/ (ready in %.2fs)\n",
+           total_images, server.num_wads, bind_address, port, now_seconds() - start);
+    fflush(stdout);
+    
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    for (;;) {
+        int count = epoll_wait(server.epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        if (count < 0 && errno != EINTR) break;
+        
+        for (int e = 0; e < count; e++) {
+            if (events[e].data.ptr == &server) {
+                uint64_t signals;
+                while (read(server.batch_fd, &signals, sizeof(signals)) < 0 && errno == EINTR) {}
+                serve_finish_batch(&server);
+                continue;
+            }
+            serve_connection_t *conn = (serve_connection_t *)events[e].data.ptr;
+            if (!conn) {
+                int fd;
+                while ((fd = accept(listener, NULL, NULL)) >= 0) {
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    conn = (serve_connection_t *)calloc(1, sizeof(serve_connection_t));
+                    struct epoll_event added = {0};
+                    added.events = EPOLLIN;
+                    added.data.ptr = conn;
+                    if (!conn || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &added) != 0) {
+                        free(conn);
+                        close(fd);
+                        continue;
                     }
-                    show_folder_selector = false;
-                }
-                break;
-            
-            case 8:  // Backspace key
-                switch(selected_input_field) {
-                    case 0:  // Input PNG Folder
-                        if (strlen(input_png_folder) > 0)
-                            input_png_folder[strlen(input_png_folder)-1] = '\0';
-                        break;
-                    case 1:  // WAD Output Name
-                        if (strlen(wad_output_name) > 0)
-                            wad_output_name[strlen(wad_output_name)-1] = '\0';
-                        break;
-                    case 2:  // Output WAD Folder
-                        if (strlen(output_wad_folder) > 0)
-                            output_wad_folder[strlen(output_wad_folder)-1] = '\0';
-                        break;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                    conn->fd = fd;
+                    conn->file_fd = -1;
+                    conn->events = EPOLLIN;
                 }
-                break;
+                continue;
+            }
             
-            default:
-                // Prevent input of very long paths
-                switch(selected_input_field) {
-                    case 0:  // Input PNG Folder
-                        if (strlen(input_png_folder) < sizeof(input_png_folder) - 1 && 
-                            (isalnum(key) || key == '/' || key == '.' || key == '_' || key == '-' || key == ' ')) {
-                            input_png_folder[strlen(input_png_folder)] = key;
-                            input_png_folder[strlen(input_png_folder)+1] = '\0';
-                        }
-                        break;
-                    case 1:  // WAD Output Name
-                        if (strlen(wad_output_name) < sizeof(wad_output_name) - 1 && 
-                            (isalnum(key) || key == '_')) {
-                            wad_output_name[strlen(wad_output_name)] = key;
-                            wad_output_name[strlen(wad_output_name)+1] = '\0';
-                        }
-                        break;
-                    case 2:  // Output WAD Folder
-                        if (strlen(output_wad_folder) < sizeof(output_wad_folder) - 1 && 
-                            (isalnum(key) || key == '/' || key == '.' || key == '_' || key == '-' || key == ' ')) {
-                            output_wad_folder[strlen(output_wad_folder)] = key;
-                            output_wad_folder[strlen(output_wad_folder)+1] = '\0';
-                        }
-                        break;
-                }
-                break;
+            // A connection waiting on the batch is disarmed (one-shot), so at
+            // most one stray event gets here; it is answered from the batch
+            if (conn->pending_kind) continue;
+            bool alive = (events[e].events & (EPOLLERR | EPOLLHUP)) == 0 || (events[e].events & EPOLLIN);
+            if (alive && conn->responding) alive = serve_process(&server, conn);
+            else if (alive) alive = serve_read(&server, conn);
+            if (!alive) serve_close(conn);
         }
-        glutPostRedisplay();
-        return;
+        
+        // One batch decodes at a time; the next starts when it is collected
+        serve_start_batch(&server);
     }
+    fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+    return 1;
+#else
+    fprintf(stderr, "eyeglass serve needs Linux (epoll and sendfile)\n");
+    return 2;
+#endif
+}
+
+#ifdef __linux__
+// One client connection of the load test, with its own results
+typedef struct {
+    long long requests;
+    long long errors;
+    long long bytes;
+    unsigned int *latencies;      // Microseconds per request
+    int num_latencies, latency_capacity;
+} loadtest_client_t;
+
+typedef struct {
+    struct sockaddr_in address;
+    char **paths;
+    int num_paths;
+    double deadline;
+    loadtest_client_t *clients;
+} loadtest_t;
+
+static int loadtest_connect(const loadtest_t *test) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    if (fd >= 0 && connect(fd, (const struct sockaddr *)&test->address, sizeof(test->address)) == 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        return fd;
+    }
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+// Keep one connection busy with requests, one at a time, until the deadline
+static void loadtest_client(void *context, int index) {
+    loadtest_t *test = (loadtest_t *)context;
+    loadtest_client_t *client = &test->clients[index];
+    char buffer[65536];
+    int fd = -1;
     
-    glutPostRedisplay();
+    for (int next = index; now_seconds() < test->deadline; next++) {
+        if (fd < 0 && (fd = loadtest_connect(test)) < 0) {
+            client->errors++;
+            return;
+        }
+        char request[512];
+        int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                              test->paths[next % test->num_paths]);
+        double start = now_seconds();
+        bool ok = send(fd, request, length, MSG_NOSIGNAL) == length;
+        
+        // Read the head, then count off the body
+        size_t buffered = 0, head_end = 0;
+        while (ok && head_end == 0) {
+            ssize_t received = recv(fd, buffer + buffered, sizeof(buffer) - 1 - buffered, 0);
+            ok = received > 0;
+            buffered += ok ? received : 0;
+            buffer[buffered] = '\0';
+            char *end = strstr(buffer, "\r\n\r\n");
+            if (end) head_end = end + 4 - buffer;
+            else if (buffered == sizeof(buffer) - 1) ok = false;
+        }
+        if (ok) buffer[head_end] = '\0';    // Body bytes are not searched
+        int status = 0;
+        long long content_length = -1;
+        if (ok) {
+            sscanf(buffer, "HTTP/1.%*d %d", &status);
+            char *field = strstr(buffer, "Content-Length:");
+            if (field) content_length = atoll(field + 15);
+            ok = content_length >= 0 && strstr(buffer, "Connection: close") == NULL;
+        }
+        long long remaining = ok ? content_length - (long long)(buffered - head_end) : 0;
+        while (ok && remaining > 0) {
+            ssize_t received = recv(fd, buffer, remaining < (long long)sizeof(buffer) ? remaining : sizeof(buffer), 0);
+            ok = received > 0;
+            remaining -= ok ? received : 0;
+        }
+        
+        if (!ok || status != 200) {
+            client->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        client->requests++;
+        client->bytes += content_length;
+        if (client->num_latencies == client->latency_capacity) {
+            int capacity = client->latency_capacity ? client->latency_capacity * 2 : 4096;
+            unsigned int *grown = (unsigned int *)realloc(client->latencies, capacity * sizeof(unsigned int));
+            if (!grown) continue;
+            client->latencies = grown;
+            client->latency_capacity = capacity;
+        }
+        client->latencies[client->num_latencies++] = (unsigned int)((now_seconds() - start) * 1e6);
+    }
+    if (fd >= 0) close(fd);
 }
 
-void special_keys(int key, int x, int y) {
-    if (show_file_selector) {
-        switch (key) {
-            case GLUT_KEY_UP:
-                selected_wad_index--;
-                if (selected_wad_index < 0) {
-                    selected_wad_index = num_available_wads - 1;
-                }
-                break;
-                
-            case GLUT_KEY_DOWN:
-                selected_wad_index++;
-                if (selected_wad_index >= num_available_wads) {
-                    selected_wad_index = 0;
-                }
-                break;
+static int compare_uints(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void loadtest_free(loadtest_t *test, int connections) {
+    for (int c = 0; test->clients && c < connections; c++) free(test->clients[c].latencies);
+    free(test->clients);
+    free(test->paths);
+}
+#endif
+
+static void loadtest_usage() {
+    fprintf(stderr,
+            "usage: eyeglass loadtest [options] <path>...\n"
+            "  -p, --port <n>         Server port on 127.0.0.1 (default %d)\n"
+            "  -c, --connections <n>  Keep-alive connections, one thread each (default 8)\n"
+            "  -d, --duration <s>     Seconds to run (default 5)\n"
+            "Paths are requested round robin, e.g. /png/0/TROOA1 /thumb/0/12 /atlas/0/0\n",
+            SERVE_DEFAULT_PORT);
+}
+
+// eyeglass loadtest: measure requests per second against a local
+// "eyeglass serve". Exits 1 if any request failed, 2 on bad usage.
+int loadtest_command(int argc, char **argv) {
+#ifdef __linux__
+    int port = SERVE_DEFAULT_PORT;
+    int connections = 8;
+    double duration = 5;
+    loadtest_t test = {0};
+    test.paths = (char **)calloc(argc + 1, sizeof(char *));
+    if (!test.paths) return 2;
+    
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-p") == 0 || strcmp(arg, "--port") == 0) {
+            port = value ? atoi(value) : 0;
+        } else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--connections") == 0) {
+            connections = value ? atoi(value) : 0;
+        } else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--duration") == 0) {
+            duration = value ? atof(value) : 0;
+        } else {
+            takes_value = false;
+            if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                loadtest_usage();
+                loadtest_free(&test, 0);
+                return 0;
+            } else if (arg[0] != '/') {
+                fprintf(stderr, "Unexpected argument: %s\n", arg);
+                loadtest_usage();
+                loadtest_free(&test, 0);
+                return 2;
+            } else {
+                test.paths[test.num_paths++] = argv[i];
+            }
+        }
+        if (takes_value) {
+            if (!value) {
+                fprintf(stderr, "%s needs a value\n", arg);
+                loadtest_free(&test, 0);
+                return 2;
+            }
+            i++;
+        }
+    }
+    if (test.num_paths == 0 || port <= 0 || port > 65535 || connections < 1 ||
+        connections > MAX_WORKER_THREADS || duration <= 0) {
+        loadtest_usage();
+        loadtest_free(&test, 0);
+        return 2;
+    }
+    
+    test.address.sin_family = AF_INET;
+    test.address.sin_port = htons(port);
+    test.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    test.clients = (loadtest_client_t *)calloc(connections, sizeof(loadtest_client_t));
+    if (!test.clients) {
+        loadtest_free(&test, 0);
+        return 2;
+    }
+    
+    // Each client blocks on its socket, so the pool gets a thread per connection
+    worker_limit = connections;
+    double start = now_seconds();
+    test.deadline = start + duration;
+    parallel_for(connections, loadtest_client, &test);
+    double seconds = now_seconds() - start;
+    
+    long long requests = 0, errors = 0, bytes = 0;
+    int num_latencies = 0;
+    for (int c = 0; c < connections; c++) {
+        requests += test.clients[c].requests;
+        errors += test.clients[c].errors;
+        bytes += test.clients[c].bytes;
+        num_latencies += test.clients[c].num_latencies;
+    }
+    unsigned int *latencies = (unsigned int *)malloc((num_latencies + 1) * sizeof(unsigned int));
+    num_latencies = 0;
+    for (int c = 0; latencies && c < connections; c++) {
+        memcpy(latencies + num_latencies, test.clients[c].latencies, test.clients[c].num_latencies * sizeof(unsigned int));
+        num_latencies += test.clients[c].num_latencies;
+    }
+    if (latencies) qsort(latencies, num_latencies, sizeof(unsigned int), compare_uints);
+    
+    printf("%lld requests in %.2fs over %d connections: %.0f requests/s, %.1f MB/s, %lld errors\n",
+           requests, seconds, connections, requests / seconds, bytes / seconds / (1024.0 * 1024.0), errors);
+    if (latencies && num_latencies > 0) {
+        printf("latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               latencies[num_latencies / 2] / 1000.0, latencies[num_latencies * 9 / 10] / 1000.0,
+               latencies[num_latencies * 99 / 100] / 1000.0, latencies[num_latencies - 1] / 1000.0);
+    }
+    free(latencies);
+    loadtest_free(&test, connections);
+    return errors > 0 || requests == 0 ? 1 : 0;
+#else
+    fprintf(stderr, "eyeglass loadtest needs Linux\n");
+    return 2;
+#endif
+}
+
+#ifdef HAVE_EGL
+// Make a GL context current without a window or a display server: Mesa's
+// surfaceless platform, else the default display with a small pbuffer.
+// libEGL is opened at runtime so the viewer does not need it to start.
+static bool offscreen_context_init() {
+    void *library = dlopen("libEGL.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        fprintf(stderr, "Offscreen rendering needs libEGL.so.1: %s\n", dlerror());
+        return false;
+    }
+    PFNEGLGETPROCADDRESSPROC get_proc_address = (PFNEGLGETPROCADDRESSPROC)dlsym(library, "eglGetProcAddress");
+    if (!get_proc_address) {
+        fprintf(stderr, "libEGL.so.1 has no eglGetProcAddress\n");
+        return false;
+    }
+    PFNEGLQUERYSTRINGPROC query_string = (PFNEGLQUERYSTRINGPROC)get_proc_address("eglQueryString");
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)get_proc_address("eglGetPlatformDisplayEXT");
+    PFNEGLGETDISPLAYPROC get_display = (PFNEGLGETDISPLAYPROC)get_proc_address("eglGetDisplay");
+    PFNEGLINITIALIZEPROC initialize = (PFNEGLINITIALIZEPROC)get_proc_address("eglInitialize");
+    PFNEGLBINDAPIPROC bind_api = (PFNEGLBINDAPIPROC)get_proc_address("eglBindAPI");
+    PFNEGLCHOOSECONFIGPROC choose_config = (PFNEGLCHOOSECONFIGPROC)get_proc_address("eglChooseConfig");
+    PFNEGLCREATECONTEXTPROC create_context = (PFNEGLCREATECONTEXTPROC)get_proc_address("eglCreateContext");
+    PFNEGLCREATEPBUFFERSURFACEPROC create_pbuffer =
+        (PFNEGLCREATEPBUFFERSURFACEPROC)get_proc_address("eglCreatePbufferSurface");
+    PFNEGLMAKECURRENTPROC make_current = (PFNEGLMAKECURRENTPROC)get_proc_address("eglMakeCurrent");
+    if (!query_string || !get_display || !initialize || !bind_api || !choose_config ||
+        !create_context || !create_pbuffer || !make_current) {
+        fprintf(stderr, "libEGL.so.1 is missing EGL 1.4 entry points\n");
+        return false;
+    }
+    
+    const char *client_extensions = query_string(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLint major, minor;
+    if (get_platform_display && client_extensions && strstr(client_extensions, "EGL_MESA_platform_surfaceless")) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (display != EGL_NO_DISPLAY && !initialize(display, &major, &minor)) display = EGL_NO_DISPLAY;
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = get_display(EGL_DEFAULT_DISPLAY);
+        if (display == EGL_NO_DISPLAY || !initialize(display, &major, &minor)) {
+            fprintf(stderr, "No EGL display is available for offscreen rendering\n");
+            return false;
+        }
+    }
+    
+    // The viewer draws with the fixed-function pipeline, so it wants desktop GL
+    const EGLint config_attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint num_configs = 0;
+    EGLContext context = EGL_NO_CONTEXT;
+    if (bind_api(EGL_OPENGL_API) && choose_config(display, config_attributes, &config, 1, &num_configs)) {
+        context = create_context(display, num_configs > 0 ? config : (EGLConfig)0, EGL_NO_CONTEXT, NULL);
+    }
+    if (context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "EGL could not create a desktop OpenGL context\n");
+        return false;
+    }
+    
+    // Without EGL_KHR_surfaceless_context a 1x1 pbuffer stands in for the window
+    if (!make_current(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        const EGLint pbuffer_attributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        EGLSurface surface = num_configs > 0 ? create_pbuffer(display, config, pbuffer_attributes) : EGL_NO_SURFACE;
+        if (surface == EGL_NO_SURFACE || !make_current(display, surface, surface, context)) {
+            fprintf(stderr, "EGL could not make the offscreen context current\n");
+            return false;
         }
+    }
+    offscreen_proc_address = (gl_proc_t (*)(const char *))get_proc_address;
+    return true;
+}
+#endif
+
+// The framebuffer that stands in for the window. The layers composite
+// into it exactly as they would into the back buffer.
+static bool offscreen_target_init(int width, int height) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    
+    gl_gen_framebuffers(1, &window_framebuffer);
+    gl_bind_framebuffer(GL_FRAMEBUFFER_EXT, window_framebuffer);
+    gl_framebuffer_texture_2d(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, texture, 0);
+    return gl_check_framebuffer_status(GL_FRAMEBUFFER_EXT) == GL_FRAMEBUFFER_COMPLETE_EXT;
+}
+
+// Copy rows [y, y + height) of the last frame into RGB scanlines that
+// start with a PNG filter byte. GL rows run bottom-up; scanlines top-down.
+static void read_frame_rows(int y, int height, unsigned char *scanlines) {
+    size_t stride = 1 + (size_t)window_width * 3;
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    for (int row = 0; row < height; row++) {
+        unsigned char *line = scanlines + row * stride;
+        line[0] = 0;
+        glReadPixels(0, window_height - 1 - (y + row), window_width, 1, GL_RGB, GL_UNSIGNED_BYTE, line + 1);
+    }
+}
+
+static bool write_png_file(const char *path, const unsigned char *scanlines, int width, int height) {
+    unsigned char *png = (unsigned char *)malloc(png_bound(width, height, 3));
+    if (!png) return false;
+    size_t size = png_encode(png, scanlines, width, height, 2, -1);
+    FILE *file = fopen(path, "wb");
+    bool written = file && fwrite(png, 1, size, file) == size;
+    if (file && fclose(file) != 0) written = false;
+    free(png);
+    return written;
+}
+
+// Height of a page's grid rows in a tall image, with room for the
+// labels under the last row
+static int render_page_band(int page, int grid_top) {
+    int count = num_shown_images - page * images_per_page;
+    if (count > images_per_page) count = images_per_page;
+    if (count <= 0) return 0;
+    int band = (count + images_per_row - 1) / images_per_row * (image_size + image_padding) + 2 * image_padding;
+    return band < window_height - 20 - grid_top ? band : window_height - 20 - grid_top;
+}
+
+// Texture memory and time so far, against what RGBA uploads would take
+static void print_texture_report() {
+    double megabyte = 1024.0 * 1024.0;
+    if (texture_stats.stored_bytes < texture_stats.rgba_bytes) {
+        double mean_error = texture_stats.samples > 0 ? texture_stats.squared_error / texture_stats.samples : 0;
+        printf("Textures: %d images in %.1f MB of BC1 instead of %.1f MB of RGBA (%.1fx smaller), "
+               "encoded in %.1f ms, uploaded in %.1f ms, PSNR %.1f dB\n",
+               texture_stats.textures, texture_stats.stored_bytes / megabyte, texture_stats.rgba_bytes / megabyte,
+               texture_stats.rgba_bytes / texture_stats.stored_bytes, texture_stats.encode_seconds * 1000.0,
+               texture_stats.upload_seconds * 1000.0,
+               mean_error > 0 ? 10.0 * log10(255.0 * 255.0 / mean_error) : INFINITY);
     } else {
-        switch (key) {
-            case GLUT_KEY_PAGE_UP:
-                current_page--;
-                if (current_page < 0) current_page = 0;
-                break;
-                
-            case GLUT_KEY_PAGE_DOWN:
-                current_page++;
-                // Upper bound check happens in display()
-                break;
-                
-            case GLUT_KEY_HOME:
-                current_page = 0;
-                break;
-                
-            case GLUT_KEY_END:
-                // Set to a high value, will be clamped in display()
-                current_page = 9999;
-                break;
-                
-            case GLUT_KEY_LEFT:
-                images_per_row--;
-                if (images_per_row < 1) images_per_row = 1;
-                break;
-                
-            case GLUT_KEY_RIGHT:
-                images_per_row++;
-                if (images_per_row > 8) images_per_row = 8;
-                break;
+        printf("Textures: %d images in %.1f MB of RGBA, uploaded in %.1f ms\n",
+               texture_stats.textures, texture_stats.stored_bytes / megabyte, texture_stats.upload_seconds * 1000.0);
+    }
+}
+
+static void render_usage() {
+    fprintf(stderr,
+            "usage: eyeglass render <wad or pk3>... [options]\n"
+            "  -o, --output <dir>     Folder for the PNGs (default .)\n"
+            "  --size <w>x<h>         Window size to render at (default %dx%d)\n"
+            "  --columns <n>          Images per row (default %d)\n"
+            "  --image-size <n>       Grid cell size in pixels (default %d)\n"
+            "  --search <query>       Only show images matching a search, as with /\n"
+            "  --page <n>             Only render page n, counting from 1\n"
+            "  --tall                 Stack every page into one tall pages.png\n"
+            "  --offsets              Draw patches anchored at their offsets\n"
+            "  --scaler <name>        Pixel-art scaler for enlarged images: off, scale2x (epx), scale3x\n"
+            "  --compress             Upload images as BC1 (S3TC) and compare the result with RGBA\n"
+            "  -j, --jobs <n>         Worker threads for decoding and scaling (default: one per CPU)\n"
+            "  --palette <file>       PLAYPAL lump or WAD to colour images with\n"
+            "Pages are written as page001.png, page002.png, ...\n",
+            window_width, window_height, images_per_row, image_size);
+}
+
+// eyeglass render: draw the grid without a window, through the same
+// display() as the viewer, and write each page as a PNG. The status bar
+// is fixed so the same WADs and options always give the same bytes.
+// Exits 1 if a page could not be written, 2 on bad usage or no GL.
+int render_command(int argc, char **argv) {
+    const char *output_folder = ".";
+    const char *palette_path = NULL;
+    const char *search = NULL;
+    int only_page = 0;
+    bool tall = false;
+    char **paths = (char **)calloc(argc + 1, sizeof(char *));
+    int num_paths = 0;
+    if (!paths) return 2;
+    
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+            output_folder = value;
+        } else if (strcmp(arg, "--size") == 0) {
+            if (!value || sscanf(value, "%dx%d", &window_width, &window_height) != 2) window_width = 0;
+        } else if (strcmp(arg, "--columns") == 0) {
+            images_per_row = value ? atoi(value) : 0;
+        } else if (strcmp(arg, "--image-size") == 0) {
+            image_size = value ? atoi(value) : 0;
+        } else if (strcmp(arg, "--search") == 0) {
+            search = value;
+        } else if (strcmp(arg, "--scaler") == 0) {
+            pixel_scaler = -1;
+            for (int s = 0; value && s < NUM_SCALERS; s++) {
+                if (strcasecmp(value, scaler_names[s]) == 0) pixel_scaler = s;
+            }
+            if (value && strcasecmp(value, "epx") == 0) pixel_scaler = SCALER_SCALE2X;
+            if (value && pixel_scaler < 0) {
+                fprintf(stderr, "Unknown scaler %s\n", value);
+                render_usage();
+                return 2;
+            }
+        } else if (strcmp(arg, "--page") == 0) {
+            only_page = value ? atoi(value) : 0;
+            if (only_page <= 0) {
+                fprintf(stderr, "--page needs a page number from 1\n");
+                return 2;
+            }
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+            worker_limit = value ? atoi(value) : 0;
+            if (worker_limit <= 0) {
+                fprintf(stderr, "--jobs needs a positive number\n");
+                return 2;
+            }
+        } else if (strcmp(arg, "--palette") == 0) {
+            palette_path = value;
+        } else {
+            takes_value = false;
+            if (strcmp(arg, "--tall") == 0) {
+                tall = true;
+            } else if (strcmp(arg, "--offsets") == 0) {
+                offset_view = true;
+            } else if (strcmp(arg, "--compress") == 0) {
+                compressed_textures = true;
+            } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                render_usage();
+                return 0;
+            } else if (arg[0] == '-') {
+                fprintf(stderr, "Unexpected argument: %s\n", arg);
+                render_usage();
+                return 2;
+            } else {
+                paths[num_paths++] = argv[i];
+            }
+        }
+        if (takes_value) {
+            if (!value) {
+                fprintf(stderr, "%s needs a value\n", arg);
+                return 2;
+            }
+            i++;
+        }
+    }
+    if (num_paths == 0 || window_width < 64 || window_height < 64 ||
+        window_width > 8192 || window_height > 8192 || images_per_row < 1 || image_size < 8) {
+        render_usage();
+        return 2;
+    }
+    if (!is_directory(output_folder)) {
+        fprintf(stderr, "%s is not a folder\n", output_folder);
+        return 2;
+    }
+    
+#ifdef HAVE_EGL
+    if (!offscreen_context_init()) return 2;
+#else
+    fprintf(stderr, "eyeglass render needs EGL\n");
+    return 2;
+#endif
+    offscreen = true;
+    live_reload = false;
+    
+    // The same GL setup as the viewer window
+    glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    text_init();
+    load_gl_extensions();
+    if (!layers_supported || !offscreen_target_init(window_width, window_height)) {
+        fprintf(stderr, "The GL driver has no usable framebuffer objects\n");
+        return 2;
+    }
+    if (compressed_textures && !texture_compression_supported) {
+        fprintf(stderr, "The GL driver has no S3TC texture compression\n");
+        return 2;
+    }
+    
+    load_doom_palette();
+    if (palette_path) {
+        if (!load_palette_file(palette_path)) {
+            fprintf(stderr, "Could not read a palette from %s\n", palette_path);
+            return 2;
         }
+        palette_loaded = true;
+        external_palette = true;
     }
     
-    glutPostRedisplay();
-}
-
-void mouse(int button, int state, int x, int y) {
-    if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN) {
-        // Calculate which image was clicked (if any)
-        int row = (y - 30) / (image_size + image_padding);
-        int col = x / (image_size + image_padding);
+    double start = now_seconds();
+    for (int p = 0; p < num_paths; p++) {
+        if (!wad_stack_push(paths[p])) {
+            fprintf(stderr, "Could not load %s: %s\n", paths[p], status_message);
+            return 2;
+        }
+    }
+    if (search) {
+        snprintf(search_query, sizeof(search_query), "%s", search);
+        apply_lump_filter();
+    }
+    printf("Loaded %d images from %d WADs in %.1f ms\n", total_images, num_wads, (now_seconds() - start) * 1000.0);
+    print_texture_report();
+    
+    // Load times and arena sizes would make every run's pixels differ
+    snprintf(status_message, sizeof(status_message), "%d images from %d WADs", total_images, num_wads);
+    
+    update_page_layout();
+    int first = 0, last = total_pages - 1;
+    if (only_page > 0) {
+        if (only_page > total_pages) {
+            fprintf(stderr, "There are only %d pages\n", total_pages);
+            return 2;
+        }
+        first = last = only_page - 1;
+    }
+    
+    // A tall image keeps the header of the first page, the grid rows of
+    // every page and the status bar of the last one
+    int grid_top = 30;
+    int tall_height = grid_top + 20;
+    for (int page = first; tall && page <= last; page++) {
+        tall_height += render_page_band(page, grid_top);
+    }
+    size_t stride = 1 + (size_t)window_width * 3;
+    unsigned char *scanlines = (unsigned char *)malloc(stride * (tall ? tall_height : window_height));
+    if (!scanlines) return 2;
+    crc32_init();
+    
+    int failures = 0, tall_y = 0;
+    double render_start = now_seconds();
+    for (int page = first; page <= last; page++) {
+        double page_start = now_seconds();
+        current_page = page;
+        display();
+        double drawn = now_seconds();
         
-        if (row >= 0 && col >= 0 && col < images_per_row) {
-            int idx = current_page * images_per_page + row * images_per_row + col;
-            if (idx >= 0 && idx < total_images) {
-                // Display info about the clicked image
-                wad_image_t *img = &images[idx];
-                sprintf(status_message, "Selected: %s (%dx%d, %d bytes)", 
-                        img->name, img->width, img->height, img->size);
+        char path[1024];
+        int count = num_shown_images - page * images_per_page;
+        if (count > images_per_page) count = images_per_page;
+        if (count < 0) count = 0;
+        if (tall) {
+            if (page == first) {
+                read_frame_rows(0, grid_top, scanlines);
+                tall_y = grid_top;
             }
+            int band = render_page_band(page, grid_top);
+            read_frame_rows(grid_top, band, scanlines + tall_y * stride);
+            tall_y += band;
+            if (page == last) {
+                read_frame_rows(window_height - 20, 20, scanlines + tall_y * stride);
+            }
+            printf("page %d/%d: %d images, drawn in %.1f ms\n",
+                   page + 1, total_pages, count, (drawn - page_start) * 1000.0);
+            continue;
+        }
+        
+        read_frame_rows(0, window_height, scanlines);
+        snprintf(path, sizeof(path), "%s/page%03d.png", output_folder, page + 1);
+        bool written = write_png_file(path, scanlines, window_width, window_height);
+        if (!written) {
+            fprintf(stderr, "Could not write %s\n", path);
+            failures++;
         }
+        printf("page %d/%d: %d images, drawn in %.1f ms, written in %.1f ms -> %s\n",
+               page + 1, total_pages, count, (drawn - page_start) * 1000.0,
+               (now_seconds() - drawn) * 1000.0, path);
     }
-    
-    glutPostRedisplay();
+    if (tall) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/pages.png", output_folder);
+        if (!write_png_file(path, scanlines, window_width, tall_height)) {
+            fprintf(stderr, "Could not write %s\n", path);
+            failures++;
+        }
+        printf("%dx%d contact sheet -> %s\n", window_width, tall_height, path);
+    }
+    printf("Rendered %d pages in %.1f ms\n", last - first + 1, (now_seconds() - render_start) * 1000.0);
+    free(scanlines);
+    free(paths);
+    return failures > 0 ? 1 : 0;
 }
 
-
-// BMP32 header structures
+// Verify results for one lump, filled on the worker pool
 typedef struct {
-    uint16_t file_type;     // Must be 0x4D42 ('BM')
-    uint32_t file_size;     // Size of the file in bytes
-    uint16_t reserved1;     // Reserved, must be zero
-    uint16_t reserved2;     // Reserved, must be zero
-    uint32_t offset_data;   // Offset to image data in bytes
-} BMP_FILE_HEADER;
+    uint32_t crc;               // CRC-32C of the lump's (uncompressed) bytes
+    const char *kind;           // "marker", "patch", "flat", "png", "raw", "map" or "data"
+    char problem[128];          // Empty when the lump is sound
+} verify_lump_t;
+
+// Why a lump must be a patch (or PNG): it sits between P_START and
+// P_END, PNAMES lists it, or it has a name the engine draws as a graphic
+enum {
+    PATCH_UNKNOWN,
+    PATCH_REQUIRED,
+    PATCH_BY_NAME
+};
 
 typedef struct {
-    uint32_t header_size;   // Size of this header
-    int32_t width;          // Image width
-    int32_t height;         // Image height
-    uint16_t planes;        // Must be 1
-    uint16_t bit_count;     // Bits per pixel
-    uint32_t compression;   // Compression method
-    uint32_t image_size;    // Size of image data
-    int32_t x_pixels_per_m; // Pixels per meter in X
-    int32_t y_pixels_per_m; // Pixels per meter in Y
-    uint32_t colors_used;   // Number of colors in color palette
-    uint32_t colors_important; // Number of important colors
-} BMP_INFO_HEADER;
+    wad_file_t *wad;
+    char (*ns)[9];
+    unsigned char *patches;     // PATCH_* per lump
+    verify_lump_t *lumps;
+} verify_job_t;
 
-int validate_bmp32_header(FILE* file, BMP_FILE_HEADER* file_header, BMP_INFO_HEADER* info_header) {
-    // Read file header
-    if (fread(file_header, sizeof(BMP_FILE_HEADER), 1, file) != 1) {
-        fprintf(stderr, "Error reading BMP file header\n");
-        return 0;
-    }
+// Record sizes of the binary map lumps, DOOM and Hexen
+static const struct {
+    const char *name;
+    int size;
+    int hexen_size;
+} map_records[] = {
+    {"THINGS", 10, 20}, {"LINEDEFS", 14, 16}, {"SIDEDEFS", 30, 30}, {"VERTEXES", 4, 4},
+    {"SEGS", 12, 12}, {"SSECTORS", 4, 4}, {"NODES", 28, 28}, {"SECTORS", 26, 26}
+};
 
-    // Validate file type (must be 'BM')
-    if (file_header->file_type != 0x4D42) {
-        fprintf(stderr, "Invalid BMP file type\n");
-        return 0;
+// A patch is sound if its column table fits, every column starts past the
+// table, and every post ends inside the lump before the 0xFF terminator
+static bool verify_patch(const unsigned char *data, int size, char *problem, size_t problem_size) {
+    if (size < 8) {
+        snprintf(problem, problem_size, "%d bytes is too short for a patch header", size);
+        return false;
     }
-
-    // Read info header
-    if (fread(info_header, sizeof(BMP_INFO_HEADER), 1, file) != 1) {
-        fprintf(stderr, "Error reading BMP info header\n");
-        return 0;
+    int width = read_le16u(data), height = read_le16u(data + 2);
+    if (width == 0 || height == 0) {
+        snprintf(problem, problem_size, "patch is %dx%d", width, height);
+        return false;
     }
-
-    // Detailed diagnostic print
-    printf("File Header Diagnostics:\n");
-    printf("  File Type: 0x%04X\n", file_header->file_type);
-    printf("  File Size: %u bytes\n", file_header->file_size);
-    printf("  Offset to Data: %u\n", file_header->offset_data);
-
-    printf("Info Header Diagnostics:\n");
-    printf("  Header Size: %u\n", info_header->header_size);
-    printf("  Width: %d\n", info_header->width);
-    printf("  Height: %d\n", info_header->height);
-    printf("  Planes: %u\n", info_header->planes);
-    printf("  Bit Count: %u\n", info_header->bit_count);
-    printf("  Compression: %u\n", info_header->compression);
-
-    // Validate image attributes more carefully
-    if (info_header->planes != 1) {
-        fprintf(stderr, "Invalid number of planes: %u (must be 1)\n", info_header->planes);
-        return 0;
+    if (8 + 4 * width > size) {
+        snprintf(problem, problem_size, "column offsets of a %d wide patch need %d bytes, the lump has %d",
+                 width, 8 + 4 * width, size);
+        return false;
     }
-
-    // More flexible bit depth check
-    if (info_header->bit_count != 24 && info_header->bit_count != 32) {
-        fprintf(stderr, "Unsupported bit depth: %u (expected 24 or 32)\n", info_header->bit_count);
-        return 0;
+    for (int x = 0; x < width; x++) {
+        uint32_t pos = read_le32(data + 8 + x * 4);
+        if (pos < 8 + 4 * (uint32_t)width || pos >= (uint32_t)size) {
+            snprintf(problem, problem_size, "column %d starts at %u, outside the lump", x, pos);
+            return false;
+        }
+        while (data[pos] != 0xFF) {
+            if (pos + 4 > (uint32_t)size || pos + 4 + data[pos + 1] >= (uint32_t)size) {
+                snprintf(problem, problem_size, "column %d runs past the end of the lump", x);
+                return false;
+            }
+            pos += 4 + data[pos + 1];
+        }
     }
+    return true;
+}
 
-    // Ensure sane image dimensions
-    if (info_header->width <= 0 || info_header->width > 512 ||
-        info_header->height <= 0 || info_header->height > 512) {
-        fprintf(stderr, "Invalid image dimensions: %dx%d\n", 
-                info_header->width, info_header->height);
-        return 0;
+// Lumps outside the sprite namespace are only held to the patch rules if
+// their header and column table say they are one
+static bool looks_like_patch(const unsigned char *data, int size) {
+    if (size < 8) return false;
+    int width = read_le16u(data), height = read_le16u(data + 2);
+    if (width == 0 || height == 0 || width > DECODE_MAX_DIMENSION || height > DECODE_MAX_DIMENSION ||
+        8 + 4 * width > size) {
+        return false;
     }
-
-    return 1;
+    for (int x = 0; x < width; x++) {
+        uint32_t pos = read_le32(data + 8 + x * 4);
+        if (pos < 8 + 4 * (uint32_t)width || pos >= (uint32_t)size) return false;
+    }
+    return true;
 }
 
-// Modify conversion function to handle 24-bit BMPs
-int bmp32_to_doom_patch_optimized(const char* input_bmp, unsigned char** output_data, int* output_size) {
-    FILE* file = fopen(input_bmp, "rb");
-    if (!file) {
-        fprintf(stderr, "Could not open BMP file: %s\n", input_bmp);
-        return 0;
+// Walk the chunks of a PNG lump and check each one's CRC-32
+static bool verify_png(const unsigned char *data, int size, char *problem, size_t problem_size) {
+    size_t pos = 8;
+    while (pos + 12 <= (size_t)size) {
+        uint32_t length = read_be32(data + pos);
+        if (length > size - pos - 12) {
+            snprintf(problem, problem_size, "PNG chunk at %zu runs past the end of the lump", pos);
+            return false;
+        }
+        if (pos == 8 && (memcmp(data + pos + 4, "IHDR", 4) != 0 || length != 13)) {
+            snprintf(problem, problem_size, "PNG does not start with an IHDR chunk");
+            return false;
+        }
+        if (crc32_update(0, data + pos + 4, length + 4) != read_be32(data + pos + 8 + length)) {
+            snprintf(problem, problem_size, "PNG %.4s chunk at %zu fails its CRC", (const char *)data + pos + 4, pos);
+            return false;
+        }
+        if (memcmp(data + pos + 4, "IEND", 4) == 0) return true;
+        pos += 12 + length;
     }
+    snprintf(problem, problem_size, "PNG ends without an IEND chunk");
+    return false;
+}
 
-    BMP_FILE_HEADER file_header;
-    BMP_INFO_HEADER info_header;
-
-    // Validate headers
-    if (!validate_bmp32_header(file, &file_header, &info_header)) {
-        fclose(file);
-        return 0;
+// Check one map's binary lumps: whole records, and every vertex, sidedef,
+// sector, seg, subsector and node reference in range. UDMF and extended
+// node lumps are text or compressed and left alone.
+static bool verify_map(wad_file_t *wad, int marker, char *problem, size_t problem_size) {
+    const unsigned char *lumps[8] = {0};
+    int counts[8] = {0};
+    bool hexen = false;
+    for (int i = marker + 1; i < wad->header.num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        if (!is_map_data_lump(name)) break;
+        if (strcmp(name, "BEHAVIOR") == 0) hexen = true;
+        if (strcmp(name, "TEXTMAP") == 0) return true;
+    }
+    for (int i = marker + 1; i < wad->header.num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        if (!is_map_data_lump(name)) break;
+        for (int r = 0; r < 8; r++) {
+            if (strcmp(name, map_records[r].name) != 0) continue;
+            int record = hexen ? map_records[r].hexen_size : map_records[r].size;
+            int size;
+            lumps[r] = wad_lump_data(wad, i, &size);
+            if (!lumps[r]) return true;     // Reported with the lump itself
+            if (r == 6 && size >= 4 && (memcmp(lumps[r], "XNOD", 4) == 0 || memcmp(lumps[r], "ZNOD", 4) == 0 ||
+                                        memcmp(lumps[r], "XGLN", 4) == 0 || memcmp(lumps[r], "ZGLN", 4) == 0 ||
+                                        memcmp(lumps[r], "XGL2", 4) == 0 || memcmp(lumps[r], "ZGL2", 4) == 0)) {
+                lumps[r] = NULL;
+                break;
+            }
+            if (size % record != 0) {
+                snprintf(problem, problem_size, "%s is %d bytes, not a whole number of %d-byte records",
+                         name, size, record);
+                return false;
+            }
+            counts[r] = size / record;
+        }
     }
-
-    // Correct width and height handling for BMP
-    int width = abs(info_header.width);
-    int height = abs(info_header.height);
-    int bytes_per_pixel = (info_header.bit_count == 32) ? 4 : 3;
-
-    // Debug print
-    printf("Processing image: %s, Dimensions: %dx%d, Bit Depth: %d\n", 
-           input_bmp, width, height, info_header.bit_count);
-
-    // Allocate robust output buffer
-    unsigned char* patch_data = malloc(width * height * 4 + 1024);
-    int current_offset = 0;
-
-    // Write DOOM patch header (width and height)
-    memcpy(patch_data + current_offset, &width, 2);
-    current_offset += 2;
-    memcpy(patch_data + current_offset, &height, 2);
-    current_offset += 2;
     
-    // Allocate column offset table
-    int* column_offsets = malloc(width * sizeof(int));
-    memset(patch_data + current_offset, 0, width * 4);
-    current_offset += width * 4;
-
-    // Seek to pixel data
-    fseek(file, file_header.offset_data, SEEK_SET);
-
-    // Allocate pixel buffer with padding
-    int row_size = ((width * info_header.bit_count + 31) / 32) * 4;  // 32-bit aligned row size
-    unsigned char* pixel_data = malloc(row_size * height);
-    memset(pixel_data, 0, row_size * height);
+    const unsigned char *lines = lumps[1], *sides = lumps[2], *segs = lumps[4], *subsectors = lumps[5], *nodes = lumps[6];
+    int num_lines = counts[1], num_sides = counts[2], num_vertices = counts[3];
+    int num_segs = counts[4], num_subsectors = counts[5], num_nodes = counts[6], num_sectors = counts[7];
+    int line_size = hexen ? 16 : 14, side_offset = hexen ? 12 : 10;
+    for (int i = 0; i < num_lines; i++) {
+        const unsigned char *p = lines + i * line_size;
+        unsigned int v1 = read_le16u(p), v2 = read_le16u(p + 2);
+        unsigned int front = read_le16u(p + side_offset), back = read_le16u(p + side_offset + 2);
+        if (v1 >= (unsigned)num_vertices || v2 >= (unsigned)num_vertices) {
+            snprintf(problem, problem_size, "linedef %d uses vertex %u of %d", i, v1 >= (unsigned)num_vertices ? v1 : v2,
+                     num_vertices);
+            return false;
+        }
+        if (front >= (unsigned)num_sides || (back != 0xFFFF && back >= (unsigned)num_sides)) {
+            snprintf(problem, problem_size, "linedef %d uses sidedef %u of %d", i,
+                     front >= (unsigned)num_sides ? front : back, num_sides);
+            return false;
+        }
+    }
+    for (int i = 0; i < num_sides; i++) {
+        unsigned int sector = read_le16u(sides + i * 30 + 28);
+        if (sector >= (unsigned)num_sectors) {
+            snprintf(problem, problem_size, "sidedef %d uses sector %u of %d", i, sector, num_sectors);
+            return false;
+        }
+    }
     
-    // Read pixel data (bottom-up for BMP)
-    for (int y = height - 1; y >= 0; y--) {
-        if (fread(pixel_data + y * row_size, 1, width * bytes_per_pixel, file) != width * bytes_per_pixel) {
-            fprintf(stderr, "Failed to read pixel data for row %d\n", y);
-            free(patch_data);
-            free(column_offsets);
-            free(pixel_data);
-            fclose(file);
-            return 0;
+    // Node lumps are built by a node builder, so these only go wrong when
+    // the file is damaged
+    if (!nodes) return true;
+    for (int i = 0; i < num_segs; i++) {
+        const unsigned char *p = segs + i * 12;
+        unsigned int v1 = read_le16u(p), v2 = read_le16u(p + 2), line = read_le16u(p + 6);
+        if (v1 >= (unsigned)num_vertices || v2 >= (unsigned)num_vertices || line >= (unsigned)num_lines) {
+            snprintf(problem, problem_size, "seg %d uses a vertex or linedef that does not exist", i);
+            return false;
         }
     }
-
-    // Process each column for DOOM patch format
-    for (int x = 0; x < width; x++) {
-        column_offsets[x] = current_offset;
-        
-        int span_start = -1;
-        unsigned char span_pixels[256];
-        int span_count = 0;
-
-        for (int y = 0; y < height; y++) {
-            int pixel_offset = (y * row_size) + (x * bytes_per_pixel);
-            unsigned char* pixel = pixel_data + pixel_offset;
-            
-            // Check alpha/transparency for 32-bit, or always visible for 24-bit
-            int is_visible = 1;
-            if (bytes_per_pixel == 4) {
-                is_visible = pixel[3] >= 128;
-            }
-            
-            // Transparent check
-            if (!is_visible) {
-                // End current span if one was in progress
-                if (span_start != -1) {
-                    // Write span details
-                    patch_data[current_offset++] = span_start;
-                    patch_data[current_offset++] = span_count;
-                    patch_data[current_offset++] = 0; // Dummy before pixels
-                    
-                    memcpy(patch_data + current_offset, span_pixels, span_count);
-                    current_offset += span_count;
-                    
-                    patch_data[current_offset++] = 0; // Dummy after pixels
-                    
-                    // Reset span
-                    span_start = -1;
-                    span_count = 0;
-                }
-                continue;
+    for (int i = 0; i < num_subsectors; i++) {
+        unsigned int count = read_le16u(subsectors + i * 4), first = read_le16u(subsectors + i * 4 + 2);
+        if (first + count > (unsigned)num_segs) {
+            snprintf(problem, problem_size, "subsector %d uses segs %u to %u of %d", i, first, first + count, num_segs);
+            return false;
+        }
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        for (int c = 0; c < 2; c++) {
+            unsigned int child = read_le16u(nodes + i * 28 + 24 + c * 2);
+            bool bad = child & 0x8000 ? (child & 0x7FFF) >= (unsigned)num_subsectors : child >= (unsigned)num_nodes;
+            if (bad) {
+                snprintf(problem, problem_size, "node %d has a child (%u) that does not exist", i, child);
+                return false;
             }
+        }
+    }
+    return true;
+}
 
-            // Start or continue span
-            if (span_start == -1) {
-                span_start = y;
-            }
+// Status bar, menu, intermission and full-screen graphics the engine
+// loads by name
+static bool is_graphic_lump_name(const char *name) {
+    static const char *names[] = {
+        "TITLEPIC", "HELP", "HELP1", "HELP2", "CREDIT", "VICTORY2", "BOSSBACK", "INTERPIC",
+        "ENDPIC", "PFUB1", "PFUB2", "STBAR", "STARMS", "END0", "END1", "END2", "END3",
+        "END4", "END5", "END6"
+    };
+    static const char *prefixes[] = {
+        "M_", "WI", "CWILV", "BRDR_", "AMMNUM", "STF", "STK", "STG", "STT", "STY", "STC", "STPB"
+    };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) return true;
+    }
+    for (int i = 0; i < (int)(sizeof(prefixes) / sizeof(prefixes[0])); i++) {
+        if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) return true;
+    }
+    return false;
+}
 
-            // Convert RGB to DOOM palette index (different handling for 24 vs 32-bit)
-            if (bytes_per_pixel == 4) {
-                span_pixels[span_count++] = 
-                    ((pixel[2] >> 2) + 
-                     (pixel[1] >> 2) * 4 + 
-                     (pixel[0] >> 2) * 16);
-            } else {
-                span_pixels[span_count++] = 
-                    ((pixel[2] >> 2) + 
-                     (pixel[1] >> 2) * 4 + 
-                     (pixel[0] >> 2) * 16);
-            }
+// Mark the lumps that must be patches. Runs before the parallel pass; the
+// last PNAMES in the file names the wall patches.
+static void verify_expect_patches(verify_job_t *job) {
+    wad_file_t *wad = job->wad;
+    int num_lumps = wad->header.num_lumps;
+    
+    uint64_t *patch_names = NULL;
+    int num_patch_names = 0;
+    for (int i = num_lumps - 1; i >= 0; i--) {
+        if (strncmp(wad->directory[i].name, "PNAMES", 8) != 0) continue;
+        int size;
+        const unsigned char *data = wad_lump_data(wad, i, &size);
+        int count = data && size >= 4 ? (int)read_le32(data) : 0;
+        if (count < 0 || count > (size - 4) / 8) count = 0;      // Damaged; checked as data
+        patch_names = (uint64_t *)malloc((count + 1) * sizeof(uint64_t));
+        for (int n = 0; patch_names && n < count; n++) {
+            char name[9] = {0};
+            memcpy(name, data + 4 + n * 8, 8);
+            patch_names[num_patch_names++] = pack_lump_name(name);
         }
-
-        // Handle final span
-        if (span_start != -1) {
-            patch_data[current_offset++] = span_start;
-            patch_data[current_offset++] = span_count;
-            patch_data[current_offset++] = 0;
-            
-            memcpy(patch_data + current_offset, span_pixels, span_count);
-            current_offset += span_count;
-            
-            patch_data[current_offset++] = 0;
+        if (patch_names) qsort(patch_names, num_patch_names, sizeof(uint64_t), compare_uint64);
+        break;
+    }
+    
+    bool in_patches = false;
+    for (int i = 0; i < num_lumps; i++) {
+        char name[9] = {0};
+        strncpy(name, wad->directory[i].name, 8);
+        if (strcmp(name, "P_START") == 0 || strcmp(name, "PP_START") == 0) in_patches = true;
+        else if (strcmp(name, "P_END") == 0 || strcmp(name, "PP_END") == 0) in_patches = false;
+        
+        job->patches[i] = PATCH_UNKNOWN;
+        if (job->ns[i][0] || wad->directory[i].size == 0) continue;   // Sprites, flats and maps have their own rules
+        uint64_t packed = pack_lump_name(name);
+        if (in_patches || (patch_names && bsearch(&packed, patch_names, num_patch_names, sizeof(uint64_t), compare_uint64))) {
+            job->patches[i] = PATCH_REQUIRED;
+        } else if (is_graphic_lump_name(name)) {
+            job->patches[i] = PATCH_BY_NAME;
         }
-
-        // Column terminator
-        patch_data[current_offset++] = 0xFF;
     }
-
-    // Update column offsets
-    memcpy(patch_data + 8, column_offsets, width * 4);
-
-    // Cleanup
-    free(column_offsets);
-    free(pixel_data);
-
-    // Set output
-    *output_data = patch_data;
-    *output_size = current_offset;
-
-    fclose(file);
-
-    return 1;
+    free(patch_names);
 }
 
-// BMP to PWAD conversion function (similar to pngtopwad)
-int bmp32_to_pwad(const char* input_folder, const char* wad_name, const char* output_folder) {
-    DIR* dir;
-    struct dirent* entry;
-    char input_path[1024];
-    char output_path[1024];
-    FILE* pwad_file;
-    int bmp_count = 0;
+// What a lump should be, from its namespace, name and first bytes, and
+// whether its structure holds up
+static void verify_lump_content(const verify_job_t *job, int index, const unsigned char *data, int size,
+                                verify_lump_t *result) {
+    wad_file_t *wad = job->wad;
+    const char *ns = job->ns[index];
+    char name[9] = {0};
+    strncpy(name, wad->directory[index].name, 8);
     
-    // Open input directory
-    dir = opendir(input_folder);
-    if (!dir) {
-        fprintf(stderr, "Error opening input folder: %s\n", strerror(errno));
-        return 0;
+    if (!wad->zip_entries && is_map_marker(name)) {
+        char next[9] = {0};
+        if (index + 1 < wad->header.num_lumps) strncpy(next, wad->directory[index + 1].name, 8);
+        if (is_map_data_lump(next)) {
+            result->kind = "map";
+            verify_map(wad, index, result->problem, sizeof(result->problem));
+            return;
+        }
     }
-    
-    // First pass: count valid BMP files
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".bmp") != NULL) {
-            bmp_count++;
+    if (is_map_marker(ns)) {
+        result->kind = "map";      // Checked with its marker
+    } else if (size == 0) {
+        result->kind = "marker";
+    } else if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        result->kind = "png";
+        verify_png(data, size, result->problem, sizeof(result->problem));
+    } else if (strcmp(ns, "F") == 0) {
+        result->kind = "flat";
+        if (size % 4096 != 0) {
+            snprintf(result->problem, sizeof(result->problem), "flat is %d bytes, not a multiple of 64x64", size);
         }
+    } else if (job->patches[index] == PATCH_BY_NAME && size == 64000 && !looks_like_patch(data, size)) {
+        result->kind = "raw";      // Heretic and Hexen keep full screens as raw 320x200
+    } else if (strcmp(ns, "S") == 0 || job->patches[index] != PATCH_UNKNOWN || looks_like_patch(data, size)) {
+        result->kind = "patch";
+        verify_patch(data, size, result->problem, sizeof(result->problem));
     }
-    rewinddir(dir);
+}
+
+// Check that a lump lies inside the file (or inflates to its size and
+// CRC, in a PK3), hash it and check its structure
+static void verify_lump(void *context, int index) {
+    verify_job_t *job = (verify_job_t *)context;
+    wad_file_t *wad = job->wad;
+    const wad_directory_t *entry = &wad->directory[index];
+    verify_lump_t *result = &job->lumps[index];
+    result->kind = "data";
     
-    // Prepare PWAD output file
-    snprintf(output_path, sizeof(output_path), "%s/%s.wad", output_folder, wad_name);
-    pwad_file = fopen(output_path, "wb");
-    if (!pwad_file) {
-        fprintf(stderr, "Error creating WAD file: %s\n", strerror(errno));
-        closedir(dir);
-        return 0;
+    const unsigned char *data;
+    unsigned char *inflated = NULL;
+    if (wad->zip_entries) {
+        const zip_entry_t *member = &wad->zip_entries[index];
+        data = zip_member_start(wad, member);
+        if (!data) {
+            snprintf(result->problem, sizeof(result->problem), "local header is damaged or outside the file");
+            return;
+        }
+        if (member->method == 8) {
+            inflated = (unsigned char *)malloc(entry->size + 1);
+            if (!inflated || inflate_raw(data, member->compressed_size, inflated, entry->size) != entry->size) {
+                snprintf(result->problem, sizeof(result->problem), "does not inflate to %d bytes", entry->size);
+                free(inflated);
+                return;
+            }
+            data = inflated;
+        } else if (member->compressed_size != entry->size) {
+            snprintf(result->problem, sizeof(result->problem), "stored as %lld bytes, listed as %d",
+                     member->compressed_size, entry->size);
+            return;
+        }
+        if (crc32_update(0, data, entry->size) != member->crc32) {
+            snprintf(result->problem, sizeof(result->problem), "CRC-32 does not match the zip directory");
+        }
+    } else {
+        if (entry->file_pos < 0 || entry->size < 0 || (size_t)entry->file_pos + entry->size > wad->map.size) {
+            snprintf(result->problem, sizeof(result->problem), "%d bytes at %d lie outside the file (%zu bytes)",
+                     entry->size, entry->file_pos, wad->map.size);
+            return;
+        }
+        data = wad->map.data + entry->file_pos;
     }
     
-    // PWAD header
-    PWADHeader header;
-    strncpy(header.magic, "PWAD", 4);
-    header.num_lumps = bmp_count;
-    header.directory_pos = sizeof(PWADHeader);
+    result->crc = crc32c_update(0, data, entry->size);
+    if (!result->problem[0]) verify_lump_content(job, index, data, entry->size, result);
+    free(inflated);
+}
+
+static void verify_usage() {
+    fprintf(stderr,
+            "usage: eyeglass verify <wad, pk3 or folder>... [options]\n"
+            "  -j, --jobs <n>         Worker threads (default: one per CPU)\n"
+            "  --json <file>          Write every lump's checksum and problem as JSON ('-' for stdout)\n"
+            "  -q, --quiet            Print only the summary\n");
+}
+
+// eyeglass verify: check that every directory entry lies inside its file,
+// that patches, flats, PNGs and maps hold together, and take a CRC-32C of
+// every lump, one file at a time with its lumps in parallel. Exits 0 if
+// everything is sound, 1 if a file is damaged or unreadable, 2 on bad usage.
+int verify_command(int argc, char **argv) {
+    const char *json_path = NULL;
+    bool quiet = false;
+    wad_info_t *files = NULL;
+    int num_files = 0, file_capacity = 0;
     
-    // Write placeholder header
-    fwrite(&header, sizeof(PWADHeader), 1, pwad_file);
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool takes_value = true;
+        if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+            worker_limit = value ? atoi(value) : 0;
+            if (worker_limit <= 0) {
+                fprintf(stderr, "--jobs needs a positive number\n");
+                return 2;
+            }
+        } else if (strcmp(arg, "--json") == 0) {
+            json_path = value;
+        } else {
+            takes_value = false;
+            if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+                verify_usage();
+                return 0;
+            } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) {
+                quiet = true;
+            } else if (arg[0] == '-') {
+                fprintf(stderr, "Unexpected argument: %s\n", arg);
+                verify_usage();
+                return 2;
+            } else if (is_directory(arg)) {
+                collect_wad_files(arg, &files, &num_files, &file_capacity);
+            } else {
+                add_wad_candidate(&files, &num_files, &file_capacity, arg, 0, 0);
+            }
+        }
+        if (takes_value) {
+            if (!value) {
+                fprintf(stderr, "%s needs a value\n", arg);
+                return 2;
+            }
+            i++;
+        }
+    }
+    if (num_files == 0) {
+        verify_usage();
+        return 2;
+    }
+    qsort(files, num_files, sizeof(wad_info_t), compare_wad_info_path);
     
-    // Allocate lump entries
-    LumpEntry* lumps = malloc(bmp_count * sizeof(LumpEntry));
-    if (!lumps) {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(pwad_file);
-        closedir(dir);
-        return 0;
+    bool json_stdout = json_path && strcmp(json_path, "-") == 0;
+    FILE *report = json_stdout ? stdout : json_path ? fopen(json_path, "w") : NULL;
+    if (json_path && !report) {
+        fprintf(stderr, "Could not write %s: %s\n", json_path, strerror(errno));
+        return 2;
     }
+    FILE *text = json_stdout ? stderr : stdout;
+    if (report) fprintf(report, "{\"files\": [");
     
-    // Second pass: process each BMP
-    int lump_index = 0;
-    int current_pos = sizeof(PWADHeader);
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, ".bmp") != NULL) {
-            // Construct full input path
-            snprintf(input_path, sizeof(input_path), "%s/%s", input_folder, entry->d_name);
+    crc32_init();
+    crc32c_init();
+    double start = now_seconds();
+    long long total_lumps = 0, total_bytes = 0;
+    int damaged_files = 0, total_problems = 0;
+    json_buffer_t json = {0};
+    for (int f = 0; f < num_files; f++) {
+        json.length = 0;
+        json_printf(&json, "%s\n  {\"path\": ", f > 0 ? "," : "");
+        json_string(&json, files[f].path);
+        
+        wad_file_t *wad = wad_open_directory(files[f].path);
+        if (!wad) {
+            // status_message says why: unreadable, not a WAD, or a directory outside the file
+            const char *reason = strncmp(status_message, "Error: ", 7) == 0 ? status_message + 7 : status_message;
+            fprintf(text, "%s: %s\n", files[f].path, reason);
+            json_printf(&json, ", \"error\": ");
+            json_string(&json, reason);
+            json_printf(&json, ", \"lumps\": []}");
+            if (report) fwrite(json.data, 1, json.length, report);
+            damaged_files++;
+            total_problems++;
+            continue;
+        }
+        
+        int num_lumps = wad->header.num_lumps;
+        verify_job_t job = {wad, (char (*)[9])arena_alloc(&wad->arena, (num_lumps + 1) * 9),
+                            (unsigned char *)arena_alloc(&wad->arena, num_lumps + 1),
+                            (verify_lump_t *)arena_calloc(&wad->arena, (num_lumps + 1) * sizeof(verify_lump_t))};
+        if (!job.ns || !job.patches || !job.lumps) {
+            fprintf(stderr, "Not enough memory for %s\n", files[f].path);
+            wad_close(wad);
+            return 2;
+        }
+        wad_lump_namespaces(wad, job.ns);
+        verify_expect_patches(&job);
+#ifndef _WIN32
+        // Lumps are handed out in order, so the file is read front to back
+        madvise(wad->map.data, wad->map.size, MADV_SEQUENTIAL);
+#endif
+        parallel_for(num_lumps, verify_lump, &job);
+        
+        const char *type = wad->zip_entries ? "PK3" : wad->is_iwad ? "IWAD" : "PWAD";
+        json_printf(&json, ", \"type\": \"%s\", \"size\": %zu, \"error\": null, \"lumps\": [", type, wad->map.size);
+        int problems = 0;
+        for (int i = 0; i < num_lumps; i++) {
+            const wad_directory_t *entry = &wad->directory[i];
+            const verify_lump_t *result = &job.lumps[i];
+            char name[9] = {0};
+            strncpy(name, entry->name, 8);
+            long long offset = wad->zip_entries ? wad->zip_entries[i].local_offset : entry->file_pos;
+            if (entry->size > 0) total_bytes += entry->size;
             
-            // Convert BMP to DOOM patch
-            unsigned char* patch_data = NULL;
-            int patch_size = 0;
-            if (!bmp32_to_doom_patch_optimized(input_path, &patch_data, &patch_size)) {
-                fprintf(stderr, "Failed to convert %s\n", input_path);
-                continue;
+            json_printf(&json, "%s\n    {\"index\": %d, \"name\": ", i > 0 ? "," : "", i);
+            json_string(&json, name);
+            json_printf(&json, ", \"ns\": ");
+            json_string(&json, job.ns[i]);
+            json_printf(&json, ", \"offset\": %lld, \"size\": %d, \"kind\": \"%s\", \"crc32c\": \"%08x\", \"problem\": ",
+                        offset, entry->size, result->kind, result->crc);
+            if (result->problem[0]) {
+                json_string(&json, result->problem);
+                if (!quiet) {
+                    fprintf(text, "%s: %s%s%s (lump %d): %s\n", files[f].path, job.ns[i], job.ns[i][0] ? "/" : "",
+                            name, i, result->problem);
+                }
+                problems++;
+            } else {
+                json_printf(&json, "null");
             }
-            
-            // Write patch data to WAD
-            fwrite(patch_data, 1, patch_size, pwad_file);
-            
-            // Prepare lump entry
-            char lump_name[9] = {0};
-            strncpy(lump_name, entry->d_name, sizeof(lump_name) - 1);
-            char *dot = strrchr(lump_name, '.');
-            if (dot) *dot = '\0';
-            
-            strncpy(lumps[lump_index].name, lump_name, 8);
-            lumps[lump_index].lump_pos = current_pos;
-            lumps[lump_index].lump_size = patch_size;
-            
-            // Update tracking
-            current_pos += patch_size;
-            lump_index++;
-            
-            // Free patch data
-            free(patch_data);
+            json_printf(&json, "}");
         }
+        json_printf(&json, "%s], \"problems\": %d}", num_lumps > 0 ? "\n  " : "", problems);
+        if (report) fwrite(json.data, 1, json.length, report);
+        
+        total_lumps += num_lumps;
+        total_problems += problems;
+        if (problems > 0) damaged_files++;
+        wad_close(wad);
     }
+    double seconds = now_seconds() - start;
     
-    // Write directory entries
-    fwrite(lumps, sizeof(LumpEntry), bmp_count, pwad_file);
-    
-    // Update header with correct directory position
-    fseek(pwad_file, 0, SEEK_SET);
-    header.directory_pos = current_pos;
-    fwrite(&header, sizeof(PWADHeader), 1, pwad_file);
-    
-    // Cleanup
-    fclose(pwad_file);
-    free(lumps);
-    closedir(dir);
+    if (report) {
+        fprintf(report, "\n], \"lumps\": %lld, \"bytes\": %lld, \"problems\": %d, \"seconds\": %.3f}\n",
+                total_lumps, total_bytes, total_problems, seconds);
+        if (!json_stdout) fclose(report);
+    }
+    if (json.failed) fprintf(stderr, "Not enough memory for the JSON report\n");
+    fprintf(text, "Verified %lld lumps (%.1f MB) in %d files in %.2fs (%.0f MB/s, CRC-32C with %s): %d problems in %d files\n",
+            total_lumps, total_bytes / 1048576.0, num_files, seconds,
+            seconds > 0 ? total_bytes / 1048576.0 / seconds : 0, crc32c_method, total_problems, damaged_files);
     
-    printf("Successfully created %s with %d BMP32 images converted to DOOM patches\n", 
-           output_path, bmp_count);
-    return 1;
+    free(json.data);
+    for (int f = 0; f < num_files; f++) free(files[f].path);
+    free(files);
+    return damaged_files > 0 || json.failed ? 1 : 0;
 }
 
 void folder_selector_menu() {
@@ -1662,11 +12664,11 @@ void folder_selector_menu() {
     
     // Title
     glColor3f(1.0, 1.0, 0.0);
-    draw_string(window_width/4 + 20, window_height/4 + 20, "BMP32 to WAD Conversion");
+    draw_string(window_width/4 + 20, window_height/4 + 20, "Image to WAD Conversion");
     
     // Input fields
     glColor3f(1.0, 1.0, 1.0);
-    draw_string(window_width/4 + 20, window_height/4 + 60, "Input BMP Folder:");
+    draw_string(window_width/4 + 20, window_height/4 + 60, "Input Folder (PNG, TGA, BMP):");
     draw_string(window_width/4 + 20, window_height/4 + 100, input_png_folder);
     
     draw_string(window_width/4 + 20, window_height/4 + 140, "Output WAD Name:");
@@ -1710,4 +12712,5 @@ void folder_selector_menu() {
     glColor3f(0.7, 0.7, 1.0);
     draw_string(window_width/4 + 20, window_height*3/4 - 40, 
         "Use Tab to switch fields, Backspace to edit, Esc to cancel");
+    text_flush();
 }
\ No newline at end of file
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Cases for `eyeglass verify`: writes small WADs with one known fault each
+# and checks the lump that should be reported is, and nothing else is.
+#
+#     python3 tests/verify_cases.py ./eyeglass
+
+import json
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+
+def patch(width, height, truncate=0):
+    columns = [bytes([0, height, 0]) + bytes((x + y) & 255 for y in range(height)) + bytes([0, 0xFF])
+               for x in range(width)]
+    offsets, body = [], b''
+    for column in columns:
+        offsets.append(8 + 4 * width + len(body))
+        body += column
+    data = struct.pack('<HHhh', width, height, 0, 0) + b''.join(struct.pack('<I', o) for o in offsets) + body
+    return data[:len(data) - truncate]
+
+
+def write_wad(path, lumps):
+    data, directory = b'', b''
+    for name, lump in lumps:
+        directory += struct.pack('<ii8s', 12 + len(data), len(lump), name.encode())
+        data += lump
+    with open(path, 'wb') as f:
+        f.write(b'PWAD' + struct.pack('<ii', len(lumps), 12 + len(data)) + data + directory)
+
+
+def pnames(*names):
+    return struct.pack('<i', len(names)) + b''.join(struct.pack('8s', n.encode()) for n in names)
+
+
+# Each case: lumps, and the names verify must report
+CASES = {
+    'sound': ([('S_START', b''), ('TROOA1', patch(20, 30)), ('S_END', b''),
+               ('P_START', b''), ('WALL1', patch(16, 16)), ('P_END', b''),
+               ('TITLEPIC', patch(32, 20)), ('DEMO1', bytes(range(256)) * 8)], []),
+    'truncated sprite': ([('S_START', b''), ('TROOA1', patch(20, 30, truncate=5)), ('S_END', b'')],
+                         ['TROOA1']),
+    'truncated patch between P_START and P_END': (
+        [('P_START', b''), ('WALLT', patch(16, 16, truncate=40)), ('P_END', b'')], ['WALLT']),
+    'column table past the end of a patch in PNAMES': (
+        [('PNAMES', pnames('BADPAT')), ('BADPAT', patch(64, 8)[:100])], ['BADPAT']),
+    'truncated TITLEPIC': ([('TITLEPIC', patch(320, 20, truncate=2000))], ['TITLEPIC']),
+    'truncated menu graphic': ([('M_DOOM', patch(40, 10)[:60])], ['M_DOOM']),
+    'short flat': ([('F_START', b''), ('FLOOR1', bytes(4000)), ('F_END', b'')], ['FLOOR1']),
+}
+
+
+def main():
+    eyeglass = sys.argv[1] if len(sys.argv) > 1 else './eyeglass'
+    failures = 0
+    with tempfile.TemporaryDirectory() as folder:
+        for title, (lumps, expected) in CASES.items():
+            path = os.path.join(folder, 'case.wad')
+            write_wad(path, lumps)
+            run = subprocess.run([eyeglass, 'verify', '-q', '--json', '-', path], capture_output=True, text=True)
+            report = json.loads(run.stdout)
+            found = sorted(l['name'] for f in report['files'] for l in f['lumps'] if l['problem'])
+            ok = found == sorted(expected) and run.returncode == (1 if expected else 0)
+            print('%-4s %s%s' % ('ok' if ok else 'FAIL', title, '' if ok else ': reported %s' % found))
+            failures += not ok
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())